@@ -0,0 +1,454 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_cache.h"
+#include "as_library.h"
+
+#include <time.h>
+
+// States of a candidate: a process posting it claims a free one, writes it,
+// then marks it as ready for the owner, who frees it once it is read
+#define CANDIDATE_FREE 0
+#define CANDIDATE_WRITING 1
+#define CANDIDATE_READY 2
+
+// NULL without a cache, shared by every process serving clients otherwise
+static FileCache *cache = NULL;
+
+// Mapping and descriptor of the file of each entry, in the owner
+static void *mappings[CACHE_MAX_FILES];
+static int fds[CACHE_MAX_FILES];
+
+// Mixed into the stable id for each row of the sketch
+static const uint64_t sketch_seeds[CACHE_SKETCH_DEPTH] = {
+    0x9e3779b97f4a7c15, 0xbf58476d1ce4e5b9, 0x94d049bb133111eb, 0xd6e8feb86659fd93};
+
+static uint64_t _now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+
+/*
+** Frequency sketch
+** ----------------
+*/
+static uint16_t *_counter(int row, uint64_t id)
+{
+    uint64_t hash = (id ^ sketch_seeds[row]) * 0x9e3779b97f4a7c15;
+    return &cache->sketch[row][hash >> (64 - __builtin_ctz(CACHE_SKETCH_WIDTH))];
+}
+
+static void _count_play(uint64_t id)
+{
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++)
+    {
+        // Racing plays may go a little over, which the counters have room for
+        uint16_t *counter = _counter(row, id);
+        if (__atomic_load_n(counter, __ATOMIC_RELAXED) < CACHE_MAX_FREQUENCY)
+        {
+            __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_add_fetch(&cache->samples, 1, __ATOMIC_RELAXED);
+}
+
+/*
+** returns how many times the file with stable id id was played, as far as
+** the sketch knows (never less)
+*/
+static uint16_t _frequency(uint64_t id)
+{
+    uint16_t frequency = UINT16_MAX;
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++)
+    {
+        frequency = MIN(frequency, __atomic_load_n(_counter(row, id), __ATOMIC_RELAXED));
+    }
+    return frequency;
+}
+
+static void _age_sketch(void)
+{
+    if (__atomic_load_n(&cache->samples, __ATOMIC_RELAXED) < CACHE_SAMPLE_SIZE)
+    {
+        return;
+    }
+    for (int row = 0; row < CACHE_SKETCH_DEPTH; row++)
+    {
+        for (int i = 0; i < CACHE_SKETCH_WIDTH; i++)
+        {
+            uint16_t *counter = &cache->sketch[row][i];
+            __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) / 2,
+                             __ATOMIC_RELAXED);
+        }
+    }
+    __atomic_store_n(&cache->samples, 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+** Plays
+** -----
+*/
+int cache_init(const ServerOptions *options)
+{
+    if (options->cache_size == 0)
+    {
+        return 0;
+    }
+    cache = mmap(NULL, sizeof(FileCache), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED)
+    {
+        perror("cache_init: mmap");
+        cache = NULL;
+        return -1;
+    }
+    cache->budget = options->cache_size;
+    cache->owner = getpid();
+    cache->locked = 1;
+    for (int i = 0; i < CACHE_MAX_FILES; i++)
+    {
+        mappings[i] = NULL;
+        fds[i] = -1;
+    }
+    return 0;
+}
+
+/*
+** returns the entry of the file with stable id id, -1 if it isn't cached
+*/
+static int _find_entry(uint64_t id)
+{
+    for (int i = 0; i < CACHE_MAX_FILES; i++)
+    {
+        if (__atomic_load_n(&cache->ids[i], __ATOMIC_ACQUIRE) == id)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int _is_modified(const CacheEntry *entry, const struct stat *st)
+{
+    return entry->size != (uint64_t)st->st_size || entry->mtime_sec != st->st_mtim.tv_sec ||
+           entry->mtime_nsec != st->st_mtim.tv_nsec;
+}
+
+/*
+** Post the file with stable id id at path as a candidate, unless it already
+** is one or there is no room for it.
+*/
+static void _post_candidate(uint64_t id, const char *path)
+{
+    size_t path_len = strlen(path);
+    if (path_len >= CACHE_MAX_PATH)
+    {
+        return;
+    }
+    for (int i = 0; i < CACHE_MAX_CANDIDATES; i++)
+    {
+        const CacheCandidate *candidate = &cache->candidates[i];
+        if (__atomic_load_n(&candidate->state, __ATOMIC_ACQUIRE) == CANDIDATE_READY &&
+            candidate->id == id)
+        {
+            return;
+        }
+    }
+    for (int i = 0; i < CACHE_MAX_CANDIDATES; i++)
+    {
+        CacheCandidate *candidate = &cache->candidates[i];
+        uint32_t expected = CANDIDATE_FREE;
+        if (__atomic_compare_exchange_n(&candidate->state, &expected, CANDIDATE_WRITING, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            candidate->id = id;
+            memcpy(candidate->path, path, path_len + 1);
+            __atomic_store_n(&candidate->state, CANDIDATE_READY, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+}
+
+void cache_played(const Library *library, uint32_t file_index, const struct stat *st)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    LibraryFileId file_id = {st->st_dev, st->st_ino};
+    uint64_t id = library_stable_id(&file_id);
+    _count_play(id);
+
+    // The entry may change under our feet, the owner is the only one relying
+    // on it being right
+    int i = _find_entry(id);
+    if (i >= 0 && !_is_modified(&cache->entries[i], st))
+    {
+        __atomic_store_n(&cache->entries[i].referenced, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+    if (i >= 0)
+    {
+        __atomic_store_n(&cache->entries[i].stale, 1, __ATOMIC_RELAXED);
+    }
+    else if (_frequency(id) >= CACHE_ADMIT_FREQUENCY && st->st_size > 0 &&
+             (uint64_t)st->st_size <= cache->budget)
+    {
+        _post_candidate(id, library->files[file_index]);
+    }
+}
+
+
+/*
+** Owner
+** -----
+*/
+static void _evict(int i)
+{
+    __atomic_store_n(&cache->ids[i], 0, __ATOMIC_RELEASE);
+    munmap(mappings[i], cache->entries[i].size);
+    close(fds[i]);
+    mappings[i] = NULL;
+    fds[i] = -1;
+    cache->resident -= cache->entries[i].size;
+}
+
+/*
+** Invalidate the files that changed since they were admitted.
+*/
+static void _validate_entries(void)
+{
+    for (int i = 0; i < CACHE_MAX_FILES; i++)
+    {
+        if (cache->ids[i] == 0)
+        {
+            continue;
+        }
+        struct stat st;
+        if (cache->entries[i].stale || fstat(fds[i], &st) < 0 || st.st_nlink == 0 ||
+            _is_modified(&cache->entries[i], &st))
+        {
+            _evict(i);
+            cache->invalidations++;
+        }
+    }
+}
+
+/*
+** returns a free entry, -1 if there is none
+*/
+static int _free_entry(void)
+{
+    for (int i = 0; i < CACHE_MAX_FILES; i++)
+    {
+        if (cache->ids[i] == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// What the clock hand would do to an entry on its way to room for a file
+#define HAND_PASSES 1          // referenced: its reference is cleared
+#define HAND_EVICTS 2
+
+/*
+** Find the files the clock hand would evict to make room for size bytes
+** (and an entry) without touching the cache: a referenced file is passed
+** the first time the hand goes by, and evicted the second time. Every file
+** is looked at in the order the hand would, and must be played less often
+** than frequency.
+**
+** returns the number of entries the hand would go over to get there, with
+** what it would do to each of them in actions (indexed by entry), -1 if the
+** room can't be made or a file would be evicted that is played as often
+*/
+static int _find_victims(uint64_t size, uint16_t frequency, uint8_t *actions)
+{
+    memset(actions, 0, CACHE_MAX_FILES);
+    uint64_t freed = 0;
+    int has_entry = _free_entry() >= 0;
+    // Every reference is cleared after one turn
+    for (int steps = 0; steps < 2 * CACHE_MAX_FILES; steps++)
+    {
+        if (cache->resident - freed + size <= cache->budget && has_entry)
+        {
+            return steps;
+        }
+        int i = (cache->hand + steps) % CACHE_MAX_FILES;
+        if (cache->ids[i] == 0 || actions[i] == HAND_EVICTS)
+        {
+            continue;
+        }
+        if (actions[i] == 0 && __atomic_load_n(&cache->entries[i].referenced, __ATOMIC_RELAXED))
+        {
+            actions[i] = HAND_PASSES;
+            continue;
+        }
+        if (_frequency(cache->ids[i]) >= frequency)
+        {
+            return -1;
+        }
+        actions[i] = HAND_EVICTS;
+        freed += cache->entries[i].size;
+        has_entry = 1;
+    }
+    return cache->resident - freed + size <= cache->budget && has_entry ? 2 * CACHE_MAX_FILES
+                                                                         : -1;
+}
+
+/*
+** Admit the file with stable id id at path (relative to library) if it is
+** played more often than the files it would evict.
+*/
+static void _admit(const Library *library, uint64_t id, const char *path)
+{
+    if (_find_entry(id) >= 0)
+    {
+        return;
+    }
+    char *file_path = _join_path(library->path, path);
+    if (file_path == NULL)
+    {
+        return;
+    }
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    free(file_path);
+    if (fd < 0)
+    {
+        return;
+    }
+    // The file may have been replaced since it was played
+    struct stat st;
+    LibraryFileId file_id;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+        (uint64_t)st.st_size > cache->budget)
+    {
+        close(fd);
+        return;
+    }
+    file_id.dev = st.st_dev;
+    file_id.ino = st.st_ino;
+    if (library_stable_id(&file_id) != id)
+    {
+        close(fd);
+        return;
+    }
+
+    // Either every victim is colder than the file, or nothing is evicted
+    uint8_t actions[CACHE_MAX_FILES];
+    int steps = _find_victims(st.st_size, _frequency(id), actions);
+    if (steps < 0)
+    {
+        cache->rejections++;
+        close(fd);
+        return;
+    }
+    void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        perror("cache_maintain: mmap");
+        close(fd);
+        return;
+    }
+    for (int i = 0; i < CACHE_MAX_FILES; i++)
+    {
+        if (actions[i] == HAND_PASSES)
+        {
+            __atomic_store_n(&cache->entries[i].referenced, 0, __ATOMIC_RELAXED);
+        }
+        else if (actions[i] == HAND_EVICTS)
+        {
+            _evict(i);
+            cache->evictions++;
+        }
+    }
+    cache->hand = (cache->hand + steps) % CACHE_MAX_FILES;
+    int i = _free_entry();
+    // Without the privilege, or over RLIMIT_MEMLOCK, the pages can only be read ahead
+    if (mlock(mapping, st.st_size) < 0)
+    {
+        if (cache->locked)
+        {
+            perror("cache_maintain: mlock, files will only be read ahead");
+            cache->locked = 0;
+        }
+        madvise(mapping, st.st_size, MADV_WILLNEED);
+    }
+
+    mappings[i] = mapping;
+    fds[i] = fd;
+    CacheEntry *entry = &cache->entries[i];
+    entry->size = st.st_size;
+    entry->mtime_sec = st.st_mtim.tv_sec;
+    entry->mtime_nsec = st.st_mtim.tv_nsec;
+    entry->referenced = 1;
+    entry->stale = 0;
+    __atomic_store_n(&cache->ids[i], id, __ATOMIC_RELEASE);
+    cache->resident += st.st_size;
+    cache->admissions++;
+}
+
+void cache_maintain(const Library *library)
+{
+    if (cache == NULL || cache->owner != getpid())
+    {
+        return;
+    }
+    uint64_t now = _now_ns();
+    if (now - cache->maintained_at < (uint64_t)CACHE_INTERVAL_MS * 1000000)
+    {
+        return;
+    }
+    cache->maintained_at = now;
+
+    _validate_entries();
+    _age_sketch();
+    for (int c = 0; c < CACHE_MAX_CANDIDATES; c++)
+    {
+        CacheCandidate *candidate = &cache->candidates[c];
+        if (__atomic_load_n(&candidate->state, __ATOMIC_ACQUIRE) != CANDIDATE_READY)
+        {
+            continue;
+        }
+        char path[CACHE_MAX_PATH];
+        uint64_t id = candidate->id;
+        memcpy(path, candidate->path, sizeof(path));
+        __atomic_store_n(&candidate->state, CANDIDATE_FREE, __ATOMIC_RELEASE);
+        _admit(library, id, path);
+    }
+}
+
+void cache_print_stats(FILE *stream)
+{
+    if (cache == NULL)
+    {
+        fprintf(stream, "The server has no file cache (-c)\n");
+        return;
+    }
+    uint32_t num_files = 0;
+    for (int i = 0; i < CACHE_MAX_FILES; i++)
+    {
+        num_files += cache->ids[i] != 0;
+    }
+    uint64_t hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+    uint64_t misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+    fprintf(stream, "File cache %.1f of %.1f MB in %u files (%s), %.1f%% hits (%llu of %llu plays)\n",
+            cache->resident / 1e6, cache->budget / 1e6, num_files,
+            cache->locked ? "locked" : "read ahead",
+            hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0,
+            (unsigned long long)hits, (unsigned long long)(hits + misses));
+    fprintf(stream, "  %llu admitted, %llu rejected, %llu evicted, %llu invalidated\n",
+            (unsigned long long)cache->admissions, (unsigned long long)cache->rejections,
+            (unsigned long long)cache->evictions, (unsigned long long)cache->invalidations);
+    // Or forked children would print it again when they exit
+    fflush(stream);
+}
@@ -0,0 +1,151 @@
+#ifndef AS_CACHE_H_
+#define AS_CACHE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+** Constants
+** ---------
+*/
+// Files held in memory at once, whatever their size
+#define CACHE_MAX_FILES 256
+
+// Counters of the frequency sketch: CACHE_SKETCH_DEPTH rows of
+// CACHE_SKETCH_WIDTH (a power of 2) counters, each counting up to
+// CACHE_MAX_FREQUENCY
+#define CACHE_SKETCH_DEPTH 4
+#define CACHE_SKETCH_WIDTH 4096
+#define CACHE_MAX_FREQUENCY 15
+
+// Plays counted before every counter of the sketch is halved, so that files
+// that were played a lot a while ago make way for the ones played now
+#define CACHE_SAMPLE_SIZE (10 * CACHE_SKETCH_WIDTH)
+
+// Plays (as counted by the sketch) before a file is considered for the cache
+#define CACHE_ADMIT_FREQUENCY 2
+
+// Files waiting to be considered for the cache, the others are dropped
+#define CACHE_MAX_CANDIDATES 64
+#define CACHE_MAX_PATH 512
+
+// Milliseconds between two looks at the candidates by the owner of the cache
+#define CACHE_INTERVAL_MS 100
+
+
+/*
+** Design
+** ------
+** A server started with -c holds the files played the most in memory, up
+** to that many bytes. STREAM responses are sent with sendfile from the page
+** cache already, every process serving clients shares it, and a copy of the
+** files in memory of our own would only add a copy on the way to the
+** socket. What the page cache doesn't do is keep them there: a burst of
+** downloads of files nobody plays twice evicts the hot ones, and their next
+** plays wait for the disk. So the cache maps the hot files and locks their
+** pages with mlock (read ahead with MADV_WILLNEED if the process may not
+** lock that much), and every STREAM of them is sent from those pages.
+**
+** Only one process, the owner, maps files: the process that set the cache
+** up (the fork server, the epoll or io_uring server, the prefork
+** supervisor), which lives as long as the server. The processes serving
+** clients tell it what they play through a FileCache in shared memory
+** (mapped before any of them is forked):
+**
+**   - every play of a file (see cache_played) is counted in a count-min
+**     sketch of the stable ids of the files (see as_library.h), whose
+**     counters are halved every CACHE_SAMPLE_SIZE plays,
+**   - a play of a file in the cache is a hit, and marks it as referenced,
+**   - a file missed that has been played CACHE_ADMIT_FREQUENCY times is
+**     posted as a candidate, with its path in the library,
+**   - at most every CACHE_INTERVAL_MS, whenever its loop comes around (at
+**     least once a second), the owner (see cache_maintain) admits the
+**     candidates. A candidate that doesn't fit in the budget evicts the
+**     files a CLOCK hand going around the cache picks to make room for it
+**     (a referenced file gets a second chance), but only if every one of
+**     them is played less often than itself according to the sketch
+**     (TinyLFU admission): otherwise the candidate is rejected, and nothing
+**     is evicted.
+**
+** A file whose size or modification time changed (seen when it is played,
+** or by the owner, which looks at the files in the cache every time) is
+** invalidated: evicted, then admitted again like any other file once it is
+** played enough. Plays never wait for the cache, a file is sent the same
+** way whether it is in the cache or not.
+**
+** The hit rate, the files admitted, rejected, evicted and invalidated, and
+** the bytes held in memory are printed with the egress cap when the user
+** types s + enter in the server's terminal.
+*/
+
+// A file in the cache, see the Design section
+typedef struct cache_entry {
+    uint64_t size;             // bytes held in memory
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint8_t referenced;        // played since the clock hand last went by
+    uint8_t stale;             // played with another size or modification time
+} CacheEntry;
+
+// A file to consider for the cache
+typedef struct cache_candidate {
+    uint32_t state;            // see as_cache.c
+    uint64_t id;               // stable id of the file
+    char path[CACHE_MAX_PATH]; // relative to the library
+} CacheCandidate;
+
+// Shared by every process serving clients
+typedef struct file_cache {
+    uint64_t budget;           // bytes
+    pid_t owner;               // process mapping the files, see the Design section
+    uint64_t resident;         // bytes of the files in the cache
+    int locked;                // their pages are locked, not only read ahead
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t admissions;
+    uint64_t rejections;
+    uint64_t evictions;
+    uint64_t invalidations;
+    uint32_t samples;          // plays counted since the sketch was last halved
+    uint32_t hand;             // of the clock, entry looked at next
+    uint64_t maintained_at;    // ns, CLOCK_MONOTONIC
+    uint16_t sketch[CACHE_SKETCH_DEPTH][CACHE_SKETCH_WIDTH];
+    CacheCandidate candidates[CACHE_MAX_CANDIDATES];
+    uint64_t ids[CACHE_MAX_FILES]; // stable id of the file of each entry, 0 if free
+    CacheEntry entries[CACHE_MAX_FILES];
+} FileCache;
+
+
+/*
+** Set up a cache of options->cache_size bytes, owned by this process. Does
+** nothing if the size is 0. Call it before forking any process serving
+** clients.
+**
+** returns 0 on success, -1 on error
+*/
+int cache_init(const ServerOptions *options);
+
+/*
+** Count a play of the file with the given index of library, opened with the
+** status st, as a hit or a miss (see the Design section).
+*/
+void cache_played(const Library *library, uint32_t file_index, const struct stat *st);
+
+/*
+** In the owner of the cache, admit the candidates and invalidate the files
+** that changed, if it is time to (see the Design section). The paths of the
+** candidates are relative to library. Does nothing in other processes.
+*/
+void cache_maintain(const Library *library);
+
+/*
+** Print the budget, the hit rate, and what the cache did.
+*/
+void cache_print_stats(FILE *stream);
+
+#endif // AS_CACHE_H_
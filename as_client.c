@@ -4,6 +4,20 @@
 /*****************************************************************************/
 #include "as_client.h"
 
+// Protocol version negotiated with the server, see negotiate_protocol_version
+static uint32_t protocol_version = PROTOCOL_VERSION_BASE;
+
+// Epoch and generation of the server's library that list_request last got
+// (see LIST_DELTA in as_server.h), epoch 0 if none
+static uint64_t library_epoch = 0;
+static uint64_t library_generation = 0;
+
+// Size of the buffer between the server and the outputs of a stream (-b)
+static size_t stream_ring_capacity = STREAM_RING_CAPACITY;
+
+// Whether streams are received with splice, see _receive_stream (-c turns it off)
+static int stream_splice = 1;
+
 static int connect_to_server(int port, const char *hostname)
 {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -44,6 +58,41 @@ static int connect_to_server(int port, const char *hostname)
     return sockfd;
 }
 
+int negotiate_protocol_version(int sockfd)
+{
+    char version_req[REQUEST_BUFFER_SIZE];
+    int req_len = snprintf(version_req, sizeof(version_req), "%s %u%s",
+                           REQUEST_VERSION, PROTOCOL_VERSION, END_OF_MESSAGE_TOKEN);
+    if (write_precisely(sockfd, version_req, req_len) != req_len)
+    {
+        perror("negotiate_protocol_version");
+        return -1;
+    }
+
+    // Servers predating VERSION drop the request without answering
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    int ready = poll(&pfd, 1, VERSION_REPLY_TIMEOUT_MS);
+    if (ready < 0)
+    {
+        perror("negotiate_protocol_version");
+        return -1;
+    }
+    if (ready == 0)
+    {
+        protocol_version = PROTOCOL_VERSION_BASE;
+        return protocol_version;
+    }
+
+    uint32_t net_version;
+    if (read_precisely(sockfd, &net_version, sizeof(net_version)) != sizeof(net_version))
+    {
+        ERR_PRINT("negotiate_protocol_version: Reading the version failed\n");
+        return -1;
+    }
+    protocol_version = ntohl(net_version);
+    return protocol_version;
+}
+
 /*
 ** Helper for: list_request
 ** This function reads from the socket until it finds a network newline.
@@ -86,15 +135,30 @@ static int get_next_filename(int sockfd, char **filename)
     return index;
 }
 
-int list_request(int sockfd, Library *library)
+/*
+** Helper for: list_request
+** Print the files of library in index order
+*/
+static void _print_library(const Library *library)
 {
-    const char *list_req = "LIST\r\n";
-
-    if (library == NULL)
+    for (int i = 0; i < library->num_files; i++)
     {
-        ERR_PRINT("list_request: library pointer is NULL\n");
-        return -1;
+        if (library->files[i] != NULL)
+        {
+            printf("%d: %s\n", i, library->files[i]);
+        }
     }
+}
+
+/*
+** Helper for: list_request
+** Get the whole library with a LIST request.
+**
+** returns the length of the new library on success, -1 on error
+*/
+static int _list_all_request(int sockfd, Library *library)
+{
+    const char *list_req = "LIST\r\n";
 
     if (write(sockfd, list_req, strlen(list_req)) < 0)
     {
@@ -104,11 +168,13 @@ int list_request(int sockfd, Library *library)
 
     _free_library(library);
 
+    int num_received = 0;
     int num_files = 0;
     char *filename = NULL;
 
-    // Temporary storage to accumulate filenames
+    // Temporary storage to accumulate filenames and their indices
     char **temp_filenames = NULL;
+    int *temp_indices = NULL;
 
     while (1)
     {
@@ -120,19 +186,33 @@ int list_request(int sockfd, Library *library)
         }
 
         // We have to use realloc since we are reading the files one-by-one so we increment by one for each iteration.
-        char **new_temp_filenames = realloc(temp_filenames, (num_files + 1) * sizeof(char *));
-        if (new_temp_filenames == NULL)
+        char **new_temp_filenames = realloc(temp_filenames, (num_received + 1) * sizeof(char *));
+        int *new_temp_indices = realloc(temp_indices, (num_received + 1) * sizeof(int));
+        if (new_temp_filenames != NULL)
+        {
+            temp_filenames = new_temp_filenames;
+        }
+        if (new_temp_indices != NULL)
+        {
+            temp_indices = new_temp_indices;
+        }
+        if (new_temp_filenames == NULL || new_temp_indices == NULL)
         {
             perror("list_request: realloc failed");
             free(filename);
-            while (num_files--)
-                free(temp_filenames[num_files]);
+            while (num_received--)
+                free(temp_filenames[num_received]);
             free(temp_filenames);
+            free(temp_indices);
             return -1;
         }
 
-        temp_filenames = new_temp_filenames;
-        temp_filenames[num_files++] = filename;
+        temp_filenames[num_received] = filename;
+        temp_indices[num_received++] = index;
+        if (index >= num_files)
+        {
+            num_files = index + 1;
+        }
 
         // To terminate the loop and void being blocked at the read(),
         // it should be very explicit when to terminate the loop.
@@ -142,36 +222,419 @@ int list_request(int sockfd, Library *library)
         }
     }
 
-    // Allocate the library's files array with the correct size
-    library->files = malloc(num_files * sizeof(char *));
-    if (library->files == NULL)
+    // Allocate the library's files array with the correct size. The server
+    // skips the indices of files removed from its library, they stay NULL.
+    library->files = calloc(num_files, sizeof(char *));
+    if (library->files == NULL && num_files > 0)
     {
         perror("list_request: malloc failed for library->files");
-        while (num_files--)
-            free(temp_filenames[num_files]);
+        while (num_received--)
+            free(temp_filenames[num_received]);
         free(temp_filenames);
+        free(temp_indices);
         return -1;
     }
 
-    // Transfer the filenames to the library's files array in reverse order
-    for (int i = 0; i < num_files; i++)
-    {
-        library->files[i] = temp_filenames[num_files - 1 - i];
-    }
-
-    // Print filenames in reverse order
-    for (int i = num_files - 1; i >= 0; i--)
+    // Transfer the filenames to the library's files array at their index
+    for (int i = 0; i < num_received; i++)
     {
-        printf("%d: %s\n", num_files - 1 - i, library->files[num_files - 1 - i]);
+        free(library->files[temp_indices[i]]);
+        library->files[temp_indices[i]] = temp_filenames[i];
     }
 
     // Free the temporary storage
     free(temp_filenames);
+    free(temp_indices);
 
     library->num_files = num_files;
+    _print_library(library);
+    return num_files;
+}
+
+/*
+** Helper for: _receive_file_lines and list_request
+** Put a copy of path at index in library->files, growing it as needed.
+**
+** returns 0 on success, -1 on error
+*/
+static int _set_library_file(Library *library, uint32_t index, const char *path)
+{
+    if (index >= library->num_files)
+    {
+        uint32_t num_files = 2 * library->num_files > index ? 2 * library->num_files : index + 1;
+        char **files = realloc(library->files, num_files * sizeof(char *));
+        if (files == NULL)
+        {
+            perror("list_page_request: realloc");
+            return -1;
+        }
+        memset(files + library->num_files, 0, (num_files - library->num_files) * sizeof(char *));
+        library->files = files;
+        library->num_files = num_files;
+    }
+    free(library->files[index]);
+    library->files[index] = strdup(path);
+    if (library->files[index] == NULL)
+    {
+        perror("list_page_request: strdup");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** Helper for: _receive_file_lines, _list_delta_request and info_request
+** Read the next line of a response into *buf, which holds *bytes_in_buffer
+** bytes and grows (from *capacity bytes) for long lines.
+**
+** returns the line (heap allocated, without its network newline), NULL on
+** error
+*/
+static char *_read_response_line(int sockfd, char **buf, int *capacity, int *bytes_in_buffer)
+{
+    char *line;
+    while ((line = find_network_newline(*buf, bytes_in_buffer)) == NULL)
+    {
+        if (*bytes_in_buffer == *capacity)
+        {
+            char *bigger = realloc(*buf, 2 * *capacity);
+            if (bigger == NULL)
+            {
+                perror("list_request: realloc");
+                return NULL;
+            }
+            *buf = bigger;
+            *capacity *= 2;
+        }
+        int num = read(sockfd, *buf + *bytes_in_buffer, *capacity - *bytes_in_buffer);
+        if (num <= 0)
+        {
+            ERR_PRINT("list_request: connection lost\n");
+            return NULL;
+        }
+        *bytes_in_buffer += num;
+    }
+    return line;
+}
+
+/*
+** Helper for: list_request
+** Apply a line of a LIST_DELTA response ("+<index>: <path>" or "-<index>")
+** to library.
+**
+** returns 0 on success, -1 on error
+*/
+static int _apply_delta_line(Library *library, const char *line)
+{
+    char *end;
+    unsigned long index = strtoul(line + 1, &end, 10);
+    if (end == line + 1 || index >= UINT32_MAX)
+    {
+        return -1;
+    }
+    if (line[0] == '+' && strncmp(end, ": ", 2) == 0)
+    {
+        return _set_library_file(library, index, end + 2);
+    }
+    if (line[0] != '-' || *end != '\0')
+    {
+        return -1;
+    }
+    if (index < library->num_files)
+    {
+        free(library->files[index]);
+        library->files[index] = NULL;
+    }
+    return 0;
+}
+
+/*
+** Helper for: list_request
+** Ask for the changes to the library since library_generation with a
+** LIST_DELTA request, and apply them to library.
+**
+** returns 1 if library is up to date, 0 if it has to be listed again (the
+** server's epoch and generation are kept for next time), -1 on error
+*/
+static int _list_delta_request(int sockfd, Library *library)
+{
+    char delta_req[REQUEST_BUFFER_SIZE];
+    int req_len = snprintf(delta_req, sizeof(delta_req), "%s %llu %llu%s", REQUEST_LIST_DELTA,
+                           (unsigned long long)library_epoch,
+                           (unsigned long long)library_generation, END_OF_MESSAGE_TOKEN);
+    if (write_precisely(sockfd, delta_req, req_len) != req_len)
+    {
+        perror("list_request: failed to write to sockfd");
+        return -1;
+    }
+
+    int capacity = RESPONSE_BUFFER_SIZE;
+    int bytes_in_buffer = 0;
+    char *buf = malloc(capacity);
+    if (buf == NULL)
+    {
+        perror("list_request: malloc");
+        return -1;
+    }
+
+    // "DELTA <epoch> <generation>" or "RESYNC <epoch> <generation>"
+    char *line = _read_response_line(sockfd, &buf, &capacity, &bytes_in_buffer);
+    if (line == NULL)
+    {
+        free(buf);
+        return -1;
+    }
+    char kind[8];
+    unsigned long long epoch, generation;
+    int up_to_date = -1;
+    if (sscanf(line, "%7s %llu %llu", kind, &epoch, &generation) == 3)
+    {
+        if (strcmp(kind, RESPONSE_DELTA) == 0)
+        {
+            up_to_date = 1;
+        }
+        else if (strcmp(kind, RESPONSE_RESYNC) == 0)
+        {
+            up_to_date = 0;
+        }
+    }
+    if (up_to_date < 0)
+    {
+        ERR_PRINT("list_request: unexpected line: %s\n", line);
+    }
+    free(line);
+
+    // The response ends with an empty line
+    while (up_to_date >= 0 &&
+           (line = _read_response_line(sockfd, &buf, &capacity, &bytes_in_buffer)) != NULL &&
+           *line != '\0')
+    {
+        if (up_to_date == 1 && _apply_delta_line(library, line) < 0)
+        {
+            ERR_PRINT("list_request: unexpected line: %s\n", line);
+            up_to_date = -1;
+        }
+        free(line);
+    }
+    if (line == NULL)
+    {
+        up_to_date = -1;
+    }
+    free(line);
+    free(buf);
+
+    if (up_to_date < 0)
+    {
+        return -1;
+    }
+    while (library->num_files > 0 && library->files[library->num_files - 1] == NULL)
+    {
+        library->num_files--;
+    }
+    library_epoch = epoch;
+    library_generation = generation;
+    return up_to_date;
+}
+
+int list_request(int sockfd, Library *library)
+{
+    if (library == NULL)
+    {
+        ERR_PRINT("list_request: library pointer is NULL\n");
+        return -1;
+    }
+
+    // Only the changes since the last LIST, when the server knows them
+    if (protocol_version >= PROTOCOL_VERSION_LIST_DELTA)
+    {
+        int up_to_date = _list_delta_request(sockfd, library);
+        if (up_to_date < 0)
+        {
+            library_epoch = 0;
+            return -1;
+        }
+        if (up_to_date)
+        {
+            _print_library(library);
+            return library->num_files;
+        }
+    }
+
+    int num_files = _list_all_request(sockfd, library);
+    if (num_files < 0)
+    {
+        library_epoch = 0;
+    }
     return num_files;
 }
 
+/*
+** Helper for: _receive_file_lines and _mux_finish
+** Parse a "<index>: <path>" line of a response into index and path (which
+** points into line).
+**
+** returns 0 on success, -1 if the line isn't one
+*/
+static int _parse_file_line(const char *line, uint32_t *index, const char **path)
+{
+    char *end;
+    unsigned long parsed = strtoul(line, &end, 10);
+    if (end == line || strncmp(end, ": ", 2) != 0 || parsed >= UINT32_MAX)
+    {
+        ERR_PRINT("_parse_file_line: unexpected line: %s\n", line);
+        return -1;
+    }
+    *index = parsed;
+    *path = end + 2;
+    return 0;
+}
+
+/*
+** Helper for: list_page_request and search_request
+** Receive "<index>: <path>" lines up to an empty line, print them as they
+** arrive and put their files in library.
+**
+** returns the number of files received on success, -1 on error
+*/
+static int _receive_file_lines(int sockfd, Library *library)
+{
+    // Lines are printed as they arrive, the buffer only grows for long paths
+    int capacity = RESPONSE_BUFFER_SIZE;
+    int bytes_in_buffer = 0;
+    char *buf = malloc(capacity);
+    if (buf == NULL)
+    {
+        perror("_receive_file_lines: malloc");
+        return -1;
+    }
+
+    int num_listed = 0;
+    while (1)
+    {
+        char *line = _read_response_line(sockfd, &buf, &capacity, &bytes_in_buffer);
+        if (line == NULL)
+        {
+            goto error;
+        }
+
+        // The lines end with an empty line
+        if (*line == '\0')
+        {
+            free(line);
+            break;
+        }
+        uint32_t index;
+        const char *path;
+        int result = _parse_file_line(line, &index, &path);
+        if (result == 0)
+        {
+            printf("%u: %s\n", index, path);
+            result = _set_library_file(library, index, path);
+        }
+        free(line);
+        if (result < 0)
+        {
+            goto error;
+        }
+        num_listed++;
+    }
+
+    free(buf);
+    return num_listed;
+error:
+    free(buf);
+    return -1;
+}
+
+int list_page_request(int sockfd, uint32_t position, uint32_t most_files,
+                      const char *extension, const char *prefix, Library *library)
+{
+    char list_req[REQUEST_BUFFER_SIZE];
+    int req_len = snprintf(list_req, sizeof(list_req), "%s %u %u %s%s%s%s", REQUEST_LIST,
+                           position, most_files, extension, *prefix != '\0' ? " " : "", prefix,
+                           END_OF_MESSAGE_TOKEN);
+    if (req_len >= sizeof(list_req) || strlen(extension) >= LIST_EXTENSION_MAX)
+    {
+        ERR_PRINT("list_page_request: prefix or extension too long\n");
+        return 0;
+    }
+    if (write_precisely(sockfd, list_req, req_len) != req_len)
+    {
+        perror("list_page_request: failed to write to sockfd");
+        return -1;
+    }
+
+    // Only a page of the library is kept, the next list gets all of it
+    _free_library(library);
+    library_epoch = 0;
+    return _receive_file_lines(sockfd, library);
+}
+
+int search_request(int sockfd, const char *query, Library *library)
+{
+    char search_req[REQUEST_BUFFER_SIZE];
+    int req_len = snprintf(search_req, sizeof(search_req), "%s %s%s", REQUEST_SEARCH, query,
+                           END_OF_MESSAGE_TOKEN);
+    if (req_len >= sizeof(search_req) || strlen(query) >= MAX_PATH)
+    {
+        ERR_PRINT("search_request: query too long\n");
+        return 0;
+    }
+    if (write_precisely(sockfd, search_req, req_len) != req_len)
+    {
+        perror("search_request: failed to write to sockfd");
+        return -1;
+    }
+
+    // Only the matches are kept, like a page
+    _free_library(library);
+    library_epoch = 0;
+    return _receive_file_lines(sockfd, library);
+}
+
+int info_request(int sockfd, uint32_t file_index)
+{
+    if (protocol_version < PROTOCOL_VERSION_INFO)
+    {
+        printf("The server doesn't know what is in its files\n");
+        return 0;
+    }
+
+    char info_req[REQUEST_BUFFER_SIZE];
+    int req_len = snprintf(info_req, sizeof(info_req), "%s %u%s", REQUEST_INFO, file_index,
+                           END_OF_MESSAGE_TOKEN);
+    if (write_precisely(sockfd, info_req, req_len) != req_len)
+    {
+        perror("info_request: failed to write to sockfd");
+        return -1;
+    }
+
+    int capacity = RESPONSE_BUFFER_SIZE;
+    int bytes_in_buffer = 0;
+    char *buf = malloc(capacity);
+    if (buf == NULL)
+    {
+        perror("info_request: malloc");
+        return -1;
+    }
+    char *line = _read_response_line(sockfd, &buf, &capacity, &bytes_in_buffer);
+    free(buf);
+    if (line == NULL)
+    {
+        return -1;
+    }
+    if (*line == '\0')
+    {
+        printf("No such file in the library\n");
+    }
+    else
+    {
+        printf("%u: %s\n", file_index, line);
+    }
+    free(line);
+    return 0;
+}
+
 /*
 ** Get the permission of the library directory. If the library
 ** directory does not exist, this function shall create it.
@@ -292,39 +755,64 @@ free_tokville:
 }
 
 /*
-** Helper for: get_file_request
+** Helper for: get_file_request, resume_file_request, fetch_request
+**
+** Opens the local copy of the file at path in library_dir for writing. With
+** resume set the file is kept as it is and the next write goes after its last
+** byte, whose position is stored in existing_size. Otherwise it is truncated.
 */
-static int file_index_to_fd(uint32_t file_index, const Library *library)
+static int path_to_fd(const char *path, const char *library_dir,
+                      int resume, off_t *existing_size)
 {
-    create_missing_directories(library->files[file_index], library->path);
+    create_missing_directories(path, library_dir);
 
-    char *filepath = _join_path(library->path, library->files[file_index]);
+    char *filepath = _join_path(library_dir, path);
     if (filepath == NULL)
     {
         return -1;
     }
 
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    int fd = open(filepath, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0666);
 #ifdef DEBUG
     printf("Opened file %s\n", filepath);
 #endif
     free(filepath);
     if (fd < 0)
     {
-        perror("file_index_to_fd");
+        perror("path_to_fd");
         return -1;
     }
 
+    if (resume)
+    {
+        *existing_size = lseek(fd, 0, SEEK_END);
+        if (*existing_size < 0)
+        {
+            perror("path_to_fd");
+            close(fd);
+            return -1;
+        }
+    }
+
     return fd;
 }
 
+/*
+** Opens the local copy of the file at file_index for writing, see path_to_fd
+*/
+static int file_index_to_fd(uint32_t file_index, const Library *library,
+                            int resume, off_t *existing_size)
+{
+    return path_to_fd(library->files[file_index], library->path, resume, existing_size);
+}
+
 int get_file_request(int sockfd, uint32_t file_index, const Library *library)
 {
 #ifdef DEBUG
     printf("Getting file %s\n", library->files[file_index]);
 #endif
 
-    int file_dest_fd = file_index_to_fd(file_index, library);
+    int file_dest_fd = file_index_to_fd(file_index, library, 0, NULL);
     if (file_dest_fd == -1)
     {
         return -1;
@@ -339,7 +827,104 @@ int get_file_request(int sockfd, uint32_t file_index, const Library *library)
     return 0;
 }
 
-int start_audio_player_process(int *audio_out_fd)
+static void _write_stream_request(uint8_t *request, uint32_t file_index);
+static int _process_stream_response(int sockfd, int audio_out_fd, int file_dest_fd);
+
+int get_files_request(int sockfd, const uint32_t *file_indices, int num_files,
+                      const Library *library)
+{
+    // Every local copy is opened first, nothing is asked for if one can't be
+    int *file_dest_fds = malloc(num_files * sizeof(int));
+    if (file_dest_fds == NULL)
+    {
+        perror("get_files_request");
+        return -1;
+    }
+    for (int i = 0; i < num_files; i++)
+    {
+        file_dest_fds[i] = file_index_to_fd(file_indices[i], library, 0, NULL);
+        if (file_dest_fds[i] == -1)
+        {
+            while (--i >= 0)
+            {
+                close(file_dest_fds[i]);
+            }
+            free(file_dest_fds);
+            return -1;
+        }
+    }
+
+    // Up to GET_PIPELINE_DEPTH requests are sent ahead of the response being
+    // received, so the server always has the next one when a response ends,
+    // without the requests filling the socket while it isn't reading
+    uint8_t requests[GET_PIPELINE_DEPTH * STREAM_REQUEST_SIZE];
+    int num_sent = 0;
+    int result = 0;
+    int i;
+    for (i = 0; i < num_files && result == 0; i++)
+    {
+        int num_requests = 0;
+        while (num_sent < num_files && num_sent < i + GET_PIPELINE_DEPTH)
+        {
+            _write_stream_request(requests + num_requests * STREAM_REQUEST_SIZE,
+                                  file_indices[num_sent++]);
+            num_requests++;
+        }
+        size_t requests_len = num_requests * STREAM_REQUEST_SIZE;
+        if (requests_len > 0 && write_precisely(sockfd, requests, requests_len) != requests_len)
+        {
+            perror("get_files_request: Writing the requests failed.\n");
+            result = -1;
+            break;
+        }
+
+#ifdef DEBUG
+        printf("Getting file %s\n", library->files[file_indices[i]]);
+#endif
+        // Closes the local copy once it is complete
+        result = _process_stream_response(sockfd, -1, file_dest_fds[i]);
+    }
+
+    // The local copies whose response never came
+    for (; i < num_files; i++)
+    {
+        close(file_dest_fds[i]);
+    }
+    free(file_dest_fds);
+    return result;
+}
+
+int resume_file_request(int sockfd, uint32_t file_index, const Library *library)
+{
+    off_t existing_size;
+    int file_dest_fd = file_index_to_fd(file_index, library, 1, &existing_size);
+    if (file_dest_fd == -1)
+    {
+        return -1;
+    }
+
+    uint64_t file_size;
+    if (send_and_process_stream_range_request(sockfd, file_index, existing_size,
+                                              -1, file_dest_fd, &file_size) == -1)
+    {
+        return -1;
+    }
+
+    // The local copy is not a part of the server's file, get all of it again
+    if (file_size < existing_size)
+    {
+        printf("Local copy is larger than the server's file, getting it again\n");
+        return get_file_request(sockfd, file_index, library);
+    }
+    if (file_size == existing_size)
+    {
+        printf("File is already complete\n");
+    }
+
+    return 0;
+}
+
+int start_audio_player_process(int *audio_out_fd)
 {
     // Since we have to fork for execvp, we should set up a pipe.
     int pipefd[2];
@@ -418,7 +1003,12 @@ int stream_request(int sockfd, uint32_t file_index)
     int audio_out_fd;
     int audio_player_pid = start_audio_player_process(&audio_out_fd);
 
-    int result = send_and_process_stream_request(sockfd, file_index, audio_out_fd, -1);
+    // Only played, so it may be paced by servers that can (see as_server.h)
+    uint64_t start_ms;
+    int result = protocol_version >= PROTOCOL_VERSION_STREAM_AT
+                     ? send_and_process_stream_at_request(sockfd, file_index, 0, audio_out_fd,
+                                                          -1, &start_ms)
+                     : send_and_process_stream_request(sockfd, file_index, audio_out_fd, -1);
     if (result == -1)
     {
         ERR_PRINT("stream_request: send_and_process_stream_request failed\n");
@@ -430,24 +1020,169 @@ int stream_request(int sockfd, uint32_t file_index)
     return 0;
 }
 
+int seek_request(int sockfd, uint32_t file_index, uint64_t position_ms)
+{
+    if (protocol_version < PROTOCOL_VERSION_STREAM_AT)
+    {
+        printf("The server can only stream files from the start\n");
+        return 0;
+    }
+
+    int audio_out_fd;
+    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+
+    uint64_t start_ms;
+    if (send_and_process_stream_at_request(sockfd, file_index, position_ms, audio_out_fd, -1,
+                                           &start_ms) == -1)
+    {
+        ERR_PRINT("seek_request: send_and_process_stream_at_request failed\n");
+        return -1;
+    }
+    _wait_on_audio_player(audio_player_pid);
+
+    printf("Played from %llu:%02llu.%03llu\n", (unsigned long long)(start_ms / 60000),
+           (unsigned long long)(start_ms / 1000 % 60), (unsigned long long)(start_ms % 1000));
+    return 0;
+}
+
+int play_request(int sockfd, const char *path, uint64_t file_id)
+{
+    if (protocol_version < PROTOCOL_VERSION_STREAM_ID)
+    {
+        printf("The server can only stream files by index, list the library first\n");
+        return 0;
+    }
+
+    int audio_out_fd;
+    int audio_player_pid = start_audio_player_process(&audio_out_fd);
+
+    if (send_and_process_stream_file_request(sockfd, path, &file_id, audio_out_fd, -1) == -1)
+    {
+        ERR_PRINT("play_request: send_and_process_stream_file_request failed\n");
+        return -1;
+    }
+    _wait_on_audio_player(audio_player_pid);
+
+    if (file_id == 0)
+    {
+        printf("No such file in the library\n");
+    }
+    else
+    {
+        printf("File id: %llu\n", (unsigned long long)file_id);
+    }
+    return 0;
+}
+
+int fetch_request(int sockfd, const char *path, const char *library_directory)
+{
+    if (protocol_version < PROTOCOL_VERSION_STREAM_ID)
+    {
+        printf("The server can only send files by index, list the library first\n");
+        return 0;
+    }
+
+    int file_dest_fd = path_to_fd(path, library_directory, 0, NULL);
+    if (file_dest_fd == -1)
+    {
+        return -1;
+    }
+
+    uint64_t file_id;
+    if (send_and_process_stream_file_request(sockfd, path, &file_id, -1, file_dest_fd) == -1)
+    {
+        return -1;
+    }
+
+    // Don't leave an empty copy of a file that doesn't exist behind
+    if (file_id == 0)
+    {
+        printf("No such file in the library\n");
+        char *filepath = _join_path(library_directory, path);
+        if (filepath != NULL)
+        {
+            unlink(filepath);
+            free(filepath);
+        }
+        return 0;
+    }
+    printf("File id: %llu\n", (unsigned long long)file_id);
+    return 0;
+}
+
 /*
-** Helper for: send_and_process_stream_request
+** Helpers for: send_and_process_stream_request
+**
+** The stream ring buffer. head counts every byte received into it, and each
+** output's tail every byte written out of it, so a cursor's position in data
+** is its count modulo capacity and nothing is ever moved or reallocated.
+*/
+static int _ring_init(StreamRing *ring, size_t capacity)
+{
+    ring->data = malloc(capacity);
+    if (ring->data == NULL)
+    {
+        perror("send_and_process_stream_request: Malloc failed.\n");
+        return -1;
+    }
+    ring->capacity = capacity;
+    ring->head = 0;
+    ring->audio_tail = 0;
+    ring->file_tail = 0;
+    return 0;
+}
+
+/*
+** Fill iov with the (at most two) pieces of the ring between the counts
+** from and to, on either side of the wrap point.
+**
+** returns the number of iovecs used
+*/
+static int _ring_iov(const StreamRing *ring, uint64_t from, uint64_t to, struct iovec iov[2])
+{
+    size_t start = from % ring->capacity;
+    size_t len = to - from;
+    size_t first = MIN(len, ring->capacity - start);
+
+    iov[0].iov_base = ring->data + start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = len - first;
+    return iov[1].iov_len > 0 ? 2 : 1;
+}
+
+/*
+** Receive into the part of the ring the slowest output is done with, but
+** never past byte want of the stream.
+**
+** returns the number of bytes received, 0 on EOF, -1 on error
 */
-void refreshDynamicBuffer(char **dynamicBuffer, size_t *dynamicBufferSize,
-                          int offset, int *processedBytes,
-                          int sockfd, int *fd, int other_fd)
+static ssize_t _ring_recv(StreamRing *ring, int sockfd, uint64_t slowest_tail, uint64_t want)
 {
-    memmove(*dynamicBuffer, *dynamicBuffer + offset, *dynamicBufferSize - offset);
-    *dynamicBuffer = realloc(*dynamicBuffer, *dynamicBufferSize - offset);
-    if (dynamicBuffer == NULL){
-        perror("send_and_process_stream_request: Realloc failed.\n");
-        exit (-1);
+    struct iovec iov[2];
+    uint64_t limit = MIN(slowest_tail + ring->capacity, want);
+    ssize_t bytes_read = readv(sockfd, iov, _ring_iov(ring, ring->head, limit, iov));
+    if (bytes_read > 0)
+    {
+        ring->head += bytes_read;
     }
-    *dynamicBufferSize -= offset;
-    *processedBytes += offset;
+    return bytes_read;
+}
 
-    // Update max file descriptor for the next select() call
-    *fd = sockfd > other_fd ? sockfd : other_fd;
+/*
+** Write the bytes of the ring not yet written to fd, advancing its tail.
+**
+** returns the number of bytes written, -1 on error
+*/
+static ssize_t _ring_send(StreamRing *ring, int fd, uint64_t *tail)
+{
+    struct iovec iov[2];
+    ssize_t bytes_written = writev(fd, iov, _ring_iov(ring, *tail, ring->head, iov));
+    if (bytes_written > 0)
+    {
+        *tail += bytes_written;
+    }
+    return bytes_written;
 }
 
 /*
@@ -478,251 +1213,1165 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library *libra
     printf("Getting file %s\n", library->files[file_index]);
 #endif
 
-    int file_dest_fd = file_index_to_fd(file_index, library);
+    int file_dest_fd = file_index_to_fd(file_index, library, 0, NULL);
     if (file_dest_fd == -1)
     {
         ERR_PRINT("stream_and_get_request: file_index_to_fd failed\n");
         return -1;
     }
 
-    int result = send_and_process_stream_request(sockfd, file_index,
-                                                 audio_out_fd, file_dest_fd);
-    if (result == -1)
-    {
-        ERR_PRINT("stream_and_get_request: send_and_process_stream_request failed\n");
-        return -1;
+    int result = send_and_process_stream_request(sockfd, file_index,
+                                                 audio_out_fd, file_dest_fd);
+    if (result == -1)
+    {
+        ERR_PRINT("stream_and_get_request: send_and_process_stream_request failed\n");
+        return -1;
+    }
+
+    _wait_on_audio_player(audio_player_pid);
+
+    return 0;
+}
+
+/*
+** Helper for: send_and_process_stream_request, send_and_process_stream_range_request
+**
+** Receives file_size bytes of the requested file from sockfd, after its
+** header, and sends them to audio_out_fd and file_dest_fd (if >= 0) as
+** described for send_and_process_stream_request.
+*/
+static int _process_stream(int sockfd, off_t file_size, int audio_out_fd, int file_dest_fd)
+{
+    StreamRing ring;
+    if (_ring_init(&ring, stream_ring_capacity) < 0)
+    {
+        return -1;
+    }
+
+    // An output that is off counts as having written everything already
+    if (audio_out_fd == -1)
+    {
+        ring.audio_tail = file_size;
+    }
+    if (file_dest_fd == -1)
+    {
+        ring.file_tail = file_size;
+    }
+
+    // Assign the max_fd for select call
+    int max_fd = determine_max_fd(sockfd, audio_out_fd, file_dest_fd);
+    int result = 0;
+
+    while (ring.audio_tail < file_size || ring.file_tail < file_size)
+    {
+        fd_set read_fds, write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+
+        // Only read from the server while the ring has room: when the slowest
+        // output falls a whole ring behind, the socket is left alone and TCP
+        // flow control slows the server down instead of the buffer growing.
+        uint64_t slowest_tail = MIN(ring.audio_tail, ring.file_tail);
+        if (ring.head < file_size && ring.head - slowest_tail < ring.capacity)
+        {
+            FD_SET(sockfd, &read_fds);
+        }
+        if (ring.audio_tail < ring.head)
+        {
+            FD_SET(audio_out_fd, &write_fds);
+        }
+        if (ring.file_tail < ring.head)
+        {
+            FD_SET(file_dest_fd, &write_fds);
+        }
+
+        // select updates the timeout, set it up again every time
+        struct timeval timeout = {SELECT_TIMEOUT_SEC, SELECT_TIMEOUT_USEC};
+        int selected_fd = select(max_fd + 1, &read_fds, &write_fds, NULL, &timeout);
+
+        // Select failed
+        if (selected_fd == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            ERR_PRINT("send_and_process_stream_request: Select failed.\n");
+            result = -1;
+            break;
+        }
+
+        // Select timeout
+        // (Piazza) When select timeout happens, just let it have another loop iteration
+        if (selected_fd == 0)
+        {
+            continue;
+        }
+
+        // Read from the server first if available.
+        // Notice that sockfd is the only fd we can read from.
+        if (FD_ISSET(sockfd, &read_fds))
+        {
+            ssize_t bytes_read = _ring_recv(&ring, sockfd, slowest_tail, file_size);
+            if (bytes_read < 0)
+            {
+                ERR_PRINT("send_and_process_stream_request: Reading from the server failed.\n");
+                result = -1;
+                break;
+            }
+            if (bytes_read == 0)
+            {
+                ERR_PRINT("send_and_process_stream_request: Server closed the connection.\n");
+                result = -1;
+                break;
+            }
+        }
+
+        // Each output writes as much as it can from its own tail, differing
+        // numbers of bytes may be written to each.
+        if (audio_out_fd != -1 && FD_ISSET(audio_out_fd, &write_fds) &&
+            _ring_send(&ring, audio_out_fd, &ring.audio_tail) < 0)
+        {
+            ERR_PRINT("send_and_process_stream_request: Writing to the audio failed.\n");
+            result = -1;
+            break;
+        }
+        if (file_dest_fd != -1 && FD_ISSET(file_dest_fd, &write_fds) &&
+            _ring_send(&ring, file_dest_fd, &ring.file_tail) < 0)
+        {
+            ERR_PRINT("send_and_process_stream_request: Writing to the file failed.\n");
+            result = -1;
+            break;
+        }
+    }
+    if (audio_out_fd != -1)
+        close(audio_out_fd);
+    if (file_dest_fd != -1)
+        close(file_dest_fd);
+
+    free(ring.data);
+
+    return result;
+}
+
+/*
+** Helper for: _splice_stream
+**
+** Move count bytes from the front of pipe_fd to out_fd with splice. If
+** out_fd can't be spliced to, *use_splice is cleared and the bytes (and
+** those of later calls) are copied through a buffer instead.
+**
+** returns 0 on success, -1 on error
+*/
+static int _drain_pipe_precisely(int pipe_fd, int out_fd, size_t count, int *use_splice)
+{
+    while (count > 0 && *use_splice)
+    {
+        ssize_t moved = splice(pipe_fd, NULL, out_fd, NULL, count, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved < 0 && errno == EINVAL)
+        {
+            *use_splice = 0;
+            break;
+        }
+        if (moved <= 0)
+        {
+            return -1;
+        }
+        count -= moved;
+    }
+
+    char buf[COPY_CHUNK_SIZE];
+    while (count > 0)
+    {
+        ssize_t num = read(pipe_fd, buf, MIN(sizeof(buf), count));
+        if (num <= 0 || write_precisely(out_fd, buf, num) != num)
+        {
+            return -1;
+        }
+        count -= num;
+    }
+    return 0;
+}
+
+/*
+** Helper for: send_and_process_stream_request, send_and_process_stream_range_request
+**
+** Same as _process_stream, without copying the stream into this process:
+**   - to the player only, the socket is spliced straight into its pipe,
+**   - to the file, the socket is spliced into a pipe of our own, which is
+**     spliced into the file,
+**   - to both, each chunk in that pipe is first duplicated into the player's
+**     pipe with tee, so the player and the file are fed from the same pages.
+** Each chunk is handed to the outputs before the next one is received, so the
+** slowest output slows the server down, like a full StreamRing does.
+**
+** returns 0 on success, -1 on error, STREAM_SPLICE_UNSUPPORTED (without
+** having received anything or closed the outputs) if splice can't be used
+*/
+static int _splice_stream(int sockfd, off_t file_size, int audio_out_fd, int file_dest_fd)
+{
+    // The player can only be fed from a pipe with splice and tee
+    struct stat st;
+    if (audio_out_fd != -1 && (fstat(audio_out_fd, &st) < 0 || !S_ISFIFO(st.st_mode)))
+    {
+        return STREAM_SPLICE_UNSUPPORTED;
+    }
+
+    int pipefd[2] = {-1, -1};
+    int in_fd = audio_out_fd;
+    if (file_dest_fd != -1)
+    {
+        if (pipe2(pipefd, O_CLOEXEC) < 0)
+        {
+            perror("send_and_process_stream_request: pipe");
+            return STREAM_SPLICE_UNSUPPORTED;
+        }
+        // As much in flight as the buffered path would hold, if we may
+        fcntl(pipefd[1], F_SETPIPE_SZ, stream_ring_capacity);
+        in_fd = pipefd[1];
+    }
+    int chunk_size = fcntl(in_fd, F_GETPIPE_SZ);
+    if (chunk_size <= 0)
+    {
+        chunk_size = SPLICE_CHUNK_SIZE;
+    }
+
+    off_t received = 0;
+    int file_splice = 1;
+    int result = 0;
+    while (received < file_size)
+    {
+        ssize_t in_pipe = splice(sockfd, NULL, in_fd, NULL, MIN(file_size - received, chunk_size),
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (in_pipe < 0 && received == 0 && (errno == EINVAL || errno == ENOSYS))
+        {
+            result = STREAM_SPLICE_UNSUPPORTED;
+            break;
+        }
+        if (in_pipe <= 0)
+        {
+            ERR_PRINT("send_and_process_stream_request: Receiving from the server failed.\n");
+            result = -1;
+            break;
+        }
+        received += in_pipe;
+        if (file_dest_fd == -1)
+        {
+            continue;
+        }
+
+        // tee doesn't consume what it duplicates, so each part teed to the
+        // player has to leave the pipe for the file before the next one
+        size_t left = in_pipe;
+        while (left > 0)
+        {
+            ssize_t teed = left;
+            if (audio_out_fd != -1)
+            {
+                teed = tee(pipefd[0], audio_out_fd, left, 0);
+                if (teed < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (teed <= 0)
+                {
+                    ERR_PRINT("send_and_process_stream_request: Writing to the audio failed.\n");
+                    result = -1;
+                    break;
+                }
+            }
+            if (_drain_pipe_precisely(pipefd[0], file_dest_fd, teed, &file_splice) < 0)
+            {
+                ERR_PRINT("send_and_process_stream_request: Writing to the file failed.\n");
+                result = -1;
+                break;
+            }
+            left -= teed;
+        }
+        if (result < 0)
+        {
+            break;
+        }
+    }
+
+    if (pipefd[0] != -1)
+    {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    if (result == STREAM_SPLICE_UNSUPPORTED)
+    {
+        return result;
+    }
+    if (audio_out_fd != -1)
+        close(audio_out_fd);
+    if (file_dest_fd != -1)
+        close(file_dest_fd);
+    return result;
+}
+
+/*
+** Helper for: send_and_process_stream_request, send_and_process_stream_range_request
+**
+** Receives file_size bytes of the requested file with _splice_stream, or
+** with _process_stream when splice can't be used or was turned off (-c).
+*/
+static int _receive_stream(int sockfd, off_t file_size, int audio_out_fd, int file_dest_fd)
+{
+    if (stream_splice)
+    {
+        int result = _splice_stream(sockfd, file_size, audio_out_fd, file_dest_fd);
+        if (result != STREAM_SPLICE_UNSUPPORTED)
+        {
+            return result;
+        }
+#ifdef DEBUG
+        printf("splice unsupported, receiving the stream through a buffer\n");
+#endif
+    }
+    return _process_stream(sockfd, file_size, audio_out_fd, file_dest_fd);
+}
+
+/*
+** Write the STREAM request for file_index to request, which has room for
+** STREAM_REQUEST_SIZE bytes: REQUEST_STREAM and the network newline, then
+** the index converted into network byte order.
+*/
+static void _write_stream_request(uint8_t *request, uint32_t file_index)
+{
+    uint32_t net_file_index = htonl(file_index);
+    memcpy(request, REQUEST_STREAM "\r\n", strlen(REQUEST_STREAM "\r\n"));
+    memcpy(request + strlen(REQUEST_STREAM "\r\n"), &net_file_index, sizeof(net_file_index));
+}
+
+/*
+** Receive the response to a STREAM request already sent into the outputs,
+** see send_and_process_stream_request.
+**
+** returns 0 on success, -1 on error
+*/
+static int _process_stream_response(int sockfd, int audio_out_fd, int file_dest_fd)
+{
+    // Read the size of the file from the first four bytes, or eight once
+    // large files were negotiated.
+    // The value has to be converted back to the host byte order.
+    off_t file_size;
+    if (protocol_version >= PROTOCOL_VERSION_LARGE_FILES)
+    {
+        uint64_t net_file_size;
+        if (read_precisely(sockfd, &net_file_size, sizeof(net_file_size)) != sizeof(net_file_size))
+        {
+            perror("send_and_process_stream_request: Reading the file size failed.\n");
+            return -1;
+        }
+        file_size = be64toh(net_file_size);
+    }
+    else
+    {
+        uint32_t net_file_size;
+        if (read_precisely(sockfd, &net_file_size, sizeof(net_file_size)) != sizeof(net_file_size))
+        {
+            perror("send_and_process_stream_request: Reading the file size failed.\n");
+            return -1;
+        }
+        file_size = ntohl(net_file_size);
+    }
+
+    return _receive_stream(sockfd, file_size, audio_out_fd, file_dest_fd);
+}
+
+int send_and_process_stream_request(int sockfd, uint32_t file_index,
+                                    int audio_out_fd, int file_dest_fd)
+{
+
+    // None of the file descriptors are "on."
+    if (audio_out_fd == -1 && file_dest_fd == -1)
+    {
+        ERR_PRINT("send_and_process_stream_request: None of the output file descriptors are activated.\n");
+        return -1;
+    }
+
+    // The request and the index in a single write, so they go in one segment
+    uint8_t stream_req[STREAM_REQUEST_SIZE];
+    _write_stream_request(stream_req, file_index);
+    if (write_precisely(sockfd, stream_req, sizeof(stream_req)) != sizeof(stream_req))
+    {
+        perror("send_and_process_stream_request: Writing the request failed.\n");
+        return -1;
+    }
+
+    return _process_stream_response(sockfd, audio_out_fd, file_dest_fd);
+}
+
+int send_and_process_stream_range_request(int sockfd, uint32_t file_index, uint64_t offset,
+                                          int audio_out_fd, int file_dest_fd, uint64_t *file_size)
+{
+    // None of the file descriptors are "on."
+    if (audio_out_fd == -1 && file_dest_fd == -1)
+    {
+        ERR_PRINT("send_and_process_stream_range_request: None of the output file descriptors are activated.\n");
+        return -1;
+    }
+
+    // Send STREAM_RANGE request for everything from offset on, in network byte order
+    const char *stream_req = REQUEST_STREAM_RANGE "\r\n";
+    uint32_t net_file_index = htonl(file_index);
+    uint64_t net_offset = htobe64(offset);
+    uint64_t net_length = 0;
+    uint8_t params[sizeof(net_file_index) + sizeof(net_offset) + sizeof(net_length)];
+    memcpy(params, &net_file_index, sizeof(net_file_index));
+    memcpy(params + sizeof(net_file_index), &net_offset, sizeof(net_offset));
+    memcpy(params + sizeof(net_file_index) + sizeof(net_offset), &net_length, sizeof(net_length));
+    if (write_precisely(sockfd, stream_req, strlen(stream_req)) != strlen(stream_req) ||
+        write_precisely(sockfd, params, sizeof(params)) != sizeof(params))
+    {
+        perror("send_and_process_stream_range_request: Writing the request failed.\n");
+        return -1;
+    }
+
+    // Read the total size of the file and the size of the range that follows
+    uint64_t net_sizes[2];
+    if (read_precisely(sockfd, net_sizes, sizeof(net_sizes)) != sizeof(net_sizes))
+    {
+        perror("send_and_process_stream_range_request: Reading the file size failed.\n");
+        return -1;
+    }
+    *file_size = be64toh(net_sizes[0]);
+    uint64_t range_size = be64toh(net_sizes[1]);
+
+    return _receive_stream(sockfd, range_size, audio_out_fd, file_dest_fd);
+}
+
+int send_and_process_stream_file_request(int sockfd, const char *path, uint64_t *file_id,
+                                         int audio_out_fd, int file_dest_fd)
+{
+    // None of the file descriptors are "on."
+    if (audio_out_fd == -1 && file_dest_fd == -1)
+    {
+        ERR_PRINT("send_and_process_stream_file_request: None of the output file descriptors are activated.\n");
+        return -1;
+    }
+
+    // The path or the id is part of the request line
+    char stream_req[REQUEST_BUFFER_SIZE];
+    int req_len;
+    if (path != NULL)
+    {
+        req_len = snprintf(stream_req, sizeof(stream_req), "%s %s\r\n", REQUEST_STREAM_PATH, path);
+    }
+    else
+    {
+        req_len = snprintf(stream_req, sizeof(stream_req), "%s %llu\r\n", REQUEST_STREAM_ID,
+                           (unsigned long long)*file_id);
+    }
+    if (req_len >= sizeof(stream_req))
+    {
+        ERR_PRINT("send_and_process_stream_file_request: Path too long\n");
+        return -1;
+    }
+    if (write_precisely(sockfd, stream_req, req_len) != req_len)
+    {
+        perror("send_and_process_stream_file_request: Writing the request failed.\n");
+        return -1;
+    }
+
+    // Read the stable id of the file and its size
+    uint64_t net_head[2];
+    if (read_precisely(sockfd, net_head, sizeof(net_head)) != sizeof(net_head))
+    {
+        perror("send_and_process_stream_file_request: Reading the file size failed.\n");
+        return -1;
+    }
+    *file_id = be64toh(net_head[0]);
+
+    return _receive_stream(sockfd, be64toh(net_head[1]), audio_out_fd, file_dest_fd);
+}
+
+int send_and_process_stream_at_request(int sockfd, uint32_t file_index, uint64_t position_ms,
+                                       int audio_out_fd, int file_dest_fd, uint64_t *start_ms)
+{
+    // None of the file descriptors are "on."
+    if (audio_out_fd == -1 && file_dest_fd == -1)
+    {
+        ERR_PRINT("send_and_process_stream_at_request: None of the output file descriptors are activated.\n");
+        return -1;
+    }
+
+    char stream_req[REQUEST_BUFFER_SIZE];
+    int req_len = snprintf(stream_req, sizeof(stream_req), "%s %u %llu%s", REQUEST_STREAM_AT,
+                           file_index, (unsigned long long)position_ms, END_OF_MESSAGE_TOKEN);
+    if (write_precisely(sockfd, stream_req, req_len) != req_len)
+    {
+        perror("send_and_process_stream_at_request: Writing the request failed.\n");
+        return -1;
+    }
+
+    // Read the position the stream starts at and the size of what follows
+    uint64_t net_head[2];
+    if (read_precisely(sockfd, net_head, sizeof(net_head)) != sizeof(net_head))
+    {
+        perror("send_and_process_stream_at_request: Reading the stream size failed.\n");
+        return -1;
+    }
+    *start_ms = be64toh(net_head[0]);
+
+    return _receive_stream(sockfd, be64toh(net_head[1]), audio_out_fd, file_dest_fd);
+}
+
+int mux_request(int sockfd)
+{
+    if (protocol_version < PROTOCOL_VERSION_MUX)
+    {
+        return 0;
+    }
+
+    const char *mux_req = REQUEST_MUX "\r\n";
+    if (write_precisely(sockfd, mux_req, strlen(mux_req)) != strlen(mux_req))
+    {
+        perror("mux_request");
+        return -1;
+    }
+    uint32_t net_accepted;
+    if (read_precisely(sockfd, &net_accepted, sizeof(net_accepted)) != sizeof(net_accepted))
+    {
+        ERR_PRINT("mux_request: Reading the answer failed\n");
+        return -1;
+    }
+    return ntohl(net_accepted) == 1;
+}
+
+/*
+** Helper for: the multiplexed shell
+** Send a frame of type on stream_id, with length bytes of payload (at most
+** REQUEST_BUFFER_SIZE), in a single write.
+**
+** returns 0 on success, -1 on error
+*/
+static int _mux_send_frame(int sockfd, uint32_t stream_id, uint8_t type, const void *payload,
+                           uint32_t length)
+{
+    uint8_t frame[MUX_HEADER_SIZE + REQUEST_BUFFER_SIZE];
+    mux_pack_header(frame, stream_id, type, length);
+    memcpy(frame + MUX_HEADER_SIZE, payload, length);
+    if (write_precisely(sockfd, frame, MUX_HEADER_SIZE + length) != MUX_HEADER_SIZE + length)
+    {
+        perror("_mux_send_frame");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** Helper for: the multiplexed shell
+** Open a stream for the request of length bytes, as a transfer for command
+** (and file_index), received into file_fd for a get (-1 otherwise), which
+** is closed if there is no stream left.
+**
+** returns 0 on success (even if there is no stream left), -1 on error
+*/
+static int _mux_start(MuxClient *mux, const char *command, uint32_t file_index, int file_fd,
+                      const void *request, size_t length)
+{
+    MuxTransfer *transfer = NULL;
+    for (int i = 0; i < MUX_MAX_STREAMS && transfer == NULL; i++)
+    {
+        if (mux->transfers[i].id == 0)
+        {
+            transfer = &mux->transfers[i];
+        }
+    }
+    if (transfer == NULL)
+    {
+        printf("Too many transfers at once, %s not sent\n", command);
+        if (file_fd >= 0)
+        {
+            close(file_fd);
+        }
+        return 0;
+    }
+
+    // A stream id is free again once the server closed it, 0 is never one
+    if (++mux->next_id == 0)
+    {
+        mux->next_id = 1;
+    }
+    *transfer = (MuxTransfer){mux->next_id, command, file_index, NULL, 0, file_fd, 0, 0, 0, 0};
+    if (_mux_send_frame(mux->sockfd, transfer->id, MUX_FRAME_REQUEST, request, length) < 0)
+    {
+        transfer->id = 0;
+        if (file_fd >= 0)
+        {
+            close(file_fd);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+** Helper for: the multiplexed shell
+** Ask the server to stop sending the response of transfer, which is
+** finished once it closes the stream.
+**
+** returns 0 on success, -1 on error
+*/
+static int _mux_cancel(MuxClient *mux, MuxTransfer *transfer)
+{
+    transfer->cancelled = 1;
+    return _mux_send_frame(mux->sockfd, transfer->id, MUX_FRAME_RESET, NULL, 0);
+}
+
+/*
+** Helper for: the multiplexed shell
+** Start getting the file at file_index, or have it wait for one of the
+** GET_PIPELINE_DEPTH gets at once to end.
+**
+** returns 0 on success, 1 if the get was skipped (and why was printed), -1
+** on error
+*/
+static int _mux_get(MuxClient *mux, uint32_t file_index, const Library *library)
+{
+    int num_gets = 0;
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        num_gets += mux->transfers[i].id != 0 && strcmp(mux->transfers[i].command, CMD_GET) == 0;
+    }
+    if (num_gets >= GET_PIPELINE_DEPTH)
+    {
+        uint32_t *waiting = realloc(mux->waiting, (mux->num_waiting + 1) * sizeof(uint32_t));
+        if (waiting == NULL)
+        {
+            perror("_mux_get: realloc");
+            return -1;
+        }
+        mux->waiting = waiting;
+        mux->waiting[mux->num_waiting++] = file_index;
+        return 0;
+    }
+
+    // The library may have been listed again since the get was typed
+    if (file_index >= library->num_files || library->files[file_index] == NULL)
+    {
+        printf("Invalid file index %u, get skipped\n", file_index);
+        return 1;
+    }
+    int file_dest_fd = file_index_to_fd(file_index, library, 0, NULL);
+    if (file_dest_fd == -1)
+    {
+        printf("Can't write %s, get skipped\n", library->files[file_index]);
+        return 1;
+    }
+    uint8_t request[STREAM_REQUEST_SIZE];
+    _write_stream_request(request, file_index);
+    return _mux_start(mux, CMD_GET, file_index, file_dest_fd, request, sizeof(request));
+}
+
+/*
+** Helper for: _mux_receive
+** Take the length bytes of a DATA frame of transfer: into the local copy of
+** a get (after the 64-bit size of the file that comes first), or at the
+** end of its text. The window of its stream is opened again every
+** MUX_WINDOW_UPDATE bytes.
+**
+** returns 0 on success, -1 on error
+*/
+static int _mux_receive_data(MuxClient *mux, MuxTransfer *transfer, const uint8_t *data,
+                             uint32_t length)
+{
+    if (transfer->cancelled)
+    {
+        // What the server sent before it saw the RESET
+    }
+    else if (transfer->file_fd >= 0)
+    {
+        uint32_t size_bytes = 0;
+        while (size_bytes < length && transfer->received + size_bytes < sizeof(uint64_t))
+        {
+            transfer->file_size = transfer->file_size << 8 | data[size_bytes++];
+        }
+        if (write_precisely(transfer->file_fd, data + size_bytes, length - size_bytes) !=
+            length - size_bytes)
+        {
+            perror("get: Writing the file failed");
+            return _mux_cancel(mux, transfer);
+        }
+    }
+    else
+    {
+        char *text = realloc(transfer->text, transfer->text_len + length + 1);
+        if (text == NULL)
+        {
+            perror("_mux_receive_data: realloc");
+            return -1;
+        }
+        memcpy(text + transfer->text_len, data, length);
+        transfer->text = text;
+        transfer->text_len += length;
+        transfer->text[transfer->text_len] = '\0';
+    }
+    transfer->received += length;
+
+    transfer->consumed += length;
+    if (transfer->consumed >= MUX_WINDOW_UPDATE && !transfer->cancelled)
+    {
+        uint32_t net_increment = htonl(transfer->consumed);
+        if (_mux_send_frame(mux->sockfd, transfer->id, MUX_FRAME_WINDOW, &net_increment,
+                            sizeof(net_increment)) < 0)
+        {
+            return -1;
+        }
+        transfer->consumed = 0;
+    }
+    return 0;
+}
+
+/*
+** Helper for: _mux_receive
+** Finish transfer once the server closed its stream with an END or RESET
+** frame (type): print what it got, a list or search into library like
+** list_request and search_request, and free the transfer.
+**
+** returns 0 on success, -1 on error
+*/
+static int _mux_finish(MuxTransfer *transfer, uint8_t type, Library *library)
+{
+    int result = 0;
+    if (transfer->cancelled)
+    {
+        printf("Cancelled the %s of file %u\n", transfer->command, transfer->file_index);
+    }
+    else if (type == MUX_FRAME_RESET)
+    {
+        printf("The server didn't answer the %s request\n", transfer->command);
+    }
+    else if (strcmp(transfer->command, CMD_GET) == 0)
+    {
+        if (transfer->received != sizeof(uint64_t) + transfer->file_size)
+        {
+            printf("File %u ended early\n", transfer->file_index);
+        }
+        else
+        {
+            printf("Got file %u (%llu bytes)\n", transfer->file_index,
+                   (unsigned long long)transfer->file_size);
+        }
+    }
+    else if (strcmp(transfer->command, CMD_INFO) == 0)
+    {
+        // Without a DATA frame there is no text to cut the token off
+        char empty[1] = "";
+        char *line = transfer->text != NULL ? transfer->text : empty;
+        line[strcspn(line, END_OF_MESSAGE_TOKEN)] = '\0';
+        if (*line == '\0')
+        {
+            printf("No such file in the library\n");
+        }
+        else
+        {
+            printf("%u: %s\n", transfer->file_index, line);
+        }
+    }
+    else
+    {
+        // The whole library, or only the matches like a page
+        _free_library(library);
+        library_epoch = 0;
+        char *line = transfer->text;
+        char *end;
+        while (line != NULL && (end = strstr(line, END_OF_MESSAGE_TOKEN)) != NULL && end != line)
+        {
+            *end = '\0';
+            uint32_t index;
+            const char *path;
+            if (_parse_file_line(line, &index, &path) < 0 ||
+                _set_library_file(library, index, path) < 0)
+            {
+                result = -1;
+                break;
+            }
+            // Searches are printed best first, the library in index order
+            if (strcmp(transfer->command, CMD_SEARCH) == 0)
+            {
+                printf("%u: %s\n", index, path);
+            }
+            line = end + strlen(END_OF_MESSAGE_TOKEN);
+        }
+        if (strcmp(transfer->command, CMD_LIST) == 0)
+        {
+            _print_library(library);
+        }
+    }
+
+    if (transfer->file_fd >= 0)
+    {
+        close(transfer->file_fd);
+    }
+    free(transfer->text);
+    transfer->id = 0;
+    return result;
+}
+
+/*
+** Helper for: the multiplexed shell
+** Read what the server sent and hand every complete frame to its transfer.
+**
+** returns 0 on success, -1 on error or if the server closed the connection
+*/
+static int _mux_receive(MuxClient *mux, Library *library)
+{
+    int num = read(mux->sockfd, mux->frames + mux->bytes_in_frames,
+                   sizeof(mux->frames) - mux->bytes_in_frames);
+    if (num <= 0)
+    {
+        if (num == 0)
+        {
+            ERR_PRINT("The server closed the connection\n");
+        }
+        else
+        {
+            perror("_mux_receive");
+        }
+        return -1;
+    }
+    mux->bytes_in_frames += num;
+
+    while (mux->bytes_in_frames >= MUX_HEADER_SIZE)
+    {
+        uint32_t stream_id;
+        uint8_t type;
+        uint32_t length;
+        mux_unpack_header(mux->frames, &stream_id, &type, &length);
+        if (length > MUX_MAX_FRAME)
+        {
+            ERR_PRINT("_mux_receive: frame of %u bytes\n", length);
+            return -1;
+        }
+        if (mux->bytes_in_frames < MUX_HEADER_SIZE + length)
+        {
+            break;
+        }
+
+        MuxTransfer *transfer = NULL;
+        for (int i = 0; i < MUX_MAX_STREAMS && stream_id != 0; i++)
+        {
+            if (mux->transfers[i].id == stream_id)
+            {
+                transfer = &mux->transfers[i];
+            }
+        }
+        int result;
+        if (transfer != NULL && type == MUX_FRAME_DATA)
+        {
+            result = _mux_receive_data(mux, transfer, mux->frames + MUX_HEADER_SIZE, length);
+        }
+        else if (transfer != NULL && (type == MUX_FRAME_END || type == MUX_FRAME_RESET))
+        {
+            int was_get = strcmp(transfer->command, CMD_GET) == 0;
+            result = _mux_finish(transfer, type, library);
+            // Until one starts, or no get would be left to start the others
+            int skipped = 1;
+            while (result == 0 && was_get && skipped && mux->num_waiting > 0)
+            {
+                uint32_t file_index = mux->waiting[0];
+                memmove(mux->waiting, mux->waiting + 1, --mux->num_waiting * sizeof(uint32_t));
+                int started = _mux_get(mux, file_index, library);
+                result = started < 0 ? -1 : 0;
+                skipped = started == 1;
+            }
+        }
+        else
+        {
+            ERR_PRINT("_mux_receive: unexpected frame of type %u on stream %u\n", type, stream_id);
+            result = -1;
+        }
+        if (result < 0)
+        {
+            return -1;
+        }
+
+        mux->bytes_in_frames -= MUX_HEADER_SIZE + length;
+        memmove(mux->frames, mux->frames + MUX_HEADER_SIZE + length, mux->bytes_in_frames);
     }
-
-    _wait_on_audio_player(audio_player_pid);
-
     return 0;
 }
 
-int send_and_process_stream_request(int sockfd, uint32_t file_index,
-                                    int audio_out_fd, int file_dest_fd)
+static void _print_mux_shell_help()
+{
+    printf("Commands (the connection is multiplexed):\n");
+    printf("  list: List the files in the library\n");
+    printf("  search <query>: List the files whose path has every word of the query\n");
+    printf("  info <file_index>: Show the codec, duration and bitrate of a file\n");
+    printf("  get <file_index> [<file_index> ...]: Get files from the library, all at\n");
+    printf("       once and in the background, while other commands are answered\n");
+    printf("  cancel <file_index>: Stop getting a file, the part received is kept\n");
+    printf("  help: Display this help message\n");
+    printf("  quit: Quit the client, without waiting for the gets\n");
+}
+
+/*
+** Helper for: the multiplexed shell
+** Run the command on line (see _print_mux_shell_help): open the streams it
+** needs, their responses are taken by _mux_receive as they arrive.
+**
+** returns 0 on success, 1 if the user quits, -1 on error
+*/
+static int _mux_command(MuxClient *mux, char *line, Library *library)
 {
+    char request[REQUEST_BUFFER_SIZE];
+    int req_len;
 
-    // None of the file descriptors are "on."
-    if (audio_out_fd == -1 && file_dest_fd == -1)
+    char *command = strtok(line, " \n");
+    if (command == NULL)
     {
-        ERR_PRINT("send_and_process_stream_request: None of the output file descriptors are activated.\n");
-        return -1;
+        return 0;
     }
 
-    // Send STREAM request with the index of the requested file converted into networkbyte order
-    const char *stream_req = "STREAM\r\n";
-    uint32_t net_file_index = htonl(file_index);
-    if (write(sockfd, stream_req, strlen(stream_req)) != strlen(stream_req))
+    if (strcmp(command, CMD_LIST) == 0)
     {
-        perror("send_and_process_stream_request: Writing the request failed.\n");
-        return -1;
+        req_len = snprintf(request, sizeof(request), "%s%s", REQUEST_LIST, END_OF_MESSAGE_TOKEN);
+        return _mux_start(mux, CMD_LIST, 0, -1, request, req_len);
     }
-    if (write(sockfd, &net_file_index, sizeof(net_file_index)) != sizeof(net_file_index))
+    else if (strcmp(command, CMD_SEARCH) == 0)
     {
-        perror("send_and_process_stream_request: Writing the file index failed.\n");
-        return -1;
-    }
-
-    // Set up the dynamic buffer as instructed in the handout.
-    char *dynamic_buffer = malloc(sizeof(char));
-    if (dynamic_buffer == NULL){
-        perror("send_and_process_stream_request: Malloc failed.\n");
-        return -1;
+        char *query = strtok(NULL, "\n");
+        if (query == NULL)
+        {
+            printf("Usage: search <query>\n");
+            return 0;
+        }
+        req_len = snprintf(request, sizeof(request), "%s %s%s", REQUEST_SEARCH, query,
+                           END_OF_MESSAGE_TOKEN);
+        if (req_len >= sizeof(request) || strlen(query) >= MAX_PATH)
+        {
+            printf("Query too long\n");
+            return 0;
+        }
+        return _mux_start(mux, CMD_SEARCH, 0, -1, request, req_len);
     }
-    size_t dynamic_buffer_size = 0;
-    char network_buffer[NETWORK_PRE_DYNAMIC_BUFF_SIZE];
-
-    // Set up the timeout macro as instructed in the handout.
-    struct timeval timeout = {SELECT_TIMEOUT_SEC, SELECT_TIMEOUT_USEC};
-
-    // Assign the max_fd for select call
-    int max_fd;
-    max_fd = determine_max_fd(sockfd, audio_out_fd, file_dest_fd);
-
-    // Read the size of the file from the first four bytes.
-    // The value has to be converted back to the host byte order.
-    uint32_t net_file_size;
-    if (read(sockfd, &net_file_size, sizeof(net_file_size)) < sizeof(net_file_size))
+    else if (strcmp(command, CMD_INFO) == 0)
     {
-        perror("send_and_process_stream_request: Reading the file size failed.\n");
-        return -1;
+        char *file_index_str = strtok(NULL, " \n");
+        if (file_index_str == NULL)
+        {
+            printf("Usage: info <file_index>\n");
+            return 0;
+        }
+        uint32_t file_index = strtoul(file_index_str, NULL, 10);
+        req_len = snprintf(request, sizeof(request), "%s %u%s", REQUEST_INFO, file_index,
+                           END_OF_MESSAGE_TOKEN);
+        return _mux_start(mux, CMD_INFO, file_index, -1, request, req_len);
     }
-    int file_size = ntohl(net_file_size);
-
-    // initialize loop variables
-    // Two offset are required for the use of dynamic buffer.
-    int processed_bytes = 0;
-    int audio_fd_offset = 0;
-    int file_fd_offset = 0;
-
-    while (processed_bytes < file_size)
+    else if (strcmp(command, CMD_GET) == 0)
     {
-        fd_set read_fds, write_fds;
-        FD_ZERO(&read_fds);
-        FD_ZERO(&write_fds);
-
-        FD_SET(sockfd, &read_fds);
-
-        if (dynamic_buffer_size > 0)
+        // The whole line is read first: opening the local copies tokenizes
+        // their paths with strtok. Every index of the line, each one at least
+        // a digit and a space, and a bad one rejects the line, as in the
+        // serial shell.
+        uint32_t file_indices[REQUEST_BUFFER_SIZE / 2];
+        int num_files = 0;
+        char *file_index_str;
+        while ((file_index_str = strtok(NULL, " \n")) != NULL)
         {
-            // Once we have checked that there is something in the buffer, we have to identify to which file descriptor
-            // we are writing to. It should be writing to both of them for stream+ operation.
-            if (audio_out_fd != -1)
+            int file_index = strtol(file_index_str, NULL, 10);
+            if (file_index < 0 || file_index >= library->num_files ||
+                library->files[file_index] == NULL)
+            {
+                printf("Invalid file index %s\n", file_index_str);
+                return 0;
+            }
+            file_indices[num_files++] = file_index;
+        }
+        if (num_files == 0)
+        {
+            printf("Usage: get <file_index> [<file_index> ...]\n");
+        }
+        for (int i = 0; i < num_files; i++)
+        {
+            if (_mux_get(mux, file_indices[i], library) < 0)
             {
-                FD_SET(audio_out_fd, &write_fds);
+                return -1;
             }
-            if (file_dest_fd != -1)
+        }
+        return 0;
+    }
+    else if (strcmp(command, CMD_CANCEL) == 0)
+    {
+        char *file_index_str = strtok(NULL, " \n");
+        if (file_index_str == NULL)
+        {
+            printf("Usage: cancel <file_index>\n");
+            return 0;
+        }
+        uint32_t file_index = strtoul(file_index_str, NULL, 10);
+        for (int i = 0; i < MUX_MAX_STREAMS; i++)
+        {
+            MuxTransfer *transfer = &mux->transfers[i];
+            if (transfer->id != 0 && strcmp(transfer->command, CMD_GET) == 0 &&
+                transfer->file_index == file_index && !transfer->cancelled)
             {
-                FD_SET(file_dest_fd, &write_fds);
+                return _mux_cancel(mux, transfer);
             }
         }
+        printf("File %u isn't being gotten\n", file_index);
+        return 0;
+    }
+    else if (strcmp(command, CMD_HELP) == 0)
+    {
+        _print_mux_shell_help();
+        return 0;
+    }
+    else if (strcmp(command, CMD_QUIT) == 0)
+    {
+        printf("Quitting shell\n");
+        return 1;
+    }
+    printf("Invalid command\n");
+    return 0;
+}
 
-        int selected_fd = select(max_fd + 1, &read_fds, &write_fds, NULL, &timeout);
+/*
+** Shell of a multiplexed connection
+** ---------------------------------
+** Same as client_shell, for a connection the server switched to frames (see
+** mux_request): stdin and the socket are both waited for with select, so
+** commands are read while the responses of the previous ones arrive. Once
+** stdin ends, the shell quits when every transfer is done.
+*/
+static int _mux_shell(int sockfd, const char *library_directory)
+{
+    Library library = {"client", library_directory, NULL, 0, NULL};
+    MuxClient mux = {.sockfd = sockfd, .next_id = 0, .bytes_in_frames = 0, .waiting = NULL,
+                     .num_waiting = 0};
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        mux.transfers[i].id = 0;
+    }
 
-        // Select failed
-        if (selected_fd == -1)
+    char line[REQUEST_BUFFER_SIZE];
+    int line_len = 0;
+    int input_done = 0;
+    int result = 0;
+
+    printf("Enter a command: ");
+    fflush(stdout);
+    while (1)
+    {
+        int num_transfers = 0;
+        for (int i = 0; i < MUX_MAX_STREAMS; i++)
         {
-            ERR_PRINT("send_and_process_stream_request: Select failed.\n");
-            return -1;
+            num_transfers += mux.transfers[i].id != 0;
+        }
+        if (input_done && num_transfers == 0)
+        {
+            break;
         }
 
-        // Select timeout
-        // (Piazza) When select timeout happens, just let it have another loop iteration
-        else if (selected_fd == 0)
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(sockfd, &read_fds);
+        if (!input_done)
         {
-            continue;
+            FD_SET(STDIN_FILENO, &read_fds);
         }
-        // Select success
-        else if (selected_fd > 0)
+        if (select(sockfd + 1, &read_fds, NULL, NULL, NULL) < 0)
         {
-            // Read from the server first if available.
-            // Notice that sockfd is the only fd we can read from.
-            if (FD_ISSET(sockfd, &read_fds))
+            if (errno == EINTR)
             {
-                // First, read as much as the buffer allows.
-                // load it to the network_buffer first, and then update the dynamic buffer.
-                int bytes_read = read(sockfd, network_buffer, NETWORK_PRE_DYNAMIC_BUFF_SIZE);
-                if (bytes_read < 0)
-                {
-                    ERR_PRINT("send_and_process_stream_request: Reading from the server failed.\n");
-                    return -1;
-                }
-
-                // Update the dynamic buffer to fit the data just read.
-                int new_size = dynamic_buffer_size + bytes_read;
-                dynamic_buffer = realloc(dynamic_buffer, new_size);
-                memcpy(dynamic_buffer + dynamic_buffer_size, network_buffer, bytes_read);
-                dynamic_buffer_size += bytes_read;
+                continue;
             }
+            perror("_mux_shell: select");
+            result = -1;
+            break;
+        }
 
-            // Write to the audio_out_fd if it is available and specified as the output fd
-            if (audio_out_fd != -1 && FD_ISSET(audio_out_fd, &write_fds))
-            {
-                int bytes_written = write(audio_out_fd, dynamic_buffer + audio_fd_offset, dynamic_buffer_size - audio_fd_offset);
-                if (bytes_written < 0)
-                {
-                    ERR_PRINT("send_and_process_stream_request: Writing to the audio failed.\n");
-                    return -1;
-                }
-                // If the chunk is successfully written, adjust the offset to indicate the data written without
-                // affecting the buffer and its size.
-                else
-                {
-                    audio_fd_offset += bytes_written;
-                }
+        if (FD_ISSET(sockfd, &read_fds) && _mux_receive(&mux, &library) < 0)
+        {
+            result = -1;
+            break;
+        }
+        if (input_done || !FD_ISSET(STDIN_FILENO, &read_fds))
+        {
+            continue;
+        }
 
-                if (file_dest_fd == -1)
-                {
-                    // Call the helper function to refresh and update the buffer
-                    refreshDynamicBuffer(&dynamic_buffer, &dynamic_buffer_size,
-                                         audio_fd_offset, &processed_bytes,
-                                         sockfd, &max_fd, audio_out_fd);
-
-                    // Now, this conditional statement implies that the audio_fd is open, therefore
-                    // we have to get the offset set for the next step.
-                    audio_fd_offset = 0;
-                }
-            }
+        ssize_t num = read(STDIN_FILENO, line + line_len, sizeof(line) - 1 - line_len);
+        if (num <= 0)
+        {
+            input_done = 1;
+            continue;
+        }
+        line_len += num;
 
-            // Write to the file_dest_fd if it is available and specified as the output fd
-            if (file_dest_fd != -1 && FD_ISSET(file_dest_fd, &write_fds))
+        char *newline;
+        int command_result = 0;
+        while (command_result == 0 && (newline = memchr(line, '\n', line_len)) != NULL)
+        {
+            *newline = '\0';
+            command_result = _mux_command(&mux, line, &library);
+            line_len -= newline + 1 - line;
+            memmove(line, newline + 1, line_len);
+            if (command_result == 0)
             {
-                int bytes_written = write(file_dest_fd, dynamic_buffer + file_fd_offset, dynamic_buffer_size - file_fd_offset);
-                if (bytes_written < 0)
-                {
-                    ERR_PRINT("send_and_process_stream_request: Writing to the file failed.\n");
-                    return -1;
-                }
-                // Update file offset to keep track of how much has been written without affecting the buffer
-                file_fd_offset += bytes_written;
-
-                // If only writing to file, remove the written data from the buffer
-                if (audio_out_fd == -1)
-                {
-                    // Call the helper function to refresh and update the buffer
-                    refreshDynamicBuffer(&dynamic_buffer, &dynamic_buffer_size,
-                                         file_fd_offset, &processed_bytes,
-                                         sockfd, &max_fd, file_dest_fd);
-
-                    // Now, this conditional statement implies that the file_fd is open, therefore
-                    // we have to get the offset set for the next step.
-                    file_fd_offset = 0;
-                }
+                printf("Enter a command: ");
+                fflush(stdout);
             }
+        }
+        if (command_result != 0)
+        {
+            result = command_result < 0 ? -1 : 0;
+            break;
+        }
+        if (line_len == sizeof(line) - 1)
+        {
+            printf("Command too long\n");
+            line_len = 0;
+        }
+    }
 
-            // In case of writing to both the audio and the file, clean the buffer after writing is done.
-            if (audio_fd_offset != -1 && file_fd_offset != -1)
+    // Partial copies are kept, resume can finish them
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        if (mux.transfers[i].id != 0)
+        {
+            if (mux.transfers[i].file_fd >= 0)
             {
-                max_fd = determine_max_fd(sockfd, audio_out_fd, file_dest_fd);
-
-                // Notice that we have to memmove with the buffer_size - smaller_offset
-                // to not accidentally ignore other written data.
-                int smaller_offset;
-                if (audio_fd_offset < file_fd_offset)
-                {
-                    smaller_offset = audio_fd_offset;
-                }
-                else
-                {
-                    smaller_offset = file_fd_offset;
-                }
-
-                // Update the offsets to get ready for the modified dynamic buffer.
-                file_fd_offset -= smaller_offset;
-                audio_fd_offset -= smaller_offset;
-
-                // Update the dynamic buffer accordingly.
-                int dynamic_reduced = dynamic_buffer_size - smaller_offset;
-                char *new_start = dynamic_buffer + smaller_offset;
-
-                memmove(dynamic_buffer, new_start, dynamic_reduced);
-
-                dynamic_buffer = realloc(dynamic_buffer, dynamic_reduced);
-                dynamic_buffer_size -= smaller_offset;
-
-                processed_bytes += smaller_offset;
+                close(mux.transfers[i].file_fd);
             }
+            free(mux.transfers[i].text);
         }
     }
-    if (audio_out_fd != -1)
-        close(audio_out_fd);
-    if (file_dest_fd != -1)
-        close(file_dest_fd);
-
-    // DYNAMIC BUFFERS ARE DYNAMIC!!!
-    free(dynamic_buffer);
-
-    return 0;
+    free(mux.waiting);
+    _free_library(&library);
+    return result;
 }
 
 static void _print_shell_help()
 {
     printf("Commands:\n");
     printf("  list: List the files in the library\n");
-    printf("  get <file_index>: Get a file from the library\n");
+    printf("  list <position> <most files> [<extension> [<prefix>]]: List a page of the files\n");
+    printf("       sorted by path, from the position-th one (most files 0 for all of them),\n");
+    printf("       only those with the extension (* for any) under the path prefix\n");
+    printf("  search <query>: List the files whose path has every word of the query\n");
+    printf("  get <file_index> [<file_index> ...]: Get files from the library, asking\n");
+    printf("       for the next ones while the first ones are received\n");
+    printf("  resume <file_index>: Finish getting a partially saved file\n");
     printf("  stream <file_index>: Stream a file from the library (without saving it)\n");
     printf("  stream+ <file_index>: Stream a file from the library\n");
     printf("                        and save it to the local library\n");
+    printf("  play <path>: Stream the file at path without listing the library first\n");
+    printf("  play_id <file_id>: Stream the file with a file id printed by play or fetch\n");
+    printf("  fetch <path>: Get the file at path without listing the library first\n");
+    printf("  info <file_index>: Show the codec, duration and bitrate of a file\n");
+    printf("  seek <file_index> <seconds>: Stream a file from a position on\n");
     printf("  help: Display this help message\n");
     printf("  quit: Quit the client\n");
 }
@@ -734,9 +2383,19 @@ static void _print_shell_help()
 ** user for a command and then calls the appropriate function to handle the
 ** command. The user can enter the following commands:
 ** - "list" to list the files in the library
-** - "get <file_index>" to get a file from the library
+** - "list <position> <most files> [<extension> [<prefix>]]" to list a page of
+**   the files in the library
+** - "search <query>" to find files in the library by name
+** - "get <file_index> [<file_index> ...]" to get files from the library,
+**   with their requests pipelined
+** - "resume <file_index>" to finish getting a partially saved file
 ** - "stream <file_index>" to stream a file from the library (without saving it)
 ** - "stream+ <file_index>" to stream a file from the library and save it to the local library
+** - "play <path>" to stream a file from the library by path
+** - "play_id <file_id>" to stream a file from the library by stable id
+** - "fetch <path>" to get a file from the library by path
+** - "info <file_index>" to show what the server knows about a file's audio
+** - "seek <file_index> <seconds>" to stream a file from a position on
 ** - "help" to display the help message
 ** - "quit" to quit the client
 */
@@ -746,7 +2405,7 @@ static int client_shell(int sockfd, const char *library_directory)
     char *command;
     int file_index;
 
-    Library library = {"client", library_directory, NULL, 0};
+    Library library = {"client", library_directory, NULL, 0, NULL};
 
     while (1)
     {
@@ -771,7 +2430,44 @@ static int client_shell(int sockfd, const char *library_directory)
         // List Request -- list the files in the library
         if (strcmp(command, CMD_LIST) == 0)
         {
-            if (list_request(sockfd, &library) == -1)
+            char *position_str = strtok(NULL, " \n");
+            if (position_str == NULL)
+            {
+                if (list_request(sockfd, &library) == -1)
+                {
+                    goto error;
+                }
+                continue;
+            }
+
+            // A page: list <position> <most files> [<extension> [<prefix>]]
+            char *most_files_str = strtok(NULL, " \n");
+            if (most_files_str == NULL)
+            {
+                printf("Usage: list [<position> <most files> [<extension> [<prefix>]]]\n");
+                continue;
+            }
+            char *extension = strtok(NULL, " \n");
+            char *prefix = extension != NULL ? strtok(NULL, "\n") : NULL;
+            if (list_page_request(sockfd, strtoul(position_str, NULL, 10),
+                                  strtoul(most_files_str, NULL, 10),
+                                  extension != NULL ? extension : LIST_ANY_EXTENSION,
+                                  prefix != NULL ? prefix : "", &library) == -1)
+            {
+                goto error;
+            }
+
+            // Search Request -- find files in the library by name
+        }
+        else if (strcmp(command, CMD_SEARCH) == 0)
+        {
+            char *query = strtok(NULL, "\n");
+            if (query == NULL)
+            {
+                printf("Usage: search <query>\n");
+                continue;
+            }
+            if (search_request(sockfd, query, &library) == -1)
             {
                 goto error;
             }
@@ -779,21 +2475,58 @@ static int client_shell(int sockfd, const char *library_directory)
             // Get Request -- get a file from the library
         }
         else if (strcmp(command, CMD_GET) == 0)
+        {
+            // Every index of the line, each one at least a digit and a space
+            uint32_t file_indices[REQUEST_BUFFER_SIZE / 2];
+            int num_files = 0;
+            int valid = 1;
+            char *file_index_str;
+            while ((file_index_str = strtok(NULL, " \n")) != NULL)
+            {
+                file_index = strtol(file_index_str, NULL, 10);
+                if (file_index < 0 || file_index >= library.num_files ||
+                    library.files[file_index] == NULL)
+                {
+                    printf("Invalid file index %s\n", file_index_str);
+                    valid = 0;
+                    break;
+                }
+                file_indices[num_files++] = file_index;
+            }
+            if (num_files == 0 && valid)
+            {
+                printf("Usage: get <file_index> [<file_index> ...]\n");
+                continue;
+            }
+            if (!valid)
+            {
+                continue;
+            }
+
+            if (get_files_request(sockfd, file_indices, num_files, &library) == -1)
+            {
+                goto error;
+            }
+
+            // Resume Request -- get the rest of a partially saved file
+        }
+        else if (strcmp(command, CMD_RESUME) == 0)
         {
             char *file_index_str = strtok(NULL, " \n");
             if (file_index_str == NULL)
             {
-                printf("Usage: get <file_index>\n");
+                printf("Usage: resume <file_index>\n");
                 continue;
             }
             file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files)
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index] == NULL)
             {
                 printf("Invalid file index\n");
                 continue;
             }
 
-            if (get_file_request(sockfd, file_index, &library) == -1)
+            if (resume_file_request(sockfd, file_index, &library) == -1)
             {
                 goto error;
             }
@@ -809,7 +2542,8 @@ static int client_shell(int sockfd, const char *library_directory)
                 continue;
             }
             file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files)
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index] == NULL)
             {
                 printf("Invalid file index\n");
                 continue;
@@ -831,7 +2565,8 @@ static int client_shell(int sockfd, const char *library_directory)
                 continue;
             }
             file_index = strtol(file_index_str, NULL, 10);
-            if (file_index < 0 || file_index >= library.num_files)
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index] == NULL)
             {
                 printf("Invalid file index\n");
                 continue;
@@ -842,6 +2577,80 @@ static int client_shell(int sockfd, const char *library_directory)
                 goto error;
             }
         }
+        else if (strcmp(command, CMD_PLAY) == 0 || strcmp(command, CMD_FETCH) == 0)
+        {
+            // Play and Fetch Requests -- by path, without a LIST first
+            char *path = strtok(NULL, "\n");
+            if (path == NULL)
+            {
+                printf("Usage: %s <path>\n", command);
+                continue;
+            }
+            int result = strcmp(command, CMD_PLAY) == 0
+                             ? play_request(sockfd, path, 0)
+                             : fetch_request(sockfd, path, library_directory);
+            if (result == -1)
+            {
+                goto error;
+            }
+        }
+        else if (strcmp(command, CMD_PLAY_ID) == 0)
+        {
+            // Play Request by stable id
+            char *file_id_str = strtok(NULL, " \n");
+            if (file_id_str == NULL)
+            {
+                printf("Usage: play_id <file_id>\n");
+                continue;
+            }
+            if (play_request(sockfd, NULL, strtoull(file_id_str, NULL, 10)) == -1)
+            {
+                goto error;
+            }
+        }
+        else if (strcmp(command, CMD_INFO) == 0)
+        {
+            // Info Request -- the metadata of a file, listed or not
+            char *file_index_str = strtok(NULL, " \n");
+            if (file_index_str == NULL)
+            {
+                printf("Usage: info <file_index>\n");
+                continue;
+            }
+            if (info_request(sockfd, strtoul(file_index_str, NULL, 10)) == -1)
+            {
+                goto error;
+            }
+        }
+        else if (strcmp(command, CMD_SEEK) == 0)
+        {
+            // Seek Request -- stream a file from a position on
+            char *file_index_str = strtok(NULL, " \n");
+            char *seconds_str = strtok(NULL, " \n");
+            if (file_index_str == NULL || seconds_str == NULL)
+            {
+                printf("Usage: seek <file_index> <seconds>\n");
+                continue;
+            }
+            file_index = strtol(file_index_str, NULL, 10);
+            double seconds = strtod(seconds_str, NULL);
+            if (file_index < 0 || file_index >= library.num_files ||
+                library.files[file_index] == NULL)
+            {
+                printf("Invalid file index\n");
+                continue;
+            }
+            if (!(seconds >= 0 && seconds < UINT32_MAX))
+            {
+                printf("Invalid position\n");
+                continue;
+            }
+
+            if (seek_request(sockfd, file_index, (uint64_t)(seconds * 1000)) == -1)
+            {
+                goto error;
+            }
+        }
         else if (strcmp(command, CMD_HELP) == 0)
         {
             _print_shell_help();
@@ -871,6 +2680,9 @@ static void print_usage()
     printf("  -a NETWORK_ADDRESS: Connect to server at NETWORK_ADDRESS (default 'localhost')\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
     printf("  -l LIBRARY_DIRECTORY: Use LIBRARY_DIRECTORY as the library directory (default 'as-library')\n");
+    printf("  -b BYTES: Buffer up to BYTES of a stream (default " XSTR(STREAM_RING_CAPACITY) ")\n");
+    printf("  -c: Copy streams through the buffer instead of splicing them to their outputs\n");
+    printf("  -m: Multiplex the connection, gets run in the background (see mux_request)\n");
 }
 
 int main(int argc, char *const *argv)
@@ -879,8 +2691,9 @@ int main(int argc, char *const *argv)
     int port = DEFAULT_PORT;
     const char *hostname = "localhost";
     const char *library_directory = "saved";
+    int multiplex = 0;
 
-    while ((opt = getopt(argc, argv, "ha:p:l:")) != -1)
+    while ((opt = getopt(argc, argv, "ha:p:l:b:cm")) != -1)
     {
         switch (opt)
         {
@@ -901,6 +2714,20 @@ int main(int argc, char *const *argv)
         case 'l':
             library_directory = optarg;
             break;
+        case 'b':
+            stream_ring_capacity = strtoul(optarg, NULL, 10);
+            if (stream_ring_capacity == 0)
+            {
+                ERR_PRINT("Invalid buffer size %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'c':
+            stream_splice = 0;
+            break;
+        case 'm':
+            multiplex = 1;
+            break;
         default:
             print_usage();
             return 1;
@@ -916,7 +2743,25 @@ int main(int argc, char *const *argv)
         return -1;
     }
 
-    int result = client_shell(sockfd, library_directory);
+    if (negotiate_protocol_version(sockfd) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+
+    int multiplexed = multiplex ? mux_request(sockfd) : 0;
+    if (multiplexed == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    if (multiplex && !multiplexed)
+    {
+        printf("The server doesn't multiplex connections, commands run one at a time\n");
+    }
+
+    int result = multiplexed ? _mux_shell(sockfd, library_directory)
+                             : client_shell(sockfd, library_directory);
     if (result == -1)
     {
         close(sockfd);
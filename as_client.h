@@ -6,6 +6,8 @@
 /*****************************************************************************/
 #include "libas.h"
 
+#include <sys/uio.h>
+
 /*
 ** The following constants are used to define a separate process that
 ** will be used to playback audio data. The process will be started
@@ -27,25 +29,121 @@
 #define SELECT_TIMEOUT_SEC 1
 #define SELECT_TIMEOUT_USEC 0
 
-// Buffer size to receive network data
-// before the dynamically changing one
-#define NETWORK_PRE_DYNAMIC_BUFF_SIZE 8192
+// How long to wait for the server to answer a VERSION request before
+// assuming it predates the request and speaks PROTOCOL_VERSION_BASE
+#define VERSION_REPLY_TIMEOUT_MS 1000
+
+// Default size of the ring buffer between the server and the outputs of
+// a stream, 1 MiB (about 6 s of CD quality audio). Change with -b.
+#define STREAM_RING_CAPACITY 1048576
 
 // Student's don't need to change this
 #define BUFFER_BLEED_OFF 1
 
+// Returned by the splice path when the stream has to be received
+// through the ring buffer instead
+#define STREAM_SPLICE_UNSUPPORTED -2
+
+// Bytes of a STREAM request: REQUEST_STREAM, the network newline and the
+// file index
+#define STREAM_REQUEST_SIZE (sizeof(REQUEST_STREAM "\r\n") - 1 + sizeof(uint32_t))
+
+// Most STREAM requests a get of several files sends ahead of the response it
+// is receiving, see get_files_request, and most files a multiplexed
+// connection gets at once, see mux_request
+#define GET_PIPELINE_DEPTH 16
+
+// Bytes of a response a multiplexed connection (-m) consumes before it opens
+// the window of its stream again by as many, see mux_request
+#define MUX_WINDOW_UPDATE (MUX_INITIAL_WINDOW / 2)
+
+/*
+** Ring buffer that send_and_process_stream_request receives a stream into.
+** head counts the bytes received so far, audio_tail and file_tail the bytes
+** written to each output, all from the start of the stream.
+*/
+typedef struct stream_ring {
+    char *data;
+    size_t capacity;
+    uint64_t head;
+    uint64_t audio_tail;
+    uint64_t file_tail;
+} StreamRing;
+
+/*
+** A transfer of a multiplexed connection, see mux_request: a request sent in
+** a REQUEST frame whose response arrives in DATA frames, into text for
+** list, search and info, into the local copy of a file for get.
+*/
+typedef struct mux_transfer {
+    uint32_t id;               // of its stream, 0 if free
+    const char *command;       // CMD_LIST, CMD_SEARCH, CMD_INFO or CMD_GET
+    uint32_t file_index;       // of an info or a get
+    char *text;                // of the response received so far, NULL for a get
+    size_t text_len;
+    int file_fd;               // local copy of a get, -1 otherwise
+    uint64_t received;         // bytes of the response
+    uint64_t file_size;        // from the first bytes of the response of a get
+    uint32_t consumed;         // bytes received since the window was last opened
+    int cancelled;
+} MuxTransfer;
+
+typedef struct mux_client {
+    int sockfd;
+    uint32_t next_id;
+    MuxTransfer transfers[MUX_MAX_STREAMS];
+    uint8_t frames[MUX_HEADER_SIZE + MUX_MAX_FRAME]; // received, not handled yet
+    int bytes_in_frames;
+    uint32_t *waiting;         // file indices of the gets waiting for a stream
+    int num_waiting;
+} MuxClient;
+
 /*
 ** Client shell commands and constants**
 ** -----------------------------------
 */
 #define CMD_LIST "list"
+#define CMD_SEARCH "search"
 #define CMD_GET "get"
+#define CMD_RESUME "resume"
 #define CMD_STREAM "stream"
 #define CMD_STREAM_AND_GET "stream+"
+#define CMD_PLAY "play"
+#define CMD_PLAY_ID "play_id"
+#define CMD_FETCH "fetch"
+#define CMD_INFO "info"
+#define CMD_SEEK "seek"
+#define CMD_CANCEL "cancel"
 #define CMD_QUIT "quit"
 #define CMD_HELP "help"
 
 
+/*
+** Negotiates the protocol version used on the connection with the server.
+** Asks for PROTOCOL_VERSION, and settles for PROTOCOL_VERSION_BASE if the
+** server doesn't answer within VERSION_REPLY_TIMEOUT_MS. Must be called
+** before any other request.
+**
+** returns the negotiated version on success, -1 on error
+*/
+int negotiate_protocol_version(int sockfd);
+
+/*
+** Sends a MUX request (see as_server.h) once PROTOCOL_VERSION_MUX was
+** negotiated. Once the server switches the connection to frames, the client
+** shell (-m) sends every list, search, info and get in a stream of its own
+** and keeps reading commands while their responses arrive, interleaved: a
+** list typed during a long get is answered at once. A get returns to the
+** prompt right away, its files are saved as their DATA frames arrive, at
+** most GET_PIPELINE_DEPTH of them at once (the other streams are left for
+** the other commands), and the window of every stream is opened again
+** every MUX_WINDOW_UPDATE bytes.
+**
+** returns 1 if the server switched the connection to frames, 0 if it keeps
+** it as it is, -1 on error
+*/
+int mux_request(int sockfd);
+
 /*
 ** Sends a list request to the server and prints the list of files in the
 ** library. Also parses the list of files and stores it in the list parameter.
@@ -56,10 +154,49 @@
 **
 ** You may free and malloc or realloc the library->files array as preferred.
 **
+** Once PROTOCOL_VERSION_LIST_DELTA is negotiated, only the changes since the
+** library was last listed are requested (LIST_DELTA, see as_server.h) and
+** applied to library in place. The whole library is listed again when the
+** server no longer knows them, or after a list_page_request.
+**
 ** returns the length of the new library on success, -1 on error
 */
 int list_request(int sockfd, Library *library);
 
+/*
+** Sends a LIST page request to the server (see as_server.h) for at most
+** most_files files (0 for all of them) with the extension (LIST_ANY_EXTENSION
+** for any) whose path starts with prefix, from the position-th one, and
+** prints them as they arrive.
+**
+** Only the files of the page are kept in library, at their index, so that
+** they can be requested next.
+**
+** returns the number of files listed on success, -1 on error
+*/
+int list_page_request(int sockfd, uint32_t position, uint32_t most_files,
+                      const char *extension, const char *prefix, Library *library);
+
+/*
+** Sends a SEARCH request for query to the server (see as_server.h) and prints
+** the matching files, best first, as they arrive.
+**
+** Only the matching files are kept in library, at their index, so that they
+** can be requested next.
+**
+** returns the number of files found on success, -1 on error
+*/
+int search_request(int sockfd, const char *query, Library *library);
+
+/*
+** Sends an INFO request for file_index to the server (see as_server.h) and
+** prints the codec, duration, sample rate, channels and bitrate it knows of
+** the file. The file doesn't have to be listed first.
+**
+** returns 0 on success (even if the server has no such file), -1 on error
+*/
+int info_request(int sockfd, uint32_t file_index);
+
 /*
 ** Sends a stream request to the server and simply saves the file received
 ** from the server to the local library directory. The AUDIO_PLAYER is
@@ -73,6 +210,30 @@ int list_request(int sockfd, Library *library);
 */
 int get_file_request(int sockfd, uint32_t file_index, const Library * library);
 
+/*
+** Same as get_file_request for the num_files files at file_indices, over the
+** one connection: the STREAM requests are pipelined, up to
+** GET_PIPELINE_DEPTH of them are sent before their responses arrive, so the
+** server starts on the next file as soon as it is done with one instead of
+** waiting for the client to ask. The responses come in the order of the
+** requests.
+**
+** returns 0 on success, -1 on error
+*/
+int get_files_request(int sockfd, const uint32_t *file_indices, int num_files,
+                      const Library *library);
+
+/*
+** Finishes getting a file that was only partially saved to the local library
+** directory, e.g. because the connection was lost during a get. Only the
+** bytes after the end of the local copy are requested from the server (see
+** send_and_process_stream_range_request) and appended to it. If the local
+** copy is larger than the server's file, the whole file is gotten again.
+**
+** returns 0 on success, -1 on error
+*/
+int resume_file_request(int sockfd, uint32_t file_index, const Library * library);
+
 /*
 ** Starts the audio player process and returns the file descriptor of
 ** the write end of a pipe connected to the audio player's stdin.
@@ -88,6 +249,8 @@ int start_audio_player_process(int *audio_out_fd);
 
 /*
 ** Sends a stream request to the server and starts the audio player process.
+** Servers that know STREAM_AT get one from position 0, which they may pace
+** (see as_server.h) since the file is only played.
 **
 ** This function leverages send_and_process_stream_request to send the request and
 ** receive the audio stream from the server.
@@ -98,6 +261,15 @@ int start_audio_player_process(int *audio_out_fd);
 */
 int stream_request(int sockfd, uint32_t file_index);
 
+/*
+** Same as stream_request, but the file plays from position_ms on: a
+** STREAM_AT request (see send_and_process_stream_at_request) has the server
+** start on the frame at that position, so nothing before it is received.
+**
+** returns 0 on success, -1 on error
+*/
+int seek_request(int sockfd, uint32_t file_index, uint64_t position_ms);
+
 /*
 ** Sends a stream request to the server, starts the audio player process and creates
 ** a file to store the incoming audio stream.
@@ -111,6 +283,23 @@ int stream_request(int sockfd, uint32_t file_index);
 */
 int stream_and_get_request(int sockfd, uint32_t file_index, const Library * library);
 
+/*
+** Streams the file at path, or the file with the stable id file_id if path
+** is NULL, from the server without listing the library first (see STREAM_PATH
+** and STREAM_ID in as_server.h), and prints its stable id.
+**
+** returns 0 on success (even if the server has no such file), -1 on error
+*/
+int play_request(int sockfd, const char *path, uint64_t file_id);
+
+/*
+** Gets the file at path from the server without listing the library first,
+** and saves it at the same path in library_directory.
+**
+** returns 0 on success (even if the server has no such file), -1 on error
+*/
+int fetch_request(int sockfd, const char *path, const char *library_directory);
+
 /*
 ** Sends a stream request for the particular file_index to the server and sends the audio
 ** stream to the audio_out_fd and file_dest_fd file descriptors
@@ -125,19 +314,59 @@ int stream_and_get_request(int sockfd, uint32_t file_index, const Library * libr
 ** One of audio_out_fd or file_dest_fd can be -1, but not both. File descriptors >= 0
 ** should be closed before the function returns.
 **
-** This function will leverage a dynamic circular buffer with two output streams
+** This function will leverage a circular buffer (StreamRing) with two output streams
 ** and one input stream. The input stream is the server connection/socket, and the output
-** streams are audio_out_fd and file_dest_fd. The buffer should be dynamically sized using
-** realloc. See the assignment handout for more information, and notice how realloc is used
-** to manage the library.files in this client and the server.
+** streams are audio_out_fd and file_dest_fd. The buffer has a fixed capacity (-b, default
+** STREAM_RING_CAPACITY), is received into with readv and written out of with writev, each
+** call covering the bytes on both sides of the wrap point.
 **
 ** Phrased differently, this uses a FIFO with two independent out streams and one in stream,
-** but because it is as long as needed, we call it circular, and just point to three different
-** parts of it.
+** with a cursor for each of them. When the slower out stream falls a whole buffer behind,
+** the socket is no longer read until it catches up, so the server is slowed down by TCP
+** instead of the buffer growing.
+**
+** Unless turned off (-c), the stream is first moved with splice instead, from the socket to
+** the outputs through kernel pipes (and duplicated with tee when going to both), so it is
+** never copied into this process. The buffer is the fallback for when splice can't be used.
 **
 ** returns 0 on success, -1 on error
 */
 int send_and_process_stream_request(int sockfd, uint32_t file_index,
                                     int audio_out_fd, int file_dest_fd);
 
+/*
+** Same as send_and_process_stream_request, but sends a STREAM_RANGE request
+** for the part of the file starting at offset, up to its end. The file's
+** total size, as reported by the server, is stored in file_size. No bytes
+** are received if offset is at or past the end of the file.
+**
+** returns 0 on success, -1 on error
+*/
+int send_and_process_stream_range_request(int sockfd, uint32_t file_index, uint64_t offset,
+                                          int audio_out_fd, int file_dest_fd,
+                                          uint64_t *file_size);
+
+/*
+** Same as send_and_process_stream_request, but sends a STREAM_PATH request
+** for the file at path, or a STREAM_ID request for the file with the stable
+** id *file_id if path is NULL. The stable id of the file is stored in
+** file_id, 0 if the server has no such file (nothing is received then, but
+** the file descriptors are still closed).
+**
+** returns 0 on success, -1 on error
+*/
+int send_and_process_stream_file_request(int sockfd, const char *path, uint64_t *file_id,
+                                         int audio_out_fd, int file_dest_fd);
+
+/*
+** Same as send_and_process_stream_request, but sends a STREAM_AT request for
+** the file from position_ms on. What is received plays on its own (headers
+** included). The position the server started at, the frame at or before
+** position_ms, is stored in start_ms.
+**
+** returns 0 on success, -1 on error
+*/
+int send_and_process_stream_at_request(int sockfd, uint32_t file_index, uint64_t position_ms,
+                                       int audio_out_fd, int file_dest_fd, uint64_t *start_ms);
+
 #endif // AS_CLIENT_H_
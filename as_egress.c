@@ -0,0 +1,564 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_egress.h"
+
+#include <sched.h>
+#include <time.h>
+
+// Tries at taking over the computation of the shares before giving up
+// waiting for the process computing them (which may have died)
+#define EGRESS_LOCK_TRIES 10000
+
+// NULL without a cap, shared by every process serving clients otherwise
+static EgressScheduler *scheduler = NULL;
+static const char *weights_path = NULL;
+
+// Slot of the connection on every socket of this process, -1 if none
+static int *slots = NULL;
+static int num_sockets = 0;
+
+// A connection sending a response, while the shares are computed
+typedef struct egress_flow {
+    uint32_t slot;
+    double weight;
+    double demand;             // bytes per second
+} EgressFlow;
+
+// Scratch space of _compute_shares, in every process
+static EgressFlow *flows = NULL;
+
+static uint64_t _now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int _slot_of(int socket)
+{
+    return socket >= 0 && socket < num_sockets ? slots[socket] : -1;
+}
+
+/*
+** Become the process computing the shares
+**
+** returns 1 on success, 0 if another process is computing them
+*/
+static int _try_lock(void)
+{
+    pid_t expected = 0;
+    return __atomic_compare_exchange_n(&scheduler->computing, &expected, getpid(), 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/*
+** Same as _try_lock, waiting for the other process to be done. A process
+** that has been waited for too long is taken over.
+*/
+static void _lock(void)
+{
+    for (int tries = 0; !_try_lock(); tries++)
+    {
+        if (tries == EGRESS_LOCK_TRIES)
+        {
+            __atomic_store_n(&scheduler->computing, getpid(), __ATOMIC_SEQ_CST);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static void _unlock(void)
+{
+    __atomic_store_n(&scheduler->computing, 0, __ATOMIC_RELEASE);
+}
+
+
+/*
+** Weights
+** -------
+*/
+static double _weight_of(const EgressScheduler *s, const struct sockaddr_in *addr)
+{
+    double weight = 1;
+    int longest = -1;
+    for (int i = 0; i < s->num_rules; i++)
+    {
+        const EgressRule *rule = &s->rules[i];
+        if ((addr->sin_addr.s_addr & rule->mask) == rule->addr && rule->prefix_len > longest)
+        {
+            weight = rule->weight;
+            longest = rule->prefix_len;
+        }
+    }
+    return weight;
+}
+
+/*
+** Parse "<address>[/<prefix length>]" into rule
+**
+** returns 0 on success, -1 if it isn't one
+*/
+static int _parse_network(char *network, EgressRule *rule)
+{
+    rule->prefix_len = 32;
+    char *slash = strchr(network, '/');
+    if (slash != NULL)
+    {
+        char *end;
+        long prefix_len = strtol(slash + 1, &end, 10);
+        if (end == slash + 1 || *end != '\0' || prefix_len < 0 || prefix_len > 32)
+        {
+            return -1;
+        }
+        rule->prefix_len = prefix_len;
+        *slash = '\0';
+    }
+
+    struct in_addr addr;
+    if (inet_pton(AF_INET, network, &addr) != 1)
+    {
+        return -1;
+    }
+    rule->mask = rule->prefix_len == 0 ? 0 : htonl(~(uint32_t)0 << (32 - rule->prefix_len));
+    rule->addr = addr.s_addr & rule->mask;
+    return 0;
+}
+
+int egress_load_weights(void)
+{
+    if (scheduler == NULL || weights_path == NULL)
+    {
+        return 0;
+    }
+    FILE *file = fopen(weights_path, "r");
+    if (file == NULL)
+    {
+        perror("egress_load_weights: fopen");
+        return -1;
+    }
+
+    static EgressRule rules[EGRESS_MAX_RULES];
+    int num_rules = 0;
+    double realtime_weight = EGRESS_REALTIME_WEIGHT;
+    char line[256];
+    int line_number = 0;
+    int result = 0;
+
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+
+        char target[64];
+        double weight;
+        char extra;
+        int fields = sscanf(line, "%63s %lf %c", target, &weight, &extra);
+        if (fields <= 0)
+        {
+            continue;
+        }
+        if (fields != 2 || !(weight > 0))
+        {
+            result = -1;
+        }
+        else if (strcmp(target, "realtime") == 0)
+        {
+            realtime_weight = weight;
+        }
+        else if (num_rules == EGRESS_MAX_RULES || _parse_network(target, &rules[num_rules]) < 0)
+        {
+            result = -1;
+        }
+        else
+        {
+            rules[num_rules++].weight = weight;
+        }
+    }
+    fclose(file);
+    if (result < 0)
+    {
+        ERR_PRINT("%s:%d: invalid weight, expected \"<address>[/<prefix length>] <weight>\" "
+                  "or \"realtime <weight>\"\n", weights_path, line_number);
+        return -1;
+    }
+
+    _lock();
+    memcpy(scheduler->rules, rules, num_rules * sizeof(EgressRule));
+    scheduler->num_rules = num_rules;
+    scheduler->realtime_weight = realtime_weight;
+    scheduler->rules_version++;
+    scheduler->changed = 1;
+    _unlock();
+
+    printf("Read %d egress weights from %s\n", num_rules, weights_path);
+    return 0;
+}
+
+
+/*
+** Shares
+** ------
+*/
+static int _compare_flows(const void *a, const void *b)
+{
+    const EgressFlow *flow_a = a;
+    const EgressFlow *flow_b = b;
+    double level_a = flow_a->demand / flow_a->weight;
+    double level_b = flow_b->demand / flow_b->weight;
+    return level_a < level_b ? -1 : level_a > level_b;
+}
+
+/*
+** Measure the rate of every connection if it is due, then share the cap
+** between the connections sending a response (see the Design section).
+** Only call it while holding the lock.
+*/
+static void _compute_shares(uint64_t now)
+{
+    EgressScheduler *s = scheduler;
+    if (flows == NULL && (flows = malloc(EGRESS_MAX_CLIENTS * sizeof(EgressFlow))) == NULL)
+    {
+        perror("_compute_shares");
+        return;
+    }
+    // Before reading the connections, so that what changes from now on is
+    // seen next time
+    __atomic_store_n(&s->changed, 0, __ATOMIC_SEQ_CST);
+
+    double elapsed = (now - s->measured_at) / 1e9;
+    int measure = elapsed * 1000 >= EGRESS_MEASURE_MS;
+    uint64_t measured_before = s->measured_at;
+    if (measure)
+    {
+        s->measured_at = now;
+    }
+    s->computed_at = now;
+
+    uint32_t num_slots = __atomic_load_n(&s->num_slots, __ATOMIC_ACQUIRE);
+    uint32_t num_flows = 0;
+    double total_weight = 0;
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+        EgressClient *client = &s->clients[i];
+        if (__atomic_load_n(&client->pid, __ATOMIC_ACQUIRE) == 0)
+        {
+            continue;
+        }
+        int busy = __atomic_load_n(&client->busy, __ATOMIC_ACQUIRE);
+        if (measure)
+        {
+            uint64_t bytes = __atomic_load_n(&client->bytes, __ATOMIC_RELAXED);
+            client->rate = bytes > client->counted ? (bytes - client->counted) / elapsed : 0;
+            client->counted = bytes;
+
+            // Sending less than its share the whole time, e.g. to a slow client
+            client->demand = 0;
+            if (busy && client->share != 0 && client->busy_since <= measured_before &&
+                client->rate < client->share * EGRESS_UNUSED_SHARE)
+            {
+                client->demand = client->rate * EGRESS_HEADROOM > client->share / 2
+                                     ? client->rate * EGRESS_HEADROOM
+                                     : client->share / 2;
+            }
+        }
+        if (client->rules_version != s->rules_version)
+        {
+            client->client_weight = _weight_of(s, &client->addr);
+            client->rules_version = s->rules_version;
+        }
+        client->weight = client->client_weight * (client->realtime ? s->realtime_weight : 1);
+
+        if (!busy)
+        {
+            continue;
+        }
+        double demand = client->limit == UINT32_MAX ? s->cap : client->limit;
+        if (client->demand != 0)
+        {
+            demand = MIN(demand, client->demand);
+        }
+        flows[num_flows].slot = i;
+        flows[num_flows].weight = client->weight;
+        flows[num_flows].demand = demand > EGRESS_MIN_RATE ? demand : EGRESS_MIN_RATE;
+        total_weight += client->weight;
+        num_flows++;
+    }
+    s->num_busy = num_flows;
+
+    // Those needing the least for their weight first, each gets what it needs
+    // or its share of what is left, whichever is less
+    qsort(flows, num_flows, sizeof(EgressFlow), _compare_flows);
+    double left = s->cap;
+    for (uint32_t i = 0; i < num_flows; i++)
+    {
+        double share = MIN(flows[i].demand, left * flows[i].weight / total_weight);
+        if (share < EGRESS_MIN_RATE)
+        {
+            share = EGRESS_MIN_RATE;
+        }
+        left = left > share ? left - share : 0;
+        total_weight -= flows[i].weight;
+        __atomic_store_n(&s->clients[flows[i].slot].share,
+                         share < UINT32_MAX - 1 ? (uint32_t)share : UINT32_MAX - 1,
+                         __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+** Connections
+** -----------
+*/
+int egress_init(const ServerOptions *options)
+{
+    if (options->egress_cap <= 0)
+    {
+        return 0;
+    }
+    scheduler = mmap(NULL, sizeof(EgressScheduler), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (scheduler == MAP_FAILED)
+    {
+        perror("egress_init: mmap");
+        scheduler = NULL;
+        return -1;
+    }
+    scheduler->cap = options->egress_cap;
+    scheduler->realtime_weight = EGRESS_REALTIME_WEIGHT;
+    scheduler->rules_version = 1;
+    scheduler->computed_at = scheduler->measured_at = _now_ns();
+
+    weights_path = options->weights_path;
+    if (egress_load_weights() < 0)
+    {
+        munmap(scheduler, sizeof(EgressScheduler));
+        scheduler = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int egress_enabled(void)
+{
+    return scheduler != NULL;
+}
+
+void egress_connect(const ClientSocket *client)
+{
+    if (scheduler == NULL || client->socket < 0)
+    {
+        return;
+    }
+    if (client->socket >= num_sockets)
+    {
+        int new_num_sockets = client->socket + 64;
+        int *new_slots = realloc(slots, new_num_sockets * sizeof(int));
+        if (new_slots == NULL)
+        {
+            perror("egress_connect");
+            return;
+        }
+        for (int i = num_sockets; i < new_num_sockets; i++)
+        {
+            new_slots[i] = -1;
+        }
+        slots = new_slots;
+        num_sockets = new_num_sockets;
+    }
+
+    pid_t pid = getpid();
+    for (uint32_t i = 0; i < EGRESS_MAX_CLIENTS; i++)
+    {
+        EgressClient *entry = &scheduler->clients[i];
+        pid_t expected = 0;
+        if (__atomic_load_n(&entry->pid, __ATOMIC_RELAXED) != 0 ||
+            !__atomic_compare_exchange_n(&entry->pid, &expected, pid, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+        entry->socket = client->socket;
+        entry->addr = client->addr;
+        entry->busy = 0;
+        entry->realtime = 0;
+        entry->limit = UINT32_MAX;
+        entry->bytes = 0;
+        entry->counted = 0;
+        entry->rate = 0;
+        entry->demand = 0;
+        entry->rules_version = 0;
+        entry->share = 0;
+
+        uint32_t num_slots = __atomic_load_n(&scheduler->num_slots, __ATOMIC_RELAXED);
+        while (num_slots <= i &&
+               !__atomic_compare_exchange_n(&scheduler->num_slots, &num_slots, i + 1, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        slots[client->socket] = i;
+        return;
+    }
+    fprintf(stderr, "Too many clients for the egress cap, %s:%d is not capped\n",
+            inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+}
+
+void egress_disconnect(int socket)
+{
+    int slot = _slot_of(socket);
+    if (slot < 0)
+    {
+        return;
+    }
+    egress_idle(socket);
+    __atomic_store_n(&scheduler->clients[slot].pid, 0, __ATOMIC_RELEASE);
+    slots[socket] = -1;
+}
+
+void egress_remove_process(pid_t pid)
+{
+    if (scheduler == NULL)
+    {
+        return;
+    }
+    uint32_t num_slots = __atomic_load_n(&scheduler->num_slots, __ATOMIC_ACQUIRE);
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+        EgressClient *client = &scheduler->clients[i];
+        if (__atomic_load_n(&client->pid, __ATOMIC_ACQUIRE) == pid)
+        {
+            __atomic_store_n(&client->busy, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&client->pid, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&scheduler->changed, 1, __ATOMIC_RELEASE);
+        }
+    }
+    // Died while computing the shares
+    pid_t expected = pid;
+    __atomic_compare_exchange_n(&scheduler->computing, &expected, 0, 0,
+                                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+
+/*
+** Sending
+** -------
+*/
+uint32_t egress_rate(int socket, int realtime, uint32_t limit)
+{
+    int slot = _slot_of(socket);
+    if (slot < 0)
+    {
+        return limit;
+    }
+    EgressClient *client = &scheduler->clients[slot];
+    uint64_t now = _now_ns();
+
+    if (!client->busy || client->realtime != realtime || client->limit != limit)
+    {
+        if (!client->busy)
+        {
+            client->busy_since = now;
+            client->demand = 0;
+            __atomic_store_n(&client->share, 0, __ATOMIC_RELEASE);
+        }
+        client->realtime = realtime;
+        client->limit = limit;
+        __atomic_store_n(&client->busy, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&scheduler->changed, 1, __ATOMIC_RELEASE);
+    }
+
+    if ((__atomic_load_n(&scheduler->changed, __ATOMIC_ACQUIRE) ||
+         now - scheduler->computed_at >= EGRESS_INTERVAL_MS * 1000000ULL) &&
+        _try_lock())
+    {
+        _compute_shares(now);
+        _unlock();
+    }
+
+    uint32_t share = __atomic_load_n(&client->share, __ATOMIC_ACQUIRE);
+    if (share == 0)
+    {
+        // Another process is computing the shares, an even one until it's done
+        share = scheduler->cap / (scheduler->num_busy + 1);
+    }
+    return MIN(share, limit);
+}
+
+void egress_sent(int socket, size_t bytes)
+{
+    int slot = _slot_of(socket);
+    if (slot >= 0)
+    {
+        __atomic_add_fetch(&scheduler->clients[slot].bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
+
+void egress_idle(int socket)
+{
+    int slot = _slot_of(socket);
+    if (slot >= 0 && scheduler->clients[slot].busy)
+    {
+        __atomic_store_n(&scheduler->clients[slot].busy, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&scheduler->changed, 1, __ATOMIC_RELEASE);
+    }
+}
+
+size_t egress_budget(uint32_t rate)
+{
+    if (scheduler == NULL)
+    {
+        return RESPONSE_SEND_BUDGET;
+    }
+    double budget = (double)rate * EGRESS_INTERVAL_MS / 1000;
+    if (budget < EGRESS_MIN_CHUNK)
+    {
+        return EGRESS_MIN_CHUNK;
+    }
+    return budget < RESPONSE_SEND_BUDGET ? budget : RESPONSE_SEND_BUDGET;
+}
+
+void egress_print_stats(FILE *stream)
+{
+    if (scheduler == NULL)
+    {
+        fprintf(stream, "The server has no egress cap (-e)\n");
+        return;
+    }
+    _lock();
+    _compute_shares(_now_ns());
+
+    uint32_t num_slots = scheduler->num_slots;
+    uint32_t num_clients = 0;
+    double total_rate = 0;
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+        if (scheduler->clients[i].pid != 0)
+        {
+            num_clients++;
+            total_rate += scheduler->clients[i].rate;
+        }
+    }
+    fprintf(stream, "Egress cap %.1f kB/s, %.1f kB/s sent to %u clients, %u of them sending\n",
+            scheduler->cap / 1000, total_rate / 1000, num_clients, scheduler->num_busy);
+    fprintf(stream, "  %-21s %7s %-9s %8s %12s %11s %12s\n",
+            "client", "pid", "sending", "weight", "share kB/s", "rate kB/s", "sent kB");
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+        const EgressClient *client = &scheduler->clients[i];
+        if (client->pid == 0)
+        {
+            continue;
+        }
+        char address[32];
+        snprintf(address, sizeof(address), "%s:%d",
+                 inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+        const char *sending = !client->busy ? "-" : client->realtime ? "stream_at" : "bulk";
+        fprintf(stream, "  %-21s %7d %-9s %8.2f %12.1f %11.1f %12.1f\n",
+                address, client->pid, sending, client->weight,
+                client->busy ? client->share / 1000.0 : 0, client->rate / 1000,
+                client->bytes / 1000.0);
+    }
+    fflush(stream);
+    _unlock();
+}
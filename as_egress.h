@@ -0,0 +1,201 @@
+#ifndef AS_EGRESS_H_
+#define AS_EGRESS_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+
+/*
+** Constants
+** ---------
+*/
+// Connections sharing the egress cap at once. Those accepted while all are
+// taken are sent to as fast as they go, outside of the cap.
+#define EGRESS_MAX_CLIENTS 16384
+
+// Rules of a weights file (-W)
+#define EGRESS_MAX_RULES 256
+
+// Milliseconds between two computations of the shares. A connection sends
+// about that long at its share before it looks at it again.
+#define EGRESS_INTERVAL_MS 100
+
+// Milliseconds the achieved rates of the connections are measured over,
+// long enough for each of them to send many times
+#define EGRESS_MEASURE_MS 1000
+
+// Weight of a STREAM_AT response, times the weight of its client, unless
+// the weights file says otherwise
+#define EGRESS_REALTIME_WEIGHT 8
+
+// Lowest share of a connection, so that nobody ever stops completely
+#define EGRESS_MIN_RATE (4 * 1024)
+
+// A connection sending less than this share of its share (e.g. to a slow
+// client) only gets what it sends times EGRESS_HEADROOM (but at least half
+// of its share, a connection slows down gradually), the rest goes to the
+// others
+#define EGRESS_UNUSED_SHARE 0.75
+#define EGRESS_HEADROOM 1.5
+
+// Fewest bytes sent (and queued by the kernel) between two looks at a share
+#define EGRESS_MIN_CHUNK (16 * 1024)
+
+
+/*
+** Design
+** ------
+** A server started with -e sends at most that many bytes per second to all
+** of its clients together, shared between the connections sending a
+** response at the time:
+**
+**   - every connection has a weight: the weight of its client's address in
+**     the weights file (-W, 1 by default), times EGRESS_REALTIME_WEIGHT
+**     while it sends a STREAM_AT response, so that players are served before
+**     bulk downloads,
+**   - the cap is shared in proportion to the weights (weighted max-min
+**     fairness): a connection that needs less than its share (a STREAM_AT
+**     response paced with -r, a slow client) gets what it needs, and what it
+**     leaves is shared between the others the same way. What a connection
+**     needs is known for paced responses, and estimated from what it sent
+**     during the last EGRESS_MEASURE_MS otherwise,
+**   - each connection is paced at its share with SO_MAX_PACING_RATE (see
+**     pace_response), and TCP_NOTSENT_LOWAT keeps about EGRESS_INTERVAL_MS
+**     of it queued in the kernel, so that a new share applies quickly.
+**
+** The clients of a fork or prefork server are served by different processes,
+** so the connections are in a table in shared memory (mapped before any
+** process is forked), one entry per connection, written to by the process
+** serving it. Every EGRESS_INTERVAL_MS, and when a connection starts or
+** finishes a response, whichever process sends next computes the shares of
+** all of them, no process sends for the others. A process that dies is
+** removed from the table when it is reaped.
+**
+** This is fair queueing by rates rather than by packets (e.g. deficit round
+** robin): the sockets belong to different processes, and the kernel already
+** spaces out the packets of a paced socket.
+**
+** Weights file
+** ------------
+** One rule per line, "<address>[/<prefix length>] <weight>", or
+** "realtime <weight>" for the weight of STREAM_AT responses. The rule with
+** the longest prefix matching the address of a client gives its weight, '#'
+** starts a comment. It is read again when the user types w + enter in the
+** server's terminal, and s + enter prints the rate achieved by every client.
+**   e.g.  # the office LAN downloads at a tenth of the rate of the others
+**         10.1.0.0/16 0.1
+**         realtime 16
+*/
+
+// A connection of the table, see the Design section
+typedef struct egress_client {
+    pid_t pid;                 // of the process serving it, 0 if free
+    int socket;                // in that process
+    struct sockaddr_in addr;
+    int busy;                  // sending a response
+    int realtime;              // a STREAM_AT response
+    uint32_t limit;            // most bytes per second the response is sent at
+    uint64_t busy_since;       // ns, CLOCK_MONOTONIC
+    uint64_t bytes;            // sent since the connection was accepted
+    uint64_t counted;          // bytes when its rate was last measured
+    double rate;               // achieved, bytes per second, when last measured
+    double demand;             // bytes per second, estimated then, 0 if unknown
+    double client_weight;      // of its address in the weights file
+    uint32_t rules_version;    // of the weights file client_weight is from
+    double weight;             // at the last computation of the shares
+    uint32_t share;            // bytes per second, 0 until computed
+} EgressClient;
+
+typedef struct egress_rule {
+    in_addr_t addr;            // network byte order
+    in_addr_t mask;
+    int prefix_len;
+    double weight;
+} EgressRule;
+
+// Shared by every process serving clients
+typedef struct egress_scheduler {
+    double cap;                // bytes per second
+    pid_t computing;           // process computing the shares, 0 if none
+    int changed;               // a connection started or finished a response
+    uint64_t computed_at;      // ns, CLOCK_MONOTONIC
+    uint64_t measured_at;      // when the rates were last measured
+    uint32_t num_busy;
+    double realtime_weight;
+    uint32_t rules_version;    // counting the times the weights file was read
+    int num_rules;
+    EgressRule rules[EGRESS_MAX_RULES];
+    uint32_t num_slots;        // of clients ever used
+    EgressClient clients[EGRESS_MAX_CLIENTS];
+} EgressScheduler;
+
+
+/*
+** Set up the scheduler for a cap of options->egress_cap bytes per second
+** with the weights file options->weights_path (NULL for none). Does nothing
+** if the cap is 0. Call it before forking any process serving clients.
+**
+** returns 0 on success, -1 on error
+*/
+int egress_init(const ServerOptions *options);
+
+/*
+** returns 1 if the server has an egress cap, 0 otherwise
+*/
+int egress_enabled(void);
+
+/*
+** Read the weights file again (see the Design section). The connections
+** get their new weights with the next computation of the shares.
+**
+** returns 0 on success, -1 on error (the weights are left as they were)
+*/
+int egress_load_weights(void);
+
+/*
+** In the process serving client, add its connection to the table, and
+** remove it once the socket is about to be closed.
+*/
+void egress_connect(const ClientSocket *client);
+void egress_disconnect(int socket);
+
+/*
+** Remove the connections of the process pid, which has been reaped.
+*/
+void egress_remove_process(pid_t pid);
+
+/*
+** Mark the connection on socket as sending a response (a STREAM_AT response
+** if realtime) that wants at most limit bytes per second (UINT32_MAX if
+** unlimited), computing the shares if they are due.
+**
+** returns the rate to send at, at most limit
+*/
+uint32_t egress_rate(int socket, int realtime, uint32_t limit);
+
+/*
+** Count bytes sent on socket
+*/
+void egress_sent(int socket, size_t bytes);
+
+/*
+** Mark the connection on socket as done with its response
+*/
+void egress_idle(int socket);
+
+/*
+** returns how many bytes to send at rate before calling egress_rate again
+** (at most RESPONSE_SEND_BUDGET, which it is without a cap)
+*/
+size_t egress_budget(uint32_t rate);
+
+/*
+** Print the cap, and the share and achieved rate of every connection.
+*/
+void egress_print_stats(FILE *stream);
+
+#endif // AS_EGRESS_H_
@@ -0,0 +1,471 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_epoll.h"
+#include "as_cache.h"
+#include "as_egress.h"
+#include "as_watch.h"
+
+#include <time.h>
+
+static int _set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("_set_nonblocking");
+        return -1;
+    }
+    return 0;
+}
+
+static void _close_connection(int epfd, Connection **connections, Connection *conn)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->client.socket, NULL);
+    egress_disconnect(conn->client.socket);
+    close(conn->client.socket);
+    free_response(&conn->response);
+    if (conn->mux != NULL)
+    {
+        mux_free(conn->mux);
+        free(conn->mux);
+    }
+
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        *connections = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    free(conn);
+}
+
+/*
+** Accept every pending connection on the non-blocking listenfd and add them
+** to epfd, waiting for their first request.
+**
+** returns 0 on success, -1 on error
+*/
+static int _accept_connections(int epfd, int listenfd, Connection **connections)
+{
+    while (1)
+    {
+        ClientSocket client;
+        socklen_t addr_size = sizeof(client.addr);
+        client.socket = accept4(listenfd, (struct sockaddr *)&client.addr, &addr_size,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client.socket < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("accept_connection: accept");
+            // Out of descriptors is not fatal, the pending client waits
+            return (errno == EMFILE || errno == ENFILE) ? 0 : -1;
+        }
+
+        printf("Server got a connection from %s, port %d\n",
+               inet_ntoa(client.addr.sin_addr), ntohs(client.addr.sin_port));
+
+        Connection *conn = malloc(sizeof(Connection));
+        if (conn == NULL)
+        {
+            perror("_accept_connections");
+            close(client.socket);
+            return -1;
+        }
+        conn->client = client;
+        conn->state = CONNECTION_READING;
+        conn->bytes_in_buf = 0;
+        conn->version = PROTOCOL_VERSION_BASE;
+        conn->response = (Response)EMPTY_RESPONSE;
+        conn->mux = NULL;
+        conn->events = EPOLLIN;
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, client.socket, &event) == -1)
+        {
+            perror("_accept_connections: epoll_ctl");
+            close(client.socket);
+            free(conn);
+            return -1;
+        }
+        egress_connect(&client);
+
+        conn->prev = NULL;
+        conn->next = *connections;
+        if (*connections != NULL)
+        {
+            (*connections)->prev = conn;
+        }
+        *connections = conn;
+    }
+}
+
+/*
+** Only wait for what the connection needs next: events, which are EPOLLIN,
+** EPOLLOUT or both.
+**
+** returns 0 on success, -1 on error
+*/
+static int _wait_for(int epfd, Connection *conn, uint32_t events)
+{
+    if (events == conn->events)
+    {
+        return 0;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = conn};
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, conn->client.socket, &event) == -1)
+    {
+        perror("_advance_connection: epoll_ctl");
+        return -1;
+    }
+    conn->events = events;
+    return 0;
+}
+
+/*
+** Move a multiplexed connection as far along as possible without blocking:
+** open a stream for every REQUEST frame in its request buffer, then send
+** the frames of its streams until the socket is full.
+**
+** returns 0 on success, -1 if the connection should be closed
+*/
+static int _advance_multiplexed(int epfd, Connection *conn, const Library *library)
+{
+    uint32_t stream_id;
+    Request request;
+    int consumed;
+    while ((consumed = mux_parse_frame(conn->mux, conn->request_buffer, conn->bytes_in_buf,
+                                       &stream_id, &request)) > 0)
+    {
+        conn->bytes_in_buf -= consumed;
+        memmove(conn->request_buffer, conn->request_buffer + consumed, conn->bytes_in_buf);
+        if (stream_id == 0)
+        {
+            continue;
+        }
+
+        // A request that fails only resets its own stream
+        Response response;
+        int prepared = prepare_response(library, &request, &conn->version, &response);
+        mux_open_stream(conn->mux, stream_id, prepared == 0 ? &response : NULL);
+    }
+    if (consumed < 0)
+    {
+        return -1;
+    }
+
+    int sent = mux_send(conn->client.socket, conn->mux);
+    if (sent < 0)
+    {
+        return -1;
+    }
+    return _wait_for(epfd, conn, sent == 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/*
+** Move the connection as far along as possible without blocking: finish
+** sending the current response, then answer the requests already in its
+** request buffer one after another.
+**
+** returns 0 on success, -1 if the connection should be closed
+*/
+static int _advance_connection(int epfd, Connection *conn, const Library *library)
+{
+    if (conn->state == CONNECTION_MULTIPLEXED)
+    {
+        return _advance_multiplexed(epfd, conn, library);
+    }
+
+    while (1)
+    {
+        if (conn->state == CONNECTION_WRITING)
+        {
+            int sent = send_response(conn->client.socket, &conn->response);
+            if (sent < 0)
+            {
+                return -1;
+            }
+            if (sent == 0)
+            {
+                break;
+            }
+            free_response(&conn->response);
+            // What follows an accepted MUX request is frames
+            if (conn->mux != NULL)
+            {
+                conn->state = CONNECTION_MULTIPLEXED;
+                return _advance_multiplexed(epfd, conn, library);
+            }
+            conn->state = CONNECTION_READING;
+        }
+
+        Request request;
+        int consumed = parse_request(conn->request_buffer, conn->bytes_in_buf, &request);
+        if (consumed == 0)
+        {
+            break;
+        }
+        conn->bytes_in_buf -= consumed;
+        memmove(conn->request_buffer, conn->request_buffer + consumed, conn->bytes_in_buf);
+
+        if (request.type == REQUEST_TYPE_MUX && conn->version >= PROTOCOL_VERSION_MUX)
+        {
+            conn->mux = malloc(sizeof(MuxSession));
+            if (conn->mux == NULL)
+            {
+                perror("_advance_connection");
+                return -1;
+            }
+            mux_init(conn->mux);
+            if (prepare_mux_response(1, &conn->response) < 0)
+            {
+                return -1;
+            }
+            conn->state = CONNECTION_WRITING;
+            continue;
+        }
+
+        int prepared = prepare_response(library, &request, &conn->version, &conn->response);
+        if (prepared < 0)
+        {
+            return -1;
+        }
+        if (prepared == 0)
+        {
+            conn->state = CONNECTION_WRITING;
+        }
+    }
+
+    return _wait_for(epfd, conn, conn->state == CONNECTION_WRITING ? EPOLLOUT : EPOLLIN);
+}
+
+/*
+** Read whatever the client has sent into its request buffer and answer it.
+**
+** returns 0 on success, -1 if the connection was closed by the client or
+** should be closed
+*/
+static int _read_from_connection(int epfd, Connection *conn, const Library *library)
+{
+    int bytes_read = read(conn->client.socket, conn->request_buffer + conn->bytes_in_buf,
+                          REQUEST_BUFFER_SIZE - conn->bytes_in_buf);
+    if (bytes_read < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return 0;
+        }
+        perror("handle_client");
+        return -1;
+    }
+    if (bytes_read == 0)
+    {
+        printf("Client on %s:%d disconnected\n",
+               inet_ntoa(conn->client.addr.sin_addr),
+               ntohs(conn->client.addr.sin_port));
+        return -1;
+    }
+#ifdef DEBUG
+    printf("Read %d bytes from client\n", bytes_read);
+#endif
+    conn->bytes_in_buf += bytes_read;
+
+    return _advance_connection(epfd, conn, library);
+}
+
+/*
+** The event loop behind run_epoll_server and run_epoll_worker. Commands are
+** read from control_fd one byte at a time: 'q' quits, 'r' reconciles the
+** library, 's' and 'w' are the commands of the egress cap (see as_egress.h),
+** 's' prints what the file cache did as well (see as_cache.h).
+** The library is kept up to date with a LibraryWatch (see as_watch.h) and
+** also reconciled every watch.reconcile_interval seconds. A worker quits when
+** control_fd reaches EOF.
+*/
+static int _run_event_loop(int listenfd, int control_fd, Library *library, int is_worker)
+{
+    // A client hanging up mid-response must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (_set_nonblocking(listenfd) < 0)
+    {
+        return 1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+    {
+        perror("run_epoll_server: epoll_create1");
+        return 1;
+    }
+
+    // The listening socket and control_fd are told apart from clients by data.ptr
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = &listenfd};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &event) == -1)
+    {
+        perror("run_epoll_server: epoll_ctl");
+        close(epfd);
+        return 1;
+    }
+    // stdin can't be polled if it is a regular file, then there is no q to wait for
+    event.data.ptr = &control_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, control_fd, &event) == -1 && errno != EPERM)
+    {
+        perror("run_epoll_server: epoll_ctl");
+        close(epfd);
+        return 1;
+    }
+
+    LibraryWatch watch;
+    if (library_watch_start(&watch, library) < 0)
+    {
+        fprintf(stderr, "Error scanning library\n");
+        close(epfd);
+        return 1;
+    }
+    event.data.ptr = &watch;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, watch.fd, &event) == -1)
+    {
+        perror("run_epoll_server: epoll_ctl");
+        library_watch_stop(&watch);
+        close(epfd);
+        return 1;
+    }
+
+    Connection *connections = NULL;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    time_t last_scan = time(NULL);
+    int result = 0;
+    int quit = 0;
+
+    while (!quit)
+    {
+        int rescan = time(NULL) - last_scan >= watch.reconcile_interval;
+
+        int num_events = epoll_wait(epfd, events, EPOLL_MAX_EVENTS, EPOLL_TIMEOUT_MS);
+        if (num_events < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("run_server");
+            result = 1;
+            break;
+        }
+
+        for (int i = 0; i < num_events; i++)
+        {
+            if (events[i].data.ptr == &listenfd)
+            {
+                if (_accept_connections(epfd, listenfd, &connections) < 0)
+                {
+                    result = 1;
+                    quit = 1;
+                }
+            }
+            else if (events[i].data.ptr == &control_fd)
+            {
+                char command;
+                ssize_t num = read(control_fd, &command, 1);
+                if (num == 1 && command == 'q')
+                {
+                    quit = 1;
+                }
+                else if (num == 1 && command == 'r')
+                {
+                    rescan = 1;
+                }
+                else if (num == 1 && command == 's')
+                {
+                    egress_print_stats(stdout);
+                    cache_print_stats(stdout);
+                }
+                else if (num == 1 && command == 'w')
+                {
+                    egress_load_weights();
+                }
+                else if (num == 0 && is_worker)
+                {
+                    quit = 1;
+                }
+                else if (num == 0)
+                {
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, control_fd, NULL);
+                }
+            }
+            else if (events[i].data.ptr == &watch)
+            {
+                if (library_watch_update(&watch, library) < 0)
+                {
+                    fprintf(stderr, "Error updating library\n");
+                    result = 1;
+                    quit = 1;
+                }
+            }
+            else
+            {
+                Connection *conn = events[i].data.ptr;
+                // A multiplexed connection reads frames while it writes others
+                int reading = conn->state == CONNECTION_READING ||
+                              (conn->state == CONNECTION_MULTIPLEXED &&
+                               (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)));
+                int ret = reading ? _read_from_connection(epfd, conn, library)
+                                  : _advance_connection(epfd, conn, library);
+                if (ret < 0)
+                {
+                    _close_connection(epfd, &connections, conn);
+                }
+            }
+        }
+
+        if (rescan && !quit)
+        {
+            if (library_watch_reconcile(&watch, library) < 0)
+            {
+                fprintf(stderr, "Error scanning library\n");
+                result = 1;
+                break;
+            }
+            last_scan = time(NULL);
+        }
+        // Only in a server of its own, prefork workers leave it to the parent
+        cache_maintain(library);
+    }
+
+    if (!is_worker)
+    {
+        printf("Quitting server\n");
+    }
+    while (connections != NULL)
+    {
+        _close_connection(epfd, &connections, connections);
+    }
+    library_watch_stop(&watch);
+    close(epfd);
+    return result;
+}
+
+int run_epoll_server(int listenfd, Library *library)
+{
+    return _run_event_loop(listenfd, STDIN_FILENO, library, 0);
+}
+
+int run_epoll_worker(int listenfd, int control_fd, Library *library)
+{
+    return _run_event_loop(listenfd, control_fd, library, 1);
+}
@@ -0,0 +1,84 @@
+#ifndef AS_EPOLL_H_
+#define AS_EPOLL_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_mux.h"
+
+#include <sys/epoll.h>
+
+/*
+** Constants
+** ---------
+*/
+#define EPOLL_MAX_EVENTS 64
+#define EPOLL_MAX_PENDING 1024
+#define EPOLL_TIMEOUT_MS (SELECT_TIMEOUT_SEC * 1000 + SELECT_TIMEOUT_USEC / 1000)
+
+
+/*
+** Design
+** ------
+** In epoll mode (as_server -m epoll) one process serves every client. All
+** sockets are non-blocking and registered with a single epoll instance, and
+** each client is a small state machine instead of a child process:
+**
+**   CONNECTION_READING: bytes are read into request_buffer until it holds a
+**                       complete request (see parse_request).
+**   CONNECTION_WRITING: the response to that request is sent with
+**                       send_response each time the socket is writable.
+**
+** Once the response is sent, any request already buffered is answered next,
+** otherwise the connection goes back to reading. Clients see exactly the same
+** protocol as with handle_client.
+**
+**   CONNECTION_MULTIPLEXED: after a MUX request (see as_mux.h), the socket is
+**                           read whenever the client sends frames, and
+**                           written to (with mux_send) as long as a stream
+**                           has something to send.
+**
+** An idle connection costs one Connection (a few hundred bytes) and a socket,
+** instead of a whole process.
+*/
+
+typedef enum connection_state {
+    CONNECTION_READING,
+    CONNECTION_WRITING,
+    CONNECTION_MULTIPLEXED,
+} ConnectionState;
+
+typedef struct connection {
+    ClientSocket client;
+    ConnectionState state;
+    uint8_t request_buffer[REQUEST_BUFFER_SIZE];
+    int bytes_in_buf;
+    uint32_t version;
+    Response response;
+    MuxSession *mux;           // once a MUX request was accepted, NULL before
+    uint32_t events;           // waited for with epoll
+    struct connection *prev;
+    struct connection *next;
+} Connection;
+
+
+/*
+** Serve every client connecting on listenfd from this process until the
+** user types q + enter in the server's terminal. The library is kept up to
+** date with a LibraryWatch (see as_watch.h), r + enter reconciles it.
+**
+** returns 0 when the user quits the server, 1 on error.
+*/
+int run_epoll_server(int listenfd, Library *library);
+
+/*
+** Same event loop, run by a worker process of a supervising server (see
+** as_prefork.h). Instead of stdin, commands come from the supervisor over
+** control_fd: 'r' reconciles the library and 'q' (or EOF) quits.
+**
+** returns 0 when told to quit, 1 on error.
+*/
+int run_epoll_worker(int listenfd, int control_fd, Library *library);
+
+#endif // AS_EPOLL_H_
@@ -0,0 +1,848 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_library.h"
+#include "as_search.h"
+
+
+/*
+** Hash tables
+** -----------
+** Both tables use linear probing and hold slot + 1, so that 0 is an empty
+** bucket. There are twice as many buckets as slots.
+*/
+static uint32_t _hash_path(const char *path)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++)
+    {
+        hash ^= (uint8_t)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+** splitmix64's finalizer, every bit of x ends up in every bit of the result
+*/
+static uint64_t _mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ull;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+uint64_t library_stable_id(const LibraryFileId *id)
+{
+    uint64_t stable_id = _mix64((uint64_t)id->ino ^ _mix64((uint64_t)id->dev));
+    return stable_id != 0 ? stable_id : 1;
+}
+
+// By stable id, so that a table can be searched with a stable id alone
+static uint32_t _hash_id(const LibraryFileId *id)
+{
+    return library_stable_id(id) >> 32;
+}
+
+static int _is_same_id(const LibraryFileId *id1, const LibraryFileId *id2)
+{
+    return id1->dev == id2->dev && id1->ino == id2->ino;
+}
+
+static int _is_null_id(const LibraryFileId *id)
+{
+    return id->dev == 0 && id->ino == 0;
+}
+
+/*
+** Bucket holding path, or the empty bucket it would go in.
+*/
+static uint32_t _path_bucket(const Library *library, const char *path)
+{
+    const LibraryIndex *index = library->index;
+    uint32_t bucket = _hash_path(path) & index->table_mask;
+    while (index->by_path[bucket] != 0 &&
+           strcmp(library->files[index->by_path[bucket] - 1], path) != 0)
+    {
+        bucket = (bucket + 1) & index->table_mask;
+    }
+    return bucket;
+}
+
+/*
+** Bucket holding id, or the empty bucket it would go in.
+*/
+static uint32_t _id_bucket(const LibraryIndex *index, const LibraryFileId *id)
+{
+    uint32_t bucket = _hash_id(id) & index->table_mask;
+    while (index->by_id[bucket] != 0 && !_is_same_id(&index->ids[index->by_id[bucket] - 1], id))
+    {
+        bucket = (bucket + 1) & index->table_mask;
+    }
+    return bucket;
+}
+
+/*
+** Empty a bucket of table, moving back the entries after it that would no
+** longer be found otherwise.
+*/
+static void _delete_bucket(const Library *library, uint32_t *table, uint32_t bucket)
+{
+    const LibraryIndex *index = library->index;
+    uint32_t hole = bucket;
+    for (uint32_t next = (hole + 1) & index->table_mask; table[next] != 0;
+         next = (next + 1) & index->table_mask)
+    {
+        uint32_t slot = table[next] - 1;
+        uint32_t home = (table == index->by_path ? _hash_path(library->files[slot])
+                                                 : _hash_id(&index->ids[slot])) &
+                        index->table_mask;
+        // The entry can fill the hole if its probe sequence goes through it
+        if (((next - home) & index->table_mask) >= ((next - hole) & index->table_mask))
+        {
+            table[hole] = table[next];
+            hole = next;
+        }
+    }
+    table[hole] = 0;
+}
+
+static void _unindex_path(Library *library, uint32_t slot)
+{
+    _delete_bucket(library, library->index->by_path,
+                   _path_bucket(library, library->files[slot]));
+}
+
+static void _index_path(Library *library, uint32_t slot)
+{
+    library->index->by_path[_path_bucket(library, library->files[slot])] = slot + 1;
+}
+
+/*
+** Forget the id of slot. The id stays in by_id if another slot holds it.
+*/
+static void _unindex_id(Library *library, uint32_t slot)
+{
+    LibraryIndex *index = library->index;
+    if (_is_null_id(&index->ids[slot]))
+    {
+        return;
+    }
+    uint32_t bucket = _id_bucket(index, &index->ids[slot]);
+    if (index->by_id[bucket] == slot + 1)
+    {
+        _delete_bucket(library, index->by_id, bucket);
+    }
+    index->ids[slot] = (LibraryFileId){0, 0};
+}
+
+static void _index_id(Library *library, uint32_t slot, const LibraryFileId *id)
+{
+    LibraryIndex *index = library->index;
+    if (_is_same_id(&index->ids[slot], id))
+    {
+        return;
+    }
+    _unindex_id(library, slot);
+    index->ids[slot] = *id;
+    // With hard links, the last one added is found by id
+    index->by_id[_id_bucket(index, id)] = slot + 1;
+}
+
+/*
+** returns the slot holding id, with a file or removed, -1 if there is none
+*/
+static int _find_id(const Library *library, const LibraryFileId *id)
+{
+    const LibraryIndex *index = library->index;
+    return (int)index->by_id[_id_bucket(index, id)] - 1;
+}
+
+
+/*
+** Slots
+** -----
+*/
+
+/*
+** returns a new random epoch
+*/
+static uint64_t _random_epoch(void)
+{
+    uint64_t epoch = 0;
+    if (getrandom(&epoch, sizeof(epoch), GRND_NONBLOCK) != sizeof(epoch))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        epoch = ((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_sec ^ ((uint64_t)now.tv_nsec << 20);
+    }
+    return epoch != 0 ? epoch : 1;
+}
+
+/*
+** Double the slots of the index (or allocate the first ones) and rebuild its
+** tables.
+**
+** returns 0 on success, -1 on error
+*/
+static int _grow_index(Library *library)
+{
+    LibraryIndex *old = library->index;
+    uint32_t old_capacity = old != NULL ? old->capacity : library->num_files;
+    uint32_t capacity = LIBRARY_INDEX_MIN_CAPACITY;
+    while (capacity <= old_capacity)
+    {
+        capacity *= 2;
+    }
+    uint32_t table_size = 2 * capacity;
+
+    size_t size = sizeof(LibraryIndex) + capacity * sizeof(LibraryFileId) +
+                  (capacity + 2 * (size_t)table_size) * sizeof(uint32_t) + capacity;
+    LibraryIndex *index = calloc(1, size);
+    char **files = realloc(library->files, capacity * sizeof(char *));
+    if (files != NULL)
+    {
+        library->files = files;
+    }
+    // Too big for the same block, it is copied at every growth otherwise
+    LibraryMetadata *metadata = realloc(old != NULL ? old->metadata : NULL,
+                                        capacity * sizeof(LibraryMetadata));
+    if (metadata != NULL && old != NULL)
+    {
+        old->metadata = metadata;
+    }
+    if (index == NULL || files == NULL || metadata == NULL)
+    {
+        perror("_grow_index");
+        free(index);
+        if (old == NULL)
+        {
+            free(metadata);
+        }
+        return -1;
+    }
+    memset(files + old_capacity, 0, (capacity - old_capacity) * sizeof(char *));
+    memset(metadata + old_capacity, 0, (capacity - old_capacity) * sizeof(LibraryMetadata));
+
+    index->capacity = capacity;
+    index->table_mask = table_size - 1;
+    index->ids = (LibraryFileId *)(index + 1);
+    index->free_slots = (uint32_t *)(index->ids + capacity);
+    index->by_path = index->free_slots + capacity;
+    index->by_id = index->by_path + table_size;
+    index->seen = (uint8_t *)(index->by_id + table_size);
+    index->list_fd = -1;
+    index->metadata = metadata;
+    if (old != NULL)
+    {
+        memcpy(index->ids, old->ids, old_capacity * sizeof(LibraryFileId));
+        memcpy(index->seen, old->seen, old_capacity);
+        index->generation = old->generation;
+        index->mapping = old->mapping;
+        index->mapping_size = old->mapping_size;
+        index->list_fd = old->list_fd;
+        index->list_size = old->list_size;
+        index->list_generation = old->list_generation;
+        index->sorted = old->sorted;
+        index->num_sorted = old->num_sorted;
+        index->sorted_generation = old->sorted_generation;
+        index->log = old->log;
+        index->search = old->search;
+        free(old);
+    }
+    else
+    {
+        index->log.epoch = _random_epoch();
+    }
+    library->index = index;
+
+    // Removed files first, so that the ids of files in the library win
+    for (uint32_t slot = 0; slot < old_capacity; slot++)
+    {
+        if (files[slot] == NULL && !_is_null_id(&index->ids[slot]))
+        {
+            index->by_id[_id_bucket(index, &index->ids[slot])] = slot + 1;
+        }
+        if (files[slot] == NULL && slot < library->num_files)
+        {
+            index->free_slots[index->num_free++] = slot;
+        }
+    }
+    for (uint32_t slot = 0; slot < library->num_files; slot++)
+    {
+        if (files[slot] != NULL)
+        {
+            index->num_live++;
+            _index_path(library, slot);
+            if (!_is_null_id(&index->ids[slot]))
+            {
+                index->by_id[_id_bucket(index, &index->ids[slot])] = slot + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+** Bump the generation of the library, for a change to its file in slot
+*/
+static void _log_change(Library *library, uint32_t slot)
+{
+    LibraryIndex *index = library->index;
+    LibraryChangeLog *log = &index->log;
+    index->generation++;
+    if (log->changes == NULL)
+    {
+        log->changes = malloc(LIBRARY_CHANGE_LOG_SIZE * sizeof(LibraryChange));
+        if (log->changes == NULL)
+        {
+            // Nothing before this change can be told apart anymore
+            log->start = index->generation;
+            return;
+        }
+        log->first = 0;
+        log->num_changes = 0;
+    }
+    if (log->num_changes == LIBRARY_CHANGE_LOG_SIZE)
+    {
+        log->start = log->changes[log->first].generation;
+        log->first = (log->first + 1) % LIBRARY_CHANGE_LOG_SIZE;
+        log->num_changes--;
+    }
+    uint32_t last = (log->first + log->num_changes++) % LIBRARY_CHANGE_LOG_SIZE;
+    log->changes[last].generation = index->generation;
+    log->changes[last].slot = slot;
+}
+
+static void _free_path(Library *library, char *path)
+{
+    const LibraryIndex *index = library->index;
+    // Paths loaded from a store stay in its mapping
+    if (index == NULL || index->mapping == NULL || path < index->mapping ||
+        path >= index->mapping + index->mapping_size)
+    {
+        free(path);
+    }
+}
+
+static void _push_free_slot(Library *library, uint32_t slot)
+{
+    LibraryIndex *index = library->index;
+    if (index->num_free < index->capacity)
+    {
+        index->free_slots[index->num_free++] = slot;
+        return;
+    }
+
+    // Full of slots reused since, start again from the removed ones
+    index->num_free = 0;
+    for (uint32_t i = 0; i < library->num_files; i++)
+    {
+        if (library->files[i] == NULL)
+        {
+            index->free_slots[index->num_free++] = i;
+        }
+    }
+}
+
+/*
+** returns a slot for a new file, -1 on error
+*/
+static int _new_slot(Library *library)
+{
+    LibraryIndex *index = library->index;
+    while (index->num_free > 0)
+    {
+        uint32_t slot = index->free_slots[--index->num_free];
+        if (slot < library->num_files && library->files[slot] == NULL)
+        {
+            return slot;
+        }
+    }
+    if (library->num_files == index->capacity && _grow_index(library) < 0)
+    {
+        return -1;
+    }
+    return library->num_files;
+}
+
+/*
+** Put the file in the empty slot.
+**
+** returns 0 on success, -1 on error
+*/
+static int _fill_slot(Library *library, uint32_t slot, const char *path, const LibraryFileId *id)
+{
+    char *path_copy = strdup(path);
+    if (path_copy == NULL)
+    {
+        perror("library_add_file");
+        return -1;
+    }
+
+    library->files[slot] = path_copy;
+    _index_path(library, slot);
+    _index_id(library, slot, id);
+    library->index->seen[slot] = 1;
+    library->index->num_live++;
+    _log_change(library, slot);
+    if (slot >= library->num_files)
+    {
+        library->num_files = slot + 1;
+    }
+    return 0;
+}
+
+/*
+** Move the file in slot from to the empty slot to.
+*/
+static void _move_file(Library *library, uint32_t from, uint32_t to)
+{
+    LibraryIndex *index = library->index;
+    LibraryFileId id = index->ids[from];
+
+    _unindex_path(library, from);
+    _unindex_id(library, from);
+    library->files[to] = library->files[from];
+    library->files[from] = NULL;
+    _index_path(library, to);
+    _index_id(library, to, &id);
+    index->seen[to] = index->seen[from];
+    index->metadata[to] = index->metadata[from];
+    _log_change(library, from);
+    _log_change(library, to);
+    _push_free_slot(library, from);
+}
+
+/*
+** Give the file in slot a new path, keeping its index.
+**
+** returns 0 on success, -1 on error
+*/
+static int _rename_file(Library *library, uint32_t slot, const char *path)
+{
+    char *path_copy = strdup(path);
+    if (path_copy == NULL)
+    {
+        perror("library_scan_file");
+        return -1;
+    }
+
+    _unindex_path(library, slot);
+    _free_path(library, library->files[slot]);
+    library->files[slot] = path_copy;
+    _index_path(library, slot);
+    library->index->seen[slot] = 1;
+    _log_change(library, slot);
+    return 0;
+}
+
+
+/*
+** Public interface
+** ----------------
+*/
+int library_file_id(const Library *library, const char *path, LibraryFileId *id)
+{
+    char *path_in_lib = _join_path(library->path, path);
+    if (path_in_lib == NULL)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    int result = lstat(path_in_lib, &st);
+    free(path_in_lib);
+    if (result < 0 || !S_ISREG(st.st_mode))
+    {
+        return -1;
+    }
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    return 0;
+}
+
+int library_has_file(const Library *library, uint32_t index)
+{
+    return index < library->num_files && library->files[index] != NULL;
+}
+
+int library_find_file(const Library *library, const char *path)
+{
+    if (library->index == NULL)
+    {
+        return -1;
+    }
+    return (int)library->index->by_path[_path_bucket(library, path)] - 1;
+}
+
+const LibraryMetadata *library_file_metadata(const Library *library, uint32_t index)
+{
+    if (library->index == NULL || !library_has_file(library, index) ||
+        _is_null_id(&library->index->metadata[index].id) ||
+        !_is_same_id(&library->index->metadata[index].id, &library->index->ids[index]))
+    {
+        return NULL;
+    }
+    return &library->index->metadata[index];
+}
+
+const LibraryMetadata *library_find_metadata(const Library *library, const LibraryFileId *id,
+                                             const struct timespec *mtime)
+{
+    int slot = library->index != NULL ? _find_id(library, id) : -1;
+    if (slot < 0)
+    {
+        return NULL;
+    }
+    const LibraryMetadata *metadata = &library->index->metadata[slot];
+    if (!_is_same_id(&metadata->id, id) || metadata->mtime_sec != mtime->tv_sec ||
+        metadata->mtime_nsec != mtime->tv_nsec)
+    {
+        return NULL;
+    }
+    return metadata;
+}
+
+void library_set_metadata(Library *library, uint32_t index, const LibraryMetadata *metadata)
+{
+    if (library_has_file(library, index) && library->index != NULL &&
+        _is_same_id(&metadata->id, &library->index->ids[index]))
+    {
+        library->index->metadata[index] = *metadata;
+    }
+}
+
+int library_id_table(const Library *library, LibraryIdTable *table)
+{
+    const LibraryIndex *index = library->index;
+    if (index == NULL)
+    {
+        return -1;
+    }
+    table->ids = index->ids;
+    table->num_ids = library->num_files;
+    table->by_id = index->by_id;
+    table->table_mask = index->table_mask;
+    return 0;
+}
+
+int library_find_stable_id(const Library *library, const LibraryIdTable *table,
+                           uint64_t stable_id)
+{
+    if (table->by_id == NULL)
+    {
+        return -1;
+    }
+    // Every id with that hash is in the run of buckets starting at its home,
+    // removed files and hard links included: look for one in the library
+    for (uint32_t bucket = (stable_id >> 32) & table->table_mask; table->by_id[bucket] != 0;
+         bucket = (bucket + 1) & table->table_mask)
+    {
+        uint32_t slot = table->by_id[bucket] - 1;
+        if (slot < table->num_ids && library_has_file(library, slot) &&
+            library_stable_id(&table->ids[slot]) == stable_id)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+int library_add_file(Library *library, const char *path, const LibraryFileId *id)
+{
+    if (library->index == NULL && _grow_index(library) < 0)
+    {
+        return -1;
+    }
+
+    int slot = library_find_file(library, path);
+    if (slot >= 0)
+    {
+        _index_id(library, slot, id);
+        library->index->seen[slot] = 1;
+        return slot;
+    }
+
+    // A file removed with the same id is coming back
+    slot = _find_id(library, id);
+    if (slot < 0 || library_has_file(library, slot))
+    {
+        slot = _new_slot(library);
+    }
+    if (slot < 0 || _fill_slot(library, slot, path, id) < 0)
+    {
+        return -1;
+    }
+    return slot;
+}
+
+void library_remove_file(Library *library, uint32_t index)
+{
+    if (!library_has_file(library, index))
+    {
+        return;
+    }
+
+    // The id is kept, in case the file comes back
+    _unindex_path(library, index);
+    _free_path(library, library->files[index]);
+    library->files[index] = NULL;
+    library->index->num_live--;
+    _log_change(library, index);
+    _push_free_slot(library, index);
+
+    // Clients read LIST up to index 0
+    if (index == 0 && library->index->num_live > 0)
+    {
+        uint32_t last = library->num_files - 1;
+        while (library->files[last] == NULL)
+        {
+            last--;
+        }
+        _move_file(library, last, 0);
+    }
+
+    while (library->num_files > 0 && library->files[library->num_files - 1] == NULL)
+    {
+        library->num_files--;
+    }
+}
+
+int library_begin_scan(Library *library)
+{
+    if (library->index == NULL && _grow_index(library) < 0)
+    {
+        return -1;
+    }
+    memset(library->index->seen, 0, library->index->capacity);
+    return 0;
+}
+
+int library_scan_file(Library *library, const char *path, const LibraryFileId *id)
+{
+    int slot = library_find_file(library, path);
+    if (slot >= 0)
+    {
+        _index_id(library, slot, id);
+        library->index->seen[slot] = 1;
+        return 0;
+    }
+
+    // A file of the library not found yet with the same id was moved here
+    slot = _find_id(library, id);
+    if (slot >= 0 && library_has_file(library, slot) && !library->index->seen[slot])
+    {
+        return _rename_file(library, slot, path);
+    }
+    return library_add_file(library, path, id) < 0 ? -1 : 0;
+}
+
+void library_end_scan(Library *library)
+{
+    // From the last file, so that a file moved to index 0 was already seen
+    for (uint32_t i = library->num_files; i-- > 0;)
+    {
+        if (library->files[i] != NULL && !library->index->seen[i])
+        {
+            library_remove_file(library, i);
+        }
+    }
+}
+
+int library_adopt_files(Library *library, char **files, const LibraryFileId *ids,
+                        uint32_t num_slots, const char *mapping, size_t mapping_size)
+{
+    library->files = files;
+    library->num_files = num_slots;
+    if (_grow_index(library) < 0)
+    {
+        library->files = NULL;
+        library->num_files = 0;
+        free(files);
+        return -1;
+    }
+    LibraryIndex *index = library->index;
+    index->mapping = mapping;
+    index->mapping_size = mapping_size;
+    for (uint32_t slot = 0; slot < num_slots; slot++)
+    {
+        if (library->files[slot] != NULL)
+        {
+            _index_id(library, slot, &ids[slot]);
+        }
+    }
+
+    // A path found twice was only indexed once
+    uint32_t num_paths = 0;
+    for (uint32_t bucket = 0; bucket <= index->table_mask; bucket++)
+    {
+        num_paths += index->by_path[bucket] != 0;
+    }
+    // Index 0 is used and there are no free slots at the end, see as_library.h
+    if (num_paths != index->num_live ||
+        (num_slots > 0 && (library->files[0] == NULL || library->files[num_slots - 1] == NULL)))
+    {
+        ERR_PRINT("library_adopt_files: not the files of a library\n");
+        index->mapping = NULL;
+        free(library->files);
+        free(index->metadata);
+        free(library->index);
+        library->files = NULL;
+        library->index = NULL;
+        library->num_files = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int _compare_paths(const void *a, const void *b, void *files)
+{
+    return strcmp(((char **)files)[*(const uint32_t *)a], ((char **)files)[*(const uint32_t *)b]);
+}
+
+const uint32_t *library_sorted_files(const Library *library, uint32_t *num_sorted)
+{
+    static const uint32_t no_files[1];
+    LibraryIndex *index = library->index;
+    if (index == NULL)
+    {
+        // Only libraries that never had files have no index on the server
+        *num_sorted = 0;
+        return library->num_files == 0 ? no_files : NULL;
+    }
+    if (index->sorted != NULL && index->sorted_generation == index->generation)
+    {
+        *num_sorted = index->num_sorted;
+        return index->sorted;
+    }
+
+    uint32_t *sorted = malloc((index->num_live + 1) * sizeof(uint32_t));
+    if (sorted == NULL)
+    {
+        perror("library_sorted_files");
+        return NULL;
+    }
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < library->num_files; i++)
+    {
+        if (library->files[i] != NULL)
+        {
+            sorted[count++] = i;
+        }
+    }
+    // Scans add the files of each directory in order, so this is mostly sorted
+    qsort_r(sorted, count, sizeof(uint32_t), _compare_paths, library->files);
+
+    free(index->sorted);
+    index->sorted = sorted;
+    index->num_sorted = count;
+    index->sorted_generation = index->generation;
+    *num_sorted = count;
+    return sorted;
+}
+
+uint32_t library_lower_bound(const Library *library, const uint32_t *sorted,
+                             uint32_t num_sorted, const char *path)
+{
+    uint32_t low = 0;
+    uint32_t high = num_sorted;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (strcmp(library->files[sorted[middle]], path) < 0)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void library_new_epoch(Library *library)
+{
+    if (library->index != NULL)
+    {
+        library->index->log.epoch = _random_epoch();
+    }
+}
+
+static int _compare_slots(const void *a, const void *b)
+{
+    uint32_t slot1 = *(const uint32_t *)a;
+    uint32_t slot2 = *(const uint32_t *)b;
+    return (slot1 > slot2) - (slot1 < slot2);
+}
+
+int library_changed_slots(const LibraryChangeLog *log, uint64_t generation, uint64_t since,
+                          uint32_t **slots)
+{
+    if (since < log->start || since > generation)
+    {
+        return -1;
+    }
+
+    // The changes after since are the last ones of the ring
+    uint32_t num_changed = 0;
+    while (num_changed < log->num_changes &&
+           log->changes[(log->first + log->num_changes - num_changed - 1) %
+                        LIBRARY_CHANGE_LOG_SIZE].generation > since)
+    {
+        num_changed++;
+    }
+    *slots = malloc((num_changed > 0 ? num_changed : 1) * sizeof(uint32_t));
+    if (*slots == NULL)
+    {
+        perror("library_changed_slots");
+        return -1;
+    }
+    for (uint32_t i = 0; i < num_changed; i++)
+    {
+        uint32_t change = (log->first + log->num_changes - num_changed + i) % LIBRARY_CHANGE_LOG_SIZE;
+        (*slots)[i] = log->changes[change].slot;
+    }
+
+    // A slot changed several times is sent once
+    qsort(*slots, num_changed, sizeof(uint32_t), _compare_slots);
+    uint32_t num_slots = 0;
+    for (uint32_t i = 0; i < num_changed; i++)
+    {
+        if (num_slots == 0 || (*slots)[num_slots - 1] != (*slots)[i])
+        {
+            (*slots)[num_slots++] = (*slots)[i];
+        }
+    }
+    return num_slots;
+}
+
+void library_free(Library *library)
+{
+    if (library->index != NULL)
+    {
+        for (uint32_t i = 0; i < library->num_files; i++)
+        {
+            _free_path(library, library->files[i]);
+            library->files[i] = NULL;
+        }
+        if (library->index->mapping != NULL)
+        {
+            munmap((void *)library->index->mapping, library->index->mapping_size);
+        }
+        if (library->index->list_fd != -1)
+        {
+            close(library->index->list_fd);
+        }
+        free(library->index->sorted);
+        free(library->index->log.changes);
+        free(library->index->metadata);
+        library_search_free(library->index->search);
+    }
+    _free_library(library);
+}
@@ -0,0 +1,280 @@
+#ifndef AS_LIBRARY_H_
+#define AS_LIBRARY_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+** Constants
+** ---------
+*/
+// Slots allocated for the first files, doubled whenever they run out
+#define LIBRARY_INDEX_MIN_CAPACITY 64
+
+// Changes remembered for LIST_DELTA requests, the oldest are forgotten first
+#define LIBRARY_CHANGE_LOG_SIZE 4096
+
+
+/*
+** Design
+** ------
+** The server's Library is indexed, so that files can be found by path or by
+** file id (device and inode number) in constant time, and so that changes
+** to the library only touch the files that changed:
+**
+**   - library->files[i] is the path of the file with index i, the index
+**     clients send in STREAM requests. A removed file leaves a NULL slot
+**     behind instead of shifting the files after it, so every other file
+**     keeps its index. New files reuse removed slots before growing the
+**     library.
+**   - a removed slot remembers the id of its file. A file coming back with
+**     that id (a file renamed or moved within the library, seen as removed
+**     then added) gets its old index back.
+**   - index 0 is always used while the library has files, since clients
+**     read LIST up to the file with index 0: removing it moves the file with
+**     the highest index there.
+**   - scans of the whole directory (see library_begin_scan) are merged
+**     into the index: files that were already there keep their index,
+**     renamed ones are recognized by their id, and only the files that
+**     weren't found are removed.
+**
+** Paths are only stored in library->files. The two hash tables (by path and
+** by id) are open addressed and hold slot numbers, they live in the same
+** heap block as the per slot ids, so _free_library releases the whole index
+** with a single free.
+**
+** The stable id of a file is a 64-bit mix of its device and inode numbers,
+** never 0, for clients to name a file with in STREAM_ID requests: unlike its
+** index, it is the same in every process and survives restarts of the
+** server, and unlike its path, renames. The table by id is hashed on the
+** stable id, so it finds files by stable id too (see library_find_stable_id).
+**
+** The metadata of every file (see as_metadata.h) is read by the scans, and
+** cached in its slot: later scans only read the files whose id or
+** modification time changed since.
+**
+** A library loaded from a store (see as_store.h) keeps the paths where they
+** are in the store's mapping, only the paths of files added since are
+** allocated. Free it with library_free, which knows the difference.
+**
+** The index also caches the LIST response of the library (see
+** prepare_list_response) and the indices of its files sorted by path (see
+** library_sorted_files), rebuilt when the generation of the library moved
+** on. Every LIST of a generation is sent from the same memfd.
+**
+** Every change to library->files bumps its generation and logs the slot it
+** touched, in a ring of the last LIBRARY_CHANGE_LOG_SIZE changes, so that a
+** client that knows the library of a generation only gets the slots changed
+** since (see prepare_list_delta_response). Generations only mean something
+** within an epoch, picked at random for every library and every process
+** that watches its own copy of it.
+*/
+
+// What identifies a file whatever its path
+typedef struct library_file_id {
+    dev_t dev;
+    ino_t ino;
+} LibraryFileId;
+
+// What the headers of an audio file say about it (see as_metadata.h), with
+// the id and the modification time of the file they were read from: they
+// are only reused for a file with the same id and time
+typedef struct library_metadata {
+    LibraryFileId id;         // 0 if never read
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t codec;           // see as_metadata.h
+    uint64_t duration_ms;     // 0 if unknown
+    uint32_t sample_rate;     // Hz
+    uint32_t bitrate;         // bits per second, on average
+    uint16_t channels;
+    uint16_t bits_per_sample; // 0 if the codec has none
+    uint32_t reserved;
+    uint64_t data_offset;     // of the first frame
+    uint64_t data_size;       // bytes of frames from there, 0 if the file can't be seeked in
+} LibraryMetadata;
+
+// The ids of the files of a library and their hash table, as LibraryIndex
+// holds them, or as a snapshot of it does (see as_snapshot.h)
+typedef struct library_id_table {
+    const LibraryFileId *ids; // of the file in each slot
+    uint32_t num_ids;
+    const uint32_t *by_id;    // slot + 1 of each id, 0 for an empty bucket, or NULL
+    uint32_t table_mask;
+} LibraryIdTable;
+
+typedef struct library_change {
+    uint64_t generation;      // of the library after the change
+    uint32_t slot;            // whose file was added, removed, moved or renamed
+} LibraryChange;
+
+typedef struct library_change_log {
+    uint64_t epoch;           // never 0, generations of other epochs are unrelated
+    uint64_t start;           // every change after this generation is logged
+    uint32_t first;           // oldest change in changes
+    uint32_t num_changes;
+    LibraryChange *changes;   // ring of LIBRARY_CHANGE_LOG_SIZE changes, or NULL
+} LibraryChangeLog;
+
+typedef struct library_index {
+    uint32_t capacity;        // slots allocated in library->files and ids
+    uint32_t table_mask;      // buckets in each hash table - 1
+    uint32_t num_live;        // files in the library, NULL slots excluded
+    uint32_t num_free;        // entries of free_slots
+    uint32_t *free_slots;     // removed slots to reuse, may be stale
+    LibraryFileId *ids;       // id of the file in each slot, kept when removed
+    uint8_t *seen;            // files found by the scan in progress
+    uint32_t *by_path;        // slot + 1 of each path, 0 for an empty bucket
+    uint32_t *by_id;          // slot + 1 of each id, 0 for an empty bucket
+    uint64_t generation;      // bumped by every change to library->files
+    const char *mapping;      // store the library was loaded from, or NULL
+    size_t mapping_size;
+    int list_fd;              // memfd with the LIST response, or -1
+    off_t list_size;
+    uint64_t list_generation; // of the library when list_fd was written
+    uint32_t *sorted;         // indices of the files by path, or NULL
+    uint32_t num_sorted;
+    uint64_t sorted_generation;
+    LibraryChangeLog log;
+    struct library_search_index *search; // see as_search.h, or NULL
+    LibraryMetadata *metadata; // read from the file in each slot, kept when removed
+} LibraryIndex;
+
+
+/*
+** Get the id of the file path (relative to the library).
+**
+** returns 0 on success, -1 if it is not a regular file or can't be found
+*/
+int library_file_id(const Library *library, const char *path, LibraryFileId *id);
+
+/*
+** return 1 if index is the index of a file of the library, 0 otherwise
+*/
+int library_has_file(const Library *library, uint32_t index);
+
+/*
+** returns the index of the file at path, -1 if there is none
+*/
+int library_find_file(const Library *library, const char *path);
+
+/*
+** returns the stable id of the file with id id (see the Design section)
+*/
+uint64_t library_stable_id(const LibraryFileId *id);
+
+/*
+** Get the ids of the files of the indexed library and their hash table.
+**
+** returns 0 on success, -1 if the library has no index
+*/
+int library_id_table(const Library *library, LibraryIdTable *table);
+
+/*
+** returns the index of the file of library whose stable id is stable_id,
+** looked up in table (the ids of library, see library_id_table), -1 if there
+** is none
+*/
+int library_find_stable_id(const Library *library, const LibraryIdTable *table,
+                           uint64_t stable_id);
+
+/*
+** returns the metadata of the file with the given index, NULL if it has none
+*/
+const LibraryMetadata *library_file_metadata(const Library *library, uint32_t index);
+
+/*
+** returns the metadata cached for the file with id id (in the library or
+** removed from it), if it was modified at mtime, NULL otherwise
+*/
+const LibraryMetadata *library_find_metadata(const Library *library, const LibraryFileId *id,
+                                             const struct timespec *mtime);
+
+/*
+** Cache metadata for the file with the given index, unless it was read from
+** another file.
+*/
+void library_set_metadata(Library *library, uint32_t index, const LibraryMetadata *metadata);
+
+/*
+** Add the file at path with the given id to the library. A file already at
+** path keeps its index (with the new id), a file removed with the same id
+** gets its old index back.
+**
+** returns the index of the file, -1 on error
+*/
+int library_add_file(Library *library, const char *path, const LibraryFileId *id);
+
+/*
+** Remove the file with the given index from the library. Only the file that
+** was moved to index 0 in its place, if any, changes index.
+*/
+void library_remove_file(Library *library, uint32_t index);
+
+/*
+** Merge a scan of the whole library directory: call library_begin_scan,
+** library_scan_file for every file found, then library_end_scan to remove
+** the files that weren't. Files moved since the last scan keep their index.
+**
+** library_begin_scan and library_scan_file return 0 on success, -1 on error.
+*/
+int library_begin_scan(Library *library);
+int library_scan_file(Library *library, const char *path, const LibraryFileId *id);
+void library_end_scan(Library *library);
+
+/*
+** Make files (an array of num_slots paths, NULL for a free slot) the files
+** of the empty library, with ids[i] the id of files[i]. The paths inside
+** mapping (mapping_size bytes, unmapped by library_free) are not copied.
+**
+** returns 0 on success, -1 if the files can't be the files of a library
+** (e.g. the same path twice) or on error. The library is left empty then,
+** and the mapping is not unmapped.
+*/
+int library_adopt_files(Library *library, char **files, const LibraryFileId *ids,
+                        uint32_t num_slots, const char *mapping, size_t mapping_size);
+
+/*
+** returns the indices of the files of the indexed library sorted by path
+** (*num_sorted of them), kept by the library until it changes, NULL on error
+** or if the library has files but no index
+*/
+const uint32_t *library_sorted_files(const Library *library, uint32_t *num_sorted);
+
+/*
+** returns the position in sorted (num_sorted indices of files of library
+** sorted by path) of the first file whose path is not before path,
+** num_sorted if there is none
+*/
+uint32_t library_lower_bound(const Library *library, const uint32_t *sorted,
+                             uint32_t num_sorted, const char *path);
+
+/*
+** Start a new epoch of the indexed library, for a process that changes its
+** own copy of it (see library_watch_start).
+*/
+void library_new_epoch(Library *library);
+
+/*
+** Get the slots changed in log after generation since, up to generation (the
+** library's), in increasing order, in *slots (to be freed).
+**
+** returns the number of slots, -1 if log doesn't go back that far (or on
+** error): the client has to get the whole library again
+*/
+int library_changed_slots(const LibraryChangeLog *log, uint64_t generation, uint64_t since,
+                          uint32_t **slots);
+
+/*
+** Free everything held by the server's library, see _free_library.
+*/
+void library_free(Library *library);
+
+#endif // AS_LIBRARY_H_
@@ -0,0 +1,1394 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_metadata.h"
+
+// A file being read, with its first bytes
+typedef struct metadata_file {
+    int fd;
+    uint64_t size;
+    uint8_t *head;             // the first head_len bytes of the file
+    size_t head_len;
+} MetadataFile;
+
+
+/*
+** Reading
+** -------
+*/
+static inline uint16_t _le16(const uint8_t *p)
+{
+    return p[0] | (uint16_t)p[1] << 8;
+}
+
+static inline uint32_t _le32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t _le64(const uint8_t *p)
+{
+    return _le32(p) | (uint64_t)_le32(p + 4) << 32;
+}
+
+static inline uint16_t _be16(const uint8_t *p)
+{
+    return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t _be32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t _be64(const uint8_t *p)
+{
+    return (uint64_t)_be32(p) << 32 | _be32(p + 4);
+}
+
+/*
+** returns units (per_second of them in a second) in milliseconds, 0 if
+** per_second is 0
+*/
+static uint64_t _to_ms(uint64_t units, uint64_t per_second)
+{
+    if (per_second == 0)
+    {
+        return 0;
+    }
+    return units / per_second * 1000 + units % per_second * 1000 / per_second;
+}
+
+static uint32_t _clamp32(uint64_t value)
+{
+    return value > UINT32_MAX ? UINT32_MAX : value;
+}
+
+/*
+** Read len bytes of file at offset into buf, from its head if they are in it.
+**
+** returns the number of bytes read, less than len at the end of the file or
+** on error
+*/
+static size_t _read_at(const MetadataFile *file, void *buf, size_t len, uint64_t offset)
+{
+    if (offset + len <= file->head_len)
+    {
+        memcpy(buf, file->head + offset, len);
+        return len;
+    }
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t num = pread(file->fd, (char *)buf + done, len - done, offset + done);
+        if (num < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (num <= 0)
+        {
+            break;
+        }
+        done += num;
+    }
+    return done;
+}
+
+/*
+** returns the bytes taken by the ID3v2 tag at the start of head (len bytes),
+** 0 if there is none
+*/
+static uint64_t _id3v2_size(const uint8_t *head, size_t len)
+{
+    if (len < 10 || memcmp(head, "ID3", 3) != 0 || head[3] == 0xFF || head[4] == 0xFF ||
+        ((head[6] | head[7] | head[8] | head[9]) & 0x80))
+    {
+        return 0;
+    }
+    // A "synchsafe" integer, 7 bits per byte, without the header or footer
+    uint64_t size = (uint64_t)head[6] << 21 | head[7] << 14 | head[8] << 7 | head[9];
+    return 10 + size + ((head[5] & 0x10) ? 10 : 0);
+}
+
+
+/*
+** Containers
+** ----------
+*/
+static void _read_wav(const MetadataFile *file, LibraryMetadata *metadata)
+{
+    uint16_t format = 0;
+    uint32_t byte_rate = 0;
+    uint64_t offset = 12;
+    for (int i = 0; i < METADATA_MAX_CHUNKS && offset + 8 <= file->size; i++)
+    {
+        uint8_t chunk[8];
+        if (_read_at(file, chunk, sizeof(chunk), offset) < sizeof(chunk))
+        {
+            return;
+        }
+        uint64_t size = _le32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16)
+        {
+            uint8_t fmt[40];
+            size_t len = size < sizeof(fmt) ? size : sizeof(fmt);
+            if (_read_at(file, fmt, len, offset + 8) < len)
+            {
+                return;
+            }
+            format = _le16(fmt);
+            // WAVE_FORMAT_EXTENSIBLE, the real format starts its sub format
+            if (format == 0xFFFE && len >= 26)
+            {
+                format = _le16(fmt + 24);
+            }
+            metadata->channels = _le16(fmt + 2);
+            metadata->sample_rate = _le32(fmt + 4);
+            byte_rate = _le32(fmt + 8);
+            metadata->bits_per_sample = _le16(fmt + 14);
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            // Files still being written may not know the size of their data
+            uint64_t data_size = file->size - offset - 8;
+            if (size != 0 && size != UINT32_MAX && size < data_size)
+            {
+                data_size = size;
+            }
+            // PCM, IEEE float, or MP3 in a WAV file
+            metadata->codec = format == 1 || format == 3 ? AUDIO_CODEC_PCM
+                              : format == 0x55           ? AUDIO_CODEC_MP3
+                                                         : AUDIO_CODEC_UNKNOWN;
+            metadata->duration_ms = _to_ms(data_size, byte_rate);
+            metadata->bitrate = _clamp32((uint64_t)byte_rate * 8);
+            if (metadata->codec == AUDIO_CODEC_PCM)
+            {
+                metadata->data_offset = offset + 8;
+                metadata->data_size = data_size;
+            }
+            return;
+        }
+        offset += 8 + size + (size & 1);
+    }
+}
+
+/*
+** Read the 34 bytes of a FLAC STREAMINFO block at info.
+*/
+static void _read_streaminfo(const uint8_t *info, LibraryMetadata *metadata)
+{
+    metadata->codec = AUDIO_CODEC_FLAC;
+    metadata->sample_rate = (uint32_t)info[10] << 12 | info[11] << 4 | info[12] >> 4;
+    metadata->channels = ((info[12] >> 1) & 7) + 1;
+    metadata->bits_per_sample = ((info[12] & 1) << 4 | info[13] >> 4) + 1;
+    uint64_t num_samples = (uint64_t)(info[13] & 0x0F) << 32 | _be32(info + 14);
+    metadata->duration_ms = _to_ms(num_samples, metadata->sample_rate);
+}
+
+/*
+** returns the offset of the first page of the Ogg stream serial after its
+** num_headers header packets (which end a page), 0 if it can't be found
+*/
+static uint64_t _ogg_data_offset(const MetadataFile *file, uint32_t serial, uint32_t num_headers)
+{
+    uint64_t offset = 0;
+    uint32_t num_packets = 0;
+    while (offset < METADATA_MAX_SEEK_HEADER)
+    {
+        uint8_t page[27 + 255];
+        if (_read_at(file, page, 27, offset) < 27 || memcmp(page, "OggS", 4) != 0 ||
+            _read_at(file, page + 27, page[26], offset + 27) < page[26])
+        {
+            return 0;
+        }
+        uint64_t length = 27 + page[26];
+        int serial_matches = _le32(page + 14) == serial;
+        for (int i = 0; i < page[26]; i++)
+        {
+            length += page[27 + i];
+            // A packet ends on every lacing value short of 255
+            num_packets += serial_matches && page[27 + i] < 255;
+        }
+        offset += length;
+        if (num_packets >= num_headers)
+        {
+            return num_packets == num_headers ? offset : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+** returns the granule position of the last page of the Ogg stream serial, 0
+** if it can't be found
+*/
+static uint64_t _last_granule(const MetadataFile *file, uint32_t serial)
+{
+    size_t len = file->size < METADATA_TAIL_SIZE ? file->size : METADATA_TAIL_SIZE;
+    uint8_t *tail = malloc(len);
+    if (tail == NULL || _read_at(file, tail, len, file->size - len) < len)
+    {
+        free(tail);
+        return 0;
+    }
+    uint64_t granule = 0;
+    for (size_t i = len >= 27 ? len - 27 + 1 : 0; i-- > 0;)
+    {
+        // -1 for pages on which no packet ends
+        if (memcmp(tail + i, "OggS", 4) == 0 && _le32(tail + i + 14) == serial &&
+            _le64(tail + i + 6) != UINT64_MAX)
+        {
+            granule = _le64(tail + i + 6);
+            break;
+        }
+    }
+    free(tail);
+    return granule;
+}
+
+static void _read_ogg(const MetadataFile *file, LibraryMetadata *metadata)
+{
+    const uint8_t *page = file->head;
+    if (file->head_len < 27 || file->head_len < 27 + (size_t)page[26])
+    {
+        return;
+    }
+    // The identification header is the first packet of the first page
+    const uint8_t *packet = page + 27 + page[26];
+    size_t len = file->head_len - 27 - page[26];
+    uint32_t serial = _le32(page + 14);
+
+    uint64_t granule_rate;
+    uint64_t pre_skip = 0;
+    uint32_t num_headers;
+    if (len >= 30 && memcmp(packet, "\x01vorbis", 7) == 0)
+    {
+        metadata->codec = AUDIO_CODEC_VORBIS;
+        metadata->channels = packet[11];
+        metadata->sample_rate = _le32(packet + 12);
+        granule_rate = metadata->sample_rate;
+        num_headers = 3;
+    }
+    else if (len >= 19 && memcmp(packet, "OpusHead", 8) == 0)
+    {
+        // Always decoded at 48 kHz, whatever the rate of the input was
+        metadata->codec = AUDIO_CODEC_OPUS;
+        metadata->channels = packet[9];
+        metadata->sample_rate = 48000;
+        pre_skip = _le16(packet + 10);
+        granule_rate = 48000;
+        num_headers = 2;
+    }
+    else if (len >= 51 && memcmp(packet, "\x7F" "FLAC", 5) == 0 &&
+             memcmp(packet + 9, "fLaC", 4) == 0)
+    {
+        _read_streaminfo(packet + 17, metadata);
+        granule_rate = metadata->sample_rate;
+        // 0 if the number of header packets that follow is unknown
+        num_headers = _be16(packet + 7) != 0 ? 1 + _be16(packet + 7) : 0;
+    }
+    else
+    {
+        return;
+    }
+
+    uint64_t granule = _last_granule(file, serial);
+    if (granule > pre_skip)
+    {
+        metadata->duration_ms = _to_ms(granule - pre_skip, granule_rate);
+    }
+    metadata->data_offset = num_headers != 0 ? _ogg_data_offset(file, serial, num_headers) : 0;
+    metadata->data_size = metadata->data_offset != 0 ? file->size - metadata->data_offset : 0;
+}
+
+/*
+** returns the payload of the first box of type at *data (*len bytes), NULL
+** if there is none. Its size is stored in box_len, and *data and *len are
+** moved past it.
+*/
+static const uint8_t *_next_box(const uint8_t **data, size_t *len, const char *type,
+                                size_t *box_len)
+{
+    while (*len >= 8)
+    {
+        uint64_t size = _be32(*data);
+        size_t header = 8;
+        if (size == 1 && *len >= 16)
+        {
+            size = _be64(*data + 8);
+            header = 16;
+        }
+        else if (size == 0)
+        {
+            size = *len;
+        }
+        if (size < header || size > *len)
+        {
+            return NULL;
+        }
+        const uint8_t *box = *data;
+        *data += size;
+        *len -= size;
+        if (memcmp(box + 4, type, 4) == 0)
+        {
+            *box_len = size - header;
+            return box + header;
+        }
+    }
+    return NULL;
+}
+
+static const uint8_t *_find_box(const uint8_t *data, size_t len, const char *type,
+                                size_t *box_len)
+{
+    return data != NULL ? _next_box(&data, &len, type, box_len) : NULL;
+}
+
+/*
+** returns the duration of an mvhd or mdhd box (len bytes at box) in
+** milliseconds, 0 if it is unknown
+*/
+static uint64_t _box_duration_ms(const uint8_t *box, size_t len)
+{
+    if (box != NULL && box[0] == 1 && len >= 32)
+    {
+        uint64_t duration = _be64(box + 24);
+        return duration != UINT64_MAX ? _to_ms(duration, _be32(box + 20)) : 0;
+    }
+    if (box != NULL && box[0] == 0 && len >= 20)
+    {
+        uint32_t duration = _be32(box + 16);
+        return duration != UINT32_MAX ? _to_ms(duration, _be32(box + 12)) : 0;
+    }
+    return 0;
+}
+
+static void _read_moov(const uint8_t *moov, size_t moov_len, LibraryMetadata *metadata)
+{
+    size_t len;
+    const uint8_t *mvhd = _find_box(moov, moov_len, "mvhd", &len);
+    metadata->duration_ms = _box_duration_ms(mvhd, len);
+
+    const uint8_t *trak;
+    size_t trak_len;
+    while ((trak = _next_box(&moov, &moov_len, "trak", &trak_len)) != NULL)
+    {
+        size_t mdia_len;
+        const uint8_t *mdia = _find_box(trak, trak_len, "mdia", &mdia_len);
+        const uint8_t *hdlr = _find_box(mdia, mdia_len, "hdlr", &len);
+        if (hdlr == NULL || len < 12 || memcmp(hdlr + 8, "soun", 4) != 0)
+        {
+            continue;
+        }
+        const uint8_t *mdhd = _find_box(mdia, mdia_len, "mdhd", &len);
+        uint64_t duration_ms = _box_duration_ms(mdhd, len);
+        if (duration_ms != 0)
+        {
+            metadata->duration_ms = duration_ms;
+        }
+
+        const uint8_t *minf = _find_box(mdia, mdia_len, "minf", &len);
+        const uint8_t *stbl = _find_box(minf, len, "stbl", &len);
+        const uint8_t *stsd = _find_box(stbl, len, "stsd", &len);
+        if (stsd == NULL || len < 8 + 36)
+        {
+            return;
+        }
+        // The first sample entry, after the version, flags and count
+        const uint8_t *entry = stsd + 8;
+        static const struct {
+            char format[5];
+            uint32_t codec;
+        } formats[] = {{"mp4a", AUDIO_CODEC_AAC}, {"alac", AUDIO_CODEC_ALAC},
+                       {"fLaC", AUDIO_CODEC_FLAC}, {"Opus", AUDIO_CODEC_OPUS},
+                       {".mp3", AUDIO_CODEC_MP3}};
+        for (int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+        {
+            if (memcmp(entry + 4, formats[i].format, 4) == 0)
+            {
+                metadata->codec = formats[i].codec;
+            }
+        }
+        metadata->channels = _be16(entry + 24);
+        // Only lossless codecs have a sample size, the others say 16
+        if (metadata->codec == AUDIO_CODEC_ALAC || metadata->codec == AUDIO_CODEC_FLAC)
+        {
+            metadata->bits_per_sample = _be16(entry + 26);
+        }
+        // 16.16 fixed point, too small for rates above 65535 Hz, which are
+        // the time scale of the track instead
+        metadata->sample_rate = _be32(entry + 32) >> 16;
+        if (metadata->sample_rate == 0 && mdhd != NULL && mdhd[0] <= 1)
+        {
+            metadata->sample_rate = _be32(mdhd + (mdhd[0] == 1 ? 20 : 12));
+        }
+        return;
+    }
+}
+
+static void _read_mp4(const MetadataFile *file, LibraryMetadata *metadata)
+{
+    uint64_t offset = 0;
+    for (int i = 0; i < METADATA_MAX_CHUNKS && offset + 8 <= file->size; i++)
+    {
+        uint8_t box[16];
+        size_t num = _read_at(file, box, sizeof(box), offset);
+        if (num < 8)
+        {
+            return;
+        }
+        uint64_t size = _be32(box);
+        uint64_t header = 8;
+        if (size == 1 && num == sizeof(box))
+        {
+            size = _be64(box + 8);
+            header = 16;
+        }
+        else if (size == 0)
+        {
+            size = file->size - offset;
+        }
+        if (size < header)
+        {
+            return;
+        }
+        if (memcmp(box + 4, "moov", 4) == 0)
+        {
+            uint64_t len = size - header;
+            if (len > file->size - offset - header)
+            {
+                len = file->size - offset - header;
+            }
+            if (len > METADATA_MAX_MOOV_SIZE)
+            {
+                len = METADATA_MAX_MOOV_SIZE;
+            }
+            uint8_t *moov = malloc(len);
+            if (moov != NULL)
+            {
+                len = _read_at(file, moov, len, offset + header);
+                _read_moov(moov, len, metadata);
+            }
+            free(moov);
+            return;
+        }
+        offset += size;
+    }
+}
+
+typedef struct mp3_frame {
+    uint32_t bitrate;          // bits per second
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t num_samples;
+    uint32_t length;           // bytes, header included
+    uint32_t side_info;        // bytes after the header
+} Mp3Frame;
+
+/*
+** returns 0 if the 4 bytes at header are the header of an MPEG audio layer
+** III frame (stored in frame), -1 otherwise
+*/
+static int _read_mp3_header(const uint8_t *header, Mp3Frame *frame)
+{
+    static const uint16_t bitrates[2][16] = {
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0}};
+    static const uint32_t sample_rates[3] = {44100, 48000, 32000};
+
+    // MPEG 2.5 (0), reserved (1), MPEG 2 (2) or MPEG 1 (3)
+    int version = (header[1] >> 3) & 3;
+    int bitrate_index = header[2] >> 4;
+    int rate_index = (header[2] >> 2) & 3;
+    if (header[0] != 0xFF || (header[1] & 0xE0) != 0xE0 || version == 1 ||
+        ((header[1] >> 1) & 3) != 1 || bitrate_index == 0 || bitrate_index == 15 ||
+        rate_index == 3)
+    {
+        return -1;
+    }
+    int mpeg1 = version == 3;
+    frame->bitrate = bitrates[!mpeg1][bitrate_index] * 1000;
+    frame->sample_rate = sample_rates[rate_index] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+    frame->channels = (header[3] >> 6) == 3 ? 1 : 2;
+    frame->num_samples = mpeg1 ? 1152 : 576;
+    frame->length = (mpeg1 ? 144 : 72) * frame->bitrate / frame->sample_rate +
+                    ((header[2] >> 1) & 1);
+    frame->side_info = mpeg1 ? (frame->channels == 1 ? 17 : 32) : (frame->channels == 1 ? 9 : 17);
+    return 0;
+}
+
+/*
+** returns the position in window (len bytes) of the first frame header
+** followed by another one, or by the end of window, so that a few random
+** bytes aren't taken for a frame (stored in frame), len if there is none
+*/
+static size_t _find_mp3_frame(const uint8_t *window, size_t len, Mp3Frame *frame)
+{
+    for (size_t start = 0; start + 4 <= len; start++)
+    {
+        Mp3Frame next;
+        if (_read_mp3_header(window + start, frame) == 0 &&
+            (start + frame->length + 4 > len ||
+             (_read_mp3_header(window + start + frame->length, &next) == 0 &&
+              next.sample_rate == frame->sample_rate)))
+        {
+            return start;
+        }
+    }
+    return len;
+}
+
+/*
+** returns the offset of the first frame of the FLAC stream at offset, past
+** its metadata blocks, 0 if it can't be found
+*/
+static uint64_t _flac_data_offset(const MetadataFile *file, uint64_t offset)
+{
+    offset += 4;
+    for (int i = 0; i < METADATA_MAX_CHUNKS; i++)
+    {
+        uint8_t block[4];
+        if (_read_at(file, block, sizeof(block), offset) < sizeof(block))
+        {
+            return 0;
+        }
+        offset += sizeof(block) + ((uint32_t)block[1] << 16 | _be16(block + 2));
+        // The last block has the top bit of its type set
+        if (block[0] & 0x80)
+        {
+            return offset < file->size ? offset : 0;
+        }
+    }
+    return 0;
+}
+
+/*
+** Read whatever follows an ID3v2 tag (or nothing) at offset: FLAC or MP3.
+*/
+static void _read_tagged(const MetadataFile *file, uint64_t offset, LibraryMetadata *metadata)
+{
+    uint8_t *window = file->head + offset;
+    size_t window_len = offset < file->head_len ? file->head_len - offset : 0;
+    uint8_t *buffer = NULL;
+    // Past a cover picture, probably
+    if (window_len < METADATA_HEAD_SIZE / 2 && offset + window_len < file->size)
+    {
+        buffer = malloc(METADATA_HEAD_SIZE);
+        if (buffer == NULL)
+        {
+            return;
+        }
+        window = buffer;
+        window_len = _read_at(file, buffer, METADATA_HEAD_SIZE, offset);
+    }
+
+    if (window_len >= 42 && memcmp(window, "fLaC", 4) == 0 && (window[4] & 0x7F) == 0)
+    {
+        _read_streaminfo(window + 8, metadata);
+        metadata->data_offset = _flac_data_offset(file, offset);
+        metadata->data_size = metadata->data_offset != 0 ? file->size - metadata->data_offset : 0;
+        free(buffer);
+        return;
+    }
+
+    Mp3Frame frame;
+    size_t start = _find_mp3_frame(window, window_len, &frame);
+    if (start + 4 > window_len)
+    {
+        free(buffer);
+        return;
+    }
+    metadata->codec = AUDIO_CODEC_MP3;
+    metadata->sample_rate = frame.sample_rate;
+    metadata->channels = frame.channels;
+
+    uint64_t audio_size = file->size - offset - start;
+    uint8_t tag[3];
+    if (audio_size >= 128 && _read_at(file, tag, sizeof(tag), file->size - 128) == sizeof(tag) &&
+        memcmp(tag, "TAG", 3) == 0)
+    {
+        audio_size -= 128;
+    }
+    metadata->data_offset = offset + start;
+    metadata->data_size = audio_size;
+
+    // A Xing (or Info) header in the first frame of VBR files, after the
+    // side information, or a VBRI header 32 bytes after the frame header
+    uint64_t num_frames = 0;
+    const uint8_t *xing = window + start + 4 + frame.side_info;
+    const uint8_t *vbri = window + start + 4 + 32;
+    if (xing + 16 <= window + window_len &&
+        (memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0))
+    {
+        uint32_t flags = _be32(xing + 4);
+        const uint8_t *field = xing + 8;
+        if (flags & 1)
+        {
+            num_frames = _be32(field);
+            field += 4;
+        }
+        if ((flags & 2) && field + 4 <= window + window_len && _be32(field) != 0)
+        {
+            audio_size = _be32(field);
+        }
+    }
+    else if (vbri + 18 <= window + window_len && memcmp(vbri, "VBRI", 4) == 0)
+    {
+        audio_size = _be32(vbri + 10);
+        num_frames = _be32(vbri + 14);
+    }
+
+    if (num_frames > 0)
+    {
+        metadata->duration_ms = _to_ms(num_frames * frame.num_samples, frame.sample_rate);
+        if (metadata->duration_ms > 0)
+        {
+            metadata->bitrate = _clamp32(audio_size * 8000 / metadata->duration_ms);
+        }
+    }
+    else
+    {
+        metadata->bitrate = frame.bitrate;
+        metadata->duration_ms = _to_ms(audio_size * 8, frame.bitrate);
+    }
+    free(buffer);
+}
+
+
+/*
+** Public interface
+** ----------------
+*/
+const char *library_codec_name(uint32_t codec)
+{
+    static const char *names[] = METADATA_CODEC_NAMES;
+    return codec < sizeof(names) / sizeof(names[0]) ? names[codec] : names[AUDIO_CODEC_UNKNOWN];
+}
+
+int library_read_metadata(int dir_fd, const char *path, LibraryMetadata *metadata)
+{
+    memset(metadata, 0, sizeof(LibraryMetadata));
+    int fd = openat(dir_fd, path, O_RDONLY | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    int result = library_read_file_metadata(fd, metadata);
+    close(fd);
+    return result;
+}
+
+int library_read_file_metadata(int fd, LibraryMetadata *metadata)
+{
+    memset(metadata, 0, sizeof(LibraryMetadata));
+    MetadataFile file;
+    file.fd = fd;
+    struct stat st;
+    file.head = malloc(METADATA_HEAD_SIZE);
+    if (file.head == NULL || fstat(file.fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        free(file.head);
+        return -1;
+    }
+    file.size = st.st_size;
+    file.head_len = 0;
+    file.head_len = _read_at(&file, file.head, METADATA_HEAD_SIZE, 0);
+
+    const uint8_t *head = file.head;
+    if (file.head_len >= 12 && memcmp(head, "RIFF", 4) == 0 && memcmp(head + 8, "WAVE", 4) == 0)
+    {
+        _read_wav(&file, metadata);
+    }
+    else if (file.head_len >= 4 && memcmp(head, "OggS", 4) == 0)
+    {
+        _read_ogg(&file, metadata);
+    }
+    else if (file.head_len >= 8 && memcmp(head + 4, "ftyp", 4) == 0)
+    {
+        _read_mp4(&file, metadata);
+    }
+    else
+    {
+        _read_tagged(&file, _id3v2_size(head, file.head_len), metadata);
+    }
+    free(file.head);
+
+    // The average of compressed files, headers and tags included
+    if (metadata->bitrate == 0 && metadata->duration_ms > 0)
+    {
+        metadata->bitrate = _clamp32(file.size * 8000 / metadata->duration_ms);
+    }
+    metadata->id.dev = st.st_dev;
+    metadata->id.ino = st.st_ino;
+    metadata->mtime_sec = st.st_mtim.tv_sec;
+    metadata->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+** Scans
+** -----
+*/
+typedef struct metadata_scan {
+    const Library *library;    // whose metadata is reused
+    LibraryScan *scan;
+    int dir_fd;                // the library
+    int next;                  // first file not handed to a thread yet
+} MetadataScan;
+
+static void *_run_metadata_worker(void *arg)
+{
+    MetadataScan *metadata_scan = arg;
+    LibraryScan *scan = metadata_scan->scan;
+    int first;
+    while ((first = __atomic_fetch_add(&metadata_scan->next, METADATA_SCAN_BATCH,
+                                       __ATOMIC_RELAXED)) < scan->num_files)
+    {
+        int end = first + METADATA_SCAN_BATCH < scan->num_files ? first + METADATA_SCAN_BATCH
+                                                                : scan->num_files;
+        for (int i = first; i < end; i++)
+        {
+            LibraryScanEntry *entry = &scan->files[i];
+            struct stat st;
+            // Removed since the directory was read, its metadata can wait
+            if (fstatat(metadata_scan->dir_fd, entry->path, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            {
+                continue;
+            }
+            // Already known by the library, no need to hand it over again
+            if (library_find_metadata(metadata_scan->library, &entry->id, &st.st_mtim) == NULL)
+            {
+                library_read_metadata(metadata_scan->dir_fd, entry->path, &entry->metadata);
+            }
+        }
+    }
+    return NULL;
+}
+
+void library_scan_metadata(const Library *library, LibraryScan *scan, int num_threads)
+{
+    MetadataScan metadata_scan = {library, scan, -1, 0};
+    metadata_scan.dir_fd = open(library->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (metadata_scan.dir_fd == -1)
+    {
+        perror("library_scan_metadata: open");
+        return;
+    }
+
+    // The calling thread is one of them
+    pthread_t threads[num_threads > 1 ? num_threads - 1 : 1];
+    int num_started = 0;
+    for (int i = 1; i < num_threads && (i - 1) * METADATA_SCAN_BATCH < scan->num_files; i++)
+    {
+        int error = pthread_create(&threads[num_started], NULL, _run_metadata_worker,
+                                   &metadata_scan);
+        if (error != 0)
+        {
+            ERR_PRINT("library_scan_metadata: pthread_create: %s\n", strerror(error));
+            break;
+        }
+        num_started++;
+    }
+    _run_metadata_worker(&metadata_scan);
+    for (int i = 0; i < num_started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    close(metadata_scan.dir_fd);
+}
+
+int library_update_metadata(Library *library, uint32_t index)
+{
+    if (!library_has_file(library, index))
+    {
+        return -1;
+    }
+    char *path = _join_path(library->path, library->files[index]);
+    if (path == NULL)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    LibraryMetadata metadata;
+    int result = -1;
+    if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        // The same file, as a removed slot may still know it
+        LibraryFileId id = {st.st_dev, st.st_ino};
+        const LibraryMetadata *cached = library_find_metadata(library, &id, &st.st_mtim);
+        if (cached != NULL)
+        {
+            metadata = *cached;
+            result = 0;
+        }
+        else
+        {
+            result = library_read_metadata(AT_FDCWD, path, &metadata);
+        }
+    }
+    free(path);
+    if (result == 0)
+    {
+        library_set_metadata(library, index, &metadata);
+    }
+    return result;
+}
+
+/*
+** Seeking
+** -------
+*/
+// A file being seeked in, read with pread only
+typedef struct metadata_seek {
+    MetadataFile file;
+    uint64_t start;            // of the first frame
+    uint64_t end;              // past the last one
+    uint8_t *window;           // METADATA_SYNC_WINDOW bytes read at a time
+    uint32_t serial;           // of the Ogg stream
+    uint32_t block_size;       // samples in the frames of a FLAC file numbered by frame
+} MetadataSeek;
+
+// A FLAC frame, or an Ogg page on which a packet ends
+typedef struct metadata_sync {
+    uint64_t offset;
+    uint64_t length;           // of an Ogg page, 0 for a FLAC frame
+    uint64_t position;         // first sample of a FLAC frame, granule position of an Ogg page
+} MetadataSync;
+
+/*
+** Find the first frame (or page) of seek at or after offset within
+** METADATA_SYNC_WINDOW bytes, into sync.
+**
+** returns 0 on success, -1 if there is none
+*/
+typedef int (*MetadataSyncFunction)(const MetadataSeek *seek, uint64_t offset, MetadataSync *sync);
+
+static inline void _put_le32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static inline void _put_be32(uint8_t *p, uint32_t value)
+{
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+/*
+** returns the number of bytes read from offset into the window of seek, 0
+** past the last frame
+*/
+static size_t _read_window(const MetadataSeek *seek, uint64_t offset)
+{
+    if (offset >= seek->end)
+    {
+        return 0;
+    }
+    uint64_t len = seek->end - offset < METADATA_SYNC_WINDOW ? seek->end - offset
+                                                             : METADATA_SYNC_WINDOW;
+    return _read_at(&seek->file, seek->window, len, offset);
+}
+
+/*
+** returns the first len bytes of file in a buffer to free, NULL on error
+*/
+static uint8_t *_read_header(const MetadataFile *file, size_t len)
+{
+    uint8_t *header = malloc(len);
+    if (header != NULL && _read_at(file, header, len, 0) < len)
+    {
+        free(header);
+        return NULL;
+    }
+    return header;
+}
+
+static uint8_t _crc8(const uint8_t *data, size_t len)
+{
+    uint8_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 0x80 ? (uint8_t)(crc << 1) ^ 0x07 : (uint8_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/*
+** returns the length of the FLAC frame header at header (len bytes, checked
+** against its CRC), 0 if it isn't one. The number of the first sample of
+** the frame is stored in sample, frames numbered by frame have block_size
+** samples.
+*/
+static size_t _read_flac_frame_header(const uint8_t *header, size_t len, uint32_t block_size,
+                                      uint64_t *sample)
+{
+    if (len < 6 || header[0] != 0xFF || (header[1] & 0xFE) != 0xF8 || (header[2] >> 4) == 0 ||
+        (header[2] & 0x0F) == 0x0F || (header[3] >> 4) > 10 || ((header[3] >> 1) & 7) == 3 ||
+        (header[3] & 1))
+    {
+        return 0;
+    }
+
+    // The frame or sample number, coded like UTF-8 (up to 36 bits)
+    size_t pos = 4;
+    int num_ones = 0;
+    while (num_ones < 8 && (header[pos] & (0x80 >> num_ones)))
+    {
+        num_ones++;
+    }
+    if (num_ones == 1 || num_ones == 8)
+    {
+        return 0;
+    }
+    int num_extra = num_ones > 0 ? num_ones - 1 : 0;
+    uint64_t number = header[pos] & (num_ones > 0 ? 0x7F >> num_ones : 0x7F);
+    pos++;
+    if (pos + num_extra > len)
+    {
+        return 0;
+    }
+    for (int i = 0; i < num_extra; i++, pos++)
+    {
+        if ((header[pos] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+        number = number << 6 | (header[pos] & 0x3F);
+    }
+
+    // Block sizes and sample rates that don't fit in their 4 bits follow
+    int size_code = header[2] >> 4;
+    int rate_code = header[2] & 0x0F;
+    pos += size_code == 6 ? 1 : size_code == 7 ? 2 : 0;
+    pos += rate_code == 12 ? 1 : rate_code == 13 || rate_code == 14 ? 2 : 0;
+    if (pos >= len || _crc8(header, pos) != header[pos])
+    {
+        return 0;
+    }
+    *sample = (header[1] & 1) ? number : number * block_size;
+    return pos + 1;
+}
+
+static int _sync_flac(const MetadataSeek *seek, uint64_t offset, MetadataSync *sync)
+{
+    size_t len = _read_window(seek, offset);
+    int at_end = offset + len == seek->end;
+    for (size_t i = 0; i + 1 < len; i++)
+    {
+        if (seek->window[i] != 0xFF || (seek->window[i + 1] & 0xFE) != 0xF8)
+        {
+            continue;
+        }
+        // The longest header is 16 bytes, found whole in the next window
+        if (i + 16 > len && !at_end)
+        {
+            return -1;
+        }
+        if (_read_flac_frame_header(seek->window + i, len - i, seek->block_size,
+                                    &sync->position) > 0)
+        {
+            sync->offset = offset + i;
+            sync->length = 0;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int _sync_ogg(const MetadataSeek *seek, uint64_t offset, MetadataSync *sync)
+{
+    size_t len = _read_window(seek, offset);
+    for (size_t i = 0; i + 27 <= len; i++)
+    {
+        const uint8_t *page = seek->window + i;
+        if (memcmp(page, "OggS", 4) != 0 || page[4] != 0 || _le32(page + 14) != seek->serial)
+        {
+            continue;
+        }
+        if (i + 27 + page[26] > len)
+        {
+            return -1;
+        }
+        // -1 for pages on which no packet ends
+        if (_le64(page + 6) == UINT64_MAX)
+        {
+            continue;
+        }
+        sync->offset = offset + i;
+        sync->length = 27 + page[26];
+        for (int j = 0; j < page[26]; j++)
+        {
+            sync->length += page[27 + j];
+        }
+        sync->position = _le64(page + 6);
+        return 0;
+    }
+    return -1;
+}
+
+/*
+** Find the last frame (or page) of seek whose position is at most target
+** into sync, between the frame at start and end (past which every frame is
+** after target): halve the bytes between them with sync_function until they
+** fit in a window, then walk the few frames left.
+**
+** returns 0 on success, -1 if the frame at start is after target already
+*/
+static int _bisect(const MetadataSeek *seek, MetadataSyncFunction sync_function, uint64_t target,
+                   uint64_t start, uint64_t end, MetadataSync *sync)
+{
+    if (sync_function(seek, start, sync) < 0 || sync->position > target)
+    {
+        return -1;
+    }
+    for (int i = 0; i < METADATA_MAX_SEEK_STEPS && end - sync->offset > METADATA_SYNC_WINDOW; i++)
+    {
+        uint64_t middle = sync->offset + (end - sync->offset) / 2;
+        MetadataSync found;
+        if (sync_function(seek, middle, &found) == 0 && found.position <= target)
+        {
+            *sync = found;
+        }
+        else
+        {
+            end = middle;
+        }
+    }
+    MetadataSync next;
+    while (sync_function(seek, sync->offset + 1, &next) == 0 && next.position <= target)
+    {
+        *sync = next;
+    }
+    return 0;
+}
+
+/*
+** Seek to the block of every channel at position_ms in the data chunk of a
+** WAV file, after the headers of the file with the sizes of what is left.
+**
+** returns 0 on success, -1 if it can't be seeked in
+*/
+static int _seek_wav(MetadataSeek *seek, const LibraryMetadata *metadata, uint64_t position_ms,
+                     LibrarySeek *result)
+{
+    uint64_t block_align = (uint64_t)metadata->channels * ((metadata->bits_per_sample + 7) / 8);
+    if (block_align == 0 || metadata->sample_rate == 0 || seek->start < 8 ||
+        seek->start > METADATA_MAX_SEEK_HEADER)
+    {
+        return -1;
+    }
+    uint8_t *header = _read_header(&seek->file, seek->start);
+    if (header == NULL || memcmp(header + seek->start - 8, "data", 4) != 0)
+    {
+        free(header);
+        return -1;
+    }
+
+    uint64_t block = position_ms * metadata->sample_rate / 1000;
+    uint64_t num_blocks = (seek->end - seek->start) / block_align;
+    if (block > num_blocks)
+    {
+        block = num_blocks;
+    }
+    result->offset = seek->start + block * block_align;
+    result->position_ms = _to_ms(block, metadata->sample_rate);
+
+    uint64_t data_size = seek->end - result->offset;
+    _put_le32(header + 4, _clamp32(seek->start - 8 + data_size));
+    _put_le32(header + seek->start - 4, _clamp32(data_size));
+    result->header = header;
+    result->header_len = seek->start;
+    return 0;
+}
+
+/*
+** Seek to the last frame starting at or before position_ms in the FLAC
+** stream at stream: between the points of its SEEKTABLE around it if it has
+** one, of the whole file otherwise. The stream is sent with only its
+** STREAMINFO block, which counts the samples left.
+**
+** returns 0 on success, -1 if it can't be seeked in
+*/
+static int _seek_flac(MetadataSeek *seek, const LibraryMetadata *metadata, uint64_t stream,
+                      uint64_t position_ms, LibrarySeek *result)
+{
+    uint8_t *header = malloc(42);
+    if (header == NULL || _read_at(&seek->file, header, 42, stream) < 42 ||
+        memcmp(header, "fLaC", 4) != 0 || (header[4] & 0x7F) != 0 || metadata->sample_rate == 0)
+    {
+        free(header);
+        return -1;
+    }
+    uint8_t *info = header + 8;
+    seek->block_size = _be16(info);
+    uint64_t target = position_ms * metadata->sample_rate / 1000;
+
+    // The seek points around target, if any
+    uint64_t start = seek->start;
+    uint64_t end = seek->end;
+    uint64_t offset = stream + 4;
+    for (int i = 0; i < METADATA_MAX_CHUNKS && offset < seek->start; i++)
+    {
+        uint8_t block[4];
+        if (_read_at(&seek->file, block, sizeof(block), offset) < sizeof(block))
+        {
+            break;
+        }
+        uint32_t len = (uint32_t)block[1] << 16 | _be16(block + 2);
+        uint8_t *table = (block[0] & 0x7F) == 3 ? malloc(len) : NULL;
+        if (table != NULL && _read_at(&seek->file, table, len, offset + 4) == len)
+        {
+            // Sample number, offset from the first frame and samples of each
+            // point, placeholders last with a sample number of -1
+            for (uint32_t point = 0; point + 18 <= len; point += 18)
+            {
+                uint64_t sample = _be64(table + point);
+                uint64_t point_offset = seek->start + _be64(table + point + 8);
+                if (sample == UINT64_MAX || point_offset >= seek->end)
+                {
+                    break;
+                }
+                if (sample <= target && point_offset > start)
+                {
+                    start = point_offset;
+                }
+                else if (sample > target && point_offset < end)
+                {
+                    end = point_offset;
+                    break;
+                }
+            }
+        }
+        free(table);
+        offset += sizeof(block) + len;
+        if (block[0] & 0x80)
+        {
+            break;
+        }
+    }
+
+    MetadataSync sync;
+    if (_bisect(seek, _sync_flac, target, start, end, &sync) < 0 &&
+        (start == seek->start || _bisect(seek, _sync_flac, target, seek->start, end, &sync) < 0))
+    {
+        free(header);
+        return -1;
+    }
+    result->offset = sync.offset;
+    result->position_ms = _to_ms(sync.position, metadata->sample_rate);
+
+    // The only metadata block, with the samples left and without the MD5
+    // signature of the whole stream
+    uint64_t num_samples = (uint64_t)(info[13] & 0x0F) << 32 | _be32(info + 14);
+    num_samples = num_samples > sync.position ? num_samples - sync.position : 0;
+    header[4] = 0x80;
+    info[13] = (info[13] & 0xF0) | (num_samples >> 32 & 0x0F);
+    _put_be32(info + 14, num_samples);
+    memset(info + 18, 0, 16);
+    result->header = header;
+    result->header_len = 42;
+    return 0;
+}
+
+/*
+** Seek to the page after the last one of the first stream of an Ogg file
+** ending at or before position_ms, after the pages of its headers.
+**
+** returns 0 on success, -1 if it can't be seeked in
+*/
+static int _seek_ogg(MetadataSeek *seek, const LibraryMetadata *metadata, uint64_t position_ms,
+                     LibrarySeek *result)
+{
+    if (seek->start > METADATA_MAX_SEEK_HEADER)
+    {
+        return -1;
+    }
+    uint8_t *header = _read_header(&seek->file, seek->start);
+    if (header == NULL || seek->start < 27 || seek->start < 27 + (uint64_t)header[26] + 19)
+    {
+        free(header);
+        return -1;
+    }
+    seek->serial = _le32(header + 14);
+
+    // Opus streams start pre_skip samples late
+    const uint8_t *packet = header + 27 + header[26];
+    uint64_t pre_skip = memcmp(packet, "OpusHead", 8) == 0 ? _le16(packet + 10) : 0;
+    uint64_t target = position_ms * metadata->sample_rate / 1000 + pre_skip;
+
+    MetadataSync sync;
+    if (_bisect(seek, _sync_ogg, target, seek->start, seek->end, &sync) == 0)
+    {
+        result->offset = sync.offset + sync.length < seek->end ? sync.offset + sync.length
+                                                                : seek->end;
+        result->position_ms = sync.position > pre_skip
+                                  ? _to_ms(sync.position - pre_skip, metadata->sample_rate)
+                                  : 0;
+    }
+    else
+    {
+        result->offset = seek->start;
+        result->position_ms = 0;
+    }
+    result->header = header;
+    result->header_len = seek->start;
+    return 0;
+}
+
+/*
+** Seek to the last frame starting at or before the share of the frames of an
+** MP3 file that position_ms is of its duration, mapped by the table of
+** contents of its Xing header if it has one. The position of the frame is
+** mapped back the same way.
+*/
+static void _seek_mp3(MetadataSeek *seek, const LibraryMetadata *metadata, uint64_t position_ms,
+                      LibrarySeek *result)
+{
+    double share = metadata->duration_ms > 0 ? (double)position_ms / metadata->duration_ms : 0;
+    share = share < 1 ? share : 1;
+    // 100 offsets, in 256ths of the frames, one for every percent of the
+    // duration
+    uint8_t toc[100];
+    int has_toc = 0;
+    size_t len = _read_window(seek, seek->start);
+    Mp3Frame frame;
+    if (len >= 4 && _read_mp3_header(seek->window, &frame) == 0 &&
+        4 + frame.side_info + 8 <= len)
+    {
+        const uint8_t *xing = seek->window + 4 + frame.side_info;
+        uint32_t flags = _be32(xing + 4);
+        const uint8_t *table = xing + 8 + ((flags & 1) ? 4 : 0) + ((flags & 2) ? 4 : 0);
+        if ((memcmp(xing, "Xing", 4) == 0 || memcmp(xing, "Info", 4) == 0) && (flags & 4) &&
+            table + sizeof(toc) <= seek->window + len)
+        {
+            memcpy(toc, table, sizeof(toc));
+            has_toc = 1;
+        }
+    }
+    if (has_toc)
+    {
+        double percent = share * 100;
+        int i = percent < 99 ? (int)percent : 99;
+        double after = i < 99 ? toc[i + 1] : 256;
+        share = (toc[i] + (after - toc[i]) * (percent - i)) / 256;
+    }
+    uint64_t size = seek->end - seek->start;
+    uint64_t offset = seek->start + (uint64_t)(share * size);
+
+    // The frames before it, from a frame or two back (the longest are 1441
+    // bytes), one after the other
+    uint64_t from = offset - seek->start > 2 * 1441 ? offset - 2 * 1441 : seek->start;
+    len = _read_window(seek, from);
+    size_t at = _find_mp3_frame(seek->window, len, &frame);
+    Mp3Frame next;
+    while (at + frame.length + 4 <= len && from + at + frame.length <= offset &&
+           _read_mp3_header(seek->window + at + frame.length, &next) == 0)
+    {
+        at += frame.length;
+        frame = next;
+    }
+    result->offset = from + at < seek->end ? from + at : seek->end;
+
+    share = (double)(result->offset - seek->start) / size;
+    if (has_toc)
+    {
+        int i = 0;
+        while (i < 99 && toc[i + 1] <= share * 256)
+        {
+            i++;
+        }
+        double after = i < 99 ? toc[i + 1] : 256;
+        double percent = i + (after > toc[i] ? (share * 256 - toc[i]) / (after - toc[i]) : 0);
+        share = percent < 100 ? percent / 100 : 1;
+    }
+    result->position_ms = (uint64_t)(share * metadata->duration_ms);
+}
+
+int library_seek(int fd, const LibraryMetadata *metadata, uint64_t position_ms,
+                 LibrarySeek *result)
+{
+    memset(result, 0, sizeof(LibrarySeek));
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        return -1;
+    }
+    result->end = st.st_size;
+
+    // Metadata read before the file changed, or not at all
+    LibraryMetadata current;
+    if (metadata == NULL || metadata->id.dev != st.st_dev || metadata->id.ino != st.st_ino ||
+        metadata->mtime_sec != st.st_mtim.tv_sec || metadata->mtime_nsec != st.st_mtim.tv_nsec)
+    {
+        if (library_read_file_metadata(fd, &current) < 0)
+        {
+            return -1;
+        }
+        metadata = &current;
+    }
+    result->bitrate = metadata->bitrate;
+    if (metadata->data_size == 0 || metadata->data_offset >= result->end ||
+        metadata->data_size > result->end - metadata->data_offset)
+    {
+        return 0;
+    }
+    // Past the end of the file, or 50 days in
+    if (metadata->duration_ms > 0 && position_ms > metadata->duration_ms)
+    {
+        position_ms = metadata->duration_ms;
+    }
+    position_ms = position_ms < UINT32_MAX ? position_ms : UINT32_MAX;
+
+    MetadataSeek seek = {{fd, st.st_size, NULL, 0}, metadata->data_offset,
+                         metadata->data_offset + metadata->data_size, NULL, 0, 0};
+    seek.window = malloc(METADATA_SYNC_WINDOW);
+    uint8_t head[10];
+    if (seek.window == NULL || _read_at(&seek.file, head, sizeof(head), 0) < sizeof(head))
+    {
+        free(seek.window);
+        return 0;
+    }
+
+    int seeked = -1;
+    if (memcmp(head, "RIFF", 4) == 0)
+    {
+        seeked = _seek_wav(&seek, metadata, position_ms, result);
+    }
+    else if (memcmp(head, "OggS", 4) == 0)
+    {
+        seeked = _seek_ogg(&seek, metadata, position_ms, result);
+    }
+    else if (metadata->codec == AUDIO_CODEC_FLAC)
+    {
+        seeked = _seek_flac(&seek, metadata, _id3v2_size(head, sizeof(head)), position_ms,
+                            result);
+    }
+    else if (metadata->codec == AUDIO_CODEC_MP3)
+    {
+        _seek_mp3(&seek, metadata, position_ms, result);
+        seeked = 0;
+    }
+    free(seek.window);
+
+    // From the start then
+    if (seeked < 0)
+    {
+        memset(result, 0, sizeof(LibrarySeek));
+        result->end = st.st_size;
+        result->bitrate = metadata->bitrate;
+        return 0;
+    }
+    result->end = seek.end;
+    return 0;
+}
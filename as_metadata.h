@@ -0,0 +1,165 @@
+#ifndef AS_METADATA_H_
+#define AS_METADATA_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_library.h"
+#include "as_scan.h"
+
+#include <pthread.h>
+
+/*
+** Constants
+** ---------
+*/
+// Bytes read from the start of a file for its headers, and from the end of
+// an Ogg file for its last page
+#define METADATA_HEAD_SIZE (64 * 1024)
+#define METADATA_TAIL_SIZE (64 * 1024)
+
+// Most bytes of the moov box of an MP4 file read, bigger ones are truncated
+// (the boxes we need come first in all but the oddest files)
+#define METADATA_MAX_MOOV_SIZE (4 * 1024 * 1024)
+
+// Top level boxes of an MP4 file, chunks of a WAV file or metadata blocks of
+// a FLAC file, walked before giving up on the one we are looking for
+#define METADATA_MAX_CHUNKS 64
+
+// Bytes searched for the next frame (or Ogg page) from a position
+#define METADATA_SYNC_WINDOW (64 * 1024)
+
+// Halvings of a FLAC or Ogg file looking for the frame to seek to, plenty
+// for any file
+#define METADATA_MAX_SEEK_STEPS 48
+
+// Most bytes of headers sent before the frames of a seek, and looked through
+// for the end of the headers of an Ogg file
+#define METADATA_MAX_SEEK_HEADER (1024 * 1024)
+
+// Files handed to a thread at once by library_scan_metadata
+#define METADATA_SCAN_BATCH 64
+
+// Codecs of LibraryMetadata, see METADATA_CODEC_NAMES
+#define AUDIO_CODEC_UNKNOWN 0
+#define AUDIO_CODEC_PCM 1
+#define AUDIO_CODEC_FLAC 2
+#define AUDIO_CODEC_MP3 3
+#define AUDIO_CODEC_VORBIS 4
+#define AUDIO_CODEC_OPUS 5
+#define AUDIO_CODEC_AAC 6
+#define AUDIO_CODEC_ALAC 7
+
+#define METADATA_CODEC_NAMES {"unknown", "pcm", "flac", "mp3", "vorbis", "opus", "aac", "alac"}
+
+
+/*
+** Design
+** ------
+** The metadata of a file (codec, duration, sample rate, channels, bitrate) is
+** read from its own headers, recognized by their magic numbers rather than
+** by the extension of the file:
+**
+**   - WAV: the "fmt " chunk (WAVE_FORMAT_EXTENSIBLE too), and the size of
+**     the "data" chunk for the duration,
+**   - FLAC: the STREAMINFO block, after an ID3v2 tag if there is one,
+**   - MP3: the first frame header after the ID3v2 tag, checked against the
+**     frame after it, and its Xing/Info or VBRI header if it has one. A file
+**     without one is assumed to be constant bitrate,
+**   - Ogg: the identification header of the first stream (Vorbis, Opus or
+**     FLAC), and the granule position of its last page for the duration,
+**   - MP4: mvhd, then the mdhd and stsd boxes of the first sound track.
+**
+** Only a few headers are read, at the start of the file (and at its end for
+** Ogg), with pread. A file that isn't recognized still gets metadata, with
+** AUDIO_CODEC_UNKNOWN, so that it isn't read again by every scan.
+**
+** Metadata is cached by the library index (see as_library.h) and its store,
+** keyed by the id and modification time of the file: library_scan_metadata
+** only reads the files that changed since the library was last scanned, on
+** several threads, after the directories were read. Only what it read is
+** merged into the library (or sent to the watching process by a
+** reconciliation, see as_watch.h), a file that didn't change costs a stat.
+**
+** The metadata also says where the frames of a file start and end (the data
+** chunk of a WAV file, the first frame of FLAC and MP3 files, the first page
+** of an Ogg file after its headers), which is all library_seek needs to
+** start a STREAM_AT response on a frame boundary, from the seek tables the
+** file has itself:
+**
+**   - WAV: the block of every channel at the position, exactly,
+**   - FLAC: the points of its SEEKTABLE around the position, then a
+**     bisection between them on the sample numbers of the frame headers
+**     (the whole file without one),
+**   - MP3: the table of contents of its Xing header, the share of the
+**     frames that the position is of the duration without one,
+**   - Ogg: a bisection on the granule positions of its pages.
+**
+** A bisection reads about 20 windows of METADATA_SYNC_WINDOW bytes whatever
+** the size of the file, nothing is walked frame by frame. Decoders get the
+** headers they need first: those of a WAV or Ogg file with the sizes of
+** what is left, or the STREAMINFO block of a FLAC stream. MP4 files (whose
+** sample tables would have to be rewritten) and unknown files are sent whole.
+*/
+
+// Where a STREAM_AT response starts in a file, see library_seek
+typedef struct library_seek {
+    uint64_t position_ms;      // of the first frame sent, as well as is known
+    uint8_t *header;           // sent before the frames, to free, or NULL
+    size_t header_len;
+    uint64_t offset;           // of the first frame sent in the file
+    uint64_t end;              // past the last one
+    uint32_t bitrate;          // of the file, bits per second, 0 if unknown
+} LibrarySeek;
+
+
+/*
+** returns the name of codec, "unknown" if it has none
+*/
+const char *library_codec_name(uint32_t codec);
+
+/*
+** Read the metadata of the file at path, relative to the directory dir_fd
+** (or AT_FDCWD), into metadata.
+**
+** returns 0 on success (even if the file isn't recognized), -1 if it can't
+** be read
+*/
+int library_read_metadata(int dir_fd, const char *path, LibraryMetadata *metadata);
+
+/*
+** Same as library_read_metadata, for the file open as fd (which isn't
+** closed).
+*/
+int library_read_file_metadata(int fd, LibraryMetadata *metadata);
+
+/*
+** Read the metadata of the files of scan (of the directory of library) with
+** num_threads threads, except for the files whose metadata library already
+** caches (with the same id and modification time), which are left without
+** metadata in scan, like the files that can't be read. library keeps the
+** metadata it has when the scan is merged into it.
+*/
+void library_scan_metadata(const Library *library, LibraryScan *scan, int num_threads);
+
+/*
+** Read the metadata of the file with the given index again, unless it is
+** still the same file as when it was last read.
+**
+** returns 0 on success, -1 if it can't be read
+*/
+int library_update_metadata(Library *library, uint32_t index);
+
+/*
+** Find where to start sending the file open as fd for it to play from
+** position_ms on, into seek, from metadata (NULL if there is none, read
+** again if the file changed since). seek starts the whole file from 0 if it
+** can't be seeked in.
+**
+** returns 0 on success, -1 if the file can't be read
+*/
+int library_seek(int fd, const LibraryMetadata *metadata, uint64_t position_ms,
+                 LibrarySeek *seek);
+
+#endif // AS_METADATA_H_
@@ -0,0 +1,314 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_mux.h"
+#include "as_egress.h"
+
+void mux_init(MuxSession *session)
+{
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        session->streams[i].id = 0;
+        session->streams[i].response = (Response)EMPTY_RESPONSE;
+    }
+    session->next = 0;
+    session->current = -1;
+    session->header_sent = 0;
+    session->type = 0;
+    session->payload_left = 0;
+    session->pacing = (Response)EMPTY_RESPONSE;
+}
+
+/*
+** returns the open stream with the given id, a free one if stream_id is 0,
+** NULL if there is none
+*/
+static MuxStream *_find_stream(MuxSession *session, uint32_t stream_id)
+{
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        if (session->streams[i].id == stream_id)
+        {
+            return &session->streams[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+** returns the number of bytes of response that haven't been sent yet
+*/
+static uint64_t _bytes_left(const Response *response)
+{
+    uint64_t left = response->head_len - response->head_sent;
+    if (response->file_fd >= 0)
+    {
+        left += response->file_end - response->file_offset;
+    }
+    return left;
+}
+
+int mux_parse_frame(MuxSession *session, const uint8_t *buf, int bytes_in_buf,
+                    uint32_t *stream_id, Request *request)
+{
+    *stream_id = 0;
+    if (bytes_in_buf < MUX_HEADER_SIZE)
+    {
+        return 0;
+    }
+
+    uint32_t id;
+    uint8_t type;
+    uint32_t length;
+    mux_unpack_header(buf, &id, &type, &length);
+    if (length > MUX_MAX_REQUEST_SIZE)
+    {
+        ERR_PRINT("mux_parse_frame: frame of %u bytes\n", length);
+        return -1;
+    }
+    if (bytes_in_buf < MUX_HEADER_SIZE + length)
+    {
+        return 0;
+    }
+    const uint8_t *payload = buf + MUX_HEADER_SIZE;
+
+    // Id 0 would find a free stream
+    MuxStream *stream = id != 0 ? _find_stream(session, id) : NULL;
+    switch (type)
+    {
+    case MUX_FRAME_REQUEST:
+        if (id == 0 || stream != NULL || _find_stream(session, 0) == NULL)
+        {
+            ERR_PRINT("mux_parse_frame: can't open stream %u\n", id);
+            return -1;
+        }
+        // The payload is the whole request, nothing more
+        if (parse_request(payload, length, request) != length ||
+            request->type == REQUEST_TYPE_MUX)
+        {
+            request->type = REQUEST_TYPE_UNKNOWN;
+        }
+        *stream_id = id;
+        break;
+    case MUX_FRAME_WINDOW:
+    {
+        if (length != sizeof(uint32_t))
+        {
+            ERR_PRINT("mux_parse_frame: WINDOW frame of %u bytes\n", length);
+            return -1;
+        }
+        // The stream may have been closed since the client sent it
+        uint32_t net_increment;
+        memcpy(&net_increment, payload, sizeof(net_increment));
+        uint32_t increment = ntohl(net_increment);
+        if (stream != NULL)
+        {
+            stream->window = increment > UINT32_MAX - stream->window ? UINT32_MAX
+                                                                     : stream->window + increment;
+        }
+        break;
+    }
+    case MUX_FRAME_RESET:
+        if (length != 0)
+        {
+            ERR_PRINT("mux_parse_frame: RESET frame of %u bytes\n", length);
+            return -1;
+        }
+        // Closed once the frame being sent on it, if any, is complete
+        if (stream != NULL && stream->closing == 0)
+        {
+            stream->closing = MUX_FRAME_RESET;
+        }
+        break;
+    default:
+        ERR_PRINT("mux_parse_frame: unexpected frame of type %u\n", type);
+        return -1;
+    }
+    return MUX_HEADER_SIZE + length;
+}
+
+void mux_open_stream(MuxSession *session, uint32_t stream_id, Response *response)
+{
+    // There is one, mux_parse_frame made sure of it
+    MuxStream *stream = _find_stream(session, 0);
+    stream->id = stream_id;
+    stream->window = MUX_INITIAL_WINDOW;
+    stream->closing = 0;
+    if (response != NULL)
+    {
+        stream->response = *response;
+    }
+    else
+    {
+        stream->response = (Response)EMPTY_RESPONSE;
+        stream->closing = MUX_FRAME_RESET;
+    }
+}
+
+/*
+** Build the header of the next frame to send, from the stream after the one
+** the last frame was from: a DATA frame as long as its window allows if it
+** has some of its response left, otherwise the frame closing it.
+**
+** returns 1 if there is a frame to send, 0 if there is none
+*/
+static int _next_frame(MuxSession *session)
+{
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        int n = (session->next + i) % MUX_MAX_STREAMS;
+        MuxStream *stream = &session->streams[n];
+        if (stream->id == 0)
+        {
+            continue;
+        }
+
+        uint64_t left = _bytes_left(&stream->response);
+        uint32_t length = 0;
+        if (stream->closing != 0)
+        {
+            session->type = stream->closing;
+        }
+        else if (left == 0)
+        {
+            session->type = MUX_FRAME_END;
+        }
+        else if (stream->window > 0)
+        {
+            session->type = MUX_FRAME_DATA;
+            length = MIN(MIN(left, stream->window), MUX_MAX_FRAME);
+            stream->window -= length;
+        }
+        else
+        {
+            continue;
+        }
+
+        mux_pack_header(session->header, stream->id, session->type, length);
+        session->header_sent = 0;
+        session->payload_left = length;
+        session->current = n;
+        session->next = (n + 1) % MUX_MAX_STREAMS;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+** returns 1 if a stream of session is sending a STREAM_AT response, 0
+** otherwise
+*/
+static int _is_realtime(const MuxSession *session)
+{
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        if (session->streams[i].id != 0 && session->streams[i].closing == 0 &&
+            session->streams[i].response.realtime)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int mux_send(int socket, MuxSession *session)
+{
+    if (session->current < 0 && !_next_frame(session))
+    {
+        egress_idle(socket);
+        return 1;
+    }
+
+    // Never paced with -r, see as_server.h
+    session->pacing.realtime = _is_realtime(session);
+    pace_response(socket, &session->pacing);
+    size_t budget = egress_budget(session->pacing.socket_pace_rate);
+
+    while (budget > 0)
+    {
+        MuxStream *stream = &session->streams[session->current];
+        Response *response = &stream->response;
+        size_t head_left = response->head_len - response->head_sent;
+        ssize_t sent;
+        if (session->header_sent < MUX_HEADER_SIZE)
+        {
+            // Held back for the payload that follows
+            int flags = MSG_NOSIGNAL | (session->payload_left > 0 ? MSG_MORE : 0);
+            sent = send(socket, session->header + session->header_sent,
+                        MUX_HEADER_SIZE - session->header_sent, flags);
+            if (sent > 0)
+            {
+                session->header_sent += sent;
+            }
+        }
+        else if (head_left > 0)
+        {
+            int flags = MSG_NOSIGNAL | (session->payload_left > head_left ? MSG_MORE : 0);
+            sent = send(socket, response->head + response->head_sent,
+                        MIN(budget, MIN(session->payload_left, head_left)), flags);
+            if (sent > 0)
+            {
+                response->head_sent += sent;
+                session->payload_left -= sent;
+            }
+        }
+        else
+        {
+            sent = sendfile_once(socket, response->file_fd, &response->file_offset,
+                                 MIN(budget, session->payload_left));
+            if (sent == 0)
+            {
+                ERR_PRINT("mux_send: file ended before its advertised size\n");
+                return -1;
+            }
+            if (sent > 0)
+            {
+                session->payload_left -= sent;
+            }
+        }
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            perror("mux_send: send");
+            return -1;
+        }
+        budget -= MIN(budget, (size_t)sent);
+        egress_sent(socket, sent);
+
+        if (session->header_sent == MUX_HEADER_SIZE && session->payload_left == 0)
+        {
+            if (session->type != MUX_FRAME_DATA)
+            {
+                free_response(response);
+                stream->id = 0;
+            }
+            session->current = -1;
+            if (!_next_frame(session))
+            {
+                egress_idle(socket);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void mux_free(MuxSession *session)
+{
+    for (int i = 0; i < MUX_MAX_STREAMS; i++)
+    {
+        if (session->streams[i].id != 0)
+        {
+            free_response(&session->streams[i].response);
+            session->streams[i].id = 0;
+        }
+    }
+}
@@ -0,0 +1,109 @@
+#ifndef AS_MUX_H_
+#define AS_MUX_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+/*
+** Constants
+** ---------
+*/
+// Longest payload of a REQUEST frame: with its header, a frame always fits
+// in the request buffer of a connection
+#define MUX_MAX_REQUEST_SIZE (REQUEST_BUFFER_SIZE - MUX_HEADER_SIZE)
+
+
+/*
+** Design
+** ------
+** The server side of a multiplexed connection (see 11 in as_server.h). A
+** MuxSession holds the open streams of a connection, each with the response
+** to its request and its window, and the frame being sent, so that it can
+** be sent in pieces on a non-blocking socket like a Response:
+**
+**   - mux_parse_frame takes the frames the client sent out of the request
+**     buffer: WINDOW and RESET frames are handled on the spot, a REQUEST is
+**     parsed with parse_request and handed to the caller, which prepares
+**     the response the way its mode does (e.g. from a snapshot of the
+**     library in fork mode) and opens the stream with it,
+**   - mux_send goes around the open streams, sending a DATA frame of at
+**     most MUX_MAX_FRAME bytes of each stream that has some window left,
+**     then the END (or RESET) frame of the streams that are done. Payloads
+**     go from the head of the response, then from its file with sendfile,
+**     as send_response does.
+**
+** A stream that has used its window is skipped until the client opens it
+** further, the others keep going: a player that stops reading only holds
+** back its own stream. Nothing is buffered for a stream, a frame is only
+** built when it can be sent.
+**
+** Multiplexing needs a socket that can be read while responses are being
+** sent: the epoll (and prefork) and fork modes multiplex connections, the
+** io_uring mode refuses to.
+*/
+
+// An open stream, see the Design section
+typedef struct mux_stream {
+    uint32_t id;               // 0 if free
+    Response response;
+    uint32_t window;           // bytes of DATA the client takes on it
+    uint8_t closing;           // frame closing it once it is sent, 0 if none yet
+} MuxStream;
+
+typedef struct mux_session {
+    MuxStream streams[MUX_MAX_STREAMS];
+    int next;                  // stream to send a frame of first
+    int current;               // stream of the frame being sent, -1 if none
+    uint8_t header[MUX_HEADER_SIZE];
+    int header_sent;
+    uint8_t type;              // of the frame being sent
+    uint32_t payload_left;     // bytes of its payload not sent yet
+    Response pacing;           // of the connection as a whole, see pace_response
+} MuxSession;
+
+
+/*
+** Set up session for a connection that was just switched to frames.
+*/
+void mux_init(MuxSession *session);
+
+/*
+** Take the first frame out of the bytes_in_buf bytes of buf. A WINDOW or
+** RESET frame is applied to its stream, a REQUEST frame is parsed into
+** request and its stream id stored in stream_id: the caller opens the
+** stream with mux_open_stream before the next call. stream_id is 0 for the
+** other frames.
+**
+** returns the number of bytes of the frame, 0 if buf doesn't hold a whole
+** frame yet, -1 if the client broke the protocol (the connection should be
+** closed)
+*/
+int mux_parse_frame(MuxSession *session, const uint8_t *buf, int bytes_in_buf,
+                    uint32_t *stream_id, Request *request);
+
+/*
+** Open the stream of the REQUEST frame just parsed with its response (which
+** session takes over), or close it with a RESET frame if response is NULL
+** (the request has no response, or it failed).
+*/
+void mux_open_stream(MuxSession *session, uint32_t stream_id, Response *response);
+
+/*
+** Send the next frames of the streams of session over the non-blocking
+** socket, at most RESPONSE_SEND_BUDGET bytes (less under an egress cap, see
+** egress_budget).
+**
+** returns 1 when there is nothing to send until the client sends another
+** frame (every stream is closed or out of window), 0 if there is more to
+** send once the socket is writable, -1 on error
+*/
+int mux_send(int socket, MuxSession *session);
+
+/*
+** Release the responses of the streams still open.
+*/
+void mux_free(MuxSession *session);
+
+#endif // AS_MUX_H_
@@ -0,0 +1,310 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_prefork.h"
+#include "as_cache.h"
+#include "as_egress.h"
+#include "as_epoll.h"
+#include "as_library.h"
+
+// Written to by the SIGCHLD handler, read by the supervisor loop
+static int sigchld_pipe[2] = {-1, -1};
+
+static void _on_sigchld(int signum)
+{
+    int saved_errno = errno;
+    char signal_byte = 0;
+    if (write(sigchld_pipe[1], &signal_byte, 1) < 0)
+    {
+        // The pipe is full, so the supervisor will reap anyway
+    }
+    errno = saved_errno;
+}
+
+/*
+** Returns the n-th CPU (wrapping around) of the cpus set.
+*/
+static int _nth_cpu(const cpu_set_t *cpus, int n)
+{
+    n %= CPU_COUNT(cpus);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, cpus) && n-- == 0)
+        {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+/*
+** Start worker w of workers: fork a process that serves clients from
+** workers[w].listenfd until its control pipe is closed.
+**
+** returns 0 on success, -1 on error. The worker process does not return.
+*/
+static int _spawn_worker(Worker *workers, int num_workers, int w, Library *library)
+{
+    int control[2];
+    if (pipe(control) == -1)
+    {
+        perror("_spawn_worker: pipe");
+        return -1;
+    }
+
+    // Don't let the worker inherit (and later repeat) buffered output
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("_spawn_worker: fork");
+        close(control[0]);
+        close(control[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        // Keep only this worker's socket and control pipe, so the other
+        // workers still see EOF when the supervisor closes their pipes
+        close(control[1]);
+        for (int i = 0; i < num_workers; i++)
+        {
+            if (i != w)
+            {
+                close(workers[i].listenfd);
+            }
+            if (workers[i].control_fd >= 0)
+            {
+                close(workers[i].control_fd);
+            }
+        }
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        signal(SIGCHLD, SIG_DFL);
+
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(workers[w].cpu, &cpu);
+        if (sched_setaffinity(0, sizeof(cpu), &cpu) == -1)
+        {
+            perror("_spawn_worker: sched_setaffinity");
+        }
+        printf("Worker %d (pid %d) serving on CPU %d\n", w, getpid(), workers[w].cpu);
+
+        int result = run_epoll_worker(workers[w].listenfd, control[0], library);
+        close(control[0]);
+        close(workers[w].listenfd);
+        library_free(library);
+        exit(result);
+    }
+
+    close(control[0]);
+    // A rescan broadcast must never block the supervisor
+    fcntl(control[1], F_SETFL, O_NONBLOCK);
+    workers[w].pid = pid;
+    workers[w].control_fd = control[1];
+    workers[w].started = time(NULL);
+    return 0;
+}
+
+static void _report_worker_exit(const Worker *worker, int w, int status)
+{
+    if (WIFEXITED(status))
+    {
+        printf("Worker %d (pid %d) terminated\n", w, worker->pid);
+        if (WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "Worker %d (pid %d) exited with status %d\n",
+                    w, worker->pid, WEXITSTATUS(status));
+        }
+    }
+    else
+    {
+        fprintf(stderr, "Worker %d (pid %d) terminated abnormally\n", w, worker->pid);
+    }
+}
+
+/*
+** Reap every worker that has terminated, marking it as not running.
+*/
+static void _reap_workers(Worker *workers, int num_workers)
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int w = 0; w < num_workers; w++)
+        {
+            if (workers[w].pid == pid)
+            {
+                _report_worker_exit(&workers[w], w, status);
+                egress_remove_process(pid);
+                close(workers[w].control_fd);
+                workers[w].control_fd = -1;
+                workers[w].pid = -1;
+            }
+        }
+    }
+}
+
+/*
+** Tell every running worker to reconcile its library.
+*/
+static void _broadcast_rescan(Worker *workers, int num_workers)
+{
+    char command = 'r';
+    for (int w = 0; w < num_workers; w++)
+    {
+        if (workers[w].control_fd >= 0 && write(workers[w].control_fd, &command, 1) < 0 &&
+            errno != EAGAIN)
+        {
+            perror("_broadcast_rescan");
+        }
+    }
+}
+
+int run_prefork_server(const ServerOptions *options, Library *library)
+{
+    cpu_set_t cpus;
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+    {
+        perror("run_prefork_server: sched_getaffinity");
+        return 1;
+    }
+    int num_workers = options->num_workers > 0 ? options->num_workers : CPU_COUNT(&cpus);
+
+    struct sockaddr_in server_addr;
+    init_server_addr(options->port, &server_addr);
+
+    Worker *workers = malloc(num_workers * sizeof(Worker));
+    if (workers == NULL)
+    {
+        perror("run_prefork_server");
+        return 1;
+    }
+    for (int w = 0; w < num_workers; w++)
+    {
+        workers[w].pid = -1;
+        workers[w].listenfd = set_up_reuseport_server_socket(&server_addr, EPOLL_MAX_PENDING);
+        workers[w].control_fd = -1;
+        workers[w].cpu = _nth_cpu(&cpus, w);
+        workers[w].started = 0;
+    }
+
+    if (pipe(sigchld_pipe) == -1)
+    {
+        perror("run_prefork_server: pipe");
+        return 1;
+    }
+    fcntl(sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+
+    struct sigaction on_sigchld = {.sa_handler = _on_sigchld, .sa_flags = SA_RESTART | SA_NOCLDSTOP};
+    sigemptyset(&on_sigchld.sa_mask);
+    sigaction(SIGCHLD, &on_sigchld, NULL);
+    // A worker dying before a broadcast reaches it must not kill the supervisor
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Starting %d workers\n", num_workers);
+
+    int result = 0;
+    int watch_stdin = 1;
+
+    while (1)
+    {
+        // (Re)start workers that are not running
+        for (int w = 0; w < num_workers; w++)
+        {
+            if (workers[w].pid == -1 &&
+                time(NULL) - workers[w].started >= WORKER_RESPAWN_DELAY_SEC &&
+                _spawn_worker(workers, num_workers, w, library) < 0)
+            {
+                result = 1;
+                goto quit;
+            }
+        }
+
+        fd_set incoming;
+        FD_ZERO(&incoming);
+        FD_SET(sigchld_pipe[0], &incoming);
+        if (watch_stdin)
+        {
+            FD_SET(STDIN_FILENO, &incoming);
+        }
+
+        struct timeval select_timeout = SELECT_TIMEOUT;
+        if (select(sigchld_pipe[0] + 1, &incoming, NULL, NULL, &select_timeout) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("run_server");
+            result = 1;
+            goto quit;
+        }
+
+        if (FD_ISSET(sigchld_pipe[0], &incoming))
+        {
+            char signal_bytes[64];
+            while (read(sigchld_pipe[0], signal_bytes, sizeof(signal_bytes)) > 0)
+                ;
+            _reap_workers(workers, num_workers);
+        }
+        // The workers keep their own libraries, the paths of the files are the same
+        cache_maintain(library);
+        if (watch_stdin && FD_ISSET(STDIN_FILENO, &incoming))
+        {
+            int command = getchar();
+            if (command == 'q')
+            {
+                break;
+            }
+            if (command == 'r')
+            {
+                _broadcast_rescan(workers, num_workers);
+            }
+            // The connections of every worker are in shared memory
+            else if (command == 's')
+            {
+                egress_print_stats(stdout);
+                cache_print_stats(stdout);
+            }
+            else if (command == 'w')
+            {
+                egress_load_weights();
+            }
+            // Nobody can type q anymore, keep serving until killed
+            watch_stdin = command != EOF;
+        }
+    }
+
+quit:
+    printf("Quitting server\n");
+    signal(SIGCHLD, SIG_DFL);
+
+    // Closing the control pipes tells every worker to quit
+    for (int w = 0; w < num_workers; w++)
+    {
+        if (workers[w].control_fd >= 0)
+        {
+            close(workers[w].control_fd);
+        }
+    }
+    for (int w = 0; w < num_workers; w++)
+    {
+        int status;
+        if (workers[w].pid > 0 && waitpid(workers[w].pid, &status, 0) > 0)
+        {
+            _report_worker_exit(&workers[w], w, status);
+        }
+        close(workers[w].listenfd);
+    }
+
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    free(workers);
+    return result;
+}
@@ -0,0 +1,57 @@
+#ifndef AS_PREFORK_H_
+#define AS_PREFORK_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+#include <sched.h>
+#include <time.h>
+
+/*
+** Constants
+** ---------
+*/
+// A worker that dies sooner than this after being started is
+// respawned only after this delay, so a crashing worker can't fork-bomb
+#define WORKER_RESPAWN_DELAY_SEC 1
+
+
+/*
+** Design
+** ------
+** In prefork mode (as_server -m prefork) the server forks its workers once,
+** at startup, instead of once per client. Each worker:
+**   - listens on a SO_REUSEPORT socket of its own, so the kernel balances
+**     new connections between the workers without a shared accept queue,
+**   - is pinned to one CPU with sched_setaffinity,
+**   - serves all of its clients concurrently with run_epoll_worker.
+**
+** Every worker keeps its own library up to date with a LibraryWatch (see
+** as_watch.h). The parent process only supervises. It reaps workers when
+** SIGCHLD arrives and respawns them on the same socket (connections queued
+** on it in the meantime are not lost), forwards r + enter to every worker
+** over its control pipe, and stops the workers by closing those pipes when
+** the user types q + enter.
+*/
+
+typedef struct worker {
+    pid_t pid;            // -1 while the worker is not running
+    int listenfd;         // SO_REUSEPORT socket, owned by the parent
+    int control_fd;       // write end of the worker's control pipe, -1 if none
+    int cpu;              // CPU the worker is pinned to
+    time_t started;
+} Worker;
+
+
+/*
+** Run the server in prefork mode with options->num_workers workers (one per
+** CPU this process may run on if 0) on options->port, serving library.
+**
+** returns 0 when the user quits the server, 1 on error. Worker processes
+** exit instead of returning.
+*/
+int run_prefork_server(const ServerOptions *options, Library *library);
+
+#endif // AS_PREFORK_H_
@@ -0,0 +1,655 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_scan.h"
+
+
+// A chunk of paths, chained to the previous chunks of the same thread
+typedef struct scan_arena {
+    struct scan_arena *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ScanArena;
+
+// A directory read by a worker, its files are next to each other
+typedef struct scan_dir {
+    const char *path;
+    int worker;
+    int first_file;            // in the worker's files
+    int num_files;
+} ScanDir;
+
+struct scanner;
+
+typedef struct scan_worker {
+    struct scanner *scanner;
+    pthread_t thread;
+    pthread_mutex_t queue_lock;
+    const char **queue;        // directories to read, stolen from the head
+    int queue_head;
+    int queue_tail;
+    int queue_capacity;
+    ScanArena *arenas;
+    LibraryScanEntry *files;
+    int num_files;
+    int files_capacity;
+    ScanDir *dirs;
+    int num_dirs;
+    int dirs_capacity;
+    char *buffer;              // for getdents64
+} ScanWorker;
+
+typedef struct scanner {
+    int root_fd;               // the library
+    ScanWorker *workers;
+    int num_workers;
+    ScanDirCallback on_dir;
+    void *context;
+    pthread_mutex_t callback_lock;
+    pthread_mutex_t lock;      // for waiting on wakeup
+    pthread_cond_t wakeup;     // directories queued, or the scan is over
+    int pending;               // directories queued or being read
+    int idle;                  // workers waiting on wakeup
+    int failed;
+} Scanner;
+
+
+/*
+** Per thread storage
+** ------------------
+*/
+static char *_arena_join(ScanWorker *worker, const char *dir, const char *name)
+{
+    size_t dir_length = strlen(dir);
+    size_t name_length = strlen(name);
+    size_t length = dir_length + (dir_length > 0) + name_length + 1;
+
+    ScanArena *arena = worker->arenas;
+    if (arena == NULL || arena->used + length > arena->capacity)
+    {
+        size_t capacity = length > LIBRARY_SCAN_ARENA_SIZE ? length : LIBRARY_SCAN_ARENA_SIZE;
+        arena = malloc(sizeof(ScanArena) + capacity);
+        if (arena == NULL)
+        {
+            perror("library_scan_directory");
+            return NULL;
+        }
+        arena->next = worker->arenas;
+        arena->used = 0;
+        arena->capacity = capacity;
+        worker->arenas = arena;
+    }
+
+    char *path = arena->data + arena->used;
+    arena->used += length;
+    memcpy(path, dir, dir_length);
+    if (dir_length > 0)
+    {
+        path[dir_length++] = '/';
+    }
+    memcpy(path + dir_length, name, name_length + 1);
+    return path;
+}
+
+/*
+** Make room for one more element in an array of elements of size size.
+*/
+static int _reserve(void *array, int num, int *capacity, size_t size)
+{
+    if (num < *capacity)
+    {
+        return 0;
+    }
+    int new_capacity = *capacity ? 2 * *capacity : 256;
+    void *grown = realloc(*(void **)array, new_capacity * size);
+    if (grown == NULL)
+    {
+        perror("library_scan_directory");
+        return -1;
+    }
+    *(void **)array = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+static int _compare_files(const void *file1, const void *file2)
+{
+    return strcmp(((const LibraryScanEntry *)file1)->path,
+                  ((const LibraryScanEntry *)file2)->path);
+}
+
+static int _compare_dirs(const void *dir1, const void *dir2)
+{
+    return strcmp(((const ScanDir *)dir1)->path, ((const ScanDir *)dir2)->path);
+}
+
+
+/*
+** Queues
+** ------
+*/
+static void _fail(Scanner *scanner)
+{
+    pthread_mutex_lock(&scanner->lock);
+    __atomic_store_n(&scanner->failed, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&scanner->wakeup);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+static int _push_dir(ScanWorker *worker, const char *path)
+{
+    Scanner *scanner = worker->scanner;
+    // Counted first, so that pending can't reach 0 while it is queued
+    __atomic_add_fetch(&scanner->pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&worker->queue_lock);
+    if (worker->queue_tail == worker->queue_capacity && worker->queue_head > 0)
+    {
+        memmove(worker->queue, worker->queue + worker->queue_head,
+                (worker->queue_tail - worker->queue_head) * sizeof(char *));
+        worker->queue_tail -= worker->queue_head;
+        worker->queue_head = 0;
+    }
+    int result = _reserve(&worker->queue, worker->queue_tail, &worker->queue_capacity,
+                          sizeof(char *));
+    if (result == 0)
+    {
+        worker->queue[worker->queue_tail++] = path;
+    }
+    pthread_mutex_unlock(&worker->queue_lock);
+    if (result < 0)
+    {
+        return -1;
+    }
+
+    // A worker going idle checks the queues after saying so, see _wait_for_dir
+    if (__atomic_load_n(&scanner->idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&scanner->lock);
+        pthread_cond_signal(&scanner->wakeup);
+        pthread_mutex_unlock(&scanner->lock);
+    }
+    return 0;
+}
+
+/*
+** returns a directory of the queue of worker, the last one pushed if it is
+** the worker's own queue, the first one otherwise, NULL if it is empty
+*/
+static const char *_pop_dir(ScanWorker *worker, int own)
+{
+    const char *path = NULL;
+    pthread_mutex_lock(&worker->queue_lock);
+    if (worker->queue_head < worker->queue_tail)
+    {
+        path = own ? worker->queue[--worker->queue_tail] : worker->queue[worker->queue_head++];
+        if (worker->queue_head == worker->queue_tail)
+        {
+            worker->queue_head = worker->queue_tail = 0;
+        }
+    }
+    pthread_mutex_unlock(&worker->queue_lock);
+    return path;
+}
+
+static const char *_steal_dir(ScanWorker *worker)
+{
+    Scanner *scanner = worker->scanner;
+    int self = worker - scanner->workers;
+    for (int i = 1; i < scanner->num_workers; i++)
+    {
+        const char *path = _pop_dir(&scanner->workers[(self + i) % scanner->num_workers], 0);
+        if (path != NULL)
+        {
+            return path;
+        }
+    }
+    return NULL;
+}
+
+static int _is_any_dir_queued(Scanner *scanner)
+{
+    for (int i = 0; i < scanner->num_workers; i++)
+    {
+        ScanWorker *worker = &scanner->workers[i];
+        pthread_mutex_lock(&worker->queue_lock);
+        int queued = worker->queue_head < worker->queue_tail;
+        pthread_mutex_unlock(&worker->queue_lock);
+        if (queued)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+** returns the next directory worker should read, NULL once the scan is over
+*/
+static const char *_wait_for_dir(ScanWorker *worker)
+{
+    Scanner *scanner = worker->scanner;
+    while (1)
+    {
+        if (__atomic_load_n(&scanner->failed, __ATOMIC_SEQ_CST))
+        {
+            return NULL;
+        }
+        const char *path = _pop_dir(worker, 1);
+        if (path == NULL)
+        {
+            path = _steal_dir(worker);
+        }
+        if (path != NULL)
+        {
+            return path;
+        }
+
+        pthread_mutex_lock(&scanner->lock);
+        __atomic_add_fetch(&scanner->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&scanner->pending, __ATOMIC_SEQ_CST) > 0 && !scanner->failed &&
+               !_is_any_dir_queued(scanner))
+        {
+            pthread_cond_wait(&scanner->wakeup, &scanner->lock);
+        }
+        __atomic_sub_fetch(&scanner->idle, 1, __ATOMIC_SEQ_CST);
+        int over = __atomic_load_n(&scanner->pending, __ATOMIC_SEQ_CST) == 0 || scanner->failed;
+        pthread_mutex_unlock(&scanner->lock);
+        if (over)
+        {
+            return NULL;
+        }
+    }
+}
+
+static void _finish_dir(Scanner *scanner)
+{
+    if (__atomic_sub_fetch(&scanner->pending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        pthread_mutex_lock(&scanner->lock);
+        pthread_cond_broadcast(&scanner->wakeup);
+        pthread_mutex_unlock(&scanner->lock);
+    }
+}
+
+
+/*
+** Reading directories
+** -------------------
+*/
+static int _add_entry(ScanWorker *worker, const char *dir, const char *name,
+                      unsigned char type, const LibraryFileId *id)
+{
+    if (type == DT_REG && _is_file_extension_supported(name))
+    {
+        if (_reserve(&worker->files, worker->num_files, &worker->files_capacity,
+                     sizeof(LibraryScanEntry)) < 0)
+        {
+            return -1;
+        }
+        const char *path = _arena_join(worker, dir, name);
+        if (path == NULL)
+        {
+            return -1;
+        }
+        worker->files[worker->num_files].path = path;
+        worker->files[worker->num_files].id = *id;
+        memset(&worker->files[worker->num_files].metadata, 0, sizeof(LibraryMetadata));
+        worker->num_files++;
+    }
+    else if (type == DT_DIR && strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+    {
+        const char *path = _arena_join(worker, dir, name);
+        if (path == NULL || _push_dir(worker, path) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int _read_dir(ScanWorker *worker, const char *path)
+{
+    Scanner *scanner = worker->scanner;
+    if (scanner->on_dir != NULL)
+    {
+        pthread_mutex_lock(&scanner->callback_lock);
+        int result = scanner->on_dir(scanner->context, path);
+        pthread_mutex_unlock(&scanner->callback_lock);
+        if (result < 0)
+        {
+            return -1;
+        }
+    }
+
+    int fd = openat(scanner->root_fd, path[0] != '\0' ? path : ".",
+                    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+    {
+        // Removed since it was listed
+        if (errno == ENOENT || errno == ENOTDIR || errno == ELOOP)
+        {
+            return 0;
+        }
+        perror("library_scan_directory: openat");
+        return -1;
+    }
+    if (_reserve(&worker->dirs, worker->num_dirs, &worker->dirs_capacity, sizeof(ScanDir)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    ScanDir *dir = &worker->dirs[worker->num_dirs++];
+    dir->path = path;
+    dir->worker = worker - scanner->workers;
+    dir->first_file = worker->num_files;
+
+    // Files are identified by the inode numbers of their entries, on the
+    // directory's device
+    struct stat dir_st;
+    if (fstat(fd, &dir_st) == -1)
+    {
+        perror("library_scan_directory: fstat");
+        close(fd);
+        return -1;
+    }
+
+    ssize_t num;
+    while ((num = getdents64(fd, worker->buffer, LIBRARY_SCAN_BUFFER_SIZE)) > 0)
+    {
+        for (char *ptr = worker->buffer; ptr < worker->buffer + num;)
+        {
+            struct dirent64 *entry = (struct dirent64 *)ptr;
+            ptr += entry->d_reclen;
+
+            LibraryFileId id = {dir_st.st_dev, entry->d_ino};
+            unsigned char type = entry->d_type;
+            // Some filesystems (e.g. older NFS and XFS) don't tell
+            struct stat st;
+            if (type == DT_UNKNOWN &&
+                fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+                id.dev = st.st_dev;
+                id.ino = st.st_ino;
+            }
+            if (_add_entry(worker, path, entry->d_name, type, &id) < 0)
+            {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+    if (num == -1)
+    {
+        perror("library_scan_directory: getdents64");
+    }
+    close(fd);
+
+    // Sorted one directory at a time, see _merge_results
+    dir = &worker->dirs[worker->num_dirs - 1];
+    dir->num_files = worker->num_files - dir->first_file;
+    if (dir->num_files > 1)
+    {
+        qsort(worker->files + dir->first_file, dir->num_files, sizeof(LibraryScanEntry),
+              _compare_files);
+    }
+    return num == -1 ? -1 : 0;
+}
+
+static void *_run_worker(void *arg)
+{
+    ScanWorker *worker = arg;
+    const char *path;
+    while ((path = _wait_for_dir(worker)) != NULL)
+    {
+        if (_read_dir(worker, path) < 0)
+        {
+            _fail(worker->scanner);
+        }
+        _finish_dir(worker->scanner);
+    }
+    return NULL;
+}
+
+
+/*
+** Results
+** -------
+*/
+/*
+** Put together what the workers found, ordered by directory then by file:
+** sorting whole directories keeps the order independent of the threads
+** for far fewer comparisons than sorting every path.
+*/
+static int _merge_results(Scanner *scanner, LibraryScan *scan)
+{
+    int num_files = 0;
+    int num_dirs = 0;
+    for (int i = 0; i < scanner->num_workers; i++)
+    {
+        num_files += scanner->workers[i].num_files;
+        num_dirs += scanner->workers[i].num_dirs;
+    }
+    ScanDir *dirs = malloc((num_dirs + 1) * sizeof(ScanDir));
+    scan->files = malloc((num_files + 1) * sizeof(LibraryScanEntry));
+    scan->dirs = malloc((num_dirs + 1) * sizeof(char *));
+    if (dirs == NULL || scan->files == NULL || scan->dirs == NULL)
+    {
+        perror("library_scan_directory");
+        free(dirs);
+        return -1;
+    }
+
+    // Workers that found nothing have no arrays at all
+    for (int i = 0; i < scanner->num_workers; i++)
+    {
+        ScanWorker *worker = &scanner->workers[i];
+        if (worker->num_dirs == 0)
+        {
+            continue;
+        }
+        memcpy(dirs + scan->num_dirs, worker->dirs, worker->num_dirs * sizeof(ScanDir));
+        scan->num_dirs += worker->num_dirs;
+    }
+    qsort(dirs, scan->num_dirs, sizeof(ScanDir), _compare_dirs);
+
+    for (int i = 0; i < scan->num_dirs; i++)
+    {
+        const ScanWorker *worker = &scanner->workers[dirs[i].worker];
+        scan->dirs[i] = dirs[i].path;
+        if (dirs[i].num_files == 0)
+        {
+            continue;
+        }
+        memcpy(scan->files + scan->num_files, worker->files + dirs[i].first_file,
+               dirs[i].num_files * sizeof(LibraryScanEntry));
+        scan->num_files += dirs[i].num_files;
+    }
+    free(dirs);
+
+    // The paths now belong to the scan
+    for (int i = 0; i < scanner->num_workers; i++)
+    {
+        ScanArena *arena = scanner->workers[i].arenas;
+        while (arena != NULL)
+        {
+            ScanArena *next = arena->next;
+            arena->next = scan->arenas;
+            scan->arenas = arena;
+            arena = next;
+        }
+        scanner->workers[i].arenas = NULL;
+    }
+    return 0;
+}
+
+static void _free_arenas(ScanArena *arena)
+{
+    while (arena != NULL)
+    {
+        ScanArena *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+
+/*
+** Public interface
+** ----------------
+*/
+int library_scan_directory(const char *library_path, const char *tree, int num_threads,
+                           ScanDirCallback on_dir, void *context, LibraryScan *scan)
+{
+    memset(scan, 0, sizeof(LibraryScan));
+    Scanner scanner = {.on_dir = on_dir, .context = context};
+    scanner.num_workers = num_threads > 1 ? num_threads : 1;
+
+    scanner.root_fd = open(library_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scanner.root_fd == -1)
+    {
+        int error = errno;
+        if (error != ENOENT && error != ENOTDIR)
+        {
+            perror("library_scan_directory: open");
+        }
+        errno = error;
+        return -1;
+    }
+    // Unlike the directories found in it, the tree itself must be there
+    int tree_fd = openat(scanner.root_fd, tree[0] != '\0' ? tree : ".",
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (tree_fd == -1)
+    {
+        int error = errno;
+        if (error != ENOENT && error != ENOTDIR)
+        {
+            perror("library_scan_directory: openat");
+        }
+        close(scanner.root_fd);
+        errno = error;
+        return -1;
+    }
+    close(tree_fd);
+
+    scanner.workers = calloc(scanner.num_workers, sizeof(ScanWorker));
+    if (scanner.workers == NULL)
+    {
+        perror("library_scan_directory");
+        close(scanner.root_fd);
+        return -1;
+    }
+    pthread_mutex_init(&scanner.callback_lock, NULL);
+    pthread_mutex_init(&scanner.lock, NULL);
+    pthread_cond_init(&scanner.wakeup, NULL);
+
+    int result = 0;
+    int num_started = 0;
+    for (int i = 0; i < scanner.num_workers; i++)
+    {
+        scanner.workers[i].scanner = &scanner;
+        pthread_mutex_init(&scanner.workers[i].queue_lock, NULL);
+        scanner.workers[i].buffer = malloc(LIBRARY_SCAN_BUFFER_SIZE);
+        if (scanner.workers[i].buffer == NULL)
+        {
+            perror("library_scan_directory");
+            result = -1;
+        }
+    }
+    char *tree_path = result == 0 ? _arena_join(&scanner.workers[0], "", tree) : NULL;
+    if (tree_path == NULL || _push_dir(&scanner.workers[0], tree_path) < 0)
+    {
+        result = -1;
+    }
+
+    // The calling thread is worker 0
+    for (int i = 1; result == 0 && i < scanner.num_workers; i++)
+    {
+        int error = pthread_create(&scanner.workers[i].thread, NULL, _run_worker,
+                                   &scanner.workers[i]);
+        if (error != 0)
+        {
+            // The threads already started are enough to finish the scan
+            ERR_PRINT("library_scan_directory: pthread_create: %s\n", strerror(error));
+            break;
+        }
+        num_started++;
+    }
+    if (result == 0)
+    {
+        _run_worker(&scanner.workers[0]);
+    }
+    for (int i = 1; i <= num_started; i++)
+    {
+        pthread_join(scanner.workers[i].thread, NULL);
+    }
+
+    if (result == 0 && !scanner.failed && _merge_results(&scanner, scan) < 0)
+    {
+        result = -1;
+    }
+    if (scanner.failed)
+    {
+        result = -1;
+    }
+
+    for (int i = 0; i < scanner.num_workers; i++)
+    {
+        ScanWorker *worker = &scanner.workers[i];
+        pthread_mutex_destroy(&worker->queue_lock);
+        _free_arenas(worker->arenas);
+        free(worker->queue);
+        free(worker->files);
+        free(worker->dirs);
+        free(worker->buffer);
+    }
+    free(scanner.workers);
+    pthread_cond_destroy(&scanner.wakeup);
+    pthread_mutex_destroy(&scanner.lock);
+    pthread_mutex_destroy(&scanner.callback_lock);
+    close(scanner.root_fd);
+
+    if (result < 0)
+    {
+        library_scan_free(scan);
+    }
+    return result;
+}
+
+void library_scan_free(LibraryScan *scan)
+{
+    free(scan->files);
+    free(scan->dirs);
+    _free_arenas(scan->arenas);
+    memset(scan, 0, sizeof(LibraryScan));
+}
+
+int library_merge_scan(Library *library, const LibraryScan *scan)
+{
+    if (library_begin_scan(library) < 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < scan->num_files; i++)
+    {
+#ifdef DEBUG
+        printf("Found file: %s\n", scan->files[i].path);
+#endif
+        if (library_scan_file(library, scan->files[i].path, &scan->files[i].id) < 0)
+        {
+            // A failed scan removes nothing
+            return -1;
+        }
+        const LibraryMetadata *metadata = &scan->files[i].metadata;
+        if (metadata->id.dev != 0 || metadata->id.ino != 0)
+        {
+            library_set_metadata(library, library_find_file(library, scan->files[i].path),
+                                 metadata);
+        }
+    }
+    library_end_scan(library);
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef AS_SCAN_H_
+#define AS_SCAN_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_library.h"
+
+#include <pthread.h>
+
+/*
+** Constants
+** ---------
+*/
+// Threads reading directories during a scan of the whole library. Scans of
+// slow (network) filesystems wait on the filesystem far more than on the CPU,
+// so there are more threads than cores.
+#define LIBRARY_SCAN_THREADS 8
+
+// Bytes of directory entries read by each getdents64 call
+#define LIBRARY_SCAN_BUFFER_SIZE (64 * 1024)
+
+// Bytes of paths allocated at once by each thread
+#define LIBRARY_SCAN_ARENA_SIZE (256 * 1024)
+
+
+/*
+** Design
+** ------
+** A scan reads every directory of a tree of the library with getdents64, on
+** several threads:
+**
+**   - each thread has a queue of directories to read. It pushes the
+**     directories it finds to its own queue and reads them last in first out
+**     (depth first), and once it runs out it steals the oldest directory of
+**     another thread's queue, which is likely the biggest tree left.
+**   - directories are opened relative to the library (openat), and paths are
+**     joined in a per thread arena instead of allocated one by one.
+**   - the files of every directory are sorted by the thread that read it,
+**     and once all are done the directories are sorted by path, so the
+**     result is the same whatever the timing of the threads. The indices of
+**     the files added to a library by a scan don't depend on it either.
+*/
+
+/*
+** Called for every directory of the scan before it is read, one call at a
+** time even when there are several threads.
+**
+** returns 0 to carry on, -1 to stop the scan with an error
+*/
+typedef int (*ScanDirCallback)(void *context, const char *path);
+
+typedef struct library_scan_entry {
+    const char *path;          // relative to the library
+    LibraryFileId id;
+    LibraryMetadata metadata;  // see library_scan_metadata, none until then
+} LibraryScanEntry;
+
+typedef struct library_scan {
+    LibraryScanEntry *files;   // supported files found, by directory then path
+    int num_files;
+    const char **dirs;         // directories found (the tree first), sorted
+    int num_dirs;
+    struct scan_arena *arenas; // where the paths are
+} LibraryScan;
+
+
+/*
+** Scan the directory tree of the library (a path relative to it, "" for the
+** whole library) with num_threads threads. on_dir, if not NULL, is called
+** with context for every directory before it is read.
+**
+** Directories removed during the scan are skipped, but the scan fails if the
+** tree itself can't be read. Errors are reported on stderr, except a tree
+** that doesn't exist (errno is then ENOENT or ENOTDIR).
+**
+** returns 0 on success (free the scan with library_scan_free), -1 on error
+*/
+int library_scan_directory(const char *library_path, const char *tree, int num_threads,
+                           ScanDirCallback on_dir, void *context, LibraryScan *scan);
+
+void library_scan_free(LibraryScan *scan);
+
+/*
+** Merge the files of a scan of the whole library into library (see
+** library_begin_scan), in the order of the scan, with the metadata of the
+** files if it was read (see library_scan_metadata).
+**
+** returns 0 on success, -1 on error (the library then lost no file)
+*/
+int library_merge_scan(Library *library, const LibraryScan *scan);
+
+#endif // AS_SCAN_H_
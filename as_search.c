@@ -0,0 +1,481 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_search.h"
+
+#define NUM_POSTING_LISTS (1u << SEARCH_TRIGRAM_BITS)
+
+
+/*
+** Index
+** -----
+*/
+static inline uint8_t _lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : (uint8_t)c;
+}
+
+/*
+** returns the posting list of the trigram made of the (lowercased) bytes
+** of trigram, a 24-bit number
+*/
+static inline uint32_t _posting_list(uint32_t trigram)
+{
+    return (trigram * 2654435761u) >> (32 - SEARCH_TRIGRAM_BITS);
+}
+
+/*
+** Add slot to the posting lists of the trigrams of path: count it in sizes if
+** postings is NULL, add it at the end of each list (ends, moved on)
+** otherwise. last is the slot + 1 last added to each list.
+*/
+static void _index_path(const char *path, uint32_t slot, uint32_t *last, uint32_t *sizes,
+                        uint32_t *ends, uint32_t *postings)
+{
+    if (path[0] == '\0' || path[1] == '\0')
+    {
+        return;
+    }
+    uint32_t trigram = _lower(path[0]) << 8 | _lower(path[1]);
+    for (const char *c = path + 2; *c != '\0'; c++)
+    {
+        trigram = (trigram << 8 | _lower(*c)) & 0xffffff;
+        uint32_t list = _posting_list(trigram);
+        // A trigram seen twice in the path
+        if (last[list] == slot + 1)
+        {
+            continue;
+        }
+        last[list] = slot + 1;
+        if (postings == NULL)
+        {
+            sizes[list]++;
+        }
+        else
+        {
+            postings[ends[list]++] = slot;
+        }
+    }
+}
+
+/*
+** Build the search index of the files of library, at generation of epoch.
+**
+** returns the index, NULL on error
+*/
+static LibrarySearchIndex *_build_index(const Library *library, uint64_t epoch,
+                                        uint64_t generation)
+{
+    LibrarySearchIndex *index = calloc(1, sizeof(LibrarySearchIndex));
+    uint32_t *last = calloc(NUM_POSTING_LISTS, sizeof(uint32_t));
+    uint32_t *offsets = calloc(NUM_POSTING_LISTS + 1, sizeof(uint32_t));
+    if (index == NULL || last == NULL || offsets == NULL)
+    {
+        perror("library_search: calloc");
+        goto error;
+    }
+
+    // The size of each list first, in offsets[list + 1]
+    for (uint32_t slot = 0; slot < library->num_files; slot++)
+    {
+        if (library->files[slot] != NULL)
+        {
+            _index_path(library->files[slot], slot, last, offsets + 1, NULL, NULL);
+        }
+    }
+    uint64_t size = 0;
+    for (uint32_t list = 1; list <= NUM_POSTING_LISTS; list++)
+    {
+        size += offsets[list];
+        offsets[list] = size;
+    }
+    if (size > UINT32_MAX)
+    {
+        ERR_PRINT("library_search: the library is too large to index\n");
+        goto error;
+    }
+    index->postings = malloc(size > 0 ? size * sizeof(uint32_t) : 1);
+    if (index->postings == NULL)
+    {
+        perror("library_search: malloc");
+        goto error;
+    }
+
+    // Then the lists, each written from its offset on, which leaves the
+    // offsets of the next lists in offsets
+    memset(last, 0, NUM_POSTING_LISTS * sizeof(uint32_t));
+    for (uint32_t slot = 0; slot < library->num_files; slot++)
+    {
+        if (library->files[slot] != NULL)
+        {
+            _index_path(library->files[slot], slot, last, NULL, offsets, index->postings);
+        }
+    }
+    memmove(offsets + 1, offsets, NUM_POSTING_LISTS * sizeof(uint32_t));
+    offsets[0] = 0;
+
+    free(last);
+    index->offsets = offsets;
+    index->epoch = epoch;
+    index->generation = generation;
+    return index;
+error:
+    free(last);
+    free(offsets);
+    if (index != NULL)
+    {
+        free(index->postings);
+        free(index);
+    }
+    return NULL;
+}
+
+/*
+** Get the slots changed in log since the search index of owner was built.
+**
+** returns the number of slots (in *changed, to be freed), -1 if the index
+** has to be built again
+*/
+static int _changed_since_index(const LibraryIndex *owner, const LibraryChangeLog *log,
+                                uint64_t generation, uint32_t **changed)
+{
+    const LibrarySearchIndex *index = owner != NULL ? owner->search : NULL;
+    if (index == NULL || log == NULL || index->epoch != log->epoch)
+    {
+        return -1;
+    }
+    int num_changed = library_changed_slots(log, generation, index->generation, changed);
+    if (num_changed > SEARCH_MAX_CHANGES)
+    {
+        free(*changed);
+        *changed = NULL;
+        return -1;
+    }
+    return num_changed;
+}
+
+
+/*
+** Queries
+** -------
+*/
+typedef struct search_query {
+    char *terms[SEARCH_MAX_TERMS];
+    int num_terms;
+    const Library *library;
+    LibrarySearchMatch *best;  // SEARCH_MAX_RESULTS of them, best first
+    int num_best;
+} SearchQuery;
+
+/*
+** returns 1 if file1 goes before file2 in the results, 0 otherwise
+*/
+static int _is_better(const Library *library, const LibrarySearchMatch *file1,
+                      const LibrarySearchMatch *file2)
+{
+    if (file1->rank != file2->rank)
+    {
+        return file1->rank < file2->rank;
+    }
+    const char *path1 = library->files[file1->index];
+    const char *path2 = library->files[file2->index];
+    size_t length1 = strlen(path1);
+    size_t length2 = strlen(path2);
+    if (length1 != length2)
+    {
+        return length1 < length2;
+    }
+    return strcmp(path1, path2) < 0;
+}
+
+/*
+** Rank the file with index slot, and keep it if it matches and is one of
+** the best files so far.
+*/
+static void _check_file(SearchQuery *query, uint32_t slot)
+{
+    if (!library_has_file(query->library, slot))
+    {
+        return;
+    }
+    const char *path = query->library->files[slot];
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+
+    LibrarySearchMatch match = {slot, 0};
+    for (int i = 0; i < query->num_terms; i++)
+    {
+        const char *found = strcasestr(name, query->terms[i]);
+        if (found != NULL)
+        {
+            match.rank += found == name ? 0 : 1;
+            continue;
+        }
+        found = strcasestr(path, query->terms[i]);
+        if (found == NULL)
+        {
+            return;
+        }
+        match.rank += found == path || found[-1] == '/' ? 2 : 3;
+    }
+
+    if (query->num_best == SEARCH_MAX_RESULTS &&
+        !_is_better(query->library, &match, &query->best[SEARCH_MAX_RESULTS - 1]))
+    {
+        return;
+    }
+    int position = query->num_best < SEARCH_MAX_RESULTS ? query->num_best++
+                                                         : SEARCH_MAX_RESULTS - 1;
+    while (position > 0 && _is_better(query->library, &match, &query->best[position - 1]))
+    {
+        query->best[position] = query->best[position - 1];
+        position--;
+    }
+    query->best[position] = match;
+}
+
+/*
+** Get the posting lists of index of the trigrams of the terms of query,
+** shortest first, each once.
+**
+** returns their number (in lists), 0 if no term is long enough to have one
+*/
+static int _query_lists(const LibrarySearchIndex *index, const SearchQuery *query,
+                        uint32_t *lists)
+{
+    int num_lists = 0;
+    for (int i = 0; i < query->num_terms; i++)
+    {
+        const char *term = query->terms[i];
+        if (term[0] == '\0' || term[1] == '\0')
+        {
+            continue;
+        }
+        uint32_t trigram = _lower(term[0]) << 8 | _lower(term[1]);
+        for (const char *c = term + 2; *c != '\0'; c++)
+        {
+            trigram = (trigram << 8 | _lower(*c)) & 0xffffff;
+            uint32_t list = _posting_list(trigram);
+            uint32_t size = index->offsets[list + 1] - index->offsets[list];
+
+            // Insertion sort, queries are short
+            int position = num_lists;
+            for (int j = 0; j < num_lists; j++)
+            {
+                if (lists[j] == list)
+                {
+                    position = -1;
+                    break;
+                }
+            }
+            if (position == -1)
+            {
+                continue;
+            }
+            while (position > 0 &&
+                   index->offsets[lists[position - 1] + 1] - index->offsets[lists[position - 1]] > size)
+            {
+                lists[position] = lists[position - 1];
+                position--;
+            }
+            lists[position] = list;
+            num_lists++;
+        }
+    }
+    return num_lists;
+}
+
+/*
+** returns the position of the first of the num_slots slots (in increasing
+** order) that is not below slot, galloping from the start
+*/
+static uint32_t _gallop(const uint32_t *slots, uint32_t num_slots, uint32_t slot)
+{
+    uint32_t high = 1;
+    while (high < num_slots && slots[high - 1] < slot)
+    {
+        high *= 2;
+    }
+    uint32_t low = high / 2;
+    high = MIN(high, num_slots);
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (slots[middle] < slot)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/*
+** Check the files that are in every posting list of index in lists
+** (num_lists of them, shortest first), but those in changed (num_changed
+** slots in increasing order)
+**
+** returns 0 on success, -1 on error
+*/
+static int _check_lists(SearchQuery *query, const LibrarySearchIndex *index,
+                        const uint32_t *lists, int num_lists, const uint32_t *changed,
+                        int num_changed)
+{
+    const uint32_t *shortest = index->postings + index->offsets[lists[0]];
+    uint32_t num_candidates = index->offsets[lists[0] + 1] - index->offsets[lists[0]];
+    uint32_t *candidates = malloc((num_candidates > 0 ? num_candidates : 1) * sizeof(uint32_t));
+    if (candidates == NULL)
+    {
+        perror("library_search: malloc");
+        return -1;
+    }
+    memcpy(candidates, shortest, num_candidates * sizeof(uint32_t));
+
+    // Candidates only get fewer, and both are in increasing order: each
+    // one is looked for from where the previous one was
+    for (int i = 1; i < num_lists && num_candidates > 0; i++)
+    {
+        const uint32_t *slots = index->postings + index->offsets[lists[i]];
+        uint32_t num_slots = index->offsets[lists[i] + 1] - index->offsets[lists[i]];
+        uint32_t kept = 0;
+        uint32_t position = 0;
+        for (uint32_t j = 0; j < num_candidates && position < num_slots; j++)
+        {
+            position += _gallop(slots + position, num_slots - position, candidates[j]);
+            if (position < num_slots && slots[position] == candidates[j])
+            {
+                candidates[kept++] = candidates[j];
+            }
+        }
+        num_candidates = kept;
+    }
+
+    // Changed slots are checked as they are now
+    int next_changed = 0;
+    for (uint32_t i = 0; i < num_candidates; i++)
+    {
+        while (next_changed < num_changed && changed[next_changed] < candidates[i])
+        {
+            next_changed++;
+        }
+        if (next_changed == num_changed || changed[next_changed] != candidates[i])
+        {
+            _check_file(query, candidates[i]);
+        }
+    }
+    free(candidates);
+    return 0;
+}
+
+
+/*
+** Public interface
+** ----------------
+*/
+int library_search(const Library *owner, const Library *library, const LibraryChangeLog *log,
+                   uint64_t generation, const char *query_text, LibrarySearchMatch **matches)
+{
+    SearchQuery query = {.library = library};
+    char *text = strdup(query_text);
+    query.best = malloc(SEARCH_MAX_RESULTS * sizeof(LibrarySearchMatch));
+    if (text == NULL || query.best == NULL)
+    {
+        perror("library_search");
+        free(text);
+        free(query.best);
+        return -1;
+    }
+    for (char *save, *term = strtok_r(text, " ", &save);
+         term != NULL && query.num_terms < SEARCH_MAX_TERMS; term = strtok_r(NULL, " ", &save))
+    {
+        query.terms[query.num_terms++] = term;
+    }
+
+    // The index of the owner, once it is recent enough
+    LibraryIndex *owner_index = owner->index;
+    uint32_t *changed = NULL;
+    int num_changed = _changed_since_index(owner_index, log, generation, &changed);
+    if (num_changed < 0 && owner_index != NULL && log != NULL && query.num_terms > 0)
+    {
+        LibrarySearchIndex *index = _build_index(library, log->epoch, generation);
+        if (index != NULL)
+        {
+            library_search_free(owner_index->search);
+            owner_index->search = index;
+            num_changed = 0;
+        }
+    }
+
+    // Every trigram of every term, up to the whole query
+    uint32_t lists[MAX_PATH];
+    int num_lists = num_changed >= 0 ? _query_lists(owner_index->search, &query, lists) : 0;
+    int result = 0;
+    if (num_lists > 0)
+    {
+        result = _check_lists(&query, owner_index->search, lists, num_lists, changed,
+                              num_changed);
+        for (int i = 0; i < num_changed; i++)
+        {
+            _check_file(&query, changed[i]);
+        }
+    }
+    else if (query.num_terms > 0)
+    {
+        // Words too short to have a trigram, or no index
+        for (uint32_t slot = 0; slot < library->num_files; slot++)
+        {
+            _check_file(&query, slot);
+        }
+    }
+
+    free(changed);
+    free(text);
+    if (result < 0)
+    {
+        free(query.best);
+        return -1;
+    }
+    *matches = query.best;
+    return query.num_best;
+}
+
+int library_search_refresh(const Library *library)
+{
+    LibraryIndex *owner_index = library->index;
+    if (owner_index == NULL)
+    {
+        return 0;
+    }
+    uint32_t *changed = NULL;
+    int num_changed = _changed_since_index(owner_index, &owner_index->log,
+                                           owner_index->generation, &changed);
+    free(changed);
+    if (num_changed >= 0)
+    {
+        return 0;
+    }
+
+    LibrarySearchIndex *index = _build_index(library, owner_index->log.epoch,
+                                             owner_index->generation);
+    if (index == NULL)
+    {
+        return -1;
+    }
+    library_search_free(owner_index->search);
+    owner_index->search = index;
+    return 0;
+}
+
+void library_search_free(LibrarySearchIndex *index)
+{
+    if (index != NULL)
+    {
+        free(index->offsets);
+        free(index->postings);
+        free(index);
+    }
+}
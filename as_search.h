@@ -0,0 +1,102 @@
+#ifndef AS_SEARCH_H_
+#define AS_SEARCH_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_library.h"
+
+#include <ctype.h>
+
+/*
+** Constants
+** ---------
+*/
+// Most files in a SEARCH response, the best ranked ones
+#define SEARCH_MAX_RESULTS 100
+
+// Most words in a query, the others are ignored
+#define SEARCH_MAX_TERMS 8
+
+// The index has 2^SEARCH_TRIGRAM_BITS posting lists, trigrams are hashed to
+// one of them
+#define SEARCH_TRIGRAM_BITS 20
+
+// Changes to the library the index can be behind before it is rebuilt, the
+// files they changed are searched one by one
+#define SEARCH_MAX_CHANGES 1024
+
+
+/*
+** Design
+** ------
+** A SEARCH query is a list of words, a file matches if its path contains
+** every word, ignoring case. Files are ranked by where the words are found:
+** at the start of the file name, elsewhere in the file name, at the start of
+** a directory name, anywhere else. Ties go to the shortest path, then to the
+** first path in order.
+**
+** Paths are indexed by trigram (three consecutive bytes, lowercased): a
+** posting list per hash of trigram holds the indices of the files with that
+** trigram, in increasing order. A query intersects the posting lists of the
+** trigrams of its words, shortest first, looking for each file left in the
+** next list by galloping search, so the long lists of common trigrams are
+** only sampled. Only the paths of the files in every list are checked
+** against the query (trigrams that hash to the same list, or that are in a
+** path but not next to each other, make for a few false candidates).
+**
+** The index is built from the library at a generation (see as_library.h) and
+** not touched afterwards. Until the library is SEARCH_MAX_CHANGES changes
+** further, the index is still used: the slots its change log lists since the
+** index's generation are ignored in the index and searched one by one
+** instead. Past that (or once the log no longer reaches that far), the index
+** is built again at the next search.
+**
+** The index is kept by the library that serves the searches. In fork mode,
+** the parent builds it whenever the library changed too much, so that
+** children inherit it when forked, and use it with the change logs of the
+** snapshots they serve.
+*/
+
+typedef struct library_search_index {
+    uint64_t epoch;            // of the library it was built from
+    uint64_t generation;
+    uint32_t *offsets;         // of each posting list in postings, and the end
+    uint32_t *postings;
+} LibrarySearchIndex;
+
+typedef struct library_search_match {
+    uint32_t index;            // of the file in the library
+    uint32_t rank;             // lower is better
+} LibrarySearchMatch;
+
+
+/*
+** Search library, of generation with the change log log (NULL if it has
+** none), for the files matching query, with the search index of owner (the
+** indexed library of this process, it may be library itself), which is
+** built again if it is too old.
+**
+** The matches are stored in matches (to be freed), best first, at most
+** SEARCH_MAX_RESULTS of them.
+**
+** returns the number of matches, -1 on error
+*/
+int library_search(const Library *owner, const Library *library, const LibraryChangeLog *log,
+                   uint64_t generation, const char *query, LibrarySearchMatch **matches);
+
+/*
+** Build the search index of library again if it changed too much since it
+** was built. Only the fork mode parent calls it, others build it on demand.
+**
+** returns 0 on success, -1 on error
+*/
+int library_search_refresh(const Library *library);
+
+/*
+** Free a search index
+*/
+void library_search_free(LibrarySearchIndex *index);
+
+#endif // AS_SEARCH_H_
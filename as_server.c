@@ -3,6 +3,24 @@
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
 #include "as_server.h"
+#include "as_cache.h"
+#include "as_egress.h"
+#include "as_epoll.h"
+#include "as_library.h"
+#include "as_metadata.h"
+#include "as_mux.h"
+#include "as_prefork.h"
+#include "as_scan.h"
+#include "as_search.h"
+#include "as_snapshot.h"
+#include "as_store.h"
+#include "as_uring.h"
+#include "as_watch.h"
+
+// Pacing of STREAM_AT responses, from the options of the server (inherited
+// by the processes serving clients), see pace_response
+static double pace_multiple = 0;
+static double send_ahead_sec = STREAM_SEND_AHEAD_SEC;
 
 int init_server_addr(int port, struct sockaddr_in *addr)
 {
@@ -19,7 +37,7 @@ int init_server_addr(int port, struct sockaddr_in *addr)
     return 0;
 }
 
-int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue)
+static int _set_up_socket(const struct sockaddr_in *server_options, int num_queue, int reuse_port)
 {
     int soc = socket(AF_INET, SOCK_STREAM, 0);
     if (soc < 0)
@@ -41,6 +59,15 @@ int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue
         exit(1);
     }
 
+    // Let several sockets, one per worker, listen on the same port.
+    // The kernel spreads incoming connections between them.
+    if (reuse_port &&
+        setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, (const char *)&on, sizeof(on)) < 0)
+    {
+        perror("setsockopt");
+        exit(1);
+    }
+
     // Associate the process with the address and a port
     if (bind(soc, (struct sockaddr *)server_options, sizeof(*server_options)) < 0)
     {
@@ -64,6 +91,16 @@ int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue
     return soc;
 }
 
+int set_up_server_socket(const struct sockaddr_in *server_options, int num_queue)
+{
+    return _set_up_socket(server_options, num_queue, 0);
+}
+
+int set_up_reuseport_server_socket(const struct sockaddr_in *server_options, int num_queue)
+{
+    return _set_up_socket(server_options, num_queue, 1);
+}
+
 ClientSocket accept_connection(int listenfd)
 {
     ClientSocket client;
@@ -83,450 +120,2135 @@ ClientSocket accept_connection(int listenfd)
     return client;
 }
 
-int list_request_response(const ClientSocket *client, const Library *library)
+static void _unpack_stream_range_params(const uint8_t *params, Request *request)
 {
-    if (client == NULL || library == NULL)
-    {
-        ERR_PRINT("list_request_response: invalid inputs");
-        exit(-1);
-    }
+    uint32_t net_file_index;
+    uint64_t net_offset;
+    uint64_t net_length;
+    memcpy(&net_file_index, params, sizeof(net_file_index));
+    memcpy(&net_offset, params + sizeof(net_file_index), sizeof(net_offset));
+    memcpy(&net_length, params + sizeof(net_file_index) + sizeof(net_offset), sizeof(net_length));
+    request->file_index = ntohl(net_file_index);
+    request->offset = be64toh(net_offset);
+    request->length = be64toh(net_length);
+}
 
-    // Calculate the response length
-    int response_length = 0;
-    for (int i = 0; i < library->num_files; i++)
+/*
+** Parse the version out of a "VERSION <version>" request line of line_length
+** bytes.
+**
+** return 0 on success, -1 if the line is not a VERSION request
+*/
+static int _parse_version_request(const char *line, int line_length, uint32_t *version)
+{
+    int prefix_length = strlen(REQUEST_VERSION " ");
+    if (line_length <= prefix_length || line_length - prefix_length > 10 ||
+        memcmp(line, REQUEST_VERSION " ", prefix_length) != 0)
     {
-        // +3 for the ": " and \n, +4 for the index (allowing up to 9999 files)
-        response_length += strlen(library->files[i]) + 7;
+        return -1;
     }
 
-    // Allocate memory for the response
-    char *response = malloc(response_length + 1); // +1 for the null terminator
-    if (response == NULL)
+    char digits[11];
+    memcpy(digits, line + prefix_length, line_length - prefix_length);
+    digits[line_length - prefix_length] = '\0';
+
+    char *end;
+    unsigned long requested = strtoul(digits, &end, 10);
+    if (*end != '\0' || requested > UINT32_MAX)
     {
-        ERR_PRINT("list_request_response: malloc failed");
         return -1;
     }
-    response[0] = '\0'; // Initialize the string
+    *version = requested;
+    return 0;
+}
 
-    // Append the files in REVERSE ORDER!!!
-    for (int i = library->num_files - 1; i >= 0; i--)
+/*
+** Parse the arguments of a "LIST <position> <most files> <extension>[ <prefix>]"
+** request line of line_length bytes into request.
+**
+** return 0 on success, -1 if the line is not a LIST page request
+*/
+static int _parse_list_page_request(const char *line, int line_length, Request *request)
+{
+    int prefix_length = strlen(REQUEST_LIST " ");
+    if (line_length <= prefix_length || line_length >= REQUEST_BUFFER_SIZE ||
+        memcmp(line, REQUEST_LIST " ", prefix_length) != 0)
     {
-        char line[response_length + 1]; // +1 for null terminator
-        int chars_written = snprintf(line, response_length + 1, "%d: %s\r\n", i, library->files[i]);
-        if (chars_written < 0 || chars_written > response_length)
-        {
-            ERR_PRINT("list_request_response: snprintf failed");
-            free(response);
-            return -1;
-        }
-        strcat(response, line);
+        return -1;
     }
 
-    int bytes_sent = write(client->socket, response, strlen(response));
-    if (bytes_sent < 0)
+    char args[REQUEST_BUFFER_SIZE];
+    memcpy(args, line + prefix_length, line_length - prefix_length);
+    args[line_length - prefix_length] = '\0';
+
+    char *end;
+    unsigned long position = strtoul(args, &end, 10);
+    if (end == args || *end != ' ' || position > UINT32_MAX)
     {
-        perror("list_request_response: write failed");
-        free(response);
         return -1;
     }
-
-    free(response);
-    return library->num_files;
-}
-
-static int _load_file_size_into_buffer(FILE *file, uint8_t *buffer)
-{
-    if (fseek(file, 0, SEEK_END) < 0)
+    char *limit = end + 1;
+    unsigned long most_files = strtoul(limit, &end, 10);
+    if (end == limit || *end != ' ' || most_files > UINT32_MAX)
     {
-        ERR_PRINT("Error seeking to end of file\n");
         return -1;
     }
-    uint32_t file_size = ftell(file);
-    if (fseek(file, 0, SEEK_SET) < 0)
+    char *extension = end + 1;
+    char *space = strchr(extension, ' ');
+    const char *path_prefix = space != NULL ? space + 1 : "";
+    if (space != NULL)
+    {
+        *space = '\0';
+    }
+    if (*extension == '\0' || strlen(extension) >= LIST_EXTENSION_MAX ||
+        strlen(path_prefix) >= MAX_PATH)
     {
-        ERR_PRINT("Error seeking to start of file\n");
         return -1;
     }
-    buffer[0] = (file_size >> 24) & 0xFF;
-    buffer[1] = (file_size >> 16) & 0xFF;
-    buffer[2] = (file_size >> 8) & 0xFF;
-    buffer[3] = file_size & 0xFF;
+
+    request->offset = position;
+    request->length = most_files;
+    strcpy(request->extension, extension);
+    strcpy(request->prefix, path_prefix);
     return 0;
 }
 
-int stream_request_response(const ClientSocket *client, const Library *library,
-                            uint8_t *post_req, int num_pr_bytes)
+/*
+** Parse a "LIST_DELTA <epoch> <generation>" request line of line_length bytes
+** into request.
+**
+** returns 0 on success, -1 if it is not one
+*/
+static int _parse_list_delta_request(const char *line, int line_length, Request *request)
 {
-    uint32_t file_index;
-    uint8_t file_index_bytes[4];
-
-    // Copy all of the bytes already received
-    memcpy(file_index_bytes, post_req, num_pr_bytes);
-
-    // Read the remaining bytes of the file index if there are some bytes lacking
-    int bytes_needed = 4 - num_pr_bytes;
-    if (bytes_needed > 0)
+    int prefix_length = strlen(REQUEST_LIST_DELTA " ");
+    // Two 64-bit numbers and a space at most
+    if (line_length <= prefix_length || line_length - prefix_length > 41 ||
+        memcmp(line, REQUEST_LIST_DELTA " ", prefix_length) != 0)
     {
-        ssize_t n = read(client->socket, file_index_bytes + num_pr_bytes, bytes_needed);
-        if (n < bytes_needed)
-        {
-            ERR_PRINT("stream_request_response: Failed to read the complete file index from client");
-            return -1;
-        }
+        return -1;
     }
 
-    // Convert the file index back from network byte order to host byte order
-    file_index = ntohl(*(uint32_t *)file_index_bytes);
+    char args[42];
+    memcpy(args, line + prefix_length, line_length - prefix_length);
+    args[line_length - prefix_length] = '\0';
 
-    // Validate the file index.
-    // The file index should be less then or equal to the total number files.
-    if (file_index >= library->num_files)
+    char *end;
+    unsigned long long epoch = strtoull(args, &end, 10);
+    if (end == args || *end != ' ')
     {
-        ERR_PRINT("stream_request_response: Invalid file index requested");
         return -1;
     }
-
-    // Open the requested file with "rb" flag to read out the binary information.
-    char *file_path = _join_path(library->path, library->files[file_index]);
-    FILE *file = fopen(file_path, "rb");
-    if (!file)
+    char *generation_str = end + 1;
+    unsigned long long generation = strtoull(generation_str, &end, 10);
+    if (end == generation_str || *end != '\0')
     {
-        ERR_PRINT("stream_request_response: Failed to open requested file");
-        fclose(file);
         return -1;
     }
+    request->epoch = epoch;
+    request->generation = generation;
+    return 0;
+}
 
-    // Since we know for sure that the file size is the first four bytes,
-    // prepare the buffer manually and load it with the provided helper function.
-    uint8_t file_size_buffer[4];
-    if (_load_file_size_into_buffer(file, file_size_buffer) != 0)
+/*
+** Parse a "SEARCH <query>" request line of line_length bytes into request.
+**
+** returns 0 on success, -1 if it is not one
+*/
+static int _parse_search_request(const char *line, int line_length, Request *request)
+{
+    int prefix_length = strlen(REQUEST_SEARCH " ");
+    if (line_length <= prefix_length || line_length - prefix_length >= MAX_PATH ||
+        memcmp(line, REQUEST_SEARCH " ", prefix_length) != 0)
     {
-        fclose(file);
         return -1;
     }
+    memcpy(request->prefix, line + prefix_length, line_length - prefix_length);
+    request->prefix[line_length - prefix_length] = '\0';
+    return 0;
+}
 
-    // Send the file size to the client.
-    if (write(client->socket, file_size_buffer, sizeof(file_size_buffer)) != sizeof(file_size_buffer))
+/*
+** Parse a "STREAM_ID <file id>" request line of line_length bytes into
+** request.
+**
+** returns 0 on success, -1 if it is not one
+*/
+static int _parse_stream_id_request(const char *line, int line_length, Request *request)
+{
+    int prefix_length = strlen(REQUEST_STREAM_ID " ");
+    // A 64-bit number at most
+    if (line_length <= prefix_length || line_length - prefix_length > 20 ||
+        memcmp(line, REQUEST_STREAM_ID " ", prefix_length) != 0 ||
+        !isdigit((unsigned char)line[prefix_length]))
     {
-        ERR_PRINT("stream_request_response: Failed to send file size to client");
-        fclose(file);
         return -1;
     }
 
-    // After sending the file size, the rest of the file should be sent to the client,
-    // separated over multiple chunks with pre-defined chunk size.
-    uint8_t data_chunk[STREAM_CHUNK_SIZE];
-    size_t bytes_read;
+    char digits[21];
+    memcpy(digits, line + prefix_length, line_length - prefix_length);
+    digits[line_length - prefix_length] = '\0';
 
-    // This loop condition for the while loop seperates the data into multiplke chunks and...
-    while ((bytes_read = fread(data_chunk, 1, sizeof(data_chunk), file)) > 0)
+    char *end;
+    errno = 0;
+    unsigned long long file_id = strtoull(digits, &end, 10);
+    if (*end != '\0' || errno == ERANGE)
     {
-        // ...this if statement condition sends it one by one!
-        if (write(client->socket, data_chunk, bytes_read) != bytes_read)
-        {
-            ERR_PRINT("stream_request_response: Failed to send data chunk to client");
-            fclose(file);
-            return -1;
-        }
+        return -1;
     }
-
-    free(file_path);
-    fclose(file);
+    request->file_id = file_id;
     return 0;
 }
 
-static Library make_library(const char *path)
+/*
+** Parse a "STREAM_PATH <path>" request line of line_length bytes into request.
+**
+** returns 0 on success, -1 if it is not one
+*/
+static int _parse_stream_path_request(const char *line, int line_length, Request *request)
 {
-    Library library;
-    library.path = path;
-    library.num_files = 0;
-    library.files = NULL;
-    library.name = "server";
-
-    printf("Initializing library\n");
-    printf("Library path: %s\n", library.path);
-
-    return library;
+    int prefix_length = strlen(REQUEST_STREAM_PATH " ");
+    if (line_length <= prefix_length || line_length - prefix_length >= MAX_PATH ||
+        memcmp(line, REQUEST_STREAM_PATH " ", prefix_length) != 0)
+    {
+        return -1;
+    }
+    memcpy(request->prefix, line + prefix_length, line_length - prefix_length);
+    request->prefix[line_length - prefix_length] = '\0';
+    return 0;
 }
 
-static void _wait_for_children(pid_t **client_conn_pids, int *num_connected_clients, uint8_t immediate)
+/*
+** Parse an "INFO <index>" request line of line_length bytes into request.
+**
+** returns 0 on success, -1 if it is not one
+*/
+static int _parse_info_request(const char *line, int line_length, Request *request)
 {
-    int status;
-    for (int i = 0; i < *num_connected_clients; i++)
+    int prefix_length = strlen(REQUEST_INFO " ");
+    // A 32-bit number at most
+    if (line_length <= prefix_length || line_length - prefix_length > 10 ||
+        memcmp(line, REQUEST_INFO " ", prefix_length) != 0 ||
+        !isdigit((unsigned char)line[prefix_length]))
     {
-        int options = immediate ? WNOHANG : 0;
-        if (waitpid((*client_conn_pids)[i], &status, options) > 0)
-        {
-            if (WIFEXITED(status))
-            {
-                printf("Client process %d terminated\n", (*client_conn_pids)[i]);
-                if (WEXITSTATUS(status) != 0)
-                {
-                    fprintf(stderr, "Client process %d exited with status %d\n",
-                            (*client_conn_pids)[i], WEXITSTATUS(status));
-                }
-            }
-            else
-            {
-                fprintf(stderr, "Client process %d terminated abnormally\n",
-                        (*client_conn_pids)[i]);
-            }
+        return -1;
+    }
 
-            for (int j = i; j < *num_connected_clients - 1; j++)
-            {
-                (*client_conn_pids)[j] = (*client_conn_pids)[j + 1];
-            }
+    char digits[11];
+    memcpy(digits, line + prefix_length, line_length - prefix_length);
+    digits[line_length - prefix_length] = '\0';
 
-            (*num_connected_clients)--;
-            *client_conn_pids = (pid_t *)realloc(*client_conn_pids,
-                                                 (*num_connected_clients) * sizeof(pid_t));
-        }
+    char *end;
+    unsigned long long file_index = strtoull(digits, &end, 10);
+    if (*end != '\0' || file_index > UINT32_MAX)
+    {
+        return -1;
     }
+    request->file_index = file_index;
+    return 0;
 }
 
 /*
-** Create a server socket and listen for connections
-**
-** port: the port number to listen on.
+** Parse a "STREAM_AT <index> <milliseconds>" request line of line_length
+** bytes into request.
 **
-** On success, returns the file descriptor of the socket.
-** On failure, return -1.
+** returns 0 on success, -1 if it is not one
 */
-static int initialize_server_socket(int port)
+static int _parse_stream_at_request(const char *line, int line_length, Request *request)
 {
+    int prefix_length = strlen(REQUEST_STREAM_AT " ");
+    // A 32-bit and a 64-bit number at most
+    if (line_length <= prefix_length || line_length - prefix_length > 10 + 1 + 20 ||
+        memcmp(line, REQUEST_STREAM_AT " ", prefix_length) != 0 ||
+        !isdigit((unsigned char)line[prefix_length]))
+    {
+        return -1;
+    }
 
-    struct sockaddr_in server_addr;
+    char digits[10 + 1 + 20 + 1];
+    memcpy(digits, line + prefix_length, line_length - prefix_length);
+    digits[line_length - prefix_length] = '\0';
 
-    // Initialize the address with provided information.
-    if (init_server_addr(port, &server_addr) < 0)
+    char *end;
+    unsigned long long file_index = strtoull(digits, &end, 10);
+    if (*end != ' ' || file_index > UINT32_MAX || !isdigit((unsigned char)end[1]))
     {
-        fprintf(stderr, "Initializing_server_socket: failed initializing server_addr\n");
         return -1;
     }
-
-    // fromo the header file, it is specified that the number of maximum pending connection is MAX_PENDING, which is 10.
-    int listenfd = set_up_server_socket(&server_addr, MAX_PENDING);
-    if (listenfd < 0)
+    errno = 0;
+    unsigned long long position_ms = strtoull(end + 1, &end, 10);
+    if (*end != '\0' || errno == ERANGE)
     {
-        fprintf(stderr, "Initializing_server_socket: failed to set up the lisenting end of the socket fd\n");
         return -1;
     }
-
-    return listenfd;
+    request->file_index = file_index;
+    request->position_ms = position_ms;
+    return 0;
 }
 
-int run_server(int port, const char *library_directory)
+int parse_request(const uint8_t *buf, int bytes_in_buf, Request *request)
 {
-    Library library = make_library(library_directory);
-    if (scan_library(&library) < 0)
+    const uint8_t *newline = memmem(buf, bytes_in_buf, END_OF_MESSAGE_TOKEN,
+                                    strlen(END_OF_MESSAGE_TOKEN));
+    if (newline == NULL)
     {
-        ERR_PRINT("Error scanning library\n");
-        return -1;
+        return 0;
     }
+    int line_length = newline - buf;
+    int consumed = line_length + strlen(END_OF_MESSAGE_TOKEN);
 
-    int num_connected_clients = 0;
-    pid_t *client_conn_pids = NULL;
-
-    int incoming_connections = initialize_server_socket(port);
-    if (incoming_connections == -1)
+    if (line_length == strlen(REQUEST_LIST) &&
+        memcmp(buf, REQUEST_LIST, line_length) == 0)
     {
-        return -1;
+        request->type = REQUEST_TYPE_LIST;
     }
-
-    int maxfd = incoming_connections;
-    fd_set incoming;
-    SET_SERVER_FD_SET(incoming, incoming_connections);
-    int num_intervals_without_scan = 0;
-
-    while (1)
+    else if (line_length == strlen(REQUEST_STREAM) &&
+             memcmp(buf, REQUEST_STREAM, line_length) == 0)
     {
-        if (num_intervals_without_scan >= LIBRARY_SCAN_INTERVAL)
+        // The file index follows the request line
+        if (bytes_in_buf - consumed < sizeof(uint32_t))
         {
-            if (scan_library(&library) < 0)
-            {
-                fprintf(stderr, "Error scanning library\n");
-                return 1;
-            }
-            num_intervals_without_scan = 0;
-        }
-
-        struct timeval select_timeout = SELECT_TIMEOUT;
-        if (select(maxfd + 1, &incoming, NULL, NULL, &select_timeout) < 0)
-        {
-            perror("run_server");
-            exit(1);
-        }
-
-        if (FD_ISSET(incoming_connections, &incoming))
-        {
-            ClientSocket client_socket = accept_connection(incoming_connections);
-
-            pid_t pid = fork();
-            if (pid == -1)
-            {
-                perror("run_server");
-                exit(-1);
-            }
-            // child process
-            if (pid == 0)
-            {
-                close(incoming_connections);
-                free(client_conn_pids);
-                int result = handle_client(&client_socket, &library);
-                _free_library(&library);
-                close(client_socket.socket);
-                return result;
-            }
-            close(client_socket.socket);
-            num_connected_clients++;
-            client_conn_pids = (pid_t *)realloc(client_conn_pids,
-                                                (num_connected_clients) * sizeof(pid_t));
-            client_conn_pids[num_connected_clients - 1] = pid;
+            return 0;
         }
-        if (FD_ISSET(STDIN_FILENO, &incoming))
+        uint32_t net_file_index;
+        memcpy(&net_file_index, buf + consumed, sizeof(net_file_index));
+        request->type = REQUEST_TYPE_STREAM;
+        request->file_index = ntohl(net_file_index);
+        consumed += sizeof(net_file_index);
+    }
+    else if (line_length == strlen(REQUEST_STREAM_RANGE) &&
+             memcmp(buf, REQUEST_STREAM_RANGE, line_length) == 0)
+    {
+        if (bytes_in_buf - consumed < STREAM_RANGE_PARAMS_SIZE)
         {
-            if (getchar() == 'q')
-                break;
+            return 0;
         }
-
-        num_intervals_without_scan++;
-        SET_SERVER_FD_SET(incoming, incoming_connections);
-
-        // Immediate return wait for client processes
-        _wait_for_children(&client_conn_pids, &num_connected_clients, 1);
+        request->type = REQUEST_TYPE_STREAM_RANGE;
+        _unpack_stream_range_params(buf + consumed, request);
+        consumed += STREAM_RANGE_PARAMS_SIZE;
+    }
+    else if (line_length == strlen(REQUEST_MUX) &&
+             memcmp(buf, REQUEST_MUX, line_length) == 0)
+    {
+        request->type = REQUEST_TYPE_MUX;
+    }
+    else if (_parse_version_request((const char *)buf, line_length, &request->version) == 0)
+    {
+        request->type = REQUEST_TYPE_VERSION;
+    }
+    else if (_parse_list_page_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_LIST_PAGE;
+    }
+    else if (_parse_list_delta_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_LIST_DELTA;
+    }
+    else if (_parse_search_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_SEARCH;
+    }
+    else if (_parse_stream_id_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_STREAM_ID;
+    }
+    else if (_parse_stream_path_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_STREAM_PATH;
+    }
+    else if (_parse_info_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_INFO;
+    }
+    else if (_parse_stream_at_request((const char *)buf, line_length, request) == 0)
+    {
+        request->type = REQUEST_TYPE_STREAM_AT;
+    }
+    else
+    {
+        ERR_PRINT("Unknown request: %.*s\n", line_length, buf);
+        request->type = REQUEST_TYPE_UNKNOWN;
     }
 
-    printf("Quitting server\n");
-    close(incoming_connections);
-    _wait_for_children(&client_conn_pids, &num_connected_clients, 0);
-    _free_library(&library);
-    return 0;
+    return consumed;
 }
 
-static uint8_t _is_file_extension_supported(const char *filename)
+static int _num_digits(uint32_t n)
 {
-    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
+    int digits = 1;
+    while (n >= 10)
+    {
+        n /= 10;
+        digits++;
+    }
+    return digits;
+}
 
-    for (int i = 0; i < sizeof(supported_file_exts) / sizeof(char *); i++)
+/*
+** Write the LIST response of library into a new buffer, in one pass over
+** the files to size it and one to fill it. If compact, the files are
+** numbered from 0 without the removed ones (see _legacy_file_index),
+** otherwise by their index.
+**
+** return the buffer (*length bytes and a null terminator), NULL on error
+*/
+static char *_serialize_list(const Library *library, int compact, size_t *length)
+{
+    size_t list_length = 0;
+    uint32_t num_listed = 0;
+    for (uint32_t i = 0; i < library->num_files; i++)
     {
-        char *files_ext = strrchr(filename, '.');
-        if (files_ext != NULL && strcmp(files_ext, supported_file_exts[i]) == 0)
+        // +4 for the ": " and \r\n
+        if (library_has_file(library, i))
         {
-            return 1;
+            list_length += _num_digits(compact ? num_listed : i) +
+                           strlen(library->files[i]) + 4;
+            num_listed++;
+        }
+    }
+
+    char *list = malloc(list_length + 1);
+    if (list == NULL)
+    {
+        ERR_PRINT("list_request_response: malloc failed");
+        return NULL;
+    }
+
+    // Append the files in REVERSE ORDER!!! Removed files keep their index
+    // free, unless compact.
+    char *end = list;
+    *end = '\0';
+    for (uint32_t i = library->num_files; i-- > 0;)
+    {
+        if (library_has_file(library, i))
+        {
+            num_listed--;
+            end += sprintf(end, "%u: %s\r\n", compact ? num_listed : i, library->files[i]);
+        }
+    }
+    *length = end - list;
+    return list;
+}
+
+/*
+** returns a memfd holding the LIST response of the current generation of
+** the indexed library (*size bytes), written only if the library changed
+** since the last call, -1 on error. The library owns it.
+*/
+static int _list_file(const Library *library, off_t *size)
+{
+    LibraryIndex *index = library->index;
+    if (index->list_fd == -1 || index->list_generation != index->generation)
+    {
+        size_t length;
+        char *list = _serialize_list(library, 0, &length);
+        if (list == NULL)
+        {
+            return -1;
+        }
+        // A new file, responses still being sent keep the previous one open
+        int fd = memfd_create("as_list", MFD_CLOEXEC);
+        if (fd == -1 || write_precisely(fd, list, length) != length)
+        {
+            perror("list_request_response: memfd");
+            if (fd != -1)
+            {
+                close(fd);
+            }
+            free(list);
+            return -1;
+        }
+        free(list);
+        if (index->list_fd != -1)
+        {
+            close(index->list_fd);
+        }
+        index->list_fd = fd;
+        index->list_size = length;
+        index->list_generation = index->generation;
+    }
+    *size = index->list_size;
+    return index->list_fd;
+}
+
+int prepare_list_response(const Library *library, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    // Sent from the library's LIST file, not copied into the response
+    if (library->index != NULL)
+    {
+        off_t size;
+        int fd = _list_file(library, &size);
+        if (fd == -1)
+        {
+            return -1;
+        }
+        response->file_fd = dup(fd);
+        if (response->file_fd == -1)
+        {
+            perror("list_request_response: dup");
+            return -1;
+        }
+        response->file_end = size;
+        return 0;
+    }
+
+    size_t length;
+    char *list = _serialize_list(library, 0, &length);
+    if (list == NULL)
+    {
+        return -1;
+    }
+    response->head = (uint8_t *)list;
+    response->head_len = length;
+    return 0;
+}
+
+/*
+** Write the lines of the files of the LIST page request to list, unless it
+** is NULL.
+**
+** return the length of the lines
+*/
+static size_t _write_list_page(const Library *library, const uint32_t *sorted,
+                               uint32_t num_sorted, const Request *request, char *list)
+{
+    size_t prefix_length = strlen(request->prefix);
+    int any_extension = strcmp(request->extension, LIST_ANY_EXTENSION) == 0;
+
+    // The files under the prefix are next to each other, from first on
+    uint32_t first = library_lower_bound(library, sorted, num_sorted, request->prefix);
+    uint64_t skipped = 0;
+    if (any_extension)
+    {
+        skipped = MIN(request->offset, num_sorted - first);
+        first += skipped;
+    }
+
+    size_t length = 0;
+    uint64_t listed = 0;
+    for (uint32_t i = first; i < num_sorted && (request->length == 0 || listed < request->length);
+         i++)
+    {
+        const char *path = library->files[sorted[i]];
+        if (strncmp(path, request->prefix, prefix_length) != 0)
+        {
+            break;
+        }
+        if (!any_extension)
+        {
+            const char *extension = strrchr(path, '.');
+            if (extension == NULL || strcmp(extension, request->extension) != 0)
+            {
+                continue;
+            }
+        }
+        if (skipped < request->offset)
+        {
+            skipped++;
+            continue;
+        }
+        listed++;
+        // +4 for the ": " and \r\n
+        length += list != NULL ? sprintf(list + length, "%u: %s\r\n", sorted[i], path)
+                               : _num_digits(sorted[i]) + strlen(path) + 4;
+    }
+    return length;
+}
+
+int prepare_list_page_response(const Library *library, const uint32_t *sorted,
+                               uint32_t num_sorted, const Request *request,
+                               Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    size_t length = _write_list_page(library, sorted, num_sorted, request, NULL);
+    // The page ends with an empty line, +1 for the null terminator
+    char *list = malloc(length + strlen(END_OF_MESSAGE_TOKEN) + 1);
+    if (list == NULL)
+    {
+        ERR_PRINT("prepare_list_page_response: malloc failed\n");
+        return -1;
+    }
+    _write_list_page(library, sorted, num_sorted, request, list);
+    strcpy(list + length, END_OF_MESSAGE_TOKEN);
+
+    response->head = (uint8_t *)list;
+    response->head_len = length + strlen(END_OF_MESSAGE_TOKEN);
+    return 0;
+}
+
+/*
+** Write the lines of the changed slots (num_slots of them) of library to
+** list, unless it is NULL.
+**
+** return the length of the lines
+*/
+static size_t _write_list_delta(const Library *library, const uint32_t *slots,
+                                uint32_t num_slots, char *list)
+{
+    size_t length = 0;
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+        if (library_has_file(library, slots[i]))
+        {
+            // +5 for the "+", ": " and \r\n
+            const char *path = library->files[slots[i]];
+            length += list != NULL ? sprintf(list + length, "+%u: %s\r\n", slots[i], path)
+                                   : _num_digits(slots[i]) + strlen(path) + 5;
+        }
+        else
+        {
+            // +3 for the "-" and \r\n
+            length += list != NULL ? sprintf(list + length, "-%u\r\n", slots[i])
+                                   : _num_digits(slots[i]) + 3;
+        }
+    }
+    return length;
+}
+
+int prepare_list_delta_response(const Library *library, const struct library_change_log *log,
+                                uint64_t generation, const Request *request,
+                                Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    uint32_t *slots = NULL;
+    int num_slots = -1;
+    if (log != NULL && request->epoch == log->epoch)
+    {
+        num_slots = library_changed_slots(log, generation, request->generation, &slots);
+    }
+
+    // "RESYNC <epoch> <generation>\r\n" or "DELTA ...", up to 20 digits each
+    char first_line[64];
+    int first_length = snprintf(first_line, sizeof(first_line), "%s %llu %llu%s",
+                                num_slots < 0 ? RESPONSE_RESYNC : RESPONSE_DELTA,
+                                (unsigned long long)(log != NULL ? log->epoch : 0),
+                                (unsigned long long)generation, END_OF_MESSAGE_TOKEN);
+    size_t length = num_slots > 0 ? _write_list_delta(library, slots, num_slots, NULL) : 0;
+    // The response ends with an empty line, +1 for the null terminator
+    char *list = malloc(first_length + length + strlen(END_OF_MESSAGE_TOKEN) + 1);
+    if (list == NULL)
+    {
+        ERR_PRINT("prepare_list_delta_response: malloc failed\n");
+        free(slots);
+        return -1;
+    }
+    memcpy(list, first_line, first_length);
+    if (num_slots > 0)
+    {
+        _write_list_delta(library, slots, num_slots, list + first_length);
+    }
+    strcpy(list + first_length + length, END_OF_MESSAGE_TOKEN);
+    free(slots);
+
+    response->head = (uint8_t *)list;
+    response->head_len = first_length + length + strlen(END_OF_MESSAGE_TOKEN);
+    return 0;
+}
+
+int prepare_search_response(const Library *owner, const Library *library,
+                            const struct library_change_log *log, uint64_t generation,
+                            const Request *request, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    LibrarySearchMatch *matches;
+    int num_matches = library_search(owner, library, log, generation, request->prefix, &matches);
+    if (num_matches < 0)
+    {
+        return -1;
+    }
+    size_t length = 0;
+    for (int i = 0; i < num_matches; i++)
+    {
+        // +4 for the ": " and \r\n
+        length += _num_digits(matches[i].index) + strlen(library->files[matches[i].index]) + 4;
+    }
+    // The results end with an empty line, +1 for the null terminator
+    char *list = malloc(length + strlen(END_OF_MESSAGE_TOKEN) + 1);
+    if (list == NULL)
+    {
+        ERR_PRINT("prepare_search_response: malloc failed\n");
+        free(matches);
+        return -1;
+    }
+    length = 0;
+    for (int i = 0; i < num_matches; i++)
+    {
+        length += sprintf(list + length, "%u: %s\r\n", matches[i].index,
+                          library->files[matches[i].index]);
+    }
+    strcpy(list + length, END_OF_MESSAGE_TOKEN);
+    free(matches);
+
+    response->head = (uint8_t *)list;
+    response->head_len = length + strlen(END_OF_MESSAGE_TOKEN);
+    return 0;
+}
+
+/*
+** Send a prepared response on a blocking socket, then free it.
+**
+** return 0 on success, -1 on error
+*/
+static int _send_whole_response(const ClientSocket *client, Response *response)
+{
+    int result;
+    while ((result = send_response(client->socket, response)) == 0)
+        ;
+    free_response(response);
+    return result < 0 ? -1 : 0;
+}
+
+int list_request_response(const ClientSocket *client, const Library *library)
+{
+    if (client == NULL || library == NULL)
+    {
+        ERR_PRINT("list_request_response: invalid inputs");
+        exit(-1);
+    }
+
+    Response response;
+    if (prepare_list_response(library, &response) < 0)
+    {
+        return -1;
+    }
+
+    if (_send_whole_response(client, &response) < 0)
+    {
+        ERR_PRINT("list_request_response: write failed\n");
+        return -1;
+    }
+    return library->num_files;
+}
+
+/*
+** Write file_size into buffer in network byte-order, as the 32 or 64-bit
+** integer the protocol version calls for.
+**
+** return the number of bytes written
+*/
+static int _load_file_size_into_buffer(off_t file_size, uint32_t version, uint8_t *buffer)
+{
+    if (version >= PROTOCOL_VERSION_LARGE_FILES)
+    {
+        uint64_t net_file_size = htobe64(file_size);
+        memcpy(buffer, &net_file_size, sizeof(net_file_size));
+        return sizeof(net_file_size);
+    }
+
+    uint32_t net_file_size = htonl(file_size);
+    memcpy(buffer, &net_file_size, sizeof(net_file_size));
+    return sizeof(net_file_size);
+}
+
+/*
+** Open file_index of the library for a STREAM request into response->file_fd,
+** and get its size.
+**
+** return 0 on success, -1 on error
+*/
+static int _open_library_file(const Library *library, uint32_t file_index,
+                              Response *response, off_t *file_size)
+{
+    // Validate the file index.
+    // The file index should be the index of a file still in the library.
+    if (!library_has_file(library, file_index))
+    {
+        ERR_PRINT("stream_request_response: Invalid file index requested");
+        return -1;
+    }
+
+    // Open the requested file read-only, its pages are handed straight to the socket.
+    char *file_path = _join_path(library->path, library->files[file_index]);
+    if (file_path == NULL)
+    {
+        return -1;
+    }
+    response->file_fd = open(file_path, O_RDONLY);
+    free(file_path);
+    if (response->file_fd < 0)
+    {
+        ERR_PRINT("stream_request_response: Failed to open requested file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(response->file_fd, &st) < 0)
+    {
+        ERR_PRINT("Error getting the size of the file\n");
+        return -1;
+    }
+    *file_size = st.st_size;
+    cache_played(library, file_index, &st);
+    return 0;
+}
+
+int prepare_stream_response(const Library *library, uint32_t file_index,
+                            uint32_t version, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    off_t file_size;
+    if (_open_library_file(library, file_index, response, &file_size) < 0)
+    {
+        free_response(response);
+        return -1;
+    }
+
+    // A truncated size would have the client stop in the middle of the file
+    if (version < PROTOCOL_VERSION_LARGE_FILES && file_size > UINT32_MAX)
+    {
+        ERR_PRINT("stream_request_response: File too large for a version %u client\n", version);
+        free_response(response);
+        return -1;
+    }
+
+    // The file size is the whole head, 4 or 8 bytes depending on the version
+    response->head = malloc(sizeof(uint64_t));
+    if (response->head == NULL)
+    {
+        perror("stream_request_response");
+        free_response(response);
+        return -1;
+    }
+    response->head_len = _load_file_size_into_buffer(file_size, version, response->head);
+    response->file_end = file_size;
+
+    return 0;
+}
+
+int prepare_stream_range_response(const Library *library, uint32_t file_index,
+                                  uint64_t offset, uint64_t length, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    off_t file_size;
+    if (_open_library_file(library, file_index, response, &file_size) < 0)
+    {
+        free_response(response);
+        return -1;
+    }
+
+    // Clamp the range to the file, an empty range is still answered
+    uint64_t start = MIN(offset, (uint64_t)file_size);
+    uint64_t end = (length == 0 || length > file_size - start) ? file_size : start + length;
+    response->file_offset = start;
+    response->file_end = end;
+
+    uint64_t net_sizes[2] = {htobe64(file_size), htobe64(end - start)};
+    response->head_len = sizeof(net_sizes);
+    response->head = malloc(response->head_len);
+    if (response->head == NULL)
+    {
+        perror("stream_range_request_response");
+        free_response(response);
+        return -1;
+    }
+    memcpy(response->head, net_sizes, sizeof(net_sizes));
+
+    return 0;
+}
+
+/*
+** returns the index of the file of library at path, found in its index or,
+** without one, in sorted (the num_sorted indices of its files by path), -1 if
+** there is none
+*/
+static int _find_path(const Library *library, const uint32_t *sorted, uint32_t num_sorted,
+                      const char *path)
+{
+    if (library->index != NULL)
+    {
+        return library_find_file(library, path);
+    }
+    if (sorted == NULL)
+    {
+        return -1;
+    }
+    uint32_t position = library_lower_bound(library, sorted, num_sorted, path);
+    if (position == num_sorted || strcmp(library->files[sorted[position]], path) != 0)
+    {
+        return -1;
+    }
+    return sorted[position];
+}
+
+int prepare_stream_file_response(const Library *library, const struct library_id_table *ids,
+                                 const uint32_t *sorted, uint32_t num_sorted,
+                                 const Request *request, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    int file_index = request->type == REQUEST_TYPE_STREAM_ID
+                         ? library_find_stable_id(library, ids, request->file_id)
+                         : _find_path(library, sorted, num_sorted, request->prefix);
+    off_t file_size = 0;
+    uint64_t file_id = 0;
+    if (file_index >= 0 && file_index < ids->num_ids)
+    {
+        if (_open_library_file(library, file_index, response, &file_size) < 0)
+        {
+            free_response(response);
+            return -1;
+        }
+        file_id = library_stable_id(&ids->ids[file_index]);
+    }
+
+    uint64_t net_head[2] = {htobe64(file_id), htobe64(file_size)};
+    response->head_len = sizeof(net_head);
+    response->head = malloc(response->head_len);
+    if (response->head == NULL)
+    {
+        perror("prepare_stream_file_response");
+        free_response(response);
+        return -1;
+    }
+    memcpy(response->head, net_head, sizeof(net_head));
+    response->file_end = file_size;
+
+    return 0;
+}
+
+int prepare_info_response(const Library *library, const struct library_metadata *metadata,
+                          const Request *request, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    LibraryMetadata none;
+    memset(&none, 0, sizeof(none));
+    if (metadata == NULL)
+    {
+        metadata = &none;
+    }
+    // Every field at its longest fits with room to spare
+    char line[256];
+    int length;
+    if (!library_has_file(library, request->file_index))
+    {
+        length = snprintf(line, sizeof(line), "%s", END_OF_MESSAGE_TOKEN);
+    }
+    else
+    {
+        length = snprintf(line, sizeof(line),
+                          "codec=%s duration_ms=%llu sample_rate=%u channels=%u "
+                          "bits_per_sample=%u bitrate=%u%s",
+                          library_codec_name(metadata->codec),
+                          (unsigned long long)metadata->duration_ms, metadata->sample_rate,
+                          metadata->channels, metadata->bits_per_sample, metadata->bitrate,
+                          END_OF_MESSAGE_TOKEN);
+    }
+
+    response->head = malloc(length + 1);
+    if (response->head == NULL)
+    {
+        perror("prepare_info_response");
+        return -1;
+    }
+    memcpy(response->head, line, length + 1);
+    response->head_len = length;
+    return 0;
+}
+
+int prepare_stream_at_response(const Library *library, const struct library_metadata *metadata,
+                               const Request *request, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    off_t file_size;
+    LibrarySeek seek;
+    if (_open_library_file(library, request->file_index, response, &file_size) < 0 ||
+        library_seek(response->file_fd, metadata, request->position_ms, &seek) < 0)
+    {
+        free_response(response);
+        return -1;
+    }
+    response->file_offset = seek.offset;
+    response->file_end = seek.end;
+    response->realtime = 1;
+
+    // Files of unknown bitrate aren't paced
+    double bytes_per_sec = seek.bitrate / 8.0;
+    if (pace_multiple > 0 && bytes_per_sec > 0)
+    {
+        double rate = bytes_per_sec * pace_multiple;
+        response->pace_rate = rate < UINT32_MAX - 1 ? (rate > 1 ? rate : 1) : UINT32_MAX - 1;
+        double send_ahead = bytes_per_sec * send_ahead_sec;
+        response->pace_offset = send_ahead < seek.end - seek.offset ? seek.offset + send_ahead
+                                                                     : seek.end;
+    }
+
+    // The position and size, then the headers the frames need
+    uint64_t net_head[2] = {htobe64(seek.position_ms),
+                            htobe64(seek.header_len + seek.end - seek.offset)};
+    response->head_len = sizeof(net_head) + seek.header_len;
+    response->head = malloc(response->head_len);
+    if (response->head == NULL)
+    {
+        perror("prepare_stream_at_response");
+        free(seek.header);
+        free_response(response);
+        return -1;
+    }
+    memcpy(response->head, net_head, sizeof(net_head));
+    if (seek.header_len > 0)
+    {
+        memcpy(response->head + sizeof(net_head), seek.header, seek.header_len);
+    }
+    free(seek.header);
+
+    return 0;
+}
+
+int prepare_version_response(uint32_t requested_version, uint32_t *version,
+                             Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    *version = MIN(requested_version, PROTOCOL_VERSION);
+    if (*version < PROTOCOL_VERSION_BASE)
+    {
+        *version = PROTOCOL_VERSION_BASE;
+    }
+
+    uint32_t net_version = htonl(*version);
+    response->head_len = sizeof(net_version);
+    response->head = malloc(response->head_len);
+    if (response->head == NULL)
+    {
+        perror("version_request_response");
+        return -1;
+    }
+    memcpy(response->head, &net_version, sizeof(net_version));
+    return 0;
+}
+
+int prepare_mux_response(int accepted, Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    uint32_t net_accepted = htonl(accepted ? 1 : 0);
+    response->head_len = sizeof(net_accepted);
+    response->head = malloc(response->head_len);
+    if (response->head == NULL)
+    {
+        perror("prepare_mux_response");
+        return -1;
+    }
+    memcpy(response->head, &net_accepted, sizeof(net_accepted));
+    return 0;
+}
+
+/*
+** Clients before PROTOCOL_VERSION_LIST_DELTA number the files of a LIST by
+** the order its lines arrive, so they don't see the holes left by removed
+** files: they are sent the files numbered from 0 without them, and the
+** indices they STREAM are mapped back to the library's.
+**
+** returns the index of the file numbered legacy_index, UINT32_MAX (an
+** invalid index) if there is none
+*/
+static uint32_t _legacy_file_index(const Library *library, uint32_t legacy_index)
+{
+    for (uint32_t i = 0; i < library->num_files; i++)
+    {
+        if (library_has_file(library, i) && legacy_index-- == 0)
+        {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+/*
+** Build the response to a LIST request of a client before
+** PROTOCOL_VERSION_LIST_DELTA (see _legacy_file_index), the same as
+** prepare_list_response while no file was removed.
+**
+** returns 0 on success, -1 on error
+*/
+static int _prepare_legacy_list_response(const Library *library, Response *response)
+{
+    uint32_t i = 0;
+    while (i < library->num_files && library_has_file(library, i))
+    {
+        i++;
+    }
+    if (i == library->num_files)
+    {
+        return prepare_list_response(library, response);
+    }
+
+    *response = (Response)EMPTY_RESPONSE;
+    size_t length;
+    char *list = _serialize_list(library, 1, &length);
+    if (list == NULL)
+    {
+        return -1;
+    }
+    response->head = (uint8_t *)list;
+    response->head_len = length;
+    return 0;
+}
+
+int prepare_response(const Library *library, const Request *request, uint32_t *version,
+                     Response *response)
+{
+    *response = (Response)EMPTY_RESPONSE;
+
+    uint32_t file_index = request->file_index;
+    if (*version < PROTOCOL_VERSION_LIST_DELTA && (request->type == REQUEST_TYPE_STREAM ||
+                                                   request->type == REQUEST_TYPE_STREAM_RANGE))
+    {
+        file_index = _legacy_file_index(library, file_index);
+    }
+
+    switch (request->type)
+    {
+    case REQUEST_TYPE_LIST:
+        if ((*version < PROTOCOL_VERSION_LIST_DELTA
+                 ? _prepare_legacy_list_response(library, response)
+                 : prepare_list_response(library, response)) < 0)
+        {
+            ERR_PRINT("Error handling LIST request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_STREAM:
+        if (prepare_stream_response(library, file_index, *version, response) < 0)
+        {
+            ERR_PRINT("Error handling STREAM request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_STREAM_RANGE:
+        if (prepare_stream_range_response(library, file_index, request->offset,
+                                          request->length, response) < 0)
+        {
+            ERR_PRINT("Error handling STREAM_RANGE request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_VERSION:
+        if (prepare_version_response(request->version, version, response) < 0)
+        {
+            ERR_PRINT("Error handling VERSION request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_LIST_PAGE:
+    {
+        uint32_t num_sorted;
+        const uint32_t *sorted = library_sorted_files(library, &num_sorted);
+        if (sorted == NULL ||
+            prepare_list_page_response(library, sorted, num_sorted, request, response) < 0)
+        {
+            ERR_PRINT("Error handling LIST page request\n");
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_LIST_DELTA:
+    {
+        const LibraryIndex *index = library->index;
+        if (prepare_list_delta_response(library, index != NULL ? &index->log : NULL,
+                                        index != NULL ? index->generation : 0,
+                                        request, response) < 0)
+        {
+            ERR_PRINT("Error handling LIST_DELTA request\n");
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_SEARCH:
+    {
+        const LibraryIndex *index = library->index;
+        if (prepare_search_response(library, library, index != NULL ? &index->log : NULL,
+                                    index != NULL ? index->generation : 0,
+                                    request, response) < 0)
+        {
+            ERR_PRINT("Error handling SEARCH request\n");
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_STREAM_ID:
+    case REQUEST_TYPE_STREAM_PATH:
+    {
+        // A library without an index has no files to find
+        LibraryIdTable ids = {0};
+        library_id_table(library, &ids);
+        if (prepare_stream_file_response(library, &ids, NULL, 0, request, response) < 0)
+        {
+            ERR_PRINT("Error handling %s request\n",
+                      request->type == REQUEST_TYPE_STREAM_ID ? REQUEST_STREAM_ID
+                                                              : REQUEST_STREAM_PATH);
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_INFO:
+        if (prepare_info_response(library, library_file_metadata(library, request->file_index),
+                                  request, response) < 0)
+        {
+            ERR_PRINT("Error handling INFO request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_STREAM_AT:
+        if (prepare_stream_at_response(library,
+                                       library_file_metadata(library, request->file_index),
+                                       request, response) < 0)
+        {
+            ERR_PRINT("Error handling STREAM_AT request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_MUX:
+        if (prepare_mux_response(0, response) < 0)
+        {
+            ERR_PRINT("Error handling MUX request\n");
+            return -1;
+        }
+        return 0;
+    default:
+        return 1;
+    }
+}
+
+/*
+** Send the head of a prepared STREAM or STREAM_RANGE response, then its file
+** range, on a blocking socket.
+**
+** return 0 on success, -1 on error
+*/
+static int _send_file_response(const ClientSocket *client, Response *response)
+{
+    // A single sendfile would keep the first share it got until the end
+    if (egress_enabled())
+    {
+        return _send_whole_response(client, response);
+    }
+
+    // Unpaced, even after a paced STREAM_AT
+    pace_response(client->socket, response);
+
+    // MSG_MORE lets the kernel put the head in the same segment as the start of the file.
+    if (send(client->socket, response->head, response->head_len, MSG_MORE) != response->head_len)
+    {
+        ERR_PRINT("stream_request_response: Failed to send file size to client");
+        return -1;
+    }
+
+    // After sending the head, the rest of the file goes from the page cache
+    // to the socket without being copied into this process.
+    off_t range_size = response->file_end - response->file_offset;
+    if (sendfile_precisely(client->socket, response->file_fd, &response->file_offset,
+                           range_size) != range_size)
+    {
+        ERR_PRINT("stream_request_response: Failed to send file to client");
+        return -1;
+    }
+    return 0;
+}
+
+int stream_request_response(const ClientSocket *client, const Library *library,
+                            uint8_t *post_req, int num_pr_bytes, uint32_t version)
+{
+    uint32_t file_index;
+    uint8_t file_index_bytes[4];
+
+    // Copy all of the bytes already received
+    memcpy(file_index_bytes, post_req, num_pr_bytes);
+
+    // Read the remaining bytes of the file index if there are some bytes lacking
+    int bytes_needed = 4 - num_pr_bytes;
+    if (bytes_needed > 0)
+    {
+        ssize_t n = read(client->socket, file_index_bytes + num_pr_bytes, bytes_needed);
+        if (n < bytes_needed)
+        {
+            ERR_PRINT("stream_request_response: Failed to read the complete file index from client");
+            return -1;
+        }
+    }
+
+    // Convert the file index back from network byte order to host byte order
+    file_index = ntohl(*(uint32_t *)file_index_bytes);
+
+    Response response;
+    if (prepare_stream_response(library, file_index, version, &response) < 0)
+    {
+        return -1;
+    }
+
+    int result = _send_file_response(client, &response);
+    free_response(&response);
+    return result;
+}
+
+int version_request_response(const ClientSocket *client, uint32_t requested_version,
+                             uint32_t *version)
+{
+    Response response;
+    if (prepare_version_response(requested_version, version, &response) < 0)
+    {
+        return -1;
+    }
+
+    int result = 0;
+    if (write_precisely(client->socket, response.head, response.head_len) != response.head_len)
+    {
+        ERR_PRINT("version_request_response: Failed to send the version to client");
+        result = -1;
+    }
+    free_response(&response);
+    return result;
+}
+
+int stream_range_request_response(const ClientSocket *client, const Library *library,
+                                  uint8_t *post_req, int num_pr_bytes)
+{
+    uint8_t params[STREAM_RANGE_PARAMS_SIZE];
+
+    // Copy all of the bytes already received, then read the rest
+    memcpy(params, post_req, num_pr_bytes);
+    if (num_pr_bytes < STREAM_RANGE_PARAMS_SIZE &&
+        read_precisely(client->socket, params + num_pr_bytes,
+                       STREAM_RANGE_PARAMS_SIZE - num_pr_bytes) !=
+            STREAM_RANGE_PARAMS_SIZE - num_pr_bytes)
+    {
+        ERR_PRINT("stream_range_request_response: Failed to read the range from client");
+        return -1;
+    }
+
+    Request request;
+    _unpack_stream_range_params(params, &request);
+
+    Response response;
+    if (prepare_stream_range_response(library, request.file_index, request.offset,
+                                      request.length, &response) < 0)
+    {
+        return -1;
+    }
+
+    int result = _send_file_response(client, &response);
+    free_response(&response);
+    return result;
+}
+
+void pace_response(int socket, Response *response)
+{
+    if (pace_multiple == 0 && !egress_enabled())
+    {
+        return;
+    }
+    // UINT32_MAX is no pacing at all
+    uint32_t rate = response->pace_rate != 0 && response->file_offset >= response->pace_offset
+                        ? response->pace_rate
+                        : UINT32_MAX;
+    if (egress_enabled())
+    {
+        rate = egress_rate(socket, response->realtime, rate);
+    }
+    if (rate == response->socket_pace_rate)
+    {
+        return;
+    }
+    if (setsockopt(socket, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) < 0)
+    {
+        perror("pace_response: setsockopt");
+    }
+    // Only what is sent before the next share is queued, see as_egress.h
+    int low_water = egress_budget(rate);
+    if (egress_enabled() &&
+        setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &low_water, sizeof(low_water)) < 0)
+    {
+        perror("pace_response: setsockopt");
+    }
+    // Not tried again for this response if it failed
+    response->socket_pace_rate = rate;
+}
+
+int send_response(int socket, Response *response)
+{
+    pace_response(socket, response);
+    size_t budget = egress_budget(response->socket_pace_rate);
+
+    while (response->head_sent < response->head_len && budget > 0)
+    {
+        // Hold the segment back if the file body follows straight after
+        int flags = MSG_NOSIGNAL | (response->file_fd >= 0 ? MSG_MORE : 0);
+        ssize_t sent = send(socket, response->head + response->head_sent,
+                            MIN(budget, response->head_len - response->head_sent), flags);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            perror("send_response: send");
+            return -1;
+        }
+        response->head_sent += sent;
+        budget -= sent;
+        egress_sent(socket, sent);
+    }
+
+    while (response->file_fd >= 0 && response->file_offset < response->file_end && budget > 0)
+    {
+        pace_response(socket, response);
+        ssize_t sent = sendfile_once(socket, response->file_fd, &response->file_offset,
+                                     MIN(budget, response->file_end - response->file_offset));
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            perror("send_response: sendfile");
+            return -1;
+        }
+        if (sent == 0)
+        {
+            ERR_PRINT("send_response: file ended before its advertised size\n");
+            return -1;
+        }
+        budget -= sent;
+        egress_sent(socket, sent);
+    }
+
+    if (response->head_sent < response->head_len ||
+        (response->file_fd >= 0 && response->file_offset < response->file_end))
+    {
+        return 0;
+    }
+    egress_idle(socket);
+    return 1;
+}
+
+void free_response(Response *response)
+{
+    free(response->head);
+    if (response->file_fd >= 0)
+    {
+        close(response->file_fd);
+    }
+    *response = (Response)EMPTY_RESPONSE;
+}
+
+static Library make_library(const char *path)
+{
+    Library library;
+    library.path = path;
+    library.num_files = 0;
+    library.files = NULL;
+    library.index = NULL;
+    library.name = "server";
+
+    printf("Initializing library\n");
+    printf("Library path: %s\n", library.path);
+
+    return library;
+}
+
+static void _wait_for_children(pid_t **client_conn_pids, int *num_connected_clients,
+                               LibrarySnapshots *snapshots, uint8_t immediate)
+{
+    int status;
+    for (int i = 0; i < *num_connected_clients; i++)
+    {
+        int options = immediate ? WNOHANG : 0;
+        if (waitpid((*client_conn_pids)[i], &status, options) > 0)
+        {
+            if (WIFEXITED(status))
+            {
+                printf("Client process %d terminated\n", (*client_conn_pids)[i]);
+                if (WEXITSTATUS(status) != 0)
+                {
+                    fprintf(stderr, "Client process %d exited with status %d\n",
+                            (*client_conn_pids)[i], WEXITSTATUS(status));
+                }
+            }
+            else
+            {
+                fprintf(stderr, "Client process %d terminated abnormally\n",
+                        (*client_conn_pids)[i]);
+            }
+            // Whatever it pinned, see as_snapshot.h
+            if (snapshots != NULL)
+            {
+                library_snapshots_remove_reader(snapshots, (*client_conn_pids)[i]);
+            }
+            egress_remove_process((*client_conn_pids)[i]);
+
+            for (int j = i; j < *num_connected_clients - 1; j++)
+            {
+                (*client_conn_pids)[j] = (*client_conn_pids)[j + 1];
+            }
+
+            (*num_connected_clients)--;
+            *client_conn_pids = (pid_t *)realloc(*client_conn_pids,
+                                                 (*num_connected_clients) * sizeof(pid_t));
+        }
+    }
+}
+
+/*
+** Create a server socket and listen for connections
+**
+** port: the port number to listen on.
+** num_queue: the number of pending connections the kernel will hold.
+**
+** On success, returns the file descriptor of the socket.
+** On failure, return -1.
+*/
+static int initialize_server_socket(int port, int num_queue)
+{
+
+    struct sockaddr_in server_addr;
+
+    // Initialize the address with provided information.
+    if (init_server_addr(port, &server_addr) < 0)
+    {
+        fprintf(stderr, "Initializing_server_socket: failed initializing server_addr\n");
+        return -1;
+    }
+
+    int listenfd = set_up_server_socket(&server_addr, num_queue);
+    if (listenfd < 0)
+    {
+        fprintf(stderr, "Initializing_server_socket: failed to set up the lisenting end of the socket fd\n");
+        return -1;
+    }
+
+    return listenfd;
+}
+
+static int _handle_client(const ClientSocket *client, const Library *library,
+                          LibrarySnapshots *snapshots);
+
+/*
+** Serve clients by forking a child process running handle_client for every
+** connection accepted on incoming_connections, keeping the library up to date
+** with a LibraryWatch (see as_watch.h), reconciled every
+** watch.reconcile_interval seconds and when the user types r + enter (s and
+** w are the commands of the egress cap, see as_egress.h, s prints the file
+** cache as well, see as_cache.h). The children see the changes through
+** snapshots of the library (see as_snapshot.h).
+**
+** returns 0 when the user quits the server, 1 on error. Child processes exit
+** with the result of handle_client instead of returning.
+*/
+static int _run_fork_server(int incoming_connections, Library *library)
+{
+    int num_connected_clients = 0;
+    pid_t *client_conn_pids = NULL;
+
+    LibraryWatch watch;
+    if (library_watch_start(&watch, library) < 0)
+    {
+        fprintf(stderr, "Error scanning library\n");
+        return 1;
+    }
+    // Without them, every child serves the library as it was when forked
+    LibrarySnapshots snapshots;
+    LibrarySnapshots *shared = &snapshots;
+    if (library_snapshots_init(&snapshots, library) < 0)
+    {
+        fprintf(stderr, "Library snapshots are not available\n");
+        shared = NULL;
+    }
+
+    int maxfd = incoming_connections > watch.fd ? incoming_connections : watch.fd;
+    fd_set incoming;
+    SET_SERVER_FD_SET(incoming, incoming_connections);
+    FD_SET(watch.fd, &incoming);
+    time_t last_scan = time(NULL);
+    int reconcile = 0;
+    int watch_stdin = 1;
+    int result = 0;
+
+    while (1)
+    {
+        if (reconcile || time(NULL) - last_scan >= watch.reconcile_interval)
+        {
+            if (library_watch_reconcile(&watch, library) < 0)
+            {
+                fprintf(stderr, "Error scanning library\n");
+                result = 1;
+                break;
+            }
+            reconcile = 0;
+            last_scan = time(NULL);
+        }
+
+        struct timeval select_timeout = SELECT_TIMEOUT;
+        if (select(maxfd + 1, &incoming, NULL, NULL, &select_timeout) < 0)
+        {
+            perror("run_server");
+            exit(1);
+        }
+
+        if (FD_ISSET(watch.fd, &incoming) && library_watch_update(&watch, library) < 0)
+        {
+            fprintf(stderr, "Error updating library\n");
+            result = 1;
+            break;
+        }
+        if (shared != NULL)
+        {
+            library_snapshots_publish(shared, library);
+        }
+        // Children inherit it, and only search what changed since
+        library_search_refresh(library);
+        cache_maintain(library);
+
+        if (FD_ISSET(incoming_connections, &incoming))
+        {
+            ClientSocket client_socket = accept_connection(incoming_connections);
+
+            int reader = shared != NULL ? library_snapshots_reserve_reader(shared) : -1;
+            pid_t pid = fork();
+            if (pid == -1)
+            {
+                perror("run_server");
+                exit(-1);
+            }
+            // child process
+            if (pid == 0)
+            {
+                close(incoming_connections);
+                library_watch_release(&watch);
+                free(client_conn_pids);
+                library_snapshots_set_reader(shared, reader, 0);
+                egress_connect(&client_socket);
+                int result = _handle_client(&client_socket, library, shared);
+                egress_disconnect(client_socket.socket);
+                if (shared != NULL)
+                {
+                    library_snapshots_close(shared);
+                }
+                library_free(library);
+                close(client_socket.socket);
+                exit(result);
+            }
+            close(client_socket.socket);
+            library_snapshots_set_reader(shared, reader, pid);
+            num_connected_clients++;
+            client_conn_pids = (pid_t *)realloc(client_conn_pids,
+                                                (num_connected_clients) * sizeof(pid_t));
+            client_conn_pids[num_connected_clients - 1] = pid;
+        }
+        if (FD_ISSET(STDIN_FILENO, &incoming))
+        {
+            int command = getchar();
+            if (command == 'q')
+                break;
+            reconcile = command == 'r';
+            if (command == 's')
+            {
+                egress_print_stats(stdout);
+                cache_print_stats(stdout);
+            }
+            else if (command == 'w')
+            {
+                egress_load_weights();
+            }
+            // Nobody can type q anymore, keep serving until killed
+            watch_stdin = command != EOF;
+        }
+
+        SET_SERVER_FD_SET(incoming, incoming_connections);
+        FD_SET(watch.fd, &incoming);
+        if (!watch_stdin)
+        {
+            FD_CLR(STDIN_FILENO, &incoming);
+        }
+
+        // Immediate return wait for client processes
+        _wait_for_children(&client_conn_pids, &num_connected_clients, shared, 1);
+    }
+
+    printf("Quitting server\n");
+    library_watch_stop(&watch);
+    _wait_for_children(&client_conn_pids, &num_connected_clients, shared, 0);
+    if (shared != NULL)
+    {
+        library_snapshots_close(shared);
+    }
+    return result;
+}
+
+int run_server(int port, const char *library_directory)
+{
+    ServerOptions options = {port, library_directory, SERVER_MODE_FORK, 0, 0,
+                             STREAM_SEND_AHEAD_SEC, 0, NULL, 0};
+    return run_server_with_options(&options);
+}
+
+int run_server_with_options(const ServerOptions *options)
+{
+    pace_multiple = options->pace_multiple;
+    send_ahead_sec = options->send_ahead_sec;
+    // Shared by every process serving clients, so before any is forked
+    if (egress_init(options) < 0)
+    {
+        ERR_PRINT("Error setting up the egress cap\n");
+        return -1;
+    }
+    if (cache_init(options) < 0)
+    {
+        ERR_PRINT("Error setting up the file cache\n");
+        return -1;
+    }
+
+    Library library = make_library(options->library_directory);
+    // A library saved by a previous run is served at once, see as_store.h
+    if (library_store_load(&library) < 0 && scan_library(&library) < 0)
+    {
+        ERR_PRINT("Error scanning library\n");
+        return -1;
+    }
+
+    // Workers listen on sockets of their own
+    if (options->mode == SERVER_MODE_PREFORK)
+    {
+        int result = run_prefork_server(options, &library);
+        library_free(&library);
+        return result;
+    }
+
+    // Event loops accept in bursts, give them room for connection storms
+    int num_queue = options->mode == SERVER_MODE_FORK ? MAX_PENDING : EPOLL_MAX_PENDING;
+    int incoming_connections = initialize_server_socket(options->port, num_queue);
+    if (incoming_connections == -1)
+    {
+        return -1;
+    }
+
+    int result;
+    switch (options->mode)
+    {
+    case SERVER_MODE_EPOLL:
+        result = run_epoll_server(incoming_connections, &library);
+        break;
+    case SERVER_MODE_URING:
+        result = run_uring_server(incoming_connections, &library);
+        if (result != URING_UNSUPPORTED)
+        {
+            break;
+        }
+        printf("io_uring is not available, serving clients in fork mode\n");
+        // fall through
+    default:
+        result = _run_fork_server(incoming_connections, &library);
+        break;
+    }
+
+    close(incoming_connections);
+    library_free(&library);
+    return result;
+}
+
+uint8_t _is_file_extension_supported(const char *filename)
+{
+    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
+
+    for (int i = 0; i < sizeof(supported_file_exts) / sizeof(char *); i++)
+    {
+        char *files_ext = strrchr(filename, '.');
+        if (files_ext != NULL && strcmp(files_ext, supported_file_exts[i]) == 0)
+        {
+            return 1;
         }
     }
 
     return 0;
 }
 
-static int _depth_scan_library(Library *library, char *current_path)
+// The directories are read on LIBRARY_SCAN_THREADS threads (see as_scan.h),
+// and the files found are merged into the library's index in an order that
+// doesn't depend on the threads, so only the files that changed are touched.
+// So is their metadata, only read for the files that changed.
+// It ignores MAX_FILES.
+int scan_library(Library *library)
+{
+#ifdef DEBUG
+    printf("^^^^ ----------------------------------- ^^^^\n");
+    printf("Scanning library\n");
+#endif
+    LibraryScan scan;
+    if (library_scan_directory(library->path, "", LIBRARY_SCAN_THREADS, NULL, NULL, &scan) < 0)
+    {
+        if (errno == ENOENT || errno == ENOTDIR)
+        {
+            perror("scan_library");
+        }
+        return -1;
+    }
+
+    library_scan_metadata(library, &scan, LIBRARY_SCAN_THREADS);
+    int result = library_merge_scan(library, &scan);
+    if (result == 0)
+    {
+        library_store_save(library, scan.dirs, scan.num_dirs);
+    }
+    library_scan_free(&scan);
+#ifdef DEBUG
+    printf("vvvv ----------------------------------- vvvv\n");
+#endif
+    return result;
+}
+
+/*
+** Get the change log of current, the library a request of a forked client is
+** answered from: that of the pinned snapshot, or of the client's own copy of
+** the library.
+**
+** returns log, filled in, or NULL if current has none
+*/
+static const LibraryChangeLog *_change_log(const LibrarySnapshots *snapshots,
+                                           const Library *current, LibraryChangeLog *log,
+                                           uint64_t *generation)
+{
+    if (snapshots != NULL && library_snapshot_change_log(snapshots, log, generation) == 0)
+    {
+        return log;
+    }
+    if (current->index == NULL)
+    {
+        *generation = 0;
+        return NULL;
+    }
+    *log = current->index->log;
+    *generation = current->index->generation;
+    return log;
+}
+
+/*
+** returns the metadata of the file with the given index of current, the
+** library a request of a forked client is answered from: in the store
+** entries of the pinned snapshot, or in the client's own copy of the
+** library. NULL if it has none.
+*/
+static const LibraryMetadata *_file_metadata(const LibrarySnapshots *snapshots,
+                                             const Library *current, uint32_t index)
+{
+    if (current->index == NULL && snapshots != NULL)
+    {
+        return library_snapshot_metadata(snapshots, index);
+    }
+    return library_file_metadata(current, index);
+}
+
+/*
+** Build the response to a request of a forked client from current (see
+** _change_log), with what the parent prepared once for everyone in the
+** pinned snapshot where it can: its LIST, its files sorted by path, its ids.
+** The rest only needs the library.
+**
+** returns as prepare_response
+*/
+static int _prepare_client_response(const Library *library, LibrarySnapshots *snapshots,
+                                    const Library *current, const Request *request,
+                                    uint32_t *version, Response *response)
 {
+    *response = (Response)EMPTY_RESPONSE;
+
+    switch (request->type)
+    {
+    case REQUEST_TYPE_LIST:
+        // Clients before LIST_DELTA may need the files numbered without the
+        // removed ones, see prepare_response
+        if (snapshots != NULL && *version >= PROTOCOL_VERSION_LIST_DELTA &&
+            library_snapshot_list_response(snapshots, response) == 0)
+        {
+            return 0;
+        }
+        break;
+    case REQUEST_TYPE_LIST_PAGE:
+    {
+        uint32_t num_sorted;
+        const uint32_t *sorted = NULL;
+        if (snapshots != NULL)
+        {
+            sorted = library_snapshot_sorted_files(snapshots, &num_sorted);
+        }
+        if (sorted == NULL)
+        {
+            sorted = library_sorted_files(current, &num_sorted);
+        }
+        if (sorted == NULL ||
+            prepare_list_page_response(current, sorted, num_sorted, request, response) < 0)
+        {
+            ERR_PRINT("Error handling LIST page request\n");
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_LIST_DELTA:
+    {
+        LibraryChangeLog log;
+        uint64_t generation;
+        const LibraryChangeLog *current_log = _change_log(snapshots, current, &log, &generation);
+        if (prepare_list_delta_response(current, current_log, generation, request, response) < 0)
+        {
+            ERR_PRINT("Error handling LIST_DELTA request\n");
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_SEARCH:
+    {
+        // The index inherited from the parent, with the snapshot's changes since
+        LibraryChangeLog log;
+        uint64_t generation;
+        const LibraryChangeLog *current_log = _change_log(snapshots, current, &log, &generation);
+        if (prepare_search_response(library, current, current_log, generation, request,
+                                    response) < 0)
+        {
+            ERR_PRINT("Error handling SEARCH request\n");
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_STREAM_ID:
+    case REQUEST_TYPE_STREAM_PATH:
+    {
+        // The snapshot has no index: paths are looked up in its sorted files
+        LibraryIdTable ids = {0};
+        uint32_t num_sorted = 0;
+        const uint32_t *sorted = NULL;
+        if (snapshots == NULL || library_snapshot_id_table(snapshots, &ids) < 0)
+        {
+            library_id_table(current, &ids);
+        }
+        else if (request->type == REQUEST_TYPE_STREAM_PATH)
+        {
+            sorted = library_snapshot_sorted_files(snapshots, &num_sorted);
+        }
+        if (prepare_stream_file_response(current, &ids, sorted, num_sorted, request,
+                                         response) < 0)
+        {
+            ERR_PRINT("Error handling %s request\n",
+                      request->type == REQUEST_TYPE_STREAM_ID ? REQUEST_STREAM_ID
+                                                              : REQUEST_STREAM_PATH);
+            return -1;
+        }
+        return 0;
+    }
+    case REQUEST_TYPE_INFO:
+        if (prepare_info_response(current, _file_metadata(snapshots, current, request->file_index),
+                                  request, response) < 0)
+        {
+            ERR_PRINT("Error handling INFO request\n");
+            return -1;
+        }
+        return 0;
+    case REQUEST_TYPE_STREAM_AT:
+        if (prepare_stream_at_response(current,
+                                       _file_metadata(snapshots, current, request->file_index),
+                                       request, response) < 0)
+        {
+            ERR_PRINT("Error handling STREAM_AT request\n");
+            return -1;
+        }
+        return 0;
+    default:
+        break;
+    }
+    return prepare_response(current, request, version, response);
+}
 
-    char *path_in_lib = _join_path(library->path, current_path);
-    if (path_in_lib == NULL)
+/*
+** Move the file range of response into its head, so that it no longer
+** depends on the file (e.g. the memfd of a snapshot, emptied once nobody
+** pins it).
+**
+** returns 0 on success, -1 on error
+*/
+static int _copy_file_into_head(Response *response)
+{
+    if (response->file_fd < 0)
     {
+        return 0;
+    }
+    size_t length = response->file_end - response->file_offset;
+    uint8_t *head = realloc(response->head, response->head_len + length);
+    if (head == NULL)
+    {
+        perror("_copy_file_into_head");
         return -1;
     }
+    response->head = head;
+    while (response->file_offset < response->file_end)
+    {
+        ssize_t num = pread(response->file_fd, head + response->head_len,
+                            response->file_end - response->file_offset, response->file_offset);
+        if (num <= 0)
+        {
+            if (num < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            perror("_copy_file_into_head: pread");
+            return -1;
+        }
+        response->head_len += num;
+        response->file_offset += num;
+    }
+    close(response->file_fd);
+    response->file_fd = -1;
+    return 0;
+}
 
-    DIR *dir = opendir(path_in_lib);
-    if (dir == NULL)
+/*
+** Serve a forked client that switched its connection to frames (see
+** as_mux.h) until it disconnects, from the bytes_in_buf bytes of
+** request_buffer it sent after its MUX request on. The socket is made
+** non-blocking: the child reads the frames of the client whenever it sends
+** some, and sends the frames of its streams while the socket takes them.
+**
+** returns 0 when the client disconnects, -1 on error
+*/
+static int _serve_multiplexed(const ClientSocket *client, const Library *library,
+                              LibrarySnapshots *snapshots, uint8_t *request_buffer,
+                              int bytes_in_buf, uint32_t *version)
+{
+    Response accepted;
+    if (prepare_mux_response(1, &accepted) < 0 || _send_whole_response(client, &accepted) < 0)
     {
-        perror("scan_library");
+        ERR_PRINT("Error handling MUX request\n");
+        return -1;
+    }
+    int flags = fcntl(client->socket, F_GETFL);
+    if (flags == -1 || fcntl(client->socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        perror("_serve_multiplexed: fcntl");
         return -1;
     }
-    free(path_in_lib);
 
-    struct dirent *entry;
-    while ((entry = readdir(dir)) != NULL)
+    MuxSession session;
+    mux_init(&session);
+    int result = 0;
+    while (1)
     {
-        if ((entry->d_type == DT_REG) &&
-            _is_file_extension_supported(entry->d_name))
+        uint32_t stream_id;
+        Request request;
+        int consumed;
+        while ((consumed = mux_parse_frame(&session, request_buffer, bytes_in_buf, &stream_id,
+                                           &request)) > 0)
         {
-            library->files = (char **)realloc(library->files,
-                                              (library->num_files + 1) * sizeof(char *));
-            if (library->files == NULL)
+            bytes_in_buf -= consumed;
+            memmove(request_buffer, request_buffer + consumed, bytes_in_buf);
+            if (stream_id == 0)
             {
-                perror("_depth_scan_library");
-                return -1;
+                continue;
             }
 
-            library->files[library->num_files] = _join_path(current_path, entry->d_name);
-            if (library->files[library->num_files] == NULL)
+            const Library *current = library;
+            if (snapshots != NULL)
             {
-                perror("scan_library");
-                return -1;
+                current = library_snapshot_acquire(snapshots, library);
             }
-#ifdef DEBUG
-            printf("Found file: %s\n", library->files[library->num_files]);
-#endif
-            library->num_files++;
+            // The snapshot is unpinned long before its LIST is sent
+            Response response;
+            int prepared = _prepare_client_response(library, snapshots, current, &request,
+                                                    version, &response);
+            if (prepared == 0 && request.type == REQUEST_TYPE_LIST &&
+                _copy_file_into_head(&response) < 0)
+            {
+                free_response(&response);
+                prepared = -1;
+            }
+            if (snapshots != NULL)
+            {
+                library_snapshot_release(snapshots);
+            }
+            // A request that fails only resets its own stream
+            mux_open_stream(&session, stream_id, prepared == 0 ? &response : NULL);
+        }
+        if (consumed < 0)
+        {
+            result = -1;
+            break;
+        }
+
+        int sent = mux_send(client->socket, &session);
+        if (sent < 0)
+        {
+            result = -1;
+            break;
         }
-        else if (entry->d_type == DT_DIR)
+
+        struct pollfd pfd = {.fd = client->socket, .events = sent == 0 ? POLLIN | POLLOUT : POLLIN};
+        if (poll(&pfd, 1, -1) < 0)
         {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            if (errno == EINTR)
             {
                 continue;
             }
-
-            char *new_path = _join_path(current_path, entry->d_name);
-            if (new_path == NULL)
+            perror("_serve_multiplexed: poll");
+            result = -1;
+            break;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t bytes_read = read(client->socket, request_buffer + bytes_in_buf,
+                                      REQUEST_BUFFER_SIZE - bytes_in_buf);
+            if (bytes_read == 0)
+            {
+                break;
+            }
+            if (bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             {
-                return -1;
+                perror("handle_client");
+                result = -1;
+                break;
             }
-
-#ifdef DEBUG
-            printf("Library scan descending into directory: %s\n", new_path);
-#endif
-
-            int ret_code = _depth_scan_library(library, new_path);
-            free(new_path);
-            if (ret_code < 0)
+            if (bytes_read > 0)
             {
-                return -1;
+                bytes_in_buf += bytes_read;
             }
         }
     }
-
-    closedir(dir);
-    return 0;
-}
-
-// This function is implemented recursively and uses realloc to grow the files array
-// as it finds more files in the library. It ignores MAX_FILES.
-int scan_library(Library *library)
-{
-// Maximal flexibility, free the old strings and start again
-// A hash table leveraging inode number would be a better way to do this
-#ifdef DEBUG
-    printf("^^^^ ----------------------------------- ^^^^\n");
-    printf("Freeing library\n");
-#endif
-    _free_library(library);
-
-#ifdef DEBUG
-    printf("Scanning library\n");
-#endif
-    int result = _depth_scan_library(library, "");
-#ifdef DEBUG
-    printf("vvvv ----------------------------------- vvvv\n");
-#endif
+    mux_free(&session);
     return result;
 }
 
-int handle_client(const ClientSocket *client, Library *library)
+/*
+** handle_client, answering every request from the current snapshot of the
+** library if there are snapshots (see as_snapshot.h)
+*/
+static int _handle_client(const ClientSocket *client, const Library *library,
+                          LibrarySnapshots *snapshots)
 {
-    char *request = NULL;
     uint8_t *request_buffer = (uint8_t *)malloc(REQUEST_BUFFER_SIZE);
     if (request_buffer == NULL)
     {
         perror("handle_client");
         return 1;
     }
-    uint8_t *buff_end = request_buffer;
+
+    // Every connection starts with the original protocol
+    uint32_t version = PROTOCOL_VERSION_BASE;
 
     int bytes_read = 0;
     int bytes_in_buf = 0;
-    while ((bytes_read = read(client->socket, buff_end, REQUEST_BUFFER_SIZE - bytes_in_buf)) > 0)
+    while ((bytes_read = read(client->socket, request_buffer + bytes_in_buf,
+                              REQUEST_BUFFER_SIZE - bytes_in_buf)) > 0)
     {
 #ifdef DEBUG
         printf("Read %d bytes from client\n", bytes_read);
@@ -534,35 +2256,56 @@ int handle_client(const ClientSocket *client, Library *library)
 
         bytes_in_buf += bytes_read;
 
-        request = find_network_newline((char *)request_buffer, &bytes_in_buf);
-
-        if (request && strcmp(request, REQUEST_LIST) == 0)
+        // Answer every request already received before reading again, so that
+        // pipelined requests are answered back to back
+        Request request;
+        int consumed;
+        while ((consumed = parse_request(request_buffer, bytes_in_buf, &request)) > 0)
         {
-            if (list_request_response(client, library) < 0)
+            bytes_in_buf -= consumed;
+            memmove(request_buffer, request_buffer + consumed, bytes_in_buf);
+
+            // Nothing but frames from then on
+            if (request.type == REQUEST_TYPE_MUX && version >= PROTOCOL_VERSION_MUX)
             {
-                ERR_PRINT("Error handling LIST request\n");
-                goto client_error;
+                if (_serve_multiplexed(client, library, snapshots, request_buffer, bytes_in_buf,
+                                       &version) < 0)
+                {
+                    goto client_error;
+                }
+                goto client_disconnected;
             }
-        }
-        else if (request && strcmp(request, REQUEST_STREAM) == 0)
-        {
-            int num_pr_bytes = MIN(sizeof(uint32_t), (unsigned long)bytes_in_buf);
-            if (stream_request_response(client, library, request_buffer, num_pr_bytes) < 0)
+
+            const Library *current = library;
+            if (snapshots != NULL)
+            {
+                current = library_snapshot_acquire(snapshots, library);
+            }
+
+            // The snapshot stays pinned until its LIST is sent from its memfd
+            Response response;
+            int result = _prepare_client_response(library, snapshots, current, &request,
+                                                  &version, &response);
+            if (result == 0 &&
+                (request.type == REQUEST_TYPE_STREAM || request.type == REQUEST_TYPE_STREAM_RANGE))
+            {
+                result = _send_file_response(client, &response);
+                free_response(&response);
+            }
+            else if (result == 0)
+            {
+                result = _send_whole_response(client, &response);
+            }
+
+            if (snapshots != NULL)
+            {
+                library_snapshot_release(snapshots);
+            }
+            if (result < 0)
             {
-                ERR_PRINT("Error handling STREAM request\n");
                 goto client_error;
             }
-            bytes_in_buf -= num_pr_bytes;
-            memmove(request_buffer, request_buffer + num_pr_bytes, bytes_in_buf);
-        }
-        else if (request)
-        {
-            ERR_PRINT("Unknown request: %s\n", request);
         }
-
-        free(request);
-        request = NULL;
-        buff_end = request_buffer + bytes_in_buf;
     }
     if (bytes_read < 0)
     {
@@ -570,43 +2313,53 @@ int handle_client(const ClientSocket *client, Library *library)
         goto client_error;
     }
 
+client_disconnected:
     printf("Client on %s:%d disconnected\n",
            inet_ntoa(client->addr.sin_addr),
            ntohs(client->addr.sin_port));
 
     free(request_buffer);
-    if (request != NULL)
-    {
-        free(request);
-    }
     return 0;
 client_error:
     free(request_buffer);
-    if (request != NULL)
-    {
-        free(request);
-    }
     return -1;
 }
 
 static void print_usage()
 {
-    printf("Usage: as_server [-h] [-p port] [-l library_directory]\n");
+    printf("Usage: as_server [-h] [-p port] [-l library_directory] [-m mode] [-w workers]\n");
+    printf("                 [-r pace] [-a send_ahead] [-e egress_cap] [-W weights_file]\n");
+    printf("                 [-c cache_size]\n");
     printf("  -h  Print this message\n");
     printf("  -p  Port to listen on (default: " XSTR(DEFAULT_PORT) ")\n");
     printf("  -l  Directory containing the library (default: ./library/)\n");
+    printf("  -m  How clients are served (default: fork)\n");
+    printf("        fork:  one child process per client\n");
+    printf("        epoll: all clients in this process, with non-blocking sockets\n");
+    printf("        prefork: a pool of epoll worker processes pinned to CPUs\n");
+    printf("        uring: all clients in this process, with io_uring (falls back to fork)\n");
+    printf("  -w  Number of prefork workers (default: one per CPU)\n");
+    printf("  -r  Pace files streamed for playback (STREAM_AT) at this many times their\n");
+    printf("      bitrate (default: not paced)\n");
+    printf("  -a  Seconds of a file sent before it is paced (default: " XSTR(STREAM_SEND_AHEAD_SEC) ")\n");
+    printf("  -e  Most bytes per second sent to all clients together, shared fairly between\n");
+    printf("      them (default: no cap). Type s + enter for the rate of every client\n");
+    printf("  -W  File of the weights of clients under the cap, by address (see as_egress.h),\n");
+    printf("      read again when you type w + enter\n");
+    printf("  -c  Bytes of the files played the most held in memory (default: none, see\n");
+    printf("      as_cache.h). Type s + enter for the hit rate\n");
 }
 
 int main(int argc, char *const *argv)
 {
     int opt;
-    int port = DEFAULT_PORT;
-    const char *library_directory = "library";
+    ServerOptions options = {DEFAULT_PORT, "library", SERVER_MODE_FORK, 0, 0,
+                             STREAM_SEND_AHEAD_SEC, 0, NULL, 0};
 
     // Check out man 3 getopt for how to use this function
     // The short version: it parses command line options
     // Note that optarg is a global variable declared in getopt.h
-    while ((opt = getopt(argc, argv, "hp:l:")) != -1)
+    while ((opt = getopt(argc, argv, "hp:l:m:w:r:a:e:W:c:")) != -1)
     {
         switch (opt)
         {
@@ -614,19 +2367,103 @@ int main(int argc, char *const *argv)
             print_usage();
             return 0;
         case 'p':
-            port = atoi(optarg);
+            options.port = atoi(optarg);
             break;
         case 'l':
-            library_directory = optarg;
+            options.library_directory = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "fork") == 0)
+            {
+                options.mode = SERVER_MODE_FORK;
+            }
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                options.mode = SERVER_MODE_EPOLL;
+            }
+            else if (strcmp(optarg, "prefork") == 0)
+            {
+                options.mode = SERVER_MODE_PREFORK;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                options.mode = SERVER_MODE_URING;
+            }
+            else
+            {
+                ERR_PRINT("Unknown server mode: %s\n", optarg);
+                print_usage();
+                return 1;
+            }
+            break;
+        case 'w':
+            options.num_workers = atoi(optarg);
+            if (options.num_workers < 0)
+            {
+                ERR_PRINT("Invalid number of workers %d\n", options.num_workers);
+                return 1;
+            }
+            break;
+        case 'r':
+            options.pace_multiple = atof(optarg);
+            // Slower than the file plays would never keep up
+            if (!(options.pace_multiple == 0 || options.pace_multiple >= 1))
+            {
+                ERR_PRINT("Invalid pace %s, it has to be at least 1\n", optarg);
+                return 1;
+            }
+            break;
+        case 'a':
+            options.send_ahead_sec = atof(optarg);
+            if (!(options.send_ahead_sec >= 0))
+            {
+                ERR_PRINT("Invalid send ahead %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            options.egress_cap = atof(optarg);
+            // Below what a single connection is ever paced at
+            if (!(options.egress_cap == 0 || options.egress_cap >= EGRESS_MIN_RATE))
+            {
+                ERR_PRINT("Invalid egress cap %s, it has to be at least %d bytes per second\n",
+                          optarg, EGRESS_MIN_RATE);
+                return 1;
+            }
+            break;
+        case 'W':
+            options.weights_path = optarg;
+            break;
+        case 'c':
+        {
+            double cache_size = atof(optarg);
+            if (!(cache_size >= 0))
+            {
+                ERR_PRINT("Invalid cache size %s\n", optarg);
+                return 1;
+            }
+            options.cache_size = cache_size;
             break;
+        }
         default:
             print_usage();
             return 1;
         }
     }
 
+    if (options.weights_path != NULL && options.egress_cap == 0)
+    {
+        ERR_PRINT("Weights (-W) are only used under an egress cap (-e)\n");
+        return 1;
+    }
+
     printf("Starting server on port %d, serving library in %s\n",
-           port, library_directory);
+           options.port, options.library_directory);
 
-    return run_server(port, library_directory);
+    return run_server_with_options(&options);
+}
+
+int handle_client(const ClientSocket *client, Library *library)
+{
+    return _handle_client(client, library, NULL);
 }
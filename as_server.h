@@ -20,6 +20,16 @@
 #define LIBRARY_FILENAME_MAX 256
 #define LIBRARY_SCAN_INTERVAL 60
 
+// Most bytes send_response moves in one call, so that one large
+// STREAM can't monopolize an event loop serving many connections
+#define RESPONSE_SEND_BUDGET (256 * 1024)
+
+// file index, offset and length following a STREAM_RANGE request
+#define STREAM_RANGE_PARAMS_SIZE (sizeof(uint32_t) + 2 * sizeof(uint64_t))
+
+// Seconds of a file sent before a paced STREAM_AT response is paced (-a)
+#define STREAM_SEND_AHEAD_SEC 10
+
 
 /*
 ** Design
@@ -49,6 +59,180 @@
 **   - The server will respond with:
 **     - the file's size followed by the file's data.
 **       - see stream_request_response for more information
+**     - the size is 32-bit, unless version 2 or later was negotiated (see 4),
+**       then it is 64-bit so files over 4 GB can be streamed.
+**
+** 3) "STREAM_RANGE" to stream part of a file from the library
+**   - The string REQUEST_STREAM_RANGE will be sent to the server, followed by
+**     the network newline "\r\n" (2 chars).
+**   - This will be followed by the index of the file (32-bit), the offset of
+**     the first byte wanted (64-bit) and the number of bytes wanted (64-bit,
+**     0 for "up to the end of the file"), all in network byte order.
+**   - The server will respond with:
+**     - the file's total size and the number of bytes that follow (both 64-bit),
+**       followed by that part of the file's data.
+**       - see stream_range_request_response for more information
+**
+** 4) "VERSION" to negotiate the protocol version of the connection
+**   - The string REQUEST_VERSION, a space and the highest protocol version
+**     the client speaks in decimal, followed by the network newline "\r\n".
+**     The version is part of the request line so that servers predating
+**     this request drop it as a whole, as they do any unknown request.
+**   - The server will respond with the version used from then on, the lowest
+**     of the client's and PROTOCOL_VERSION, as a 32-bit integer in network
+**     byte order.
+**   - Until a client sends VERSION, PROTOCOL_VERSION_BASE is used. A client
+**     that gets no response should keep using it.
+**
+** 5) "LIST" with arguments to list a page of the files in the library
+**   - The string REQUEST_LIST, then on the same line the position of the
+**     first file wanted, the most files wanted (0 for all of them), the
+**     extension of the files wanted (e.g. ".wav", LIST_ANY_EXTENSION for
+**     any) and optionally a path prefix (e.g. an artist's directory, up to
+**     the end of the line, spaces included), all separated by single
+**     spaces, followed by the network newline "\r\n".
+**     e.g. "LIST 100 50 .mp3 artist/album/\r\n"
+**   - The server will respond with the files whose path starts with the
+**     prefix and that have the extension, sorted by path, from the given
+**     position, one per line as in a LIST response, followed by an empty
+**     line ("\r\n").
+**       - see prepare_list_page_response for more information
+**   - Like VERSION, the arguments are part of the request line, so servers
+**     predating them drop the request.
+**
+** 6) "LIST_DELTA" to get the changes to the library since a LIST
+**   - The string REQUEST_LIST_DELTA, then on the same line the epoch and the
+**     generation of the library the client knows, in decimal, separated by
+**     single spaces, followed by the network newline "\r\n".
+**     e.g. "LIST_DELTA 9141510871424 1042\r\n"
+**   - The server will respond with a line RESPONSE_DELTA, the epoch and the
+**     current generation of the library, then one line per index that
+**     changed since, in increasing order: "+<index>: <path>" for a file now
+**     at that index, "-<index>" for an index that is now empty. The
+**     response ends with an empty line.
+**       e.g. "DELTA 9141510871424 1045\r\n+3: artist/new.wav\r\n-7\r\n\r\n"
+**   - If the changes since that generation are no longer known (another
+**     epoch, or too many changes), it will respond with a line
+**     RESPONSE_RESYNC, the epoch and the current generation of the library,
+**     followed by an empty line. The client should LIST again, and can ask
+**     for the changes since that generation afterwards.
+**   - Lines describe indices as they are now, so getting a change twice is
+**     harmless, e.g. after a LIST that already had it.
+**       - see prepare_list_delta_response for more information
+**   - Only send it once PROTOCOL_VERSION_LIST_DELTA or later was negotiated
+**     (see 4): servers predating it drop the request without responding.
+**
+** 7) "SEARCH" to find files by name
+**   - The string REQUEST_SEARCH, a space and the query (up to the end of the
+**     line), followed by the network newline "\r\n".
+**     e.g. "SEARCH beatles help\r\n"
+**   - The server will respond with the files whose path contains every word
+**     of the query, ignoring case, best ranked first (see as_search.h), at
+**     most SEARCH_MAX_RESULTS of them, one per line as in a LIST response,
+**     followed by an empty line ("\r\n").
+**       - see prepare_search_response for more information
+**   - Like VERSION, the query is part of the request line, so servers
+**     predating SEARCH drop the request.
+**
+** 8) "STREAM_ID" and "STREAM_PATH" to stream a file without knowing its index
+**   - The string REQUEST_STREAM_ID, a space and the stable id of the file in
+**     decimal (see as_library.h), or the string REQUEST_STREAM_PATH, a space
+**     and the path of the file (up to the end of the line, spaces included),
+**     followed by the network newline "\r\n".
+**     e.g. "STREAM_ID 11400714819323198485\r\n"
+**          "STREAM_PATH artist/album/track.wav\r\n"
+**   - The server will respond with the stable id of the file and its size
+**     (both 64-bit, network byte order), followed by the file's data. The
+**     id lets a client that only knew the path ask for the file by id
+**     afterwards, whatever it is renamed to.
+**   - If there is no such file, the id and the size are 0 and nothing
+**     follows, the connection stays open.
+**       - see prepare_stream_file_response for more information
+**   - Only send them once PROTOCOL_VERSION_STREAM_ID or later was negotiated
+**     (see 4): servers predating them drop the requests without responding.
+**
+** 9) "INFO" to get what the headers of a file say about its audio
+**   - The string REQUEST_INFO, a space and the index of the file in decimal,
+**     followed by the network newline "\r\n".
+**     e.g. "INFO 42\r\n"
+**   - The server will respond with a single line of space separated
+**     key=value fields, read from the file when it was scanned (see
+**     as_metadata.h): its codec, its duration in milliseconds, its sample
+**     rate, its channels, its bits per sample and its average bitrate.
+**       e.g. "codec=flac duration_ms=215373 sample_rate=44100 channels=2 "
+**            "bits_per_sample=16 bitrate=913742\r\n"
+**     Fields that aren't known (e.g. a file not read yet, or a codec the
+**     server doesn't know) are 0, with codec=unknown.
+**   - If there is no such file, the line is empty ("\r\n").
+**       - see prepare_info_response for more information
+**   - Only send it once PROTOCOL_VERSION_INFO or later was negotiated (see
+**     4): servers predating it drop the request without responding.
+**
+** 10) "STREAM_AT" to stream a file from a position in time on
+**   - The string REQUEST_STREAM_AT, a space, the index of the file and the
+**     position in milliseconds in decimal, followed by the network newline.
+**     e.g. "STREAM_AT 42 95000\r\n"
+**   - The server will respond with the position in milliseconds of the
+**     frame it starts at (the last one starting at or before the requested
+**     position where the file says where frames are, see as_metadata.h) and
+**     the size of what follows (both 64-bit, network byte order). What
+**     follows plays on its own: the headers of the file where its format
+**     needs them (e.g. a WAV header with the sizes of what is left), then
+**     the file from that frame on.
+**   - Files the server can't seek in (e.g. MP4) are sent whole, from
+**     position 0.
+**   - STREAM_AT is meant for playback (a client gets a whole file with
+**     STREAM), and a server started with -r paces it: the first seconds of
+**     the file (-a, STREAM_SEND_AHEAD_SEC by default) go as fast as the
+**     connection allows for the player to start at once, the rest at -r
+**     times the bitrate of the file (see as_metadata.h), so that clients
+**     that only play don't take the bandwidth of the others.
+**       - see prepare_stream_at_response for more information
+**   - Only send it once PROTOCOL_VERSION_STREAM_AT or later was negotiated
+**     (see 4): servers predating it drop the request without responding.
+**
+** 11) "MUX" to multiplex the connection
+**   - The string REQUEST_MUX followed by the network newline "\r\n".
+**   - The server will respond with 1 if it switches the connection to
+**     frames, 0 if it keeps it as it is (a server in io_uring mode, or a
+**     connection that didn't negotiate PROTOCOL_VERSION_MUX), as a 32-bit
+**     integer in network byte order.
+**   - After a 1, both sides only send frames (see MUX_HEADER_SIZE): a header
+**     with a stream id, the type of the frame and the length of the payload
+**     that follows. Each stream carries a request and its response, several
+**     of them at once:
+**       - REQUEST, from the client, opens the stream with the id of the
+**         frame (not 0, nor that of a stream still open). The payload is
+**         any request but MUX, exactly as it would be sent otherwise (e.g.
+**         "LIST\r\n", or "STREAM\r\n" then the file index).
+**       - DATA, from the server, carries the next bytes of the response,
+**         exactly as they would be sent otherwise, at most MUX_MAX_FRAME.
+**       - END, from the server, closes the stream once all of the response
+**         was sent.
+**       - WINDOW, from the client, lets the server send a 32-bit number of
+**         bytes more of DATA on the stream. Every stream starts with
+**         MUX_INITIAL_WINDOW, and nothing more is sent on it until the
+**         client opens it further, e.g. as a player plays.
+**       - RESET, from the client, cancels the stream. From the server, it
+**         closes the stream without all of its response: it was cancelled,
+**         or the request has none (unknown, or failed).
+**     The server closes every stream with END or RESET, only then can its id
+**     be used again. A client opening more than MUX_MAX_STREAMS streams at
+**     once, or sending a frame the server doesn't expect, is disconnected.
+**   - The server sends a DATA frame of every stream with some window in
+**     turn, so a LIST sent during a long STREAM is answered after at most a
+**     frame of every other stream, not after all of the file.
+**   - The streams of a connection are not paced with -r, their windows
+**     already keep players from getting ahead. Under an egress cap (see
+**     as_egress.h) the connection as a whole gets its share.
+**       - see as_mux.h for more information
+**   - Only send it once PROTOCOL_VERSION_MUX or later was negotiated (see
+**     4): servers predating it drop the request without responding.
+**
+** Requests can be pipelined: a client may send several requests without
+** waiting for their responses (e.g. the STREAM requests of a playlist), the
+** server answers every complete request it has received, in order, before
+** reading more, whatever the mode.
 **
 ** The client-server connection code is nearly identical to T10, so be sure to take a crack
 ** at that lab before starting this assignment.
@@ -62,6 +246,107 @@ typedef struct client_socket {
 } ClientSocket;
 
 
+/*
+** Requests and responses
+** ----------------------
+** A request parsed from the bytes a client has sent so far. file_index is
+** only set for the STREAM requests, offset and length for STREAM_RANGE (and
+** the position and most files of a LIST page, with its extension and prefix),
+** version for VERSION, epoch and generation for LIST_DELTA, prefix for
+** the query of a SEARCH and the path of a STREAM_PATH, and file_id for
+** STREAM_ID. INFO requests set file_index too, STREAM_AT requests
+** file_index and position_ms.
+*/
+typedef enum request_type {
+    REQUEST_TYPE_UNKNOWN,
+    REQUEST_TYPE_LIST,
+    REQUEST_TYPE_STREAM,
+    REQUEST_TYPE_STREAM_RANGE,
+    REQUEST_TYPE_VERSION,
+    REQUEST_TYPE_LIST_PAGE,
+    REQUEST_TYPE_LIST_DELTA,
+    REQUEST_TYPE_SEARCH,
+    REQUEST_TYPE_STREAM_ID,
+    REQUEST_TYPE_STREAM_PATH,
+    REQUEST_TYPE_INFO,
+    REQUEST_TYPE_STREAM_AT,
+    REQUEST_TYPE_MUX,
+} RequestType;
+
+typedef struct request {
+    RequestType type;
+    uint32_t file_index;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t version;
+    char extension[LIST_EXTENSION_MAX];
+    char prefix[MAX_PATH];
+    uint64_t epoch;
+    uint64_t generation;
+    uint64_t file_id;
+    uint64_t position_ms;
+} Request;
+
+/*
+** A response that is ready to be sent: head bytes (heap-allocated, e.g. the
+** STREAM size header) followed by the file_offset to file_end byte range of
+** file_fd (-1 if the response has no file body, a file of the library, or the
+** LIST text the library caches in a memfd). head_sent and
+** file_offset track how much has been sent, so a response can be sent in
+** pieces on a non-blocking socket.
+**
+** A paced response (see pace_response) is sent at pace_rate bytes per
+** second from pace_offset of the file on, with SO_MAX_PACING_RATE: the
+** kernel spaces out the packets, nothing is sent late by the server. A
+** server with an egress cap paces every response at the share of its
+** connection as well (see as_egress.h). A server with a file cache keeps
+** the pages of the files played the most in memory (see as_cache.h).
+*/
+typedef struct response {
+    uint8_t *head;
+    size_t head_len;
+    size_t head_sent;
+    int file_fd;
+    off_t file_offset;
+    off_t file_end;
+    uint32_t pace_rate;        // 0 if not paced
+    off_t pace_offset;
+    uint32_t socket_pace_rate; // the socket was set to by pace_response, 0 if not yet
+    int realtime;              // a STREAM_AT response, see as_egress.h
+} Response;
+
+#define EMPTY_RESPONSE {NULL, 0, 0, -1, 0, 0, 0, 0, 0, 0}
+
+
+/*
+** Server modes, selected with -m
+** fork:    one child process per client running handle_client (default)
+** epoll:   a single process multiplexing every client with epoll, see as_epoll.h
+** prefork: num_workers long-lived epoll worker processes, see as_prefork.h
+**          (num_workers 0 means one per CPU)
+** uring:   a single process submitting all of its I/O to an io_uring, see
+**          as_uring.h. Falls back to fork mode where io_uring is unavailable.
+*/
+typedef enum server_mode {
+    SERVER_MODE_FORK,
+    SERVER_MODE_EPOLL,
+    SERVER_MODE_PREFORK,
+    SERVER_MODE_URING,
+} ServerMode;
+
+typedef struct server_options {
+    int port;
+    const char *library_directory;
+    ServerMode mode;
+    int num_workers;
+    double pace_multiple;      // of the bitrate STREAM_AT is paced at, 0 to not pace (-r)
+    double send_ahead_sec;     // of a file sent before pacing it (-a)
+    double egress_cap;         // bytes per second sent to all clients, 0 for no cap (-e)
+    const char *weights_path;  // weights of the clients under the cap, or NULL (-W)
+    uint64_t cache_size;       // bytes of hot files held in memory, 0 for none (-c)
+} ServerOptions;
+
+
 #define SET_SERVER_FD_SET(fd, conn_soc) do { \
     FD_ZERO(&fd); \
     FD_SET(conn_soc, &fd); \
@@ -92,6 +377,13 @@ int init_server_addr(int port, struct sockaddr_in *server_options);
 */
 int set_up_server_socket(const struct sockaddr_in *self, int num_queue);
 
+/*
+** Same as set_up_server_socket, but the socket is created with SO_REUSEPORT
+** so that other SO_REUSEPORT sockets can listen on the same port, with the
+** kernel distributing new connections between them.
+*/
+int set_up_reuseport_server_socket(const struct sockaddr_in *self, int num_queue);
+
 
 /*
 ** Wait for and accept a new connection. Return the socket file descriptor for
@@ -134,11 +426,13 @@ int list_request_response(const ClientSocket * client, const Library *library);
 ** from the client_socket, but will consider num_pr_bytes (must be <= uint32_t)
 ** from post_req first, then:
 **   The stream will be sent in the following format:
-**     - the first 4 bytes (32-bits) will be the file size in network byte-order
-**     - the rest of the stream will be the file's data written in chunks of
-**       STREAM_CHUNK_SIZE bytes, or less if write returns less than STREAM_CHUNK_SIZE,
-**       the file is less than STREAM_CHUNK_SIZE bytes, or the last remaining chunk is
-**       less than STREAM_CHUNK_SIZE bytes.
+**     - the first 4 bytes (32-bits) will be the file size in network byte-order,
+**       8 bytes (64-bits) if the connection's protocol version is at least
+**       PROTOCOL_VERSION_LARGE_FILES. Files too large for a 32-bit size
+**       are refused on older connections.
+**     - the rest of the stream will be the file's data, moved from the file to
+**       the socket with sendfile_precisely so it never passes through a user
+**       space buffer.
 **
 ** Make the assumption that post_req is at least 4 bytes long.
 **
@@ -146,7 +440,213 @@ int list_request_response(const ClientSocket * client, const Library *library);
 ** return 0. Otherwise, return -1.
  */
 int stream_request_response(const ClientSocket * client, const Library *library,
-                            uint8_t *post_req, int num_pr_bytes);
+                            uint8_t *post_req, int num_pr_bytes, uint32_t version);
+
+
+/*
+** Answer a VERSION request for requested_version (see the Design section)
+** and store the negotiated version in version.
+**
+** return 0 on success, -1 on error
+*/
+int version_request_response(const ClientSocket * client, uint32_t requested_version,
+                             uint32_t *version);
+
+
+/*
+** Stream part of a file from the library to the client, for resuming an
+** interrupted transfer or seeking.
+**
+** The request's parameters, STREAM_RANGE_PARAMS_SIZE bytes in network
+** byte-order, will be read from the client_socket, but will consider
+** num_pr_bytes (must be <= STREAM_RANGE_PARAMS_SIZE) from post_req first:
+**     - the 32-bit file index
+**     - the 64-bit offset of the first byte to send
+**     - the 64-bit number of bytes to send, 0 to send up to the end of the file
+**   The range is clamped to the file, then sent in the following format:
+**     - the first 8 bytes will be the file's total size in network byte-order
+**     - the next 8 bytes will be the number of bytes in the range, n
+**     - then the n bytes of the file starting at offset, sent with
+**       sendfile_precisely from that position (the file is never seeked).
+**
+** If the range is successfully transported to the client over the client_socket,
+** return 0. Otherwise, return -1.
+*/
+int stream_range_request_response(const ClientSocket * client, const Library *library,
+                                  uint8_t *post_req, int num_pr_bytes);
+
+
+/*
+** Parse the request at the start of buf, which holds bytes_in_buf bytes
+** received from a client, into request. Unknown requests are reported and
+** returned as REQUEST_TYPE_UNKNOWN so that the caller can skip them.
+**
+** returns the number of bytes of buf taken up by the request, which the caller
+** should remove from buf, or 0 if buf does not hold a complete request yet.
+*/
+int parse_request(const uint8_t *buf, int bytes_in_buf, Request *request);
+
+/*
+** Build the response to a LIST request (see list_request_response), to a
+** STREAM request for file_index (see stream_request_response) or to a
+** STREAM_RANGE request (see stream_range_request_response), without sending
+** anything.
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_list_response(const Library *library, Response *response);
+int prepare_stream_response(const Library *library, uint32_t file_index,
+                            uint32_t version, Response *response);
+int prepare_stream_range_response(const Library *library, uint32_t file_index,
+                                  uint64_t offset, uint64_t length,
+                                  Response *response);
+
+/*
+** Build the response to a LIST page request (see the protocol above), from
+** sorted, the num_sorted indices of the files of library sorted by path
+** (see library_sorted_files).
+**
+** The files under the prefix are found by binary search, only those are
+** looked at.
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_list_page_response(const Library *library, const uint32_t *sorted,
+                               uint32_t num_sorted, const Request *request,
+                               Response *response);
+
+// Change log of a library, see as_library.h
+struct library_change_log;
+
+/*
+** Build the response to a LIST_DELTA request (see the protocol above) from
+** library, whose generation is generation and whose changes are in log (NULL
+** if it has none, the client always has to resync then).
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_list_delta_response(const Library *library, const struct library_change_log *log,
+                                 uint64_t generation, const Request *request,
+                                 Response *response);
+
+/*
+** Build the response to a SEARCH request (see the protocol above) searching
+** library, whose generation is generation and whose changes are in log
+** (NULL if it has none), with the search index of owner (see
+** library_search).
+**
+** The posting lists of every trigram of the query are intersected, shortest
+** first, and only the files left are checked against it: the cost grows
+** with the shortest list and the files that match, e.g. a query matching
+** most of 1M files takes milliseconds (see the Design section of
+** as_search.h).
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_search_response(const Library *owner, const Library *library,
+                            const struct library_change_log *log, uint64_t generation,
+                            const Request *request, Response *response);
+
+// Ids of the files of a library, see as_library.h
+struct library_id_table;
+
+/*
+** Build the response to a STREAM_ID or STREAM_PATH request (see the protocol
+** above) from library, whose ids are in ids. The path of a STREAM_PATH is
+** looked up in the index of library, or if it has none by binary search in
+** sorted, the num_sorted indices of its files sorted by path.
+**
+** Unlike the other STREAM requests, a file that isn't in the library is
+** answered, with an id of 0.
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_stream_file_response(const Library *library, const struct library_id_table *ids,
+                                 const uint32_t *sorted, uint32_t num_sorted,
+                                 const Request *request, Response *response);
+
+// Metadata of a file, see as_library.h
+struct library_metadata;
+
+/*
+** Build the response to an INFO request (see the protocol above) for the file
+** of library whose metadata is metadata (NULL if it has none). The metadata
+** was read when the file was scanned, the file itself isn't touched.
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_info_response(const Library *library, const struct library_metadata *metadata,
+                          const Request *request, Response *response);
+
+/*
+** Build the response to a STREAM_AT request (see the protocol above) for the
+** file of library whose metadata is metadata (NULL if it has none), with
+** library_seek. Only a few windows of the file are read to find the frame to
+** start at, the rest is sent like any other STREAM.
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_stream_at_response(const Library *library, const struct library_metadata *metadata,
+                               const Request *request, Response *response);
+
+/*
+** Build the response to a VERSION request asking for requested_version, and
+** store the negotiated version in version.
+**
+** return 0 on success, -1 on error (response is left empty)
+*/
+int prepare_version_response(uint32_t requested_version, uint32_t *version,
+                             Response *response);
+
+/*
+** Build the response to a MUX request: 1 if the connection is switched to
+** frames (accepted), 0 otherwise.
+**
+** return 0 on success, -1 on error
+*/
+int prepare_mux_response(int accepted, Response *response);
+
+/*
+** Build the response to any parsed request with the prepare_*_response
+** function for its type, reporting failures. version is the protocol version
+** of the connection the request came from, updated by VERSION requests.
+** Before PROTOCOL_VERSION_LIST_DELTA, LIST numbers the files without the
+** removed ones, and STREAM and STREAM_RANGE take those numbers.
+**
+** MUX requests are refused: the event loops that multiplex connections (see
+** as_mux.h) answer them before calling it.
+**
+** return 0 on success, 1 if the request has no response (unknown requests),
+** -1 on error (response is left empty)
+*/
+int prepare_response(const Library *library, const Request *request, uint32_t *version,
+                     Response *response);
+
+/*
+** Send the next part of response over socket, at most RESPONSE_SEND_BUDGET
+** bytes (less under an egress cap, see egress_budget). Blocking sockets send
+** the whole budget; non-blocking sockets stop early once the socket is full.
+**
+** returns 1 when all of the response has been sent, 0 if there is more to
+** send, -1 on error
+*/
+int send_response(int socket, Response *response);
+
+/*
+** Set socket to the pacing of response at the point of the file it was sent
+** up to: unpaced until its pace_offset, then at its pace_rate. Responses
+** that aren't paced unpace the socket, when a previous one paced it. Under
+** an egress cap, the socket is paced at the share of its connection (see
+** as_egress.h) if that is less. Does nothing unless the server paces
+** STREAM_AT responses or has an egress cap. Call it before sending every
+** piece of response.
+*/
+void pace_response(int socket, Response *response);
+
+/*
+** Release the head buffer and file descriptor of response and empty it.
+*/
+void free_response(Response *response);
 
 
 // Library functions
@@ -155,12 +655,18 @@ int stream_request_response(const ClientSocket * client, const Library *library,
 ** structure will be populated with the name of the library, the path to the library,
 ** and a list of files in the library.
 **
-** Only SUPPORTED_FILE_EXTS files will be added to the library.
+** Only SUPPORTED_FILE_EXTS files will be added to the library. Files already
+** in the library keep their index, see as_library.h.
 **
 ** If the library is successfully populated, return 0. Otherwise, return -1.
 */
 int scan_library(Library *library);
 
+/*
+** return 1 if filename has one of the SUPPORTED_FILE_EXTS, 0 otherwise
+*/
+uint8_t _is_file_extension_supported(const char *filename);
+
 
 // Server operation functions
 // These leverage all above functions
@@ -190,4 +696,11 @@ int handle_client(const ClientSocket * client, Library *library);
 */
 int run_server(int port, const char *library_directory);
 
+/*
+** Same as run_server, with the port, library directory, the way clients are
+** served (options->mode), the pacing of STREAM_AT responses and the egress
+** cap taken from options.
+*/
+int run_server_with_options(const ServerOptions *options);
+
 #endif // AS_SERVER_H_
@@ -0,0 +1,554 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_snapshot.h"
+#include "as_store.h"
+
+static long _elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+
+/*
+** Publishing
+** ----------
+*/
+int library_snapshots_init(LibrarySnapshots *snapshots, const Library *library)
+{
+    memset(snapshots, 0, sizeof(*snapshots));
+    snapshots->reader = -1;
+    snapshots->slot = -1;
+    snapshots->view.name = library->name;
+    snapshots->view.path = library->path;
+    for (int i = 0; i < LIBRARY_SNAPSHOT_SLOTS; i++)
+    {
+        snapshots->fds[i] = -1;
+    }
+
+    snapshots->control = mmap(NULL, sizeof(LibrarySnapshotControl), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (snapshots->control == MAP_FAILED)
+    {
+        perror("library_snapshots_init: mmap");
+        snapshots->control = NULL;
+        return -1;
+    }
+    snapshots->control->current = -1;
+    for (int i = 0; i < LIBRARY_SNAPSHOT_READERS; i++)
+    {
+        snapshots->control->readers[i].slot = -1;
+    }
+    for (int i = 0; i < LIBRARY_SNAPSHOT_SLOTS; i++)
+    {
+        snapshots->fds[i] = memfd_create("as_library_snapshot", MFD_CLOEXEC);
+        if (snapshots->fds[i] == -1)
+        {
+            perror("library_snapshots_init: memfd_create");
+            library_snapshots_close(snapshots);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int _is_pinned(const LibrarySnapshots *snapshots, int slot)
+{
+    for (int i = 0; i < LIBRARY_SNAPSHOT_READERS; i++)
+    {
+        const LibrarySnapshotReader *reader = &snapshots->control->readers[i];
+        if (reader->pid != 0 && __atomic_load_n(&reader->slot, __ATOMIC_SEQ_CST) == slot)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+** Empty the old snapshots nobody pins, so their memory goes back to the system
+*/
+static void _reclaim_snapshots(LibrarySnapshots *snapshots)
+{
+    LibrarySnapshotControl *control = snapshots->control;
+    for (int i = 0; i < LIBRARY_SNAPSHOT_SLOTS; i++)
+    {
+        if (i != control->current && control->numbers[i] != 0 && !_is_pinned(snapshots, i))
+        {
+            control->numbers[i] = 0;
+            control->list_offsets[i] = 0;
+            control->sorted_offsets[i] = 0;
+            control->num_sorted[i] = 0;
+            control->list_ends[i] = 0;
+            control->log_offsets[i] = 0;
+            control->num_changes[i] = 0;
+            control->sizes[i] = 0;
+            if (ftruncate(snapshots->fds[i], 0) == -1)
+            {
+                perror("library_snapshots_publish: ftruncate");
+            }
+        }
+    }
+}
+
+/*
+** Write the LIST response of library (see prepare_list_response) to fd, at
+** its offset
+*/
+static int _write_list(int fd, const Library *library)
+{
+    Response response;
+    if (prepare_list_response(library, &response) < 0)
+    {
+        return -1;
+    }
+    int result = 0;
+    off_t size = response.file_end - response.file_offset;
+    if (write_precisely(fd, response.head, response.head_len) != response.head_len ||
+        (response.file_fd >= 0 &&
+         sendfile_precisely(fd, response.file_fd, &response.file_offset, size) != size))
+    {
+        result = -1;
+    }
+    free_response(&response);
+    return result;
+}
+
+/*
+** Write size bytes of data to fd, at its offset rounded up to a multiple of
+** alignment.
+**
+** returns the offset they were written at, -1 on error
+*/
+static off_t _write_aligned(int fd, const void *data, size_t size, size_t alignment)
+{
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset == -1)
+    {
+        return -1;
+    }
+    offset = (offset + alignment - 1) / alignment * alignment;
+    if (lseek(fd, offset, SEEK_SET) == -1 || write_precisely(fd, data, size) != size)
+    {
+        return -1;
+    }
+    return offset;
+}
+
+/*
+** Write the indices of the files of library sorted by path to fd
+*/
+static int _write_sorted_files(int fd, int slot, LibrarySnapshotControl *control,
+                               const Library *library)
+{
+    uint32_t num_sorted;
+    const uint32_t *sorted = library_sorted_files(library, &num_sorted);
+    if (sorted == NULL)
+    {
+        return -1;
+    }
+    off_t offset = _write_aligned(fd, sorted, num_sorted * sizeof(uint32_t), sizeof(uint32_t));
+    if (offset == -1)
+    {
+        return -1;
+    }
+    control->sorted_offsets[slot] = offset;
+    control->num_sorted[slot] = num_sorted;
+    return 0;
+}
+
+/*
+** Write the change log of library to fd, oldest change first
+*/
+static int _write_change_log(int fd, int slot, LibrarySnapshotControl *control,
+                             const Library *library)
+{
+    LibraryChangeLog log = {0};
+    if (library->index != NULL)
+    {
+        log = library->index->log;
+    }
+
+    // The ring in two pieces: from the oldest change to its end, then from its start
+    uint32_t num_first = MIN(log.num_changes, LIBRARY_CHANGE_LOG_SIZE - log.first);
+    const LibraryChange *first = log.changes != NULL ? log.changes + log.first : NULL;
+    off_t offset = _write_aligned(fd, first, num_first * sizeof(LibraryChange),
+                                  sizeof(LibraryChange));
+    size_t rest = (log.num_changes - num_first) * sizeof(LibraryChange);
+    if (offset == -1 || (rest > 0 && write_precisely(fd, log.changes, rest) != rest))
+    {
+        return -1;
+    }
+    control->epochs[slot] = log.epoch;
+    control->log_starts[slot] = log.start;
+    control->log_offsets[slot] = offset;
+    control->num_changes[slot] = log.num_changes;
+    return 0;
+}
+
+/*
+** Write the ids of the files of library and their hash table to fd, as they
+** are in its index
+*/
+static int _write_id_table(int fd, int slot, LibrarySnapshotControl *control,
+                           const Library *library)
+{
+    LibraryIdTable table = {0};
+    uint32_t num_buckets = 0;
+    if (library_id_table(library, &table) == 0)
+    {
+        num_buckets = table.table_mask + 1;
+    }
+    off_t ids_offset = _write_aligned(fd, table.ids, table.num_ids * sizeof(LibraryFileId),
+                                      sizeof(uint64_t));
+    off_t by_id_offset = ids_offset != -1 ? _write_aligned(fd, table.by_id,
+                                                           num_buckets * sizeof(uint32_t),
+                                                           sizeof(uint32_t))
+                                          : -1;
+    if (by_id_offset == -1)
+    {
+        return -1;
+    }
+    control->ids_offsets[slot] = ids_offset;
+    control->num_ids[slot] = table.num_ids;
+    control->by_id_offsets[slot] = by_id_offset;
+    control->table_masks[slot] = table.table_mask;
+    return 0;
+}
+
+/*
+** Write the snapshot of library to slot: its store, then its LIST response,
+** its files sorted by path, its change log and the ids of its files
+*/
+static int _write_snapshot(LibrarySnapshots *snapshots, int slot, const Library *library)
+{
+    // The stream closes its own descriptor
+    int fd = dup(snapshots->fds[slot]);
+    FILE *out = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (out == NULL)
+    {
+        perror("library_snapshots_publish");
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+
+    int result = 0;
+    if (ftruncate(fd, 0) == -1 || lseek(fd, 0, SEEK_SET) == -1)
+    {
+        perror("library_snapshots_publish");
+        result = -1;
+    }
+    else
+    {
+        result = library_store_write_snapshot(library, out);
+    }
+    if (fflush(out) != 0)
+    {
+        result = -1;
+    }
+    off_t list_offset = lseek(fd, 0, SEEK_CUR);
+    off_t list_end = -1;
+    if (result == 0 && list_offset > 0 && _write_list(fd, library) == 0 &&
+        (list_end = lseek(fd, 0, SEEK_CUR)) != -1 &&
+        _write_sorted_files(fd, slot, snapshots->control, library) == 0 &&
+        _write_change_log(fd, slot, snapshots->control, library) == 0 &&
+        _write_id_table(fd, slot, snapshots->control, library) == 0)
+    {
+        snapshots->control->list_offsets[slot] = list_offset;
+        snapshots->control->list_ends[slot] = list_end;
+        snapshots->control->sizes[slot] = lseek(fd, 0, SEEK_CUR);
+    }
+    else
+    {
+        result = -1;
+    }
+    fclose(out);
+    if (result < 0)
+    {
+        ERR_PRINT("Library snapshot can't be written\n");
+    }
+    return result;
+}
+
+int library_snapshots_publish(LibrarySnapshots *snapshots, const Library *library)
+{
+    LibrarySnapshotControl *control = snapshots->control;
+    _reclaim_snapshots(snapshots);
+
+    uint64_t generation = library->index != NULL ? library->index->generation : 0;
+    if ((control->current != -1 && generation == snapshots->published) ||
+        _elapsed_ms(&snapshots->published_at) < LIBRARY_SNAPSHOT_INTERVAL_MS)
+    {
+        return 0;
+    }
+
+    int slot = -1;
+    for (int i = 0; slot == -1 && i < LIBRARY_SNAPSHOT_SLOTS; i++)
+    {
+        if (i != control->current && !_is_pinned(snapshots, i))
+        {
+            slot = i;
+        }
+    }
+    // Every old snapshot is still in use, clients keep the current one
+    if (slot == -1)
+    {
+        return 0;
+    }
+
+    // Whatever the slot held is gone from now on
+    control->numbers[slot] = 0;
+    if (_write_snapshot(snapshots, slot, library) < 0)
+    {
+        return -1;
+    }
+    control->generations[slot] = generation;
+    control->numbers[slot] = ++snapshots->last_number;
+    __atomic_store_n(&control->current, slot, __ATOMIC_SEQ_CST);
+    snapshots->published = generation;
+    clock_gettime(CLOCK_MONOTONIC, &snapshots->published_at);
+
+    // The previous snapshot goes too, unless a client is using it
+    _reclaim_snapshots(snapshots);
+    return 0;
+}
+
+
+/*
+** Readers
+** -------
+*/
+int library_snapshots_reserve_reader(LibrarySnapshots *snapshots)
+{
+    for (int i = 0; i < LIBRARY_SNAPSHOT_READERS; i++)
+    {
+        if (snapshots->control->readers[i].pid == 0)
+        {
+            snapshots->control->readers[i].slot = -1;
+            snapshots->control->readers[i].pid = -1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void library_snapshots_set_reader(LibrarySnapshots *snapshots, int reader, pid_t pid)
+{
+    if (reader < 0)
+    {
+        return;
+    }
+    if (pid == 0)
+    {
+        snapshots->reader = reader;
+    }
+    else
+    {
+        snapshots->control->readers[reader].pid = pid > 0 ? pid : 0;
+    }
+}
+
+void library_snapshots_remove_reader(LibrarySnapshots *snapshots, pid_t pid)
+{
+    for (int i = 0; i < LIBRARY_SNAPSHOT_READERS; i++)
+    {
+        LibrarySnapshotReader *reader = &snapshots->control->readers[i];
+        if (reader->pid == pid)
+        {
+            __atomic_store_n(&reader->slot, -1, __ATOMIC_SEQ_CST);
+            reader->pid = 0;
+            return;
+        }
+    }
+}
+
+static void _unmap_snapshot(LibrarySnapshots *snapshots)
+{
+    if (snapshots->mapping != NULL)
+    {
+        munmap(snapshots->mapping, snapshots->mapping_size);
+    }
+    free(snapshots->view.files);
+    snapshots->view.files = NULL;
+    snapshots->view.num_files = 0;
+    snapshots->mapping = NULL;
+    snapshots->mapping_size = 0;
+    snapshots->slot = -1;
+    snapshots->number = 0;
+}
+
+const Library *library_snapshot_acquire(LibrarySnapshots *snapshots, const Library *fallback)
+{
+    if (snapshots->reader < 0)
+    {
+        return fallback;
+    }
+    LibrarySnapshotControl *control = snapshots->control;
+    LibrarySnapshotReader *reader = &control->readers[snapshots->reader];
+
+    // The parent doesn't write a slot it sees pinned, and doesn't look for
+    // pins of the current slot: pin it, then check it still is current.
+    int slot;
+    do
+    {
+        slot = __atomic_load_n(&control->current, __ATOMIC_SEQ_CST);
+        if (slot == -1)
+        {
+            return fallback;
+        }
+        __atomic_store_n(&reader->slot, slot, __ATOMIC_SEQ_CST);
+    } while (__atomic_load_n(&control->current, __ATOMIC_SEQ_CST) != slot);
+
+    // Forked after a change that isn't published yet
+    if (fallback->index != NULL && control->generations[slot] < fallback->index->generation)
+    {
+        library_snapshot_release(snapshots);
+        return fallback;
+    }
+
+    if (slot == snapshots->slot && control->numbers[slot] == snapshots->number)
+    {
+        return &snapshots->view;
+    }
+
+    _unmap_snapshot(snapshots);
+    size_t size = control->sizes[slot];
+    char *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, snapshots->fds[slot], 0);
+    if (mapping == MAP_FAILED)
+    {
+        perror("library_snapshot_acquire: mmap");
+        library_snapshot_release(snapshots);
+        return fallback;
+    }
+    snapshots->mapping = mapping;
+    snapshots->mapping_size = size;
+    if (library_store_view(&snapshots->view, mapping, control->list_offsets[slot]) < 0)
+    {
+        _unmap_snapshot(snapshots);
+        library_snapshot_release(snapshots);
+        return fallback;
+    }
+    snapshots->slot = slot;
+    snapshots->number = control->numbers[slot];
+    return &snapshots->view;
+}
+
+int library_snapshot_list_response(const LibrarySnapshots *snapshots, Response *response)
+{
+    if (snapshots->reader < 0 || snapshots->slot == -1 ||
+        __atomic_load_n(&snapshots->control->readers[snapshots->reader].slot,
+                        __ATOMIC_SEQ_CST) != snapshots->slot)
+    {
+        return -1;
+    }
+    *response = (Response)EMPTY_RESPONSE;
+    response->file_fd = dup(snapshots->fds[snapshots->slot]);
+    if (response->file_fd == -1)
+    {
+        perror("library_snapshot_list_response: dup");
+        return -1;
+    }
+    response->file_offset = snapshots->control->list_offsets[snapshots->slot];
+    response->file_end = snapshots->control->list_ends[snapshots->slot];
+    return 0;
+}
+
+const uint32_t *library_snapshot_sorted_files(const LibrarySnapshots *snapshots,
+                                              uint32_t *num_sorted)
+{
+    if (snapshots->reader < 0 || snapshots->slot == -1 ||
+        __atomic_load_n(&snapshots->control->readers[snapshots->reader].slot,
+                        __ATOMIC_SEQ_CST) != snapshots->slot)
+    {
+        return NULL;
+    }
+    *num_sorted = snapshots->control->num_sorted[snapshots->slot];
+    return (const uint32_t *)(snapshots->mapping +
+                              snapshots->control->sorted_offsets[snapshots->slot]);
+}
+
+int library_snapshot_change_log(const LibrarySnapshots *snapshots, LibraryChangeLog *log,
+                                uint64_t *generation)
+{
+    if (snapshots->reader < 0 || snapshots->slot == -1 ||
+        __atomic_load_n(&snapshots->control->readers[snapshots->reader].slot,
+                        __ATOMIC_SEQ_CST) != snapshots->slot)
+    {
+        return -1;
+    }
+    const LibrarySnapshotControl *control = snapshots->control;
+    int slot = snapshots->slot;
+    log->epoch = control->epochs[slot];
+    log->start = control->log_starts[slot];
+    log->first = 0;
+    log->num_changes = control->num_changes[slot];
+    log->changes = (LibraryChange *)(snapshots->mapping + control->log_offsets[slot]);
+    *generation = control->generations[slot];
+    return 0;
+}
+
+int library_snapshot_id_table(const LibrarySnapshots *snapshots, LibraryIdTable *table)
+{
+    if (snapshots->reader < 0 || snapshots->slot == -1 ||
+        __atomic_load_n(&snapshots->control->readers[snapshots->reader].slot,
+                        __ATOMIC_SEQ_CST) != snapshots->slot)
+    {
+        return -1;
+    }
+    const LibrarySnapshotControl *control = snapshots->control;
+    int slot = snapshots->slot;
+    table->ids = (const LibraryFileId *)(snapshots->mapping + control->ids_offsets[slot]);
+    table->num_ids = control->num_ids[slot];
+    // A library without an index has no table
+    table->by_id = control->num_ids[slot] > 0
+                       ? (const uint32_t *)(snapshots->mapping + control->by_id_offsets[slot])
+                       : NULL;
+    table->table_mask = control->table_masks[slot];
+    return 0;
+}
+
+const LibraryMetadata *library_snapshot_metadata(const LibrarySnapshots *snapshots,
+                                                 uint32_t index)
+{
+    if (snapshots->reader < 0 || snapshots->slot == -1 ||
+        __atomic_load_n(&snapshots->control->readers[snapshots->reader].slot,
+                        __ATOMIC_SEQ_CST) != snapshots->slot)
+    {
+        return NULL;
+    }
+    return library_store_metadata(snapshots->mapping, index);
+}
+
+void library_snapshot_release(LibrarySnapshots *snapshots)
+{
+    if (snapshots->reader >= 0)
+    {
+        __atomic_store_n(&snapshots->control->readers[snapshots->reader].slot, -1,
+                         __ATOMIC_SEQ_CST);
+    }
+}
+
+void library_snapshots_close(LibrarySnapshots *snapshots)
+{
+    _unmap_snapshot(snapshots);
+    for (int i = 0; i < LIBRARY_SNAPSHOT_SLOTS; i++)
+    {
+        if (snapshots->fds[i] != -1)
+        {
+            close(snapshots->fds[i]);
+            snapshots->fds[i] = -1;
+        }
+    }
+    if (snapshots->control != NULL)
+    {
+        munmap(snapshots->control, sizeof(LibrarySnapshotControl));
+        snapshots->control = NULL;
+    }
+    snapshots->reader = -1;
+}
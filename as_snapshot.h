@@ -0,0 +1,200 @@
+#ifndef AS_SNAPSHOT_H_
+#define AS_SNAPSHOT_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_library.h"
+
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+** Constants
+** ---------
+*/
+// Snapshots that can exist at once: the current one, and older ones still
+// in use by clients
+#define LIBRARY_SNAPSHOT_SLOTS 8
+
+// Client processes that can read snapshots at once. Those forked while all
+// are taken serve the library as it was when they were forked.
+#define LIBRARY_SNAPSHOT_READERS 1024
+
+// Fewest milliseconds between two snapshots, so that a library changing all
+// the time isn't copied all the time
+#define LIBRARY_SNAPSHOT_INTERVAL_MS 250
+
+
+/*
+** Design
+** ------
+** A forked child has a private copy of the library, as it was when the child
+** was forked. So that clients see the files added after they connected, the
+** parent publishes the library in shared memory as immutable snapshots:
+**
+**   - every snapshot is a memfd (created before any child is forked) holding
+**     the library in the layout of a store (see as_store.h), so a child maps
+**     it and uses it as is, followed by the LIST response of the library,
+**     which children send straight from the memfd, the indices of its
+**     files sorted by path (for LIST pages and STREAM_PATH requests), its
+**     change log (for LIST_DELTA requests) and the ids of its files with
+**     their hash table (for STREAM_ID requests), copied from its index. The
+**     metadata of its files (for INFO requests) is in the store's entries,
+**   - a shared control page holds the slot of the current snapshot, the
+**     number of the snapshot in every slot and a table of readers: one
+**     entry per child, with the slot it is using,
+**   - before every request, a child pins the current slot in its entry (and
+**     checks it is still current), maps it again if it changed since its last
+**     request, and unpins it once the request is answered,
+**   - the parent writes a new snapshot to a slot that is neither current nor
+**     pinned, then makes it current. Old slots that nobody pins anymore are
+**     emptied. Readers are cleared when their child is reaped, so a child
+**     that crashed doesn't pin a slot forever.
+**
+** A snapshot is never written while it is pinned, so a request is answered
+** from one generation of the library from start to end. If every slot is
+** pinned, the parent tries again later. Until a snapshot is as recent as the
+** library a child was forked with, it uses its own copy.
+*/
+
+typedef struct library_snapshot_reader {
+    pid_t pid;                 // 0 if free, -1 while its child is forked
+    int slot;                  // pinned, or -1
+} LibrarySnapshotReader;
+
+// Shared by the parent and every child
+typedef struct library_snapshot_control {
+    int current;               // slot of the current snapshot, -1 if none
+    uint64_t numbers[LIBRARY_SNAPSHOT_SLOTS]; // of the snapshot in each slot, 0 if empty
+    uint64_t generations[LIBRARY_SNAPSHOT_SLOTS]; // of the library in each slot
+    uint64_t list_offsets[LIBRARY_SNAPSHOT_SLOTS]; // of the LIST response in each slot
+    uint64_t list_ends[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t sorted_offsets[LIBRARY_SNAPSHOT_SLOTS]; // of the files sorted by path
+    uint32_t num_sorted[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t epochs[LIBRARY_SNAPSHOT_SLOTS]; // of the change log in each slot
+    uint64_t log_starts[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t log_offsets[LIBRARY_SNAPSHOT_SLOTS]; // of its changes, oldest first
+    uint32_t num_changes[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t ids_offsets[LIBRARY_SNAPSHOT_SLOTS]; // of the ids of its files
+    uint32_t num_ids[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t by_id_offsets[LIBRARY_SNAPSHOT_SLOTS]; // of their hash table
+    uint32_t table_masks[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t sizes[LIBRARY_SNAPSHOT_SLOTS];
+    LibrarySnapshotReader readers[LIBRARY_SNAPSHOT_READERS];
+} LibrarySnapshotControl;
+
+typedef struct library_snapshots {
+    LibrarySnapshotControl *control;
+    int fds[LIBRARY_SNAPSHOT_SLOTS];
+    uint64_t published;        // library generation of the current snapshot
+    uint64_t last_number;      // of the current snapshot, counting from 1
+    struct timespec published_at;
+    // In a child
+    int reader;                // its entry in control->readers, or -1
+    int slot;                  // mapped, or -1
+    uint64_t number;           // of the mapped snapshot
+    char *mapping;
+    size_t mapping_size;
+    Library view;              // of the mapped slot
+} LibrarySnapshots;
+
+
+/*
+** Create the (empty) snapshots of library. Call it before forking children.
+**
+** returns 0 on success, -1 on error
+*/
+int library_snapshots_init(LibrarySnapshots *snapshots, const Library *library);
+
+/*
+** Publish library as the current snapshot if it changed since the last one
+** (at most every LIBRARY_SNAPSHOT_INTERVAL_MS), and empty the old snapshots
+** nobody uses. Call it regularly in the parent.
+**
+** returns 0 on success (even if it had to skip publishing), -1 on error
+*/
+int library_snapshots_publish(LibrarySnapshots *snapshots, const Library *library);
+
+/*
+** Reserve a reader for the child about to be forked.
+**
+** returns its index, -1 if all are taken
+*/
+int library_snapshots_reserve_reader(LibrarySnapshots *snapshots);
+
+/*
+** In the parent, give the reserved reader to the child pid (or free it if
+** pid is -1, the fork failed). In the child, pass pid 0 to become it.
+*/
+void library_snapshots_set_reader(LibrarySnapshots *snapshots, int reader, pid_t pid);
+
+/*
+** Free the reader of the reaped child pid, and unpin its slot.
+*/
+void library_snapshots_remove_reader(LibrarySnapshots *snapshots, pid_t pid);
+
+/*
+** In a child, pin the current snapshot until library_snapshot_release.
+**
+** returns the library of the current snapshot, fallback (the child's own copy
+** of the library) if there is none, if the child has no reader or if fallback
+** is newer than the snapshot
+*/
+const Library *library_snapshot_acquire(LibrarySnapshots *snapshots, const Library *fallback);
+
+/*
+** In a child, prepare the response to a LIST request from the snapshot
+** pinned by library_snapshot_acquire (see prepare_list_response).
+**
+** returns 0 on success, -1 if no snapshot is pinned or on error
+*/
+int library_snapshot_list_response(const LibrarySnapshots *snapshots, Response *response);
+
+/*
+** In a child, get the indices of the files of the snapshot pinned by
+** library_snapshot_acquire sorted by path (see library_sorted_files).
+**
+** returns them (*num_sorted of them), NULL if no snapshot is pinned
+*/
+const uint32_t *library_snapshot_sorted_files(const LibrarySnapshots *snapshots,
+                                              uint32_t *num_sorted);
+
+/*
+** In a child, get the change log of the snapshot pinned by
+** library_snapshot_acquire (see library_changed_slots) and the generation of
+** its library.
+**
+** returns 0 on success, -1 if no snapshot is pinned
+*/
+int library_snapshot_change_log(const LibrarySnapshots *snapshots, LibraryChangeLog *log,
+                                uint64_t *generation);
+
+/*
+** In a child, get the ids of the files of the snapshot pinned by
+** library_snapshot_acquire and their hash table (see library_find_stable_id).
+**
+** returns 0 on success, -1 if no snapshot is pinned
+*/
+int library_snapshot_id_table(const LibrarySnapshots *snapshots, LibraryIdTable *table);
+
+/*
+** In a child, returns the metadata of the file with the given index in the
+** snapshot pinned by library_snapshot_acquire, NULL if it has none or if no
+** snapshot is pinned
+*/
+const LibraryMetadata *library_snapshot_metadata(const LibrarySnapshots *snapshots,
+                                                 uint32_t index);
+
+/*
+** Unpin the snapshot pinned by library_snapshot_acquire
+*/
+void library_snapshot_release(LibrarySnapshots *snapshots);
+
+/*
+** Release the snapshots, in the parent or in a child
+*/
+void library_snapshots_close(LibrarySnapshots *snapshots);
+
+#endif // AS_SNAPSHOT_H_
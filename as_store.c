@@ -0,0 +1,488 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_store.h"
+
+#include <time.h>
+
+#define STORE_ALIGNMENT 8
+
+static uint64_t _align(uint64_t offset)
+{
+    return (offset + STORE_ALIGNMENT - 1) & ~(uint64_t)(STORE_ALIGNMENT - 1);
+}
+
+static uint16_t _file_format(const char *path)
+{
+    static const char *supported_file_exts[] = SUPPORTED_FILE_EXTS;
+    const char *ext = strrchr(path, '.');
+    for (int i = 0; ext != NULL && i < sizeof(supported_file_exts) / sizeof(char *); i++)
+    {
+        if (strcmp(ext, supported_file_exts[i]) == 0)
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+static const LibraryStoreHeader *_store_header(const Library *library)
+{
+    if (library->index == NULL)
+    {
+        return NULL;
+    }
+    return (const LibraryStoreHeader *)library->index->mapping;
+}
+
+
+/*
+** Loading
+** -------
+*/
+
+/*
+** returns 1 if the sections of the mapped store header are where they
+** belong in its size bytes, 0 otherwise. The store must have been saved from
+** the library directory library_st, unless it is NULL.
+*/
+static int _is_valid_header(const LibraryStoreHeader *header, size_t size,
+                            const struct stat *library_st)
+{
+    if (size < sizeof(LibraryStoreHeader) ||
+        memcmp(header->magic, LIBRARY_STORE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != LIBRARY_STORE_VERSION ||
+        header->header_size != sizeof(LibraryStoreHeader) ||
+        header->entry_size != sizeof(LibraryStoreEntry) || header->store_size != size)
+    {
+        return 0;
+    }
+    // A copy of the library, or another library in its place
+    if (library_st != NULL && (header->library_dev != library_st->st_dev ||
+                               header->library_ino != library_st->st_ino))
+    {
+        return 0;
+    }
+    return header->num_entries <= header->num_slots &&
+           header->num_slots <= UINT32_MAX / 2 &&
+           header->entries_offset >= sizeof(LibraryStoreHeader) &&
+           header->entries_offset % STORE_ALIGNMENT == 0 &&
+           header->dirs_offset >= header->entries_offset +
+                                      (uint64_t)header->num_entries * sizeof(LibraryStoreEntry) &&
+           header->dirs_offset % sizeof(uint32_t) == 0 &&
+           header->strings_offset >= header->dirs_offset +
+                                         (uint64_t)header->num_dirs * sizeof(uint32_t) &&
+           header->strings_size > 0 && header->strings_size <= UINT32_MAX &&
+           header->strings_offset + header->strings_size == size &&
+           // Every string offset points to a null terminated string
+           ((const char *)header)[size - 1] == '\0';
+}
+
+/*
+** Point files (and ids, if not NULL), num_slots long and zeroed, to the
+** entries of the valid store header.
+**
+** returns 1 if every entry and directory refers to the store, 0 otherwise
+*/
+static int _store_files(const LibraryStoreHeader *header, char **files, LibraryFileId *ids)
+{
+    const char *mapping = (const char *)header;
+    const LibraryStoreEntry *entries = (const LibraryStoreEntry *)(mapping + header->entries_offset);
+    const uint32_t *dirs = (const uint32_t *)(mapping + header->dirs_offset);
+    const char *strings = mapping + header->strings_offset;
+
+    for (uint32_t i = 0; i < header->num_entries; i++)
+    {
+        if (entries[i].slot >= header->num_slots || files[entries[i].slot] != NULL ||
+            entries[i].path >= header->strings_size)
+        {
+            return 0;
+        }
+        files[entries[i].slot] = (char *)strings + entries[i].path;
+        if (ids != NULL)
+        {
+            ids[entries[i].slot].dev = entries[i].dev;
+            ids[entries[i].slot].ino = entries[i].ino;
+        }
+    }
+    for (uint32_t i = 0; i < header->num_dirs; i++)
+    {
+        if (dirs[i] >= header->strings_size)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int library_store_load(Library *library)
+{
+    char *store_path = _join_path(library->path, LIBRARY_STORE_FILE);
+    if (store_path == NULL)
+    {
+        return -1;
+    }
+    int fd = open(store_path, O_RDONLY | O_CLOEXEC);
+    free(store_path);
+    if (fd == -1)
+    {
+        if (errno != ENOENT)
+        {
+            perror("library_store_load: open");
+        }
+        return -1;
+    }
+
+    struct stat st;
+    struct stat library_st;
+    if (fstat(fd, &st) == -1 || stat(library->path, &library_st) == -1)
+    {
+        perror("library_store_load: stat");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < sizeof(LibraryStoreHeader))
+    {
+        ERR_PRINT("Library store is not valid, ignoring it\n");
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    const char *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        perror("library_store_load: mmap");
+        return -1;
+    }
+
+    const LibraryStoreHeader *header = (const LibraryStoreHeader *)mapping;
+    if (!_is_valid_header(header, size, &library_st))
+    {
+        ERR_PRINT("Library store is not valid, ignoring it\n");
+        munmap((void *)mapping, size);
+        return -1;
+    }
+
+    char **files = calloc(header->num_slots, sizeof(char *));
+    LibraryFileId *ids = calloc(header->num_slots, sizeof(LibraryFileId));
+    int valid = files != NULL && ids != NULL;
+    if (!valid)
+    {
+        perror("library_store_load");
+    }
+    else
+    {
+        valid = _store_files(header, files, ids);
+    }
+
+    if (!valid)
+    {
+        if (files != NULL && ids != NULL)
+        {
+            ERR_PRINT("Library store is not valid, ignoring it\n");
+        }
+        free(files);
+        free(ids);
+        munmap((void *)mapping, size);
+        return -1;
+    }
+    // The library frees files from now on, whatever happens
+    int result = library_adopt_files(library, files, ids, header->num_slots, mapping, size);
+    free(ids);
+    if (result < 0)
+    {
+        munmap((void *)mapping, size);
+        return -1;
+    }
+    const LibraryStoreEntry *entries = (const LibraryStoreEntry *)(mapping + header->entries_offset);
+    for (uint32_t i = 0; i < header->num_entries; i++)
+    {
+        library_set_metadata(library, entries[i].slot, &entries[i].metadata);
+    }
+
+    char saved_at[32];
+    time_t saved_time = header->saved_at;
+    strftime(saved_at, sizeof(saved_at), "%Y-%m-%d %H:%M:%S", localtime(&saved_time));
+    printf("Library loaded from its store (saved %s): %u files\n", saved_at,
+           header->num_entries);
+    return 0;
+}
+
+const LibraryMetadata *library_store_metadata(const char *mapping, uint32_t index)
+{
+    const LibraryStoreHeader *header = (const LibraryStoreHeader *)mapping;
+    const LibraryStoreEntry *entries = (const LibraryStoreEntry *)(mapping + header->entries_offset);
+    // Written by increasing slot
+    uint32_t low = 0;
+    uint32_t high = header->num_entries;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (entries[middle].slot < index)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == header->num_entries || entries[low].slot != index ||
+        (entries[low].metadata.id.dev == 0 && entries[low].metadata.id.ino == 0))
+    {
+        return NULL;
+    }
+    return &entries[low].metadata;
+}
+
+const char *library_store_dir(const Library *library, uint32_t i)
+{
+    const LibraryStoreHeader *header = _store_header(library);
+    if (header == NULL || i >= header->num_dirs)
+    {
+        return NULL;
+    }
+    const uint32_t *dirs = (const uint32_t *)((const char *)header + header->dirs_offset);
+    return (const char *)header + header->strings_offset + dirs[i];
+}
+
+
+/*
+** Saving
+** ------
+*/
+
+/*
+** Write library and its num_dirs directories to out in the layout of its
+** store. Without library_fd (-1), the store isn't tied to the library
+** directory and has neither the sizes nor the times of the files.
+*/
+static int _write_store(const Library *library, const char *const *dirs, int num_dirs, FILE *out,
+                        int library_fd)
+{
+    struct stat library_st;
+    memset(&library_st, 0, sizeof(library_st));
+    if (library_fd != -1 && fstat(library_fd, &library_st) == -1)
+    {
+        return -1;
+    }
+
+    LibraryStoreHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LIBRARY_STORE_MAGIC, sizeof(header.magic));
+    header.version = LIBRARY_STORE_VERSION;
+    header.header_size = sizeof(LibraryStoreHeader);
+    header.entry_size = sizeof(LibraryStoreEntry);
+    header.num_slots = library->num_files;
+    header.library_dev = library_st.st_dev;
+    header.library_ino = library_st.st_ino;
+    header.saved_at = time(NULL);
+    // Starts with an empty string, so that no offset is past the end
+    header.strings_size = 1;
+    for (uint32_t i = 0; i < library->num_files; i++)
+    {
+        if (library->files[i] != NULL)
+        {
+            header.num_entries++;
+            header.strings_size += strlen(library->files[i]) + 1;
+        }
+    }
+    for (int i = 0; i < num_dirs; i++)
+    {
+        if (dirs[i] != NULL)
+        {
+            header.num_dirs++;
+            header.strings_size += strlen(dirs[i]) + 1;
+        }
+    }
+    if (header.strings_size > UINT32_MAX)
+    {
+        ERR_PRINT("Library too big for its store\n");
+        return -1;
+    }
+    header.entries_offset = _align(sizeof(LibraryStoreHeader));
+    header.dirs_offset = header.entries_offset + header.num_entries * sizeof(LibraryStoreEntry);
+    header.strings_offset = _align(header.dirs_offset + header.num_dirs * sizeof(uint32_t));
+    header.store_size = header.strings_offset + header.strings_size;
+
+    static const char padding[STORE_ALIGNMENT];
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(padding, header.entries_offset - sizeof(header), 1, out);
+
+    uint32_t offset = 1;
+    for (uint32_t i = 0; i < library->num_files; i++)
+    {
+        if (library->files[i] == NULL)
+        {
+            continue;
+        }
+        LibraryStoreEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.slot = i;
+        entry.path = offset;
+        entry.dev = library->index->ids[i].dev;
+        entry.ino = library->index->ids[i].ino;
+        entry.format = _file_format(library->files[i]);
+        const LibraryMetadata *metadata = library_file_metadata(library, i);
+        if (metadata != NULL)
+        {
+            entry.metadata = *metadata;
+        }
+        struct stat st;
+        if (library_fd != -1 && fstatat(library_fd, library->files[i], &st, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            entry.size = st.st_size;
+            entry.mtime_sec = st.st_mtim.tv_sec;
+            entry.mtime_nsec = st.st_mtim.tv_nsec;
+        }
+        fwrite(&entry, sizeof(entry), 1, out);
+        offset += strlen(library->files[i]) + 1;
+    }
+    for (int i = 0; i < num_dirs; i++)
+    {
+        if (dirs[i] != NULL)
+        {
+            fwrite(&offset, sizeof(offset), 1, out);
+            offset += strlen(dirs[i]) + 1;
+        }
+    }
+    fwrite(padding, header.strings_offset - header.dirs_offset -
+                        header.num_dirs * sizeof(uint32_t), 1, out);
+
+    fputc('\0', out);
+    for (uint32_t i = 0; i < library->num_files; i++)
+    {
+        if (library->files[i] != NULL)
+        {
+            fwrite(library->files[i], strlen(library->files[i]) + 1, 1, out);
+        }
+    }
+    for (int i = 0; i < num_dirs; i++)
+    {
+        if (dirs[i] != NULL)
+        {
+            fwrite(dirs[i], strlen(dirs[i]) + 1, 1, out);
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+** Write the store next to the one in use, then rename it over it.
+*/
+static int _save_store(const Library *library, const char *const *dirs, int num_dirs)
+{
+    char *store_path = _join_path(library->path, LIBRARY_STORE_FILE);
+    char *temp_path = store_path != NULL ? malloc(strlen(store_path) + 32) : NULL;
+    if (temp_path == NULL)
+    {
+        free(store_path);
+        return -1;
+    }
+    sprintf(temp_path, "%s.%d", store_path, getpid());
+
+    int result = -1;
+    int library_fd = open(library->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *out = fd != -1 ? fdopen(fd, "w") : NULL;
+    if (library_fd == -1 || out == NULL)
+    {
+        ERR_PRINT("Library store can't be saved to %s: %s\n", temp_path, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+    }
+    else
+    {
+        result = _write_store(library, dirs, num_dirs, out, library_fd);
+        if (fflush(out) != 0 || fsync(fd) == -1)
+        {
+            result = -1;
+        }
+        if (fclose(out) != 0)
+        {
+            result = -1;
+        }
+        if (result == 0 && rename(temp_path, store_path) == -1)
+        {
+            perror("library_store_save: rename");
+            result = -1;
+        }
+        if (result < 0)
+        {
+            unlink(temp_path);
+        }
+    }
+    if (library_fd != -1)
+    {
+        close(library_fd);
+    }
+    free(temp_path);
+    free(store_path);
+    return result;
+}
+
+int library_store_save(const Library *library, const char *const *dirs, int num_dirs)
+{
+    // Don't let the children inherit (and later repeat) buffered output
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("library_store_save: fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        // Orphaned at once, so that nobody has to wait for it
+        if (fork() != 0)
+        {
+            _exit(0);
+        }
+        // Without the server's sockets, which may be restarted meanwhile
+        close_range(3, ~0U, 0);
+        _exit(_save_store(library, dirs, num_dirs) == 0 ? 0 : 1);
+    }
+    waitpid(pid, NULL, 0);
+    return 0;
+}
+
+
+/*
+** Snapshots
+** ---------
+*/
+
+int library_store_write_snapshot(const Library *library, FILE *out)
+{
+    return _write_store(library, NULL, 0, out, -1);
+}
+
+int library_store_view(Library *view, const char *mapping, size_t size)
+{
+    const LibraryStoreHeader *header = (const LibraryStoreHeader *)mapping;
+    if (!_is_valid_header(header, size, NULL))
+    {
+        ERR_PRINT("Library snapshot is not valid\n");
+        return -1;
+    }
+    char **files = calloc(header->num_slots, sizeof(char *));
+    if (files == NULL)
+    {
+        perror("library_store_view");
+        return -1;
+    }
+    if (!_store_files(header, files, NULL))
+    {
+        ERR_PRINT("Library snapshot is not valid\n");
+        free(files);
+        return -1;
+    }
+    view->files = files;
+    view->num_files = header->num_slots;
+    view->index = NULL;
+    return 0;
+}
@@ -0,0 +1,128 @@
+#ifndef AS_STORE_H_
+#define AS_STORE_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_library.h"
+
+/*
+** Constants
+** ---------
+*/
+// Where the library is stored, in the library directory
+#define LIBRARY_STORE_FILE ".as_library"
+
+#define LIBRARY_STORE_MAGIC "ASLIBRY"
+
+// Bump it whenever the layout below changes, stores of other versions are
+// ignored (and replaced)
+#define LIBRARY_STORE_VERSION 3
+
+
+/*
+** Design
+** ------
+** A server that knows its library from a previous run doesn't scan it before
+** serving clients. The library is saved to a store, a single file laid out so
+** that it can be used as is once mapped in memory:
+**
+**   header | entries (one per file) | directory offsets | strings
+**
+** Everything in it is referred to by offset, so the mapping works wherever
+** it is mapped, and nothing is copied out of it when it is loaded: the paths
+** of the library point into the mapping, which prefork workers share
+** read-only with the supervisor.
+**
+** A loaded library is validated in the background: its directories are
+** watched at once, and a reconciliation (see as_watch.h) applies whatever
+** changed while the server wasn't running. The store is saved again, by a
+** background process, after every full scan or reconciliation.
+**
+** The metadata of the files (see as_metadata.h) is stored with them, so that
+** the reconciliation of a loaded library only reads the files that changed.
+**
+** Stores are replaced by renaming a new file over them, never rewritten in
+** place, so a mapped store never changes under a server using it.
+*/
+
+typedef struct library_store_header {
+    char magic[8];             // LIBRARY_STORE_MAGIC
+    uint32_t version;          // LIBRARY_STORE_VERSION
+    uint32_t header_size;      // sizeof(LibraryStoreHeader)
+    uint32_t entry_size;       // sizeof(LibraryStoreEntry)
+    uint32_t num_slots;        // library->num_files when saved
+    uint32_t num_entries;      // files in the library
+    uint32_t num_dirs;
+    uint64_t store_size;       // of the whole file
+    uint64_t library_dev;      // the library directory it was saved from
+    uint64_t library_ino;
+    int64_t saved_at;
+    uint64_t entries_offset;
+    uint64_t dirs_offset;      // a uint32_t string offset per directory
+    uint64_t strings_offset;   // null terminated paths
+    uint64_t strings_size;
+} LibraryStoreHeader;
+
+typedef struct library_store_entry {
+    uint32_t slot;             // index of the file in the library
+    uint32_t path;             // string offset of its path
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;             // bytes, 0 if it couldn't be found when saved
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint16_t format;           // 1 + its index in SUPPORTED_FILE_EXTS
+    uint16_t reserved;
+    LibraryMetadata metadata;  // its id is 0 if the file has none
+} LibraryStoreEntry;
+
+
+/*
+** Load the empty library from its store, if it has a valid one.
+**
+** returns 0 on success, -1 if there is no valid store (the library is still
+** empty then)
+*/
+int library_store_load(Library *library);
+
+/*
+** returns the i-th directory of the store library was loaded from, NULL if
+** there is none (or library wasn't loaded from a store)
+*/
+const char *library_store_dir(const Library *library, uint32_t i);
+
+/*
+** returns the metadata of the file with the given index in the valid store
+** at mapping (see library_store_view), NULL if it has none
+*/
+const LibraryMetadata *library_store_metadata(const char *mapping, uint32_t index);
+
+/*
+** Save library and its directories (num_dirs paths, NULL ones are skipped)
+** to its store, in a background process that is not a child of the caller.
+**
+** returns 0 if the store is being saved, -1 on error
+*/
+int library_store_save(const Library *library, const char *const *dirs, int num_dirs);
+
+/*
+** Write the files of library to out in the layout of a store, without its
+** directories, the sizes and times of its files, or the library directory it
+** belongs to (see as_snapshot.h).
+**
+** returns 0 on success, -1 on error
+*/
+int library_store_write_snapshot(const Library *library, FILE *out);
+
+/*
+** Set the files of view to those of the store of size bytes at mapping, as
+** written by library_store_write_snapshot. The paths point into the mapping,
+** free view->files (and nothing else of view) when done with it.
+**
+** returns 0 on success, -1 if the store is not valid
+*/
+int library_store_view(Library *view, const char *mapping, size_t size);
+
+#endif // AS_STORE_H_
@@ -0,0 +1,840 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_uring.h"
+#include "as_cache.h"
+#include "as_egress.h"
+#include "as_watch.h"
+
+#include <time.h>
+
+// Everything the completion handlers share
+typedef struct uring_server {
+    Uring ring;
+    Library *library;
+    int listenfd;
+    int multishot_accept;
+    uint8_t *buffers;
+    int free_buffers[URING_NUM_BUFFERS];
+    int num_free_buffers;
+    UringConnection *waiting_head;
+    UringConnection *waiting_tail;
+    UringConnection *connections;
+    struct __kernel_timespec tick;
+    LibraryWatch watch;
+    int reconcile;            // 'r' was typed
+    int quit;
+    int failed;
+} UringServer;
+
+
+/*
+** Ring set up and submission
+** --------------------------
+*/
+static int _uring_setup(Uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        perror("run_uring_server: mmap");
+        close(ring->fd);
+        return -1;
+    }
+
+    uint8_t *sq = ring->sq_ring;
+    uint8_t *cq = ring->cq_ring;
+    ring->sq_entries = params.sq_entries;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->to_submit = 0;
+    return 0;
+}
+
+static void _uring_teardown(Uring *ring)
+{
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/*
+** Hand the queued submissions to the kernel and, if wait, block until at
+** least one completion is available.
+**
+** returns 0 on success, -1 on error
+*/
+static int _uring_enter(Uring *ring, int wait)
+{
+    while (1)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait ? 1 : 0,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0)
+        {
+            ring->to_submit -= ret;
+            return 0;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("run_uring_server: io_uring_enter");
+            return -1;
+        }
+        if (!wait)
+        {
+            return 0;
+        }
+    }
+}
+
+/*
+** Get a zeroed submission queue entry for op on conn (NULL for the server's
+** own operations). The entry is submitted on the next _uring_enter.
+*/
+static struct io_uring_sqe *_uring_get_sqe(Uring *ring, UringConnection *conn, UringOp op)
+{
+    unsigned tail = *ring->sq_tail;
+    while (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if (_uring_enter(ring, 0) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = (uint64_t)(uintptr_t)conn | op;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    if (conn != NULL)
+    {
+        conn->pending_ops++;
+    }
+    return sqe;
+}
+
+/*
+** Check that the kernel has every operation this server submits.
+*/
+static int _uring_supports_ops(const Uring *ring)
+{
+    static const uint8_t needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                     IORING_OP_READ_FIXED, IORING_OP_POLL_ADD,
+                                     IORING_OP_TIMEOUT};
+    size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_size);
+    if (probe == NULL)
+    {
+        return 0;
+    }
+
+    int supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (int i = 0; supported && i < sizeof(needed); i++)
+    {
+        supported = needed[i] <= probe->last_op &&
+                    (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+
+/*
+** Submissions
+** -----------
+*/
+static int _submit_accept(UringServer *server)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, NULL, URING_OP_ACCEPT);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->listenfd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (server->multishot_accept)
+    {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    return 0;
+}
+
+static int _submit_control(UringServer *server)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, NULL, URING_OP_CONTROL);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = STDIN_FILENO;
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+static int _submit_library_poll(UringServer *server)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, NULL, URING_OP_LIBRARY);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = server->watch.fd;
+    sqe->poll32_events = POLLIN;
+    return 0;
+}
+
+static int _submit_tick(UringServer *server)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, NULL, URING_OP_TICK);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uintptr_t)&server->tick;
+    sqe->len = 1;
+    return 0;
+}
+
+static int _submit_recv(UringServer *server, UringConnection *conn)
+{
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, conn, URING_OP_RECV);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->client.socket;
+    sqe->addr = (uintptr_t)(conn->request_buffer + conn->bytes_in_buf);
+    sqe->len = REQUEST_BUFFER_SIZE - conn->bytes_in_buf;
+    return 0;
+}
+
+static int _submit_send_head(UringServer *server, UringConnection *conn)
+{
+    Response *response = &conn->response;
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, conn, URING_OP_SEND_HEAD);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    pace_response(conn->client.socket, response);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->client.socket;
+    sqe->addr = (uintptr_t)(response->head + response->head_sent);
+    sqe->len = response->head_len - response->head_sent;
+    sqe->msg_flags = MSG_NOSIGNAL | (response->file_fd >= 0 ? MSG_MORE : 0);
+    return 0;
+}
+
+static uint8_t *_chunk_buffer(UringServer *server, UringConnection *conn)
+{
+    return server->buffers + (size_t)conn->buffer_index * URING_CHUNK_SIZE;
+}
+
+static int _submit_send_chunk(UringServer *server, UringConnection *conn)
+{
+    Response *response = &conn->response;
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, conn, URING_OP_SEND_CHUNK);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    int last_chunk = response->file_offset + conn->chunk_len >= response->file_end;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->client.socket;
+    sqe->addr = (uintptr_t)(_chunk_buffer(server, conn) + conn->chunk_sent);
+    sqe->len = conn->chunk_len - conn->chunk_sent;
+    sqe->msg_flags = MSG_NOSIGNAL | (last_chunk ? 0 : MSG_MORE);
+    return 0;
+}
+
+/*
+** Submit the read of the next file chunk into the connection's registered
+** buffer, linked to the send of that buffer.
+*/
+static int _submit_chunk(UringServer *server, UringConnection *conn)
+{
+    Response *response = &conn->response;
+    pace_response(conn->client.socket, response);
+    conn->chunk_len = MIN(MIN(URING_CHUNK_SIZE, egress_budget(response->socket_pace_rate)),
+                          response->file_end - response->file_offset);
+    conn->chunk_sent = 0;
+
+    struct io_uring_sqe *sqe = _uring_get_sqe(&server->ring, conn, URING_OP_READ_CHUNK);
+    if (sqe == NULL)
+    {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = response->file_fd;
+    sqe->addr = (uintptr_t)_chunk_buffer(server, conn);
+    sqe->len = conn->chunk_len;
+    sqe->off = response->file_offset;
+    sqe->buf_index = conn->buffer_index;
+    sqe->flags = IOSQE_IO_LINK;
+
+    return _submit_send_chunk(server, conn);
+}
+
+
+/*
+** Connections
+** -----------
+*/
+static void _release_buffer(UringServer *server, UringConnection *conn);
+static int _advance_connection(UringServer *server, UringConnection *conn);
+
+static void _free_connection(UringServer *server, UringConnection *conn)
+{
+    egress_disconnect(conn->client.socket);
+    close(conn->client.socket);
+    free_response(&conn->response);
+    _release_buffer(server, conn);
+
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        server->connections = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    free(conn);
+}
+
+/*
+** Start closing the connection. Shutting the socket down completes its
+** pending operations; it is freed when the last one is done.
+*/
+static void _close_connection(UringServer *server, UringConnection *conn)
+{
+    if (!conn->closing)
+    {
+        conn->closing = 1;
+        shutdown(conn->client.socket, SHUT_RDWR);
+    }
+
+    // Stop waiting for a buffer
+    UringConnection **waiting = &server->waiting_head;
+    UringConnection *previous = NULL;
+    while (*waiting != NULL)
+    {
+        if (*waiting == conn)
+        {
+            *waiting = conn->next_waiting;
+            if (server->waiting_tail == conn)
+            {
+                server->waiting_tail = previous;
+            }
+            break;
+        }
+        previous = *waiting;
+        waiting = &(*waiting)->next_waiting;
+    }
+
+    if (conn->pending_ops == 0)
+    {
+        _free_connection(server, conn);
+    }
+}
+
+static void _add_connection(UringServer *server, int socket)
+{
+    UringConnection *conn = malloc(sizeof(UringConnection));
+    if (conn == NULL)
+    {
+        perror("run_uring_server");
+        close(socket);
+        return;
+    }
+    conn->client.socket = socket;
+    socklen_t addr_size = sizeof(conn->client.addr);
+    getpeername(socket, (struct sockaddr *)&conn->client.addr, &addr_size);
+    conn->bytes_in_buf = 0;
+    conn->version = PROTOCOL_VERSION_BASE;
+    conn->response = (Response)EMPTY_RESPONSE;
+    conn->writing = 0;
+    conn->buffer_index = -1;
+    conn->pending_ops = 0;
+    conn->closing = 0;
+    conn->next_waiting = NULL;
+
+    conn->prev = NULL;
+    conn->next = server->connections;
+    if (server->connections != NULL)
+    {
+        server->connections->prev = conn;
+    }
+    server->connections = conn;
+
+    printf("Server got a connection from %s, port %d\n",
+           inet_ntoa(conn->client.addr.sin_addr), ntohs(conn->client.addr.sin_port));
+    egress_connect(&conn->client);
+
+    if (_submit_recv(server, conn) < 0)
+    {
+        _close_connection(server, conn);
+    }
+}
+
+/*
+** Start sending the file body, once a registered buffer is available.
+*/
+static int _start_body(UringServer *server, UringConnection *conn)
+{
+    if (server->num_free_buffers == 0)
+    {
+        conn->next_waiting = NULL;
+        if (server->waiting_tail != NULL)
+        {
+            server->waiting_tail->next_waiting = conn;
+        }
+        else
+        {
+            server->waiting_head = conn;
+        }
+        server->waiting_tail = conn;
+        return 0;
+    }
+
+    conn->buffer_index = server->free_buffers[--server->num_free_buffers];
+    return _submit_chunk(server, conn);
+}
+
+static void _release_buffer(UringServer *server, UringConnection *conn)
+{
+    if (conn->buffer_index < 0)
+    {
+        return;
+    }
+    server->free_buffers[server->num_free_buffers++] = conn->buffer_index;
+    conn->buffer_index = -1;
+
+    // Hand it straight to the next STREAM waiting for one
+    UringConnection *waiting = server->waiting_head;
+    if (waiting != NULL)
+    {
+        server->waiting_head = waiting->next_waiting;
+        if (server->waiting_head == NULL)
+        {
+            server->waiting_tail = NULL;
+        }
+        if (_start_body(server, waiting) < 0)
+        {
+            _close_connection(server, waiting);
+        }
+    }
+}
+
+static int _finish_response(UringServer *server, UringConnection *conn)
+{
+    egress_idle(conn->client.socket);
+    _release_buffer(server, conn);
+    free_response(&conn->response);
+    conn->writing = 0;
+    return _advance_connection(server, conn);
+}
+
+/*
+** Answer the next request in the connection's buffer, or receive more of it.
+**
+** returns 0 on success, -1 if the connection should be closed
+*/
+static int _advance_connection(UringServer *server, UringConnection *conn)
+{
+    while (!conn->writing)
+    {
+        Request request;
+        int consumed = parse_request(conn->request_buffer, conn->bytes_in_buf, &request);
+        if (consumed == 0)
+        {
+            // Nowhere left to receive the rest of the request into
+            if (conn->bytes_in_buf == REQUEST_BUFFER_SIZE)
+            {
+                return -1;
+            }
+            return _submit_recv(server, conn);
+        }
+        conn->bytes_in_buf -= consumed;
+        memmove(conn->request_buffer, conn->request_buffer + consumed, conn->bytes_in_buf);
+
+        int prepared = prepare_response(server->library, &request, &conn->version,
+                                        &conn->response);
+        if (prepared < 0)
+        {
+            return -1;
+        }
+        if (prepared == 0)
+        {
+            conn->writing = 1;
+        }
+    }
+    return _submit_send_head(server, conn);
+}
+
+
+/*
+** Completions
+** -----------
+*/
+static int _on_recv(UringServer *server, UringConnection *conn, int res)
+{
+    if (res < 0)
+    {
+        errno = -res;
+        perror("handle_client");
+        return -1;
+    }
+    if (res == 0)
+    {
+        printf("Client on %s:%d disconnected\n",
+               inet_ntoa(conn->client.addr.sin_addr),
+               ntohs(conn->client.addr.sin_port));
+        return -1;
+    }
+    conn->bytes_in_buf += res;
+    return _advance_connection(server, conn);
+}
+
+static int _on_send_head(UringServer *server, UringConnection *conn, int res)
+{
+    Response *response = &conn->response;
+    if (res < 0)
+    {
+        errno = -res;
+        perror("send_response: send");
+        return -1;
+    }
+    response->head_sent += res;
+    egress_sent(conn->client.socket, res);
+    if (response->head_sent < response->head_len)
+    {
+        return _submit_send_head(server, conn);
+    }
+    if (response->file_fd >= 0 && response->file_offset < response->file_end)
+    {
+        return _start_body(server, conn);
+    }
+    return _finish_response(server, conn);
+}
+
+static int _on_read_chunk(UringServer *server, UringConnection *conn, int res)
+{
+    if (res <= 0)
+    {
+        ERR_PRINT("send_response: failed to read the file\n");
+        return -1;
+    }
+    // A short read breaks the link and cancels the send, which is then
+    // resubmitted for what was read
+    conn->chunk_len = res;
+    return 0;
+}
+
+static int _on_send_chunk(UringServer *server, UringConnection *conn, int res)
+{
+    Response *response = &conn->response;
+    if (res == -ECANCELED && conn->chunk_sent == 0)
+    {
+        return _submit_send_chunk(server, conn);
+    }
+    if (res < 0)
+    {
+        errno = -res;
+        perror("send_response: send");
+        return -1;
+    }
+
+    conn->chunk_sent += res;
+    egress_sent(conn->client.socket, res);
+    if (conn->chunk_sent < conn->chunk_len)
+    {
+        return _submit_send_chunk(server, conn);
+    }
+    response->file_offset += conn->chunk_len;
+    if (response->file_offset < response->file_end)
+    {
+        return _submit_chunk(server, conn);
+    }
+    return _finish_response(server, conn);
+}
+
+static int _on_control(UringServer *server)
+{
+    char command;
+    ssize_t num = read(STDIN_FILENO, &command, 1);
+    if (num == 1 && command == 'q')
+    {
+        server->quit = 1;
+        return 0;
+    }
+    if (num == 1 && command == 'r')
+    {
+        server->reconcile = 1;
+    }
+    else if (num == 1 && command == 's')
+    {
+        egress_print_stats(stdout);
+        cache_print_stats(stdout);
+    }
+    else if (num == 1 && command == 'w')
+    {
+        egress_load_weights();
+    }
+    // Nobody can type q anymore once stdin is at EOF
+    if (num == 0)
+    {
+        return 0;
+    }
+    return _submit_control(server);
+}
+
+static void _handle_completion(UringServer *server, const struct io_uring_cqe *cqe)
+{
+    UringOp op = cqe->user_data & URING_OP_MASK;
+    UringConnection *conn = (UringConnection *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+    if (op == URING_OP_ACCEPT)
+    {
+        if (cqe->res >= 0)
+        {
+            _add_connection(server, cqe->res);
+        }
+        else if (cqe->res == -EINVAL && server->multishot_accept)
+        {
+            // Multishot accept is newer than the rest, accept one at a time
+            server->multishot_accept = 0;
+        }
+        else
+        {
+            errno = -cqe->res;
+            perror("accept_connection: accept");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE) && _submit_accept(server) < 0)
+        {
+            server->quit = 1;
+        }
+        return;
+    }
+    if (op == URING_OP_CONTROL)
+    {
+        if (_on_control(server) < 0)
+        {
+            server->quit = 1;
+        }
+        return;
+    }
+    if (op == URING_OP_LIBRARY)
+    {
+        if (library_watch_update(&server->watch, server->library) < 0)
+        {
+            fprintf(stderr, "Error updating library\n");
+            server->failed = 1;
+        }
+        if (server->failed || _submit_library_poll(server) < 0)
+        {
+            server->quit = 1;
+        }
+        return;
+    }
+    if (op == URING_OP_TICK)
+    {
+        if (_submit_tick(server) < 0)
+        {
+            server->quit = 1;
+        }
+        return;
+    }
+
+    conn->pending_ops--;
+    if (conn->closing)
+    {
+        if (conn->pending_ops == 0)
+        {
+            _free_connection(server, conn);
+        }
+        return;
+    }
+
+    int ret = 0;
+    switch (op)
+    {
+    case URING_OP_RECV:
+        ret = _on_recv(server, conn, cqe->res);
+        break;
+    case URING_OP_SEND_HEAD:
+        ret = _on_send_head(server, conn, cqe->res);
+        break;
+    case URING_OP_READ_CHUNK:
+        ret = _on_read_chunk(server, conn, cqe->res);
+        break;
+    case URING_OP_SEND_CHUNK:
+        ret = _on_send_chunk(server, conn, cqe->res);
+        break;
+    default:
+        break;
+    }
+    if (ret < 0)
+    {
+        _close_connection(server, conn);
+    }
+}
+
+int run_uring_server(int listenfd, Library *library)
+{
+    UringServer server;
+    memset(&server, 0, sizeof(server));
+    server.library = library;
+    server.listenfd = listenfd;
+    server.multishot_accept = 1;
+    server.tick.tv_sec = SELECT_TIMEOUT_SEC;
+    server.tick.tv_nsec = SELECT_TIMEOUT_USEC * 1000;
+
+    if (_uring_setup(&server.ring, URING_ENTRIES) < 0)
+    {
+        perror("run_uring_server: io_uring_setup");
+        return URING_UNSUPPORTED;
+    }
+    if (!_uring_supports_ops(&server.ring))
+    {
+        ERR_PRINT("run_uring_server: the kernel's io_uring lacks needed operations\n");
+        _uring_teardown(&server.ring);
+        return URING_UNSUPPORTED;
+    }
+
+    // Register the chunk buffers once, so reads into them skip page pinning
+    size_t buffers_size = (size_t)URING_NUM_BUFFERS * URING_CHUNK_SIZE;
+    server.buffers = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (server.buffers == MAP_FAILED)
+    {
+        perror("run_uring_server: mmap");
+        _uring_teardown(&server.ring);
+        return 1;
+    }
+    struct iovec iovecs[URING_NUM_BUFFERS];
+    for (int i = 0; i < URING_NUM_BUFFERS; i++)
+    {
+        iovecs[i].iov_base = server.buffers + (size_t)i * URING_CHUNK_SIZE;
+        iovecs[i].iov_len = URING_CHUNK_SIZE;
+        server.free_buffers[i] = URING_NUM_BUFFERS - 1 - i;
+    }
+    server.num_free_buffers = URING_NUM_BUFFERS;
+    if (syscall(__NR_io_uring_register, server.ring.fd, IORING_REGISTER_BUFFERS,
+                iovecs, URING_NUM_BUFFERS) < 0)
+    {
+        perror("run_uring_server: io_uring_register");
+        munmap(server.buffers, buffers_size);
+        _uring_teardown(&server.ring);
+        return URING_UNSUPPORTED;
+    }
+
+    if (library_watch_start(&server.watch, library) < 0)
+    {
+        fprintf(stderr, "Error scanning library\n");
+        munmap(server.buffers, buffers_size);
+        _uring_teardown(&server.ring);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int result = 0;
+    time_t last_scan = time(NULL);
+    if (_submit_accept(&server) < 0 || _submit_control(&server) < 0 || _submit_tick(&server) < 0 ||
+        _submit_library_poll(&server) < 0)
+    {
+        result = 1;
+        server.quit = 1;
+    }
+
+    while (!server.quit)
+    {
+        if (_uring_enter(&server.ring, 1) < 0)
+        {
+            result = 1;
+            break;
+        }
+
+        unsigned head = *server.ring.cq_head;
+        while (head != __atomic_load_n(server.ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe cqe = server.ring.cqes[head & *server.ring.cq_mask];
+            // Free the slot before handling it, handlers submit more work
+            __atomic_store_n(server.ring.cq_head, ++head, __ATOMIC_RELEASE);
+            _handle_completion(&server, &cqe);
+        }
+
+        if (server.failed)
+        {
+            result = 1;
+            break;
+        }
+        if (server.reconcile || time(NULL) - last_scan >= server.watch.reconcile_interval)
+        {
+            if (library_watch_reconcile(&server.watch, library) < 0)
+            {
+                fprintf(stderr, "Error scanning library\n");
+                result = 1;
+                break;
+            }
+            server.reconcile = 0;
+            last_scan = time(NULL);
+        }
+        cache_maintain(library);
+    }
+
+    printf("Quitting server\n");
+    // Closing the ring cancels whatever is still in flight
+    for (UringConnection *conn = server.connections; conn != NULL; conn = conn->next)
+    {
+        shutdown(conn->client.socket, SHUT_RDWR);
+    }
+    _uring_teardown(&server.ring);
+    server.waiting_head = NULL;
+    while (server.connections != NULL)
+    {
+        server.connections->pending_ops = 0;
+        _free_connection(&server, server.connections);
+    }
+    munmap(server.buffers, buffers_size);
+    library_watch_stop(&server.watch);
+    return result;
+}
@@ -0,0 +1,118 @@
+#ifndef AS_URING_H_
+#define AS_URING_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/*
+** Constants
+** ---------
+*/
+#define URING_ENTRIES 256
+// Registered buffers that file chunks are read into and sent from.
+// A STREAM holds one buffer until it is done, others wait for a free one.
+#define URING_NUM_BUFFERS 64
+#define URING_CHUNK_SIZE (64 * 1024)
+
+// Returned by run_uring_server when the kernel can't run it
+#define URING_UNSUPPORTED -2
+
+
+/*
+** Design
+** ------
+** In io_uring mode (as_server -m uring) one process serves every client, like
+** epoll mode, but instead of waiting for sockets to become ready it submits
+** the I/O itself to an io_uring and handles completions:
+**
+**   - a single multishot accept replaces the select + accept_connection pair,
+**   - requests are received with recv and parsed with parse_request,
+**   - a response's head (LIST text or STREAM size header) is sent with send,
+**   - a STREAM body is sent in URING_CHUNK_SIZE chunks, each one a read into
+**     a registered buffer linked to a send of that buffer, so a single
+**     submission moves a chunk from the file to the socket.
+**
+** Changes to the library are applied when a poll on the LibraryWatch's fd
+** (see as_watch.h) completes.
+**
+** Each completion carries the connection it belongs to and which of the
+** operations above it is (see UringOp) in its user_data. A connection is only
+** freed once none of its operations are in flight.
+**
+** The ring is driven with the raw io_uring_setup/io_uring_enter/
+** io_uring_register system calls. If the kernel lacks io_uring or any of the
+** operations above, run_uring_server returns URING_UNSUPPORTED without
+** having done anything, so the caller can serve clients another way.
+*/
+
+typedef enum uring_op {
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_SEND_HEAD,
+    URING_OP_READ_CHUNK,
+    URING_OP_SEND_CHUNK,
+    URING_OP_CONTROL,
+    URING_OP_TICK,
+    URING_OP_LIBRARY,
+} UringOp;
+
+// Operations are stored in the low bits of user_data, next to the
+// (malloc aligned) connection pointer
+#define URING_OP_MASK 0x7
+
+typedef struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+} Uring;
+
+typedef struct uring_connection {
+    ClientSocket client;
+    uint8_t request_buffer[REQUEST_BUFFER_SIZE];
+    int bytes_in_buf;
+    uint32_t version;         // negotiated protocol version
+    Response response;
+    int writing;              // a response is being sent
+    int buffer_index;         // registered buffer held while streaming, or -1
+    size_t chunk_len;         // bytes of the file chunk in the buffer
+    size_t chunk_sent;        // bytes of the chunk sent so far
+    int pending_ops;          // submitted operations not completed yet
+    int closing;
+    struct uring_connection *next_waiting;
+    struct uring_connection *prev;
+    struct uring_connection *next;
+} UringConnection;
+
+
+/*
+** Serve every client connecting on listenfd from this process with io_uring
+** until the user types q + enter in the server's terminal. The library is
+** kept up to date with a LibraryWatch (see as_watch.h).
+**
+** returns 0 when the user quits the server, 1 on error, URING_UNSUPPORTED if
+** io_uring can't be used on this kernel.
+*/
+int run_uring_server(int listenfd, Library *library);
+
+#endif // AS_URING_H_
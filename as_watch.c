@@ -0,0 +1,734 @@
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_watch.h"
+#include "as_metadata.h"
+#include "as_scan.h"
+#include "as_store.h"
+
+// Entries sent by the scanner process, each followed by a null char. Files
+// are sent as SCAN_ENTRY_FILE, their device and inode numbers in hexadecimal
+// each followed by a space, then their path. Files whose metadata the
+// scanner read are sent as SCAN_ENTRY_METADATA, with the fields of their
+// metadata (see SCAN_METADATA_FORMAT) between their inode number and path.
+#define SCAN_ENTRY_DIR 'D'
+#define SCAN_ENTRY_FILE 'F'
+#define SCAN_ENTRY_METADATA 'M'
+#define SCAN_ENTRY_END 'E'
+
+#define SCAN_METADATA_FORMAT "%llx %llx %llx %x %x %llx %x %x %hx %hx %llx %llx"
+
+/*
+** Library changes
+** ---------------
+*/
+static int _record_change(LibraryWatch *watch, WatchChangeType type, const char *path,
+                          const LibraryFileId *id)
+{
+    // Only needed to replay on top of a reconciliation in progress
+    if (watch->scanner_pid == -1)
+    {
+        return 0;
+    }
+
+    WatchChange *changes = realloc(watch->changes, (watch->num_changes + 1) * sizeof(WatchChange));
+    if (changes == NULL)
+    {
+        perror("_record_change");
+        return -1;
+    }
+    watch->changes = changes;
+    watch->changes[watch->num_changes].type = type;
+    watch->changes[watch->num_changes].id = id != NULL ? *id : (LibraryFileId){0, 0};
+    watch->changes[watch->num_changes].path = strdup(path);
+    if (watch->changes[watch->num_changes].path == NULL)
+    {
+        perror("_record_change");
+        return -1;
+    }
+    watch->num_changes++;
+    return 0;
+}
+
+static void _forget_changes(LibraryWatch *watch)
+{
+    for (int i = 0; i < watch->num_changes; i++)
+    {
+        free(watch->changes[i].path);
+    }
+    free(watch->changes);
+    watch->changes = NULL;
+    watch->num_changes = 0;
+}
+
+static int _add_file(LibraryWatch *watch, Library *library, const char *path,
+                     const LibraryFileId *id)
+{
+    if (_record_change(watch, WATCH_ADD_FILE, path, id) < 0)
+    {
+        return -1;
+    }
+#ifdef DEBUG
+    printf("Library watch: added %s\n", path);
+#endif
+    int index = library_add_file(library, path, id);
+    if (index < 0)
+    {
+        return -1;
+    }
+    // Written again, or unknown to the library: not worth failing for
+    library_update_metadata(library, index);
+    return 0;
+}
+
+static int _remove_file(LibraryWatch *watch, Library *library, const char *path)
+{
+    if (_record_change(watch, WATCH_REMOVE_FILE, path, NULL) < 0)
+    {
+        return -1;
+    }
+    int index = library_find_file(library, path);
+    if (index >= 0)
+    {
+#ifdef DEBUG
+        printf("Library watch: removed %s\n", path);
+#endif
+        library_remove_file(library, index);
+    }
+    return 0;
+}
+
+static int _is_in_tree(const char *path, const char *tree)
+{
+    size_t tree_length = strlen(tree);
+    return strncmp(path, tree, tree_length) == 0 && path[tree_length] == '/';
+}
+
+/*
+** Remove every file under the directory tree, and stop watching it.
+*/
+static int _remove_tree(LibraryWatch *watch, Library *library, const char *tree)
+{
+    if (_record_change(watch, WATCH_REMOVE_TREE, tree, NULL) < 0)
+    {
+        return -1;
+    }
+
+    // From the last file, so that a file moved to index 0 was already checked
+    for (uint32_t i = library->num_files; i-- > 0;)
+    {
+        if (library->files[i] != NULL && _is_in_tree(library->files[i], tree))
+        {
+            library_remove_file(library, i);
+        }
+    }
+
+    for (int wd = 0; wd < watch->num_dirs; wd++)
+    {
+        if (watch->dirs[wd] != NULL &&
+            (strcmp(watch->dirs[wd], tree) == 0 || _is_in_tree(watch->dirs[wd], tree)))
+        {
+            inotify_rm_watch(watch->inotify_fd, wd);
+            free(watch->dirs[wd]);
+            watch->dirs[wd] = NULL;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Directory watches
+** -----------------
+*/
+static int _watch_dir(LibraryWatch *watch, const Library *library, const char *path)
+{
+    if (watch->inotify_fd == -1)
+    {
+        return 0;
+    }
+
+    char *path_in_lib = _join_path(library->path, path);
+    if (path_in_lib == NULL)
+    {
+        return -1;
+    }
+    int wd = inotify_add_watch(watch->inotify_fd, path_in_lib, LIBRARY_WATCH_MASK);
+    free(path_in_lib);
+    if (wd == -1)
+    {
+        // Out of watches, what is not watched waits for the next reconciliation
+        if (errno == ENOSPC)
+        {
+            ERR_PRINT("Library watch: out of inotify watches for %s\n", path);
+            return 0;
+        }
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    }
+
+    if (wd >= watch->num_dirs)
+    {
+        char **dirs = realloc(watch->dirs, (wd + 1) * sizeof(char *));
+        if (dirs == NULL)
+        {
+            perror("_watch_dir");
+            return -1;
+        }
+        memset(dirs + watch->num_dirs, 0, (wd + 1 - watch->num_dirs) * sizeof(char *));
+        watch->dirs = dirs;
+        watch->num_dirs = wd + 1;
+    }
+    // A directory watched again (e.g. by a reconciliation) may have moved
+    free(watch->dirs[wd]);
+    watch->dirs[wd] = strdup(path);
+    if (watch->dirs[wd] == NULL)
+    {
+        perror("_watch_dir");
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct watch_walk {
+    LibraryWatch *watch;
+    const Library *library;
+} WatchWalk;
+
+static int _watch_walk_callback(void *context, const char *path)
+{
+    WatchWalk *walk = context;
+    return _watch_dir(walk->watch, walk->library, path);
+}
+
+/*
+** A directory tree appeared in the library: watch it and add its files.
+*/
+static int _add_tree(LibraryWatch *watch, Library *library, const char *tree)
+{
+    // Usually a single new directory, not worth starting threads for
+    WatchWalk walk = {watch, library};
+    LibraryScan scan;
+    if (library_scan_directory(library->path, tree, 1, _watch_walk_callback, &walk, &scan) < 0)
+    {
+        // Removed since we heard of it, its removal is on its way
+        return (errno == ENOENT || errno == ENOTDIR) ? 0 : -1;
+    }
+
+    int result = 0;
+    for (int i = 0; result == 0 && i < scan.num_files; i++)
+    {
+        result = _add_file(watch, library, scan.files[i].path, &scan.files[i].id);
+    }
+    library_scan_free(&scan);
+    return result;
+}
+
+static int _handle_event(LibraryWatch *watch, Library *library, const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        ERR_PRINT("Library watch: events were dropped, reconciling the library\n");
+        return library_watch_reconcile(watch, library);
+    }
+    if (event->wd < 0 || event->wd >= watch->num_dirs || watch->dirs[event->wd] == NULL)
+    {
+        return 0;
+    }
+    if (event->mask & IN_IGNORED)
+    {
+        free(watch->dirs[event->wd]);
+        watch->dirs[event->wd] = NULL;
+        return 0;
+    }
+    if (event->len == 0)
+    {
+        return 0;
+    }
+
+    char *path = _join_path(watch->dirs[event->wd], event->name);
+    if (path == NULL)
+    {
+        return -1;
+    }
+
+    int result = 0;
+    if (event->mask & IN_ISDIR)
+    {
+        if (event->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            result = _add_tree(watch, library, path);
+        }
+        else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            result = _remove_tree(watch, library, path);
+        }
+    }
+    else if (_is_file_extension_supported(event->name))
+    {
+        // Gone again if it can't be found, its removal is on its way
+        LibraryFileId id;
+        if ((event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+            library_file_id(library, path, &id) == 0)
+        {
+            result = _add_file(watch, library, path, &id);
+        }
+        else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            result = _remove_file(watch, library, path);
+        }
+    }
+
+    free(path);
+    return result;
+}
+
+/*
+** Apply one buffer of events. A burst of changes is spread over several
+** calls, watch->fd stays readable until it is all applied.
+*/
+static int _read_events(LibraryWatch *watch, Library *library)
+{
+    char buf[LIBRARY_WATCH_EVENT_BUFFER_SIZE]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ssize_t num = read(watch->inotify_fd, buf, sizeof(buf));
+    if (num < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return 0;
+        }
+        perror("library_watch_update: read");
+        return -1;
+    }
+
+    for (char *ptr = buf; ptr < buf + num;)
+    {
+        const struct inotify_event *event = (const struct inotify_event *)ptr;
+        if (_handle_event(watch, library, event) < 0)
+        {
+            return -1;
+        }
+        ptr += sizeof(struct inotify_event) + event->len;
+    }
+    return 0;
+}
+
+
+/*
+** Reconciliation
+** --------------
+*/
+/*
+** Send a scan of the library to the pipe fd, for _apply_scan.
+*/
+static int _send_scan(int fd, const LibraryScan *scan)
+{
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < scan->num_dirs; i++)
+    {
+        fprintf(out, "%c%s%c", SCAN_ENTRY_DIR, scan->dirs[i], '\0');
+    }
+    for (int i = 0; i < scan->num_files; i++)
+    {
+        const LibraryMetadata *metadata = &scan->files[i].metadata;
+        if (metadata->id.dev == 0 && metadata->id.ino == 0)
+        {
+            fprintf(out, "%c%llx %llx %s%c", SCAN_ENTRY_FILE,
+                    (unsigned long long)scan->files[i].id.dev,
+                    (unsigned long long)scan->files[i].id.ino, scan->files[i].path, '\0');
+            continue;
+        }
+        fprintf(out, "%c%llx %llx " SCAN_METADATA_FORMAT " %s%c", SCAN_ENTRY_METADATA,
+                (unsigned long long)scan->files[i].id.dev,
+                (unsigned long long)scan->files[i].id.ino,
+                (unsigned long long)metadata->id.dev, (unsigned long long)metadata->id.ino,
+                (unsigned long long)metadata->mtime_sec, metadata->mtime_nsec, metadata->codec,
+                (unsigned long long)metadata->duration_ms, metadata->sample_rate,
+                metadata->bitrate, metadata->channels, metadata->bits_per_sample,
+                (unsigned long long)metadata->data_offset,
+                (unsigned long long)metadata->data_size, scan->files[i].path, '\0');
+    }
+    fprintf(out, "%c%c", SCAN_ENTRY_END, '\0');
+    int failed = ferror(out);
+    return fclose(out) == 0 && !failed ? 0 : -1;
+}
+
+static void _end_scan(LibraryWatch *watch)
+{
+    epoll_ctl(watch->fd, EPOLL_CTL_DEL, watch->scanner_fd, NULL);
+    close(watch->scanner_fd);
+    // Somebody else may have reaped it (see _reap_workers)
+    waitpid(watch->scanner_pid, NULL, 0);
+    watch->scanner_fd = -1;
+    watch->scanner_pid = -1;
+    free(watch->scan_buf);
+    watch->scan_buf = NULL;
+    watch->scan_len = 0;
+    watch->scan_capacity = 0;
+    _forget_changes(watch);
+}
+
+/*
+** Merge a SCAN_ENTRY_METADATA entry into the library being scanned.
+**
+** returns 0 on success, -1 on error
+*/
+static int _apply_metadata_entry(Library *library, const char *entry)
+{
+    unsigned long long dev, ino, metadata_dev, metadata_ino, mtime_sec, duration_ms;
+    unsigned long long data_offset, data_size;
+    LibraryMetadata metadata;
+    memset(&metadata, 0, sizeof(metadata));
+    int path_offset = 0;
+    sscanf(entry + 1, "%llx %llx " SCAN_METADATA_FORMAT "%n", &dev, &ino, &metadata_dev,
+           &metadata_ino, &mtime_sec, &metadata.mtime_nsec, &metadata.codec, &duration_ms,
+           &metadata.sample_rate, &metadata.bitrate, &metadata.channels,
+           &metadata.bits_per_sample, &data_offset, &data_size, &path_offset);
+    if (path_offset == 0)
+    {
+        ERR_PRINT("Library watch: invalid scan entry\n");
+        return -1;
+    }
+    // Past the space, a path may start with spaces of its own
+    const char *path = entry + 1 + path_offset + 1;
+    LibraryFileId id = {dev, ino};
+    metadata.id.dev = metadata_dev;
+    metadata.id.ino = metadata_ino;
+    metadata.mtime_sec = mtime_sec;
+    metadata.duration_ms = duration_ms;
+    metadata.data_offset = data_offset;
+    metadata.data_size = data_size;
+    if (library_scan_file(library, path, &id) < 0)
+    {
+        return -1;
+    }
+    library_set_metadata(library, library_find_file(library, path), &metadata);
+    return 0;
+}
+
+/*
+** Merge the files the scanner found into the library, watch the directories
+** it found, then replay the changes seen since it started.
+*/
+static int _apply_scan(LibraryWatch *watch, Library *library)
+{
+    // The scanner ends with SCAN_ENTRY_END, anything else is a failed scan
+    char *scan_end = watch->scan_buf + watch->scan_len;
+    char *entry = watch->scan_buf;
+    while (entry < scan_end && entry[0] != SCAN_ENTRY_END)
+    {
+        char *entry_end = memchr(entry, '\0', scan_end - entry);
+        entry = entry_end == NULL ? scan_end : entry_end + 1;
+    }
+    if (entry == scan_end)
+    {
+        ERR_PRINT("Library watch: reconciliation failed, keeping the library as is\n");
+        return 0;
+    }
+
+    if (library_begin_scan(library) < 0)
+    {
+        return -1;
+    }
+    for (entry = watch->scan_buf; entry[0] != SCAN_ENTRY_END; entry += strlen(entry) + 1)
+    {
+        int result;
+        if (entry[0] == SCAN_ENTRY_DIR)
+        {
+            result = _watch_dir(watch, library, entry + 1);
+        }
+        else if (entry[0] == SCAN_ENTRY_FILE)
+        {
+            char *path;
+            LibraryFileId id;
+            id.dev = strtoull(entry + 1, &path, 16);
+            id.ino = strtoull(path + 1, &path, 16);
+            result = library_scan_file(library, path + 1, &id);
+        }
+        else
+        {
+            result = _apply_metadata_entry(library, entry);
+        }
+        if (result < 0)
+        {
+            return -1;
+        }
+    }
+    library_end_scan(library);
+
+    // Replay with no reconciliation running, so nothing is recorded again
+    WatchChange *changes = watch->changes;
+    int num_changes = watch->num_changes;
+    pid_t scanner_pid = watch->scanner_pid;
+    watch->scanner_pid = -1;
+    int result = 0;
+    for (int i = 0; result == 0 && i < num_changes; i++)
+    {
+        switch (changes[i].type)
+        {
+        case WATCH_ADD_FILE:
+            result = _add_file(watch, library, changes[i].path, &changes[i].id);
+            break;
+        case WATCH_REMOVE_FILE:
+            result = _remove_file(watch, library, changes[i].path);
+            break;
+        case WATCH_REMOVE_TREE:
+            result = _remove_tree(watch, library, changes[i].path);
+            break;
+        }
+    }
+    watch->scanner_pid = scanner_pid;
+
+    printf("Library reconciled: %u files\n", library->index->num_live);
+    if (result == 0 && library->index->generation != watch->saved_generation)
+    {
+        watch->saved_generation = library->index->generation;
+        library_store_save(library, (const char *const *)watch->dirs, watch->num_dirs);
+    }
+    return result;
+}
+
+static int _read_scan(LibraryWatch *watch, Library *library)
+{
+    while (1)
+    {
+        if (watch->scan_len == watch->scan_capacity)
+        {
+            size_t capacity = watch->scan_capacity ? 2 * watch->scan_capacity : 65536;
+            char *scan_buf = realloc(watch->scan_buf, capacity);
+            if (scan_buf == NULL)
+            {
+                perror("library_watch_update");
+                _end_scan(watch);
+                return -1;
+            }
+            watch->scan_buf = scan_buf;
+            watch->scan_capacity = capacity;
+        }
+
+        ssize_t num = read(watch->scanner_fd, watch->scan_buf + watch->scan_len,
+                           watch->scan_capacity - watch->scan_len);
+        if (num < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+            {
+                return 0;
+            }
+            perror("library_watch_update: read");
+            _end_scan(watch);
+            return -1;
+        }
+        if (num == 0)
+        {
+            int result = _apply_scan(watch, library);
+            _end_scan(watch);
+            return result;
+        }
+        watch->scan_len += num;
+    }
+}
+
+int library_watch_reconcile(LibraryWatch *watch, const Library *library)
+{
+    if (watch->scanner_pid != -1)
+    {
+        return 0;
+    }
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+    {
+        perror("library_watch_reconcile: pipe");
+        return -1;
+    }
+
+    // Output buffered so far must not be written twice
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("library_watch_reconcile: fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    if (pid == 0)
+    {
+        close(pipefd[0]);
+        LibraryScan scan;
+        int result = library_scan_directory(library->path, "", LIBRARY_SCAN_THREADS, NULL,
+                                            NULL, &scan);
+        if (result == 0)
+        {
+            // Only the files changed since the library was saved are read
+            library_scan_metadata(library, &scan, LIBRARY_SCAN_THREADS);
+            result = _send_scan(pipefd[1], &scan);
+        }
+        _exit(result == 0 ? 0 : 1);
+    }
+
+    close(pipefd[1]);
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = pipefd[0]};
+    if (epoll_ctl(watch->fd, EPOLL_CTL_ADD, pipefd[0], &event) == -1)
+    {
+        perror("library_watch_reconcile: epoll_ctl");
+        close(pipefd[0]);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    watch->scanner_pid = pid;
+    watch->scanner_fd = pipefd[0];
+    return 0;
+}
+
+
+/*
+** Public interface
+** ----------------
+*/
+int library_watch_start(LibraryWatch *watch, Library *library)
+{
+    memset(watch, 0, sizeof(LibraryWatch));
+    watch->inotify_fd = -1;
+    watch->scanner_pid = -1;
+    watch->scanner_fd = -1;
+
+    // From now on this process changes its own copy of the library, whose
+    // generations are no longer those of any other copy (a prefork worker's)
+    library_new_epoch(library);
+
+    watch->fd = epoll_create1(EPOLL_CLOEXEC);
+    if (watch->fd == -1)
+    {
+        perror("library_watch_start: epoll_create1");
+        return -1;
+    }
+
+    watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->inotify_fd == -1)
+    {
+        perror("library_watch_start: inotify_init1");
+        printf("Library changes are not watched, rescanning every %d seconds\n",
+               LIBRARY_SCAN_INTERVAL);
+        watch->reconcile_interval = LIBRARY_SCAN_INTERVAL;
+    }
+    else
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = watch->inotify_fd};
+        if (epoll_ctl(watch->fd, EPOLL_CTL_ADD, watch->inotify_fd, &event) == -1)
+        {
+            perror("library_watch_start: epoll_ctl");
+            library_watch_stop(watch);
+            return -1;
+        }
+        watch->reconcile_interval = LIBRARY_RECONCILE_INTERVAL;
+    }
+
+    // Served as loaded, what changed since it was saved is applied once the
+    // reconciliation is done
+    if (library->index != NULL && library->index->mapping != NULL)
+    {
+        watch->saved_generation = library->index->generation;
+        const char *dir;
+        for (uint32_t i = 0; (dir = library_store_dir(library, i)) != NULL; i++)
+        {
+            if (_watch_dir(watch, library, dir) < 0)
+            {
+                library_watch_stop(watch);
+                return -1;
+            }
+        }
+        if (library_watch_reconcile(watch, library) < 0)
+        {
+            library_watch_stop(watch);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Each directory is watched before it is read, so no file added
+    // during the scan is missed
+    WatchWalk walk = {watch, library};
+    LibraryScan scan;
+    if (library_scan_directory(library->path, "", LIBRARY_SCAN_THREADS, _watch_walk_callback,
+                               &walk, &scan) < 0)
+    {
+        if (errno == ENOENT || errno == ENOTDIR)
+        {
+            perror("library_watch_start");
+        }
+        library_watch_stop(watch);
+        return -1;
+    }
+    library_scan_metadata(library, &scan, LIBRARY_SCAN_THREADS);
+    int result = library_merge_scan(library, &scan);
+    library_scan_free(&scan);
+    if (result < 0)
+    {
+        library_watch_stop(watch);
+        return -1;
+    }
+    // Saved by scan_library
+    watch->saved_generation = library->index->generation;
+    return 0;
+}
+
+int library_watch_update(LibraryWatch *watch, Library *library)
+{
+    if (watch->inotify_fd != -1 && _read_events(watch, library) < 0)
+    {
+        return -1;
+    }
+    if (watch->scanner_fd != -1 && _read_scan(watch, library) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void library_watch_stop(LibraryWatch *watch)
+{
+    if (watch->scanner_pid != -1)
+    {
+        kill(watch->scanner_pid, SIGKILL);
+        _end_scan(watch);
+    }
+    library_watch_release(watch);
+}
+
+void library_watch_release(LibraryWatch *watch)
+{
+    watch->scanner_pid = -1;
+    if (watch->scanner_fd != -1)
+    {
+        close(watch->scanner_fd);
+        watch->scanner_fd = -1;
+    }
+    free(watch->scan_buf);
+    watch->scan_buf = NULL;
+    _forget_changes(watch);
+    if (watch->inotify_fd != -1)
+    {
+        close(watch->inotify_fd);
+        watch->inotify_fd = -1;
+    }
+    if (watch->fd != -1)
+    {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+    for (int wd = 0; wd < watch->num_dirs; wd++)
+    {
+        free(watch->dirs[wd]);
+    }
+    free(watch->dirs);
+    watch->dirs = NULL;
+    watch->num_dirs = 0;
+}
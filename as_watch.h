@@ -0,0 +1,125 @@
+#ifndef AS_WATCH_H_
+#define AS_WATCH_H_
+/*****************************************************************************/
+/*                       CSC209-24s A4 Audio Stream                          */
+/*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
+/*****************************************************************************/
+#include "as_server.h"
+#include "as_library.h"
+
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <time.h>
+
+/*
+** Constants
+** ---------
+*/
+// Seconds between full reconciliations of a watched library. They are only
+// a safety net, watched libraries are kept up to date by inotify. Libraries
+// that can't be watched are rescanned every LIBRARY_SCAN_INTERVAL instead.
+#define LIBRARY_RECONCILE_INTERVAL 900
+
+// Changes watched in every directory of the library. Files are added once
+// they are closed after writing (or moved in), so uploads in progress are
+// not listed.
+#define LIBRARY_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | \
+                            IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+#define LIBRARY_WATCH_EVENT_BUFFER_SIZE 4096
+
+
+/*
+** Design
+** ------
+** Instead of rescanning the whole library every LIBRARY_SCAN_INTERVAL, the
+** loops serving clients keep it up to date with a LibraryWatch:
+**
+**   - every directory of the library has an inotify watch, and the files
+**     added, removed or renamed in it are applied to the Library one by one,
+**     new and renamed directories are watched (and their files added) as
+**     they appear,
+**   - every LIBRARY_RECONCILE_INTERVAL seconds, when inotify dropped events
+**     or when asked to ('r'), a full scan reconciles the Library with the
+**     directory. It runs in a child process, so the loop keeps accepting and
+**     serving clients, and sends its result back over a pipe. Changes seen
+**     while it runs are replayed on top of its result. The library's store
+**     is then saved if anything changed since it last was.
+**
+** The inotify instance and the scanner's pipe are both behind the watch's fd,
+** so a loop only waits for that one descriptor to become readable and then
+** calls library_watch_update.
+*/
+
+typedef enum watch_change_type {
+    WATCH_ADD_FILE,
+    WATCH_REMOVE_FILE,
+    WATCH_REMOVE_TREE,
+} WatchChangeType;
+
+// A change applied while a reconciliation was running
+typedef struct watch_change {
+    WatchChangeType type;
+    char *path;
+    LibraryFileId id;          // of an added file
+} WatchChange;
+
+typedef struct library_watch {
+    int fd;                    // epoll instance, readable when there is work
+    int inotify_fd;            // -1 if the library can't be watched
+    char **dirs;               // library relative path of each watch, by wd
+    int num_dirs;              // size of dirs
+    int reconcile_interval;    // seconds between full reconciliations
+    pid_t scanner_pid;         // reconciliation in progress, or -1
+    int scanner_fd;            // read end of its pipe, or -1
+    char *scan_buf;            // what the scanner sent so far
+    size_t scan_len;
+    size_t scan_capacity;
+    WatchChange *changes;      // changes to replay after the reconciliation
+    int num_changes;
+    uint64_t saved_generation; // of the library when its store was saved
+} LibraryWatch;
+
+
+/*
+** Start watching library->path, and scan it at the same time: the files found
+** are merged into the library (see library_begin_scan). A library loaded from
+** its store (see as_store.h) is not scanned, its directories are watched and
+** it is reconciled in the background instead. If inotify is not available the
+** watch still works, but only through full reconciliations every
+** LIBRARY_SCAN_INTERVAL (see watch->reconcile_interval).
+**
+** returns 0 on success, -1 on error
+*/
+int library_watch_start(LibraryWatch *watch, Library *library);
+
+/*
+** Apply the changes inotify reported and the result of a finished
+** reconciliation to library, without blocking. Call it whenever watch->fd
+** is readable.
+**
+** returns 0 on success, -1 on error
+*/
+int library_watch_update(LibraryWatch *watch, Library *library);
+
+/*
+** Start a full reconciliation of library in the background, unless one is
+** already running. library_watch_update applies it once it is done.
+**
+** returns 0 on success, -1 on error
+*/
+int library_watch_reconcile(LibraryWatch *watch, const Library *library);
+
+/*
+** Stop watching and release everything held by the watch. A reconciliation
+** in progress is abandoned.
+*/
+void library_watch_stop(LibraryWatch *watch);
+
+/*
+** Release what a child process inherited of its parent's watch, leaving the
+** parent's watch (and its reconciliation) alone.
+*/
+void library_watch_release(LibraryWatch *watch);
+
+#endif // AS_WATCH_H_
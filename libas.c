@@ -15,6 +15,9 @@ void _free_library(Library *library){
     }
     library->files = NULL;
     library->num_files = 0;
+    // The index is allocated as a single block (see as_library.h)
+    free(library->index);
+    library->index = NULL;
 }
 
 
@@ -98,3 +101,208 @@ int write_precisely(int fd, const void *buf, size_t count) {
     #endif
     return bytes_written;
 }
+
+
+/*
+** Helper for: sendfile_precisely
+** Blocks until fd can be written to again after EAGAIN.
+** returns 0 on success, -1 on error
+*/
+static int _wait_writable(int fd)
+{
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    while (poll(&pfd, 1, -1) == -1) {
+        if (errno != EINTR) {
+            perror("sendfile_precisely: poll");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Helper for: sendfile_precisely
+** Last resort for descriptors that support neither sendfile nor splice.
+*/
+static ssize_t _copy_precisely(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    char buf[COPY_CHUNK_SIZE];
+    size_t bytes_sent = 0;
+    while (bytes_sent < count) {
+        ssize_t num = pread(in_fd, buf, MIN(sizeof(buf), count - bytes_sent), *offset);
+        if (num == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendfile_precisely: pread");
+            return -1;
+        }
+        if (num == 0) {
+            ERR_PRINT("sendfile_precisely: pread: Unexpected EOF\n");
+            return -1;
+        }
+
+        ssize_t written = 0;
+        while (written < num) {
+            ssize_t ret = write(out_fd, buf + written, num - written);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN && _wait_writable(out_fd) == 0) {
+                    continue;
+                }
+                perror("sendfile_precisely: write");
+                return -1;
+            }
+            written += ret;
+        }
+        *offset += num;
+        bytes_sent += num;
+    }
+    return bytes_sent;
+}
+
+
+/*
+** Helper for: sendfile_precisely
+** Moves the file pages into a pipe, then from the pipe into out_fd.
+** Falls back to _copy_precisely if in_fd cannot be spliced at all.
+*/
+static ssize_t _splice_precisely(int out_fd, int in_fd, off_t *offset, size_t count)
+{
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("sendfile_precisely: pipe");
+        return -1;
+    }
+
+    size_t bytes_sent = 0;
+    while (bytes_sent < count) {
+        ssize_t in_pipe = splice(in_fd, offset, pipefd[1], NULL,
+                                 MIN(SPLICE_CHUNK_SIZE, count - bytes_sent),
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && bytes_sent == 0) {
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return _copy_precisely(out_fd, in_fd, offset, count);
+            }
+            perror("sendfile_precisely: splice");
+            goto splice_error;
+        }
+        if (in_pipe == 0) {
+            ERR_PRINT("sendfile_precisely: splice: Unexpected EOF\n");
+            goto splice_error;
+        }
+
+        // Drain everything that was just moved into the pipe
+        while (in_pipe > 0) {
+            ssize_t ret = splice(pipefd[0], NULL, out_fd, NULL, in_pipe,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN && _wait_writable(out_fd) == 0) {
+                    continue;
+                }
+                perror("sendfile_precisely: splice");
+                goto splice_error;
+            }
+            in_pipe -= ret;
+            bytes_sent += ret;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return bytes_sent;
+splice_error:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return -1;
+}
+
+
+ssize_t sendfile_precisely(int out_fd, int in_fd, off_t *offset, size_t count) {
+    size_t bytes_sent = 0;
+    while (bytes_sent < count) {
+        ssize_t ret = sendfile(out_fd, in_fd, offset, count - bytes_sent);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                if (_wait_writable(out_fd) < 0) {
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINVAL || errno == ENOSYS) {
+                // This pair of descriptors can't do sendfile, splice the rest
+                ssize_t rest = _splice_precisely(out_fd, in_fd, offset, count - bytes_sent);
+                if (rest < 0) {
+                    return -1;
+                }
+                bytes_sent += rest;
+                break;
+            }
+            perror("sendfile_precisely: sendfile");
+            return -1;
+        }
+        if (ret == 0) {
+            ERR_PRINT("sendfile_precisely: sendfile: Unexpected EOF\n");
+            return -1;
+        }
+        bytes_sent += ret;
+    }
+    #ifdef DEBUG
+    printf("sendfile_precisely: sent %zu bytes\n", bytes_sent);
+    #endif
+    return bytes_sent;
+}
+
+
+ssize_t sendfile_once(int out_fd, int in_fd, off_t *offset, size_t count) {
+    ssize_t ret = sendfile(out_fd, in_fd, offset, count);
+    if (ret >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+        return ret;
+    }
+
+    char buf[COPY_CHUNK_SIZE];
+    ssize_t num = pread(in_fd, buf, MIN(sizeof(buf), count), *offset);
+    if (num <= 0) {
+        return num;
+    }
+    ret = write(out_fd, buf, num);
+    if (ret > 0) {
+        *offset += ret;
+    }
+    return ret;
+}
+
+
+void mux_pack_header(uint8_t *header, uint32_t stream_id, uint8_t type, uint32_t length) {
+    uint32_t net_stream_id = htonl(stream_id);
+    uint32_t net_length = htonl(length);
+    memcpy(header, &net_stream_id, sizeof(net_stream_id));
+    header[sizeof(net_stream_id)] = type;
+    memcpy(header + sizeof(net_stream_id) + 1, &net_length, sizeof(net_length));
+}
+
+
+void mux_unpack_header(const uint8_t *header, uint32_t *stream_id, uint8_t *type,
+                       uint32_t *length) {
+    uint32_t net_stream_id;
+    uint32_t net_length;
+    memcpy(&net_stream_id, header, sizeof(net_stream_id));
+    *type = header[sizeof(net_stream_id)];
+    memcpy(&net_length, header + sizeof(net_stream_id) + 1, sizeof(net_length));
+    *stream_id = ntohl(net_stream_id);
+    *length = ntohl(net_length);
+}
@@ -4,6 +4,10 @@
 /*                       CSC209-24s A4 Audio Stream                          */
 /*       Copyright 2024 -- Demetres Kostas PhD (aka Darlene Heliokinde)      */
 /*****************************************************************************/
+// sendfile, splice and friends are GNU extensions
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 
 // General stuff
@@ -11,6 +15,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <endian.h>
 #include <unistd.h>
 
 // Network stuff
@@ -21,10 +26,13 @@
 // File and directory stuff
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <dirent.h>
 
 // system stuff
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/wait.h>
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
@@ -54,12 +62,74 @@
 // a configuration file or command line arguments.
 #define SUPPORTED_FILE_EXTS {".wav", ".mp3", ".flac", ".ogg", ".m4a"}
 
-#define REQUEST_BUFFER_SIZE 128
+// Room for a LIST page request with a prefix of MAX_PATH bytes
+#define REQUEST_BUFFER_SIZE 512
 #define REQUEST_LIST "LIST"
 #define REQUEST_STREAM "STREAM"
+#define REQUEST_STREAM_RANGE "STREAM_RANGE"
+#define REQUEST_VERSION "VERSION"
+#define REQUEST_LIST_DELTA "LIST_DELTA"
+#define REQUEST_SEARCH "SEARCH"
+#define REQUEST_STREAM_ID "STREAM_ID"
+#define REQUEST_STREAM_PATH "STREAM_PATH"
+#define REQUEST_INFO "INFO"
+#define REQUEST_STREAM_AT "STREAM_AT"
+#define REQUEST_MUX "MUX"
+
+// Extension of a LIST page request matching every file, and the longest one
+#define LIST_ANY_EXTENSION "*"
+#define LIST_EXTENSION_MAX 16
+
+// First line of a LIST_DELTA response, followed by the epoch and generation
+// of the library: either the changes follow, or the client has to LIST again
+#define RESPONSE_DELTA "DELTA"
+#define RESPONSE_RESYNC "RESYNC"
+
+// Protocol versions a client can ask for with a VERSION request.
+// Clients that never ask get PROTOCOL_VERSION_BASE.
+// Before 3, LIST numbers the files from 0 without the removed ones (the
+// order of its lines, as the first clients count them), and STREAM and
+// STREAM_RANGE take those numbers; from 3 on, the indices of the files.
+//   1: STREAM responses start with a 32-bit file size
+//   2: STREAM responses start with a 64-bit file size
+//   3: LIST_DELTA requests are answered
+//   4: STREAM_ID and STREAM_PATH requests are answered
+//   5: INFO requests are answered
+//   6: STREAM_AT requests are answered
+//   7: MUX requests are answered
+#define PROTOCOL_VERSION_BASE 1
+#define PROTOCOL_VERSION_LARGE_FILES 2
+#define PROTOCOL_VERSION_LIST_DELTA 3
+#define PROTOCOL_VERSION_STREAM_ID 4
+#define PROTOCOL_VERSION_INFO 5
+#define PROTOCOL_VERSION_STREAM_AT 6
+#define PROTOCOL_VERSION_MUX 7
+#define PROTOCOL_VERSION PROTOCOL_VERSION_MUX
+
+// Frames of a multiplexed connection (see as_server.h): a header with the
+// stream id (32-bit), the type of the frame (8-bit) and the length of the
+// payload that follows it (32-bit), all in network byte order
+#define MUX_HEADER_SIZE 9
+#define MUX_FRAME_REQUEST 1
+#define MUX_FRAME_DATA 2
+#define MUX_FRAME_END 3
+#define MUX_FRAME_WINDOW 4
+#define MUX_FRAME_RESET 5
+
+// Streams open at once on a multiplexed connection, bytes of DATA the server
+// sends on a stream before the client opens its window further, and the
+// longest DATA payload
+#define MUX_MAX_STREAMS 32
+#define MUX_INITIAL_WINDOW (256 * 1024)
+#define MUX_MAX_FRAME (16 * 1024)
 
 #define RESPONSE_BUFFER_SIZE 4 * MAX_FILE_NAME
 
+// Bytes moved per splice call, and the size of the bounce buffer used
+// when neither sendfile nor splice work for a pair of file descriptors
+#define SPLICE_CHUNK_SIZE 65536
+#define COPY_CHUNK_SIZE 8192
+
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 #define END_OF_MESSAGE_TOKEN "\r\n"
@@ -76,12 +146,17 @@
 **        relative to the library's path without a leading slash (heap-allocated).
 **        (e.g. "file1.wav", "artist/file2.wav", "artist/album/file3.wav", etc)
 ** num_files: number of files in the library, and the size of the files array.
+**            On the server files are indexed (see as_library.h) and a file
+**            keeps its index while the library changes: the entries of
+**            removed files are NULL and count towards num_files.
+** index: the server's lookup tables for files, NULL on the client.
  */
 typedef struct library {
     char *name;
     const char *path;
     char **files;
     uint32_t num_files;
+    struct library_index *index;
 } Library;
 
 
@@ -122,4 +197,38 @@ int read_precisely(int fd, void *buf, size_t count);
 */
 int write_precisely(int fd, const void *buf, size_t count);
 
+/*
+** Blocking transfer of *exactly* count bytes of in_fd, starting at *offset, to
+** out_fd without copying them through user space. sendfile is tried first;
+** if the kernel refuses this pair of descriptors, the rest goes through a
+** pipe with splice, and as a last resort through a read/write loop.
+**
+** Partial transfers and EINTR are retried. If out_fd is non-blocking, EAGAIN
+** waits (poll) for it to become writable again. *offset is advanced past the
+** bytes that were sent; the file position of in_fd is not used.
+**
+** Returns the number of bytes actually sent, or -1 on error (including in_fd
+** ending before count bytes were sent).
+*/
+ssize_t sendfile_precisely(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/*
+** Single attempt at sending up to count bytes of in_fd, starting at *offset,
+** to out_fd, for use with non-blocking sockets. Uses sendfile, or a pread and
+** a write of at most COPY_CHUNK_SIZE bytes if sendfile is not supported for
+** these descriptors. *offset is advanced past the bytes that were sent.
+**
+** Returns the number of bytes sent (0 at the end of in_fd), or -1 on error
+** with errno set (EAGAIN when out_fd cannot take any more data right now).
+*/
+ssize_t sendfile_once(int out_fd, int in_fd, off_t *offset, size_t count);
+
+/*
+** Write the header of a frame of a multiplexed connection (see
+** MUX_HEADER_SIZE) into header, or read one from it.
+*/
+void mux_pack_header(uint8_t *header, uint32_t stream_id, uint8_t type, uint32_t length);
+void mux_unpack_header(const uint8_t *header, uint32_t *stream_id, uint8_t *type,
+                       uint32_t *length);
+
 #endif // LIBAS_H_